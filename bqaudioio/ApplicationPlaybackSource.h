@@ -32,6 +32,8 @@
 #ifndef BQAUDIOIO_APPLICATION_PLAYBACK_SOURCE_H
 #define BQAUDIOIO_APPLICATION_PLAYBACK_SOURCE_H
 
+#include "CallbackTiming.h"
+
 #include <string>
 
 namespace breakfastquay {
@@ -129,19 +131,92 @@ public:
      */
     virtual int getSourceSamples(float *const *samples, int nchannels, int nframes) = 0;
 
+    /**
+     * Request a number of audio sample frames from the application,
+     * as for getSourceSamples, also providing timing information for
+     * the block. This is the function actually called by the system
+     * target/IO; the default implementation ignores the timing and
+     * calls getSourceSamples. Override it if you need to know
+     * (without calling back into the target from a realtime thread)
+     * when the requested samples will be heard.
+     *
+     * This may be called from a realtime context.
+     */
+    virtual int getSourceSamplesWithTiming(float *const *samples,
+                                           int nchannels, int nframes,
+                                           const CallbackTiming &) {
+        return getSourceSamples(samples, nchannels, nframes);
+    }
+
+    /**
+     * Return true if the application can supply samples in
+     * interleaved form, through getSourceSamplesInterleaved. This is
+     * queried once, when the device is opened. If it returns true
+     * and the device is opened with the application's channel count,
+     * the system target/IO will call getSourceSamplesInterleaved
+     * instead of getSourceSamplesWithTiming, passing the device's own
+     * buffer where possible, so that no de-interleaving and
+     * re-interleaving is needed. Otherwise the non-interleaved
+     * functions are used as usual. The default returns false.
+     */
+    virtual bool supportsInterleavedSamples() const { return false; }
+
+    /**
+     * Request a number of audio sample frames from the application,
+     * as for getSourceSamplesWithTiming, but in interleaved form. The
+     * samples pointer points to a single buffer with room for nframes
+     * * nchannels samples. Called only if supportsInterleavedSamples
+     * returned true.
+     *
+     * Return value should be the number of sample frames written.
+     *
+     * This may be called from a realtime context.
+     */
+    virtual int getSourceSamplesInterleaved(float *, int, int,
+                                            const CallbackTiming &) {
+        return 0;
+    }
+
     /**
      * Report peak output levels for the last output
      * buffer. Potentially useful for monitoring.
      *
-     * This may be called from a realtime context.
+     * This may be called from a realtime context. For per-channel
+     * levels, read at the application's own rate, see
+     * SystemPlaybackTarget::getOutputLevels; these calls can then be
+     * turned off with setOutputLevelCallbacksEnabled.
      */
     virtual void setOutputLevels(float peakLeft, float peakRight) = 0;
 
+    /**
+     * Called by the system target/IO when it starts or stops running
+     * faster than realtime (see SystemPlaybackTarget::setFreewheeling).
+     * While freewheeling, the times in CallbackTiming follow the
+     * frame count rather than the wall clock, and output levels are
+     * reported at a wall-clock rate rather than once per block.
+     */
+    virtual void setSystemFreewheeling(bool) { }
+
     /**
      * Called when an audio dropout is reported due to a processing
      * overload.
      */
     virtual void audioProcessingOverload() { }
+
+    /**
+     * Called when a single call into the application for samples
+     * took longer than the threshold set with
+     * SystemPlaybackTarget::setDeadlineWarningThreshold, as an early
+     * warning of overload. duration is the time the call took, and
+     * deadline the duration of the audio it was asked for, both in
+     * seconds. Where several calls exceed the threshold in quick
+     * succession, only the longest is reported.
+     *
+     * This is called from a thread of the library's own, not from
+     * realtime context.
+     */
+    virtual void audioProcessingDeadlineWarning(double /* duration */,
+                                                double /* deadline */) { }
 };
 
 }
@@ -32,6 +32,8 @@
 #ifndef BQAUDIOIO_APPLICATION_RECORD_TARGET_H
 #define BQAUDIOIO_APPLICATION_RECORD_TARGET_H
 
+#include "CallbackTiming.h"
+
 #include <string>
 
 namespace breakfastquay {
@@ -119,20 +121,84 @@ public:
      * This may be called from realtime context.
      */
     virtual void putSamples(const float *const *samples, int nchannels, int nframes) = 0;
+
+    /**
+     * Accept a number of audio sample frames, as for putSamples, also
+     * receiving timing information for the block. This is the
+     * function actually called by the system source/IO; the default
+     * implementation ignores the timing and calls putSamples.
+     *
+     * This may be called from realtime context.
+     */
+    virtual void putSamplesWithTiming(const float *const *samples,
+                                      int nchannels, int nframes,
+                                      const CallbackTiming &) {
+        putSamples(samples, nchannels, nframes);
+    }
+
+    /**
+     * Return true if the application can accept samples in
+     * interleaved form, through putSamplesInterleaved. This is
+     * queried once, when the device is opened. If it returns true
+     * and the device is opened with the application's channel count,
+     * the system source/IO will call putSamplesInterleaved instead of
+     * putSamplesWithTiming, passing the device's own buffer where
+     * possible. Otherwise the non-interleaved functions are used as
+     * usual. The default returns false.
+     */
+    virtual bool supportsInterleavedSamples() const { return false; }
+
+    /**
+     * Accept a number of audio sample frames, as for
+     * putSamplesWithTiming, but in interleaved form: the samples
+     * pointer points to a single buffer of nframes * nchannels
+     * samples. Called only if supportsInterleavedSamples returned
+     * true.
+     *
+     * This may be called from realtime context.
+     */
+    virtual void putSamplesInterleaved(const float *, int, int,
+                                       const CallbackTiming &) { }
     
     /**
      * Report peak input levels for the last output
      * buffer. Potentially useful for monitoring.
      *
-     * This may be called from realtime context.
+     * This may be called from realtime context. For per-channel
+     * levels, see SystemRecordSource::getInputLevels; these calls
+     * can then be turned off with setInputLevelCallbacksEnabled.
      */
     virtual void setInputLevels(float peakLeft, float peakRight) = 0;
 
+    /**
+     * Called by the system source/IO when it starts or stops running
+     * faster than realtime (see SystemPlaybackTarget::setFreewheeling).
+     * While freewheeling, the times in CallbackTiming follow the
+     * frame count rather than the wall clock, and input levels are
+     * reported at a wall-clock rate rather than once per block.
+     */
+    virtual void setSystemFreewheeling(bool) { }
+
     /**
      * Called when an audio dropout is reported due to a processing
      * overload.
      */
     virtual void audioProcessingOverload() { }
+
+    /**
+     * Called when a single call into the application for samples
+     * took longer than the threshold set with
+     * SystemRecordSource::setDeadlineWarningThreshold, as an early
+     * warning of overload. duration is the time the call took, and
+     * deadline the duration of the audio it was asked for, both in
+     * seconds. Where several calls exceed the threshold in quick
+     * succession, only the longest is reported.
+     *
+     * This is called from a thread of the library's own, not from
+     * realtime context.
+     */
+    virtual void audioProcessingDeadlineWarning(double /* duration */,
+                                                double /* deadline */) { }
 };
 
 }
@@ -32,8 +32,11 @@
 #ifndef BQAUDIOIO_AUDIO_FACTORY_H
 #define BQAUDIOIO_AUDIO_FACTORY_H
 
+#include "SampleFormat.h"
+
 #include <vector>
 #include <string>
+#include <utility>
 
 namespace breakfastquay {
 
@@ -47,23 +50,88 @@ class ApplicationPlaybackSource;
 class AudioFactory 
 {
 public:
+    enum class LogLevel { Debug, Info, Warning, Error };
+
+    /**
+     * A single log message, with its severity, the component of the
+     * library it came from (such as "PulseAudioIO"), and any values
+     * it reports given separately as named fields.
+     */
+    struct LogRecord {
+        LogLevel level;
+        std::string component;
+        std::string message;
+        std::vector<std::pair<std::string, std::string>> fields;
+
+        LogRecord() : level(LogLevel::Info) { }
+
+        /**
+         * Format the record on one line, as for example
+         * "PortAudioIO: WARNING: Failed to open stream [rate=48000]".
+         */
+        std::string toString() const;
+    };
+    
     struct LogCallback {
         virtual ~LogCallback() { }
         virtual void log(std::string) const = 0;
+
+        /**
+         * Receive a log record. The default implementation formats
+         * it with LogRecord::toString and passes it to log(). Override
+         * this to receive the level, component and fields separately.
+         */
+        virtual void logRecord(const LogRecord &record) const {
+            log(record.toString());
+        }
     };
 
     /**
      * Set a log callback to be used globally by the bqaudioio
      * classes. The default is no callback, and this default may be
      * restored by passing nullptr to this function. If the logger is
-     * non-null, any debug information that may otherwise have been
-     * written to cerr will be sent to its log method.
+     * non-null, any log messages that may otherwise have been
+     * written to cerr will be sent to its logRecord method.
      *
      * The caller retains ownership of the logger and must ensure
      * that it is not destroyed before the last audio driver has been
      * closed (or the next call to setLogCallback).
      */
     static void setLogCallback(LogCallback *logger);
+
+    /**
+     * Set the lowest level of message to be logged. The default is
+     * LogLevel::Info. Messages below the level cost no more than a
+     * comparison, as they are not even formatted. Setting
+     * LogLevel::Debug enables detailed tracing of the drivers'
+     * activity, including from the audio threads, unless the library
+     * was built with BQAUDIOIO_NO_DEBUG_LOG defined, which removes
+     * debug messages at compile time.
+     */
+    static void setLogLevel(LogLevel level);
+
+    /**
+     * Start or stop recording a trace of the library's activity:
+     * every driver callback, every call into the application for
+     * samples, resampler calls, and PulseAudio mainloop dispatches,
+     * each timed and attributed to its thread. Tracing is off by
+     * default, and costs a clock reading or two per event when on.
+     * Events are kept in fixed per-thread buffers allocated on first
+     * use, which retain the most recent events (a few tens of
+     * seconds' worth of callbacks).
+     *
+     * Tracing is unavailable if the library was built with
+     * BQAUDIOIO_NO_TRACING defined.
+     */
+    static void setTracing(bool enabled);
+
+    /**
+     * Write the trace recorded so far to the given file, in the
+     * Chrome trace-event JSON format that can be loaded into
+     * chrome://tracing or Perfetto. This may be called while tracing
+     * continues. Return false if the file could not be written.
+     */
+    static bool writeTrace(std::string filename);
     
     static std::vector<std::string> getImplementationNames();
     static std::string getImplementationDescription(std::string implName);
@@ -82,12 +150,78 @@ public:
      * Wherever an empty string is provided, the driver will make an
      * automatic selection and may potentially try more than one
      * implementation or device if its first choice can't be used.
+     *
+     * The "null" implementation, which is always available, is never
+     * selected automatically. It uses no audio hardware: a timer
+     * thread calls the application at the rate real hardware would,
+     * and the output is discarded. Its record device may be
+     * "Silence" (the default) or "Loopback", which records exactly
+     * what was played, at the same frame position. It is intended
+     * for headless machines and for testing.
+     *
+     * If shareClient is true and the JACK implementation is used,
+     * the IO will share a single JACK client with every other IO in
+     * this process that was opened with shareClient set and the same
+     * client name, registering its own group of ports on it. This
+     * saves per-cycle work in the JACK server when an application
+     * runs many streams at once. It is ignored by other
+     * implementations.
+     *
+     * If subBlockSize is non-zero, drivers that may be handed large
+     * or irregular blocks (PulseAudio and PortAudio) split each one
+     * into sub-blocks of at most this many frames, and carry every
+     * stage of processing - the application callback, gain, metering
+     * and interleaving - through to completion on each sub-block
+     * before starting the next. A value that keeps a sub-block of
+     * all channels within the CPU's L1 cache (something like 64-256
+     * frames) keeps the data in cache between stages. The
+     * application then sees callbacks of no more than this size. The
+     * default of zero processes each driver block whole.
+     *
+     * If sampleFormat is an integer format, the PulseAudio and
+     * PortAudio implementations ask for that format from the server
+     * or host API, converting to and from float within the library
+     * (with dither on 16-bit output). This avoids moving float
+     * samples only to have them converted further down the line, and
+     * halves the data sent to a remote server for 16-bit. If the
+     * format is refused, the implementation falls back to float. It
+     * is ignored by JACK, which is always float.
+     *
+     * If recordChannels is non-empty, only the listed device input
+     * channels (numbered from zero) are recorded, in the order
+     * given. JACK registers and connects only one port per listed
+     * channel. PortAudio and PulseAudio open the device with as many
+     * channels as needed to reach the highest one listed, and
+     * extract the selected channels directly from the interleaved
+     * input, without deinterleaving the rest. The record target
+     * then sees the selection as the device's channels, and any
+     * input mixing matrix must have one column per listed channel.
+     *
+     * If blockSize is non-zero, the null implementation calls the
+     * application with blocks of this many frames (the default is
+     * 1024). Other implementations take their block size from the
+     * device and ignore it.
+     *
+     * If statisticsName is non-empty, the IO publishes its callback
+     * load, dropout counts, latency, levels and state to a POSIX
+     * shared-memory segment of that name, for monitoring from
+     * another process (see SystemPlaybackTarget::publishStatistics).
+     * Failure to create the segment is logged but does not prevent
+     * the IO from opening.
      */
     struct Preference {
         std::string implementation;
         std::string recordDevice;
         std::string playbackDevice;
-        Preference() { }
+        bool shareClient;
+        int subBlockSize;
+        SampleFormat sampleFormat;
+        std::vector<int> recordChannels;
+        std::string statisticsName;
+        int blockSize;
+        Preference() :
+            shareClient(false), subBlockSize(0),
+            sampleFormat(SampleFormat::Float32), blockSize(0) { }
     };
 
     /**
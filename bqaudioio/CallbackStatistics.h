@@ -0,0 +1,105 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_CALLBACK_STATISTICS_H
+#define BQAUDIOIO_CALLBACK_STATISTICS_H
+
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Measurements of the audio callbacks of a SystemPlaybackTarget,
+ * SystemRecordSource or SystemAudioIO, as returned by their
+ * getStatistics() methods. Each quantity is summarised over all
+ * callbacks since the stream was opened or the statistics were last
+ * reset.
+ *
+ * Times are measured with a monotonic clock and given in seconds.
+ */
+struct CallbackStatistics
+{
+    struct Summary
+    {
+        double min;
+        double mean;
+        double max;
+
+        /**
+         * 99th percentile, to within about 5%.
+         */
+        double p99;
+
+        Summary() : min(0.0), mean(0.0), max(0.0), p99(0.0) { }
+    };
+
+    /**
+     * Number of callbacks measured.
+     */
+    int64_t callbacks;
+
+    /**
+     * Time spent in each callback as a fraction of the duration of
+     * the audio it processed. Values approaching 1.0 mean the
+     * callback is close to missing its deadline.
+     */
+    Summary dspLoad;
+
+    /**
+     * Time spent in the application's sample callbacks
+     * (ApplicationPlaybackSource::getSourceSamples and
+     * ApplicationRecordTarget::putSamples and their variants) in
+     * each callback.
+     */
+    Summary applicationTime;
+
+    /**
+     * Time spent in each callback by the library itself: mixing,
+     * gain, metering, format conversion and so on.
+     */
+    Summary libraryTime;
+
+    /**
+     * Number of sample frames processed in each callback.
+     */
+    Summary blockSize;
+
+    /**
+     * Time between the starts of successive callbacks.
+     */
+    Summary interval;
+
+    CallbackStatistics() : callbacks(0) { }
+};
+
+}
+
+#endif
@@ -0,0 +1,101 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_CALLBACK_TIMING_H
+#define BQAUDIOIO_CALLBACK_TIMING_H
+
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Timing information for a single block of audio, passed to the
+ * application alongside the samples through
+ * ApplicationPlaybackSource::getSourceSamplesWithTiming and
+ * ApplicationRecordTarget::putSamplesWithTiming.
+ *
+ * All times are in seconds, on the same clock as is used by
+ * SystemPlaybackTarget::getCurrentTime(). A time of zero means the
+ * implementation was unable to determine that time.
+ *
+ * This is a plain struct so that it can be filled and passed in a
+ * realtime context without allocation.
+ */
+struct CallbackTiming
+{
+    enum Flag {
+        InputUnderflow  = 0x01,
+        InputOverflow   = 0x02,
+        OutputUnderflow = 0x04,
+        OutputOverflow  = 0x08,
+        PrimingOutput   = 0x10,
+        Freewheeling    = 0x20
+    };
+
+    /**
+     * Time at which the callback was invoked.
+     */
+    double currentTime;
+
+    /**
+     * Time at which the first sample of the output block is
+     * expected to be presented at the output of the device.
+     */
+    double outputTime;
+
+    /**
+     * Time at which the first sample of the input block was
+     * captured at the input of the device.
+     */
+    double inputTime;
+
+    /**
+     * Position of the first sample frame of this block in the
+     * running frame count of the IO. For JACK this is the JACK frame
+     * time, which is shared by all clients of the same server; for
+     * other implementations it counts from zero when the stream is
+     * first started.
+     */
+    int64_t frame;
+
+    /**
+     * Bitwise combination of Flag values, reporting any dropouts
+     * detected since the previous block, and whether the IO is
+     * currently running faster than realtime (in which case the
+     * times are derived from the frame count and do not track the
+     * wall clock).
+     */
+    int flags;
+};
+
+}
+
+#endif
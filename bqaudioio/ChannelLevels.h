@@ -0,0 +1,76 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_CHANNEL_LEVELS_H
+#define BQAUDIOIO_CHANNEL_LEVELS_H
+
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Levels measured on one channel of audio, as returned by
+ * SystemPlaybackTarget::getOutputLevels and
+ * SystemRecordSource::getInputLevels. Levels are linear, with 1.0
+ * being full scale.
+ */
+struct ChannelLevels
+{
+    /**
+     * Highest absolute sample value since the previous reading.
+     */
+    float peak;
+
+    /**
+     * RMS level since the previous reading.
+     */
+    float rms;
+
+    /**
+     * Highest estimated inter-sample ("true") peak since the
+     * previous reading, using the 4x oversampling method of ITU-R
+     * BS.1770. This may exceed the sample peak, and may exceed 1.0
+     * even where no sample does.
+     */
+    float truePeak;
+
+    /**
+     * Number of samples at or beyond full scale since the stream
+     * was opened. This only ever increases.
+     */
+    int64_t clipCount;
+
+    ChannelLevels() : peak(0.f), rms(0.f), truePeak(0.f), clipCount(0) { }
+};
+
+}
+
+#endif
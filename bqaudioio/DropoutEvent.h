@@ -0,0 +1,108 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_DROPOUT_EVENT_H
+#define BQAUDIOIO_DROPOUT_EVENT_H
+
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * A record of one dropout, as returned by
+ * SystemPlaybackTarget::getDropoutEvents and
+ * SystemRecordSource::getDropoutEvents.
+ */
+struct DropoutEvent
+{
+    enum Kind {
+        /// The device ran out of output samples
+        OutputUnderflow,
+        /// Output samples were discarded because the device buffer was full
+        OutputOverflow,
+        /// The device delivered fewer input samples than expected
+        InputUnderflow,
+        /// Input samples were lost because they were not read in time
+        InputOverflow,
+        /// The audio server reported an xrun (JACK), which may have
+        /// affected both input and output
+        ServerXrun,
+        /// The application's getSourceSamples returned fewer
+        /// samples than requested, and the rest were played as
+        /// silence, having returned all it was asked for the time
+        /// before. A source that stays short (because it is stopped,
+        /// say) is reported only once
+        SourceUnderDelivery
+    };
+
+    /**
+     * Serial number of the event, counting from 1. A gap in the
+     * numbers returned means that events were discarded from the
+     * journal before they could be read.
+     */
+    int64_t sequence;
+
+    Kind kind;
+
+    /**
+     * Frame position, on the clock of CallbackTiming::frame, of the
+     * block in which the dropout was detected; or, for
+     * SourceUnderDelivery, of the first sample that was missing.
+     */
+    int64_t frame;
+
+    /**
+     * Time at which the dropout was detected, in seconds on the
+     * monotonic clock used for CallbackStatistics. Only differences
+     * between these times are meaningful.
+     */
+    double time;
+
+    /**
+     * Duration in seconds of the most recent callback to complete
+     * before the dropout was detected, for correlation with load
+     * spikes.
+     */
+    double previousCallbackDuration;
+
+    /**
+     * Number of frames processed in that callback.
+     */
+    int blockSize;
+
+    DropoutEvent() :
+        sequence(0), kind(OutputUnderflow), frame(0), time(0.0),
+        previousCallbackDuration(0.0), blockSize(0) { }
+};
+
+}
+
+#endif
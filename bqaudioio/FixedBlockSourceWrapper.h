@@ -0,0 +1,163 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_FIXED_BLOCK_SOURCE_WRAPPER_H
+#define BQAUDIOIO_FIXED_BLOCK_SOURCE_WRAPPER_H
+
+#include "ApplicationPlaybackSource.h"
+
+#include <mutex>
+
+namespace breakfastquay {
+
+/**
+ * Utility class for applications whose playback processing needs to
+ * work in blocks of a fixed size (for example, FFT-based processing
+ * with a power-of-two frame size).
+ *
+ * Audio drivers make no promise about the number of frames they will
+ * ask for in each callback: PulseAudio asks for arbitrary amounts,
+ * PortAudio may use varying block sizes, and a ResamplerWrapper
+ * changes the block size anyway. An application can wrap its
+ * ApplicationPlaybackSource in a FixedBlockSourceWrapper when passing
+ * it to the AudioFactory, and its getSourceSamples will then always
+ * be asked for exactly the block size given here, however many frames
+ * the driver itself requests.
+ *
+ * The wrapped source renders directly into the wrapper's buffer, and
+ * the wrapper holds on to any frames left over once the driver's
+ * request has been met. Those frames are a delay between rendering
+ * and playback on top of the driver's own latency, and the latency
+ * reported to the wrapped source through setSystemPlaybackLatency
+ * includes them: it is updated, if it has changed, just before each
+ * block is requested, so that it is exact for that block. The output
+ * time in any CallbackTiming passed on is adjusted in the same way.
+ */
+class FixedBlockSourceWrapper : public ApplicationPlaybackSource
+{
+public:
+    /**
+     * Create a wrapper around the given ApplicationPlaybackSource,
+     * implementing another ApplicationPlaybackSource interface that
+     * draws from the same source but always in blocks of blockSize
+     * frames.
+     *
+     * The wrapper does not take ownership of the wrapped
+     * ApplicationPlaybackSource, whose lifespan must exceed that of
+     * this object.
+     */
+    FixedBlockSourceWrapper(ApplicationPlaybackSource *source,
+                            int blockSize);
+
+    ~FixedBlockSourceWrapper();
+
+    /**
+     * Return the fixed block size that the wrapped source is called
+     * with.
+     */
+    int getBlockSize() const { return m_blockSize; }
+
+    /**
+     * Discard any frames already rendered by the wrapped source but
+     * not yet played.
+     */
+    void reset();
+    
+    // These functions are passed through to the wrapped
+    // ApplicationPlaybackSource
+    
+    std::string getClientName() const override;
+    int getApplicationSampleRate() const override;
+    int getApplicationChannelCount() const override;
+
+    void setSystemPlaybackSampleRate(int) override;
+    void setOutputLevels(float peakLeft, float peakRight) override;
+    void setSystemFreewheeling(bool) override;
+    void audioProcessingOverload() override;
+    void audioProcessingDeadlineWarning(double duration, double deadline) override;
+
+    // These functions are intercepted: the wrapped source is told
+    // the fixed block size, and a latency that includes the frames
+    // buffered here
+    
+    void setSystemPlaybackBlockSize(int) override;
+    void setSystemPlaybackChannelCount(int) override;
+    void setSystemPlaybackLatency(int) override;
+
+    /** 
+     * Return the requested number of frames, requesting as many
+     * fixed-size blocks from the wrapped ApplicationPlaybackSource as
+     * needed to do so. If the wrapped source returns fewer frames
+     * than a whole block, the rest of the block is filled with
+     * silence.
+     */
+    int getSourceSamples(float *const *samples, int nchannels, int nframes) override;
+
+    /**
+     * As getSourceSamples, also passing timing information through
+     * to the wrapped source, with the frame position and output time
+     * advanced to account for the frames already buffered.
+     */
+    int getSourceSamplesWithTiming(float *const *samples,
+                                   int nchannels, int nframes,
+                                   const CallbackTiming &timing) override;
+
+private:
+    ApplicationPlaybackSource *m_source;
+
+    const int m_blockSize;
+    int m_channels;
+    int m_sampleRate;
+    int m_systemLatency;
+    int m_reportedLatency;
+    
+    float **m_buffer;
+    int m_bufferSize;
+    int m_fill;
+    float **m_ptrs;
+
+    std::mutex m_mutex;
+
+    int getSamples(float *const *samples, int nchannels, int nframes,
+                   const CallbackTiming *timing);
+
+    // These should be called with m_mutex held already
+    void reallocate(int channels, int nframes);
+    void checkBufferFor(int nframes);
+    void reportLatency();
+    
+    FixedBlockSourceWrapper(const FixedBlockSourceWrapper &)=delete;
+    FixedBlockSourceWrapper &operator=(const FixedBlockSourceWrapper &)=delete;
+};
+
+}
+
+#endif
@@ -0,0 +1,162 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_FIXED_BLOCK_TARGET_WRAPPER_H
+#define BQAUDIOIO_FIXED_BLOCK_TARGET_WRAPPER_H
+
+#include "ApplicationRecordTarget.h"
+
+#include <mutex>
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Utility class for applications whose record processing needs to
+ * work in blocks of a fixed size. This is the recording counterpart
+ * of FixedBlockSourceWrapper.
+ *
+ * An application can wrap its ApplicationRecordTarget in a
+ * FixedBlockTargetWrapper when passing it to the AudioFactory, and
+ * its putSamples will then always be called with exactly the block
+ * size given here, however many frames the driver delivers at a
+ * time.
+ *
+ * Incoming frames are collected in the wrapper's buffer and handed
+ * on, without further copying, as soon as a whole block is
+ * available. Frames that arrive after the end of a block but before
+ * it can be delivered are an additional delay, and the latency
+ * reported to the wrapped target through setSystemRecordLatency
+ * includes them: it is updated, if it has changed, just before each
+ * block is delivered, so that it is exact for that block. The frame
+ * position and input time in any CallbackTiming passed on refer to
+ * the first frame of the block.
+ */
+class FixedBlockTargetWrapper : public ApplicationRecordTarget
+{
+public:
+    /**
+     * Create a wrapper around the given ApplicationRecordTarget,
+     * implementing another ApplicationRecordTarget interface that
+     * passes on the same data but always in blocks of blockSize
+     * frames.
+     *
+     * The wrapper does not take ownership of the wrapped
+     * ApplicationRecordTarget, whose lifespan must exceed that of
+     * this object.
+     */
+    FixedBlockTargetWrapper(ApplicationRecordTarget *target,
+                            int blockSize);
+
+    ~FixedBlockTargetWrapper();
+
+    /**
+     * Return the fixed block size that the wrapped target is called
+     * with.
+     */
+    int getBlockSize() const { return m_blockSize; }
+
+    /**
+     * Discard any frames received but not yet passed on to the
+     * wrapped target.
+     */
+    void reset();
+    
+    // These functions are passed through to the wrapped
+    // ApplicationRecordTarget
+
+    std::string getClientName() const override;
+    int getApplicationSampleRate() const override;
+    int getApplicationChannelCount() const override;
+
+    void setSystemRecordSampleRate(int) override;
+    void setInputLevels(float peakLeft, float peakRight) override;
+    void setSystemFreewheeling(bool) override;
+    void audioProcessingOverload() override;
+    void audioProcessingDeadlineWarning(double duration, double deadline) override;
+
+    // These functions are intercepted: the wrapped target is told
+    // the fixed block size, and a latency that includes the frames
+    // buffered here
+    
+    void setSystemRecordBlockSize(int) override;
+    void setSystemRecordChannelCount(int) override;
+    void setSystemRecordLatency(int) override;
+
+    /**
+     * Buffer the given frames, passing on to the wrapped
+     * ApplicationRecordTarget as many whole blocks as are now
+     * available.
+     */
+    void putSamples(const float *const *samples, int nchannels, int nframes) override;
+
+    /**
+     * As putSamples, also passing timing information through to the
+     * wrapped target for each block delivered.
+     */
+    void putSamplesWithTiming(const float *const *samples,
+                              int nchannels, int nframes,
+                              const CallbackTiming &timing) override;
+
+private:
+    ApplicationRecordTarget *m_target;
+
+    const int m_blockSize;
+    int m_channels;
+    int m_sampleRate;
+    int m_systemLatency;
+    int m_reportedLatency;
+    int m_addedLatency;
+
+    float **m_buffer;
+    int m_bufferSize;
+    int m_fill;
+    const float **m_ptrs;
+    int64_t m_startFrame;
+    double m_startTime;
+
+    std::mutex m_mutex;
+
+    void put(const float *const *samples, int nchannels, int nframes,
+             const CallbackTiming *timing);
+
+    // These should be called with m_mutex held already
+    void reallocate(int channels, int nframes);
+    void checkBufferFor(int nframes);
+    void reportLatency();
+    
+    FixedBlockTargetWrapper(const FixedBlockTargetWrapper &)=delete;
+    FixedBlockTargetWrapper &operator=(const FixedBlockTargetWrapper &)=delete;
+};
+
+}
+
+#endif
@@ -0,0 +1,133 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_MIXING_MATRIX_H
+#define BQAUDIOIO_MIXING_MATRIX_H
+
+#include <vector>
+
+namespace breakfastquay {
+
+/**
+ * A matrix of gains mapping one set of audio channels onto another,
+ * for up- or down-mixing between the channel count of the
+ * application and that of the device. Each row is an output channel
+ * and each column an input channel; output channel r receives the
+ * sum over c of input channel c multiplied by get(r, c).
+ *
+ * For playback the inputs are the application source's channels and
+ * the outputs are the device's. For recording the inputs are the
+ * device's channels and the outputs are the application target's.
+ *
+ * A default-constructed matrix is empty, meaning "use the default
+ * mapping" - see standard().
+ *
+ * The presets assume the usual channel order for each layout: L, R
+ * for stereo; L, R, rear L, rear R for quad; and L, R, C, LFE, rear
+ * L, rear R for 5.1.
+ */
+class MixingMatrix
+{
+public:
+    /**
+     * Construct an empty matrix.
+     */
+    MixingMatrix();
+
+    /**
+     * Construct a matrix with the given numbers of output and input
+     * channels, with all gains zero.
+     */
+    MixingMatrix(int outputs, int inputs);
+
+    int getOutputCount() const { return m_outputs; }
+    int getInputCount() const { return m_inputs; }
+    bool isEmpty() const { return m_outputs == 0 || m_inputs == 0; }
+
+    float get(int output, int input) const;
+    void set(int output, int input, float gain);
+
+    /**
+     * Return a matrix passing each of the given number of channels
+     * straight through.
+     */
+    static MixingMatrix identity(int channels);
+
+    /**
+     * Return a matrix sending the first input to the first output,
+     * and so on, but in the given order: output r takes input
+     * order[r], or is silent if order[r] is negative.
+     */
+    static MixingMatrix routing(const std::vector<int> &order, int inputs);
+
+    /**
+     * Mono to stereo, with the mono signal at full level in both
+     * channels.
+     */
+    static MixingMatrix monoToStereo();
+
+    /**
+     * Stereo to mono, averaging the two channels.
+     */
+    static MixingMatrix stereoToMono();
+
+    /**
+     * Stereo to quad, with the front pair repeated at the rear.
+     */
+    static MixingMatrix stereoToQuad();
+
+    /**
+     * 5.1 to stereo using the ITU-R BS.775 downmix coefficients:
+     * centre and each rear channel at -3dB into the corresponding
+     * side, LFE discarded.
+     */
+    static MixingMatrix fiveOneToStereo();
+
+    /**
+     * Return the default mapping from the given number of inputs to
+     * the given number of outputs. This is what is used when no
+     * matrix has been set. Equal counts pass straight through; mono
+     * input is copied to every output; mono output takes the average
+     * of every input; more outputs than inputs repeat the inputs in
+     * turn; fewer outputs than inputs fold the extra inputs in turn
+     * onto the outputs.
+     */
+    static MixingMatrix standard(int outputs, int inputs);
+
+private:
+    int m_outputs;
+    int m_inputs;
+    std::vector<float> m_gains;
+};
+
+}
+
+#endif
@@ -0,0 +1,271 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_OFFLINE_RENDERER_H
+#define BQAUDIOIO_OFFLINE_RENDERER_H
+
+#include "SystemAudioIO.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace breakfastquay {
+
+class ChannelMixer;
+class CallbackMonitor;
+
+/**
+ * Renders from an ApplicationPlaybackSource, and optionally to an
+ * ApplicationRecordTarget, as fast as the CPU allows rather than at
+ * the rate of an audio device, for example to export a mix to a
+ * file. The renderer is a SystemAudioIO, and the source and target
+ * are called exactly as they would be by an audio driver, with the
+ * same output gain, balance, channel mixing and metering, so the
+ * application's playback code can be used unchanged. To render at a
+ * rate other than the source's own, wrap the source in a
+ * ResamplerWrapper and pass the rate to the constructor.
+ *
+ * Nothing happens except in calls to render, which process the
+ * source and target on the calling thread, in blocks of at most the
+ * block size given to the constructor. The output is written either
+ * to buffers provided by the caller or to a Sink.
+ *
+ * The source and target are told through setSystemFreewheeling that
+ * they are running faster than realtime, and each CallbackTiming
+ * passed to them has the Freewheeling flag set. Levels are reported
+ * to them for every block, which may be a great many calls a second;
+ * applications that don't want them can disable them with
+ * setOutputLevelCallbacksEnabled and setInputLevelCallbacksEnabled.
+ *
+ * A renderer is not created through AudioFactory: construct it
+ * directly. The supplied source and target must outlive it.
+ */
+class OfflineRenderer : public SystemAudioIO
+{
+public:
+    /**
+     * Receiver for rendered output, for use with render(Sink &,
+     * int64_t).
+     */
+    class Sink
+    {
+    public:
+        virtual ~Sink() { }
+
+        /**
+         * Accept a block of rendered output, of nframes in each of
+         * nchannels non-interleaved channels. Return false to stop
+         * rendering after this block.
+         */
+        virtual bool putRenderedSamples(const float *const *samples,
+                                        int nchannels, int nframes) = 0;
+    };
+
+    /**
+     * Create a renderer for the given source and target, either of
+     * which (but not both) may be null. If sampleRate is zero, the
+     * rate requested by the source is used, or that requested by the
+     * target if the source has none, or 44100 if neither has. The
+     * source is asked for at most blockSize frames at a time.
+     */
+    OfflineRenderer(ApplicationRecordTarget *recordTarget,
+                    ApplicationPlaybackSource *playSource,
+                    int sampleRate = 0,
+                    int blockSize = 1024);
+    virtual ~OfflineRenderer();
+
+    int getSampleRate() const { return m_sampleRate; }
+    int getBlockSize() const { return m_blockSize; }
+
+    /**
+     * Return the number of output channels rendered. This is the
+     * source's channel count, or the number of rows of an output
+     * mixing matrix that fits the source. It is zero if there is no
+     * source.
+     */
+    int getOutputChannelCount() const { return m_outputChannels; }
+
+    /**
+     * Return the number of input channels expected by render for the
+     * record target. This is the target's channel count, or the
+     * number of columns of an input mixing matrix that fits the
+     * target. It is zero if there is no target.
+     */
+    int getInputChannelCount() const { return m_inputChannels; }
+
+    /**
+     * Render nframes of output into the given buffers, which must
+     * have getOutputChannelCount() channels of at least nframes
+     * each. Output may be null, in which case the output is rendered
+     * and discarded (for example if only the record target matters).
+     *
+     * If input is non-null, it must have getInputChannelCount()
+     * channels of at least nframes, which are passed to the record
+     * target. If it is null, the target receives the rendered output
+     * instead, as if recording from a loopback of the output:
+     * channel n from output channel n, or silence if there is no
+     * such output channel.
+     *
+     * Return the number of frames rendered, which is nframes.
+     */
+    int render(float *const *output, int nframes,
+               const float *const *input = nullptr);
+
+    /**
+     * Render up to the given number of frames, block by block, to
+     * the given sink, with the record target (if any) receiving the
+     * output as for render with null input. Stop early if the sink
+     * returns false. Return the number of frames rendered.
+     */
+    int64_t render(Sink &sink, int64_t frames);
+
+    /**
+     * A unit of work for renderParallel.
+     */
+    struct Job {
+        OfflineRenderer *renderer;
+        Sink *sink;
+        int64_t frames;
+    };
+
+    /**
+     * Carry out the given jobs, each as render(*job.sink,
+     * job.frames), sharing them out between up to the given number
+     * of threads (including the calling thread), or one per CPU if
+     * threads is zero. Each renderer is only ever used by one thread
+     * at a time, so this is for renderers whose sources are
+     * independent of one another: a source shared between two jobs
+     * must be safe to call from two threads at once. Return when all
+     * the jobs are done.
+     */
+    static void renderParallel(const std::vector<Job> &jobs,
+                               int threads = 0);
+
+    /**
+     * Return the speed of rendering so far, as a multiple of
+     * realtime: the duration of the audio rendered divided by the
+     * time spent in render calls. Return 0 if nothing has been
+     * rendered. This is reset by resetStatistics.
+     */
+    double getRealtimeMultiple() const;
+
+    virtual bool isSourceOK() const override { return true; }
+    virtual bool isTargetOK() const override { return true; }
+
+    virtual double getCurrentTime() const override;
+    virtual int64_t getCurrentFrame() const override { return m_frame; }
+
+    /**
+     * A renderer only renders when asked to, so suspending and
+     * resuming it has no effect, except to be reflected in any
+     * published statistics.
+     */
+    virtual void suspend() override;
+    virtual void resume() override;
+
+    virtual void suppressRecordSide(bool) override { }
+
+    virtual void setOutputMixingMatrix(const MixingMatrix &) override;
+    virtual void setInputMixingMatrix(const MixingMatrix &) override;
+
+    virtual CallbackStatistics getStatistics() const override;
+    virtual void resetStatistics() override;
+    virtual std::vector<DropoutEvent> getDropoutEvents(int64_t after = 0) const override;
+    virtual bool setDeadlineWarningThreshold(double fraction) override;
+    virtual bool publishStatistics(std::string name) override;
+
+protected:
+    /**
+     * For subclasses that drive the renderer at some other pace, as
+     * NullAudioIO does. If offline is false, the source and target
+     * are not told they are freewheeling. Subclasses may also set
+     * m_loopback to false, to record silence rather than the output
+     * when no input is given, and m_callbackName, to label the
+     * renderer's callbacks in traces.
+     */
+    OfflineRenderer(ApplicationRecordTarget *recordTarget,
+                    ApplicationPlaybackSource *playSource,
+                    int sampleRate, int blockSize, bool offline);
+
+    void setup();
+    void allocateBuffers();
+    void deallocateBuffers();
+
+    /**
+     * Render one block of at most the block size, with m_mutex held,
+     * adding the given CallbackTiming flags to those passed to the
+     * application. Output and input are as for render, except that
+     * output may not be null.
+     */
+    void renderBlock(float *const *output, const float *const *input,
+                     int nframes, int flags);
+
+    bool m_offline;
+    bool m_loopback;
+    const char *m_callbackName;
+    int m_sampleRate;
+    int m_blockSize;
+    int m_sourceChannels;
+    int m_targetChannels;
+    int m_outputChannels;
+    int m_inputChannels;
+    ChannelMixer *m_outputMixer;
+    ChannelMixer *m_inputMixer;
+    float **m_outputBuffers;
+    float **m_sourceScratch;
+    float **m_targetScratch;
+    float *m_silence;
+    int m_allocatedOutputs;
+    int m_allocatedSources;
+    int m_allocatedTargets;
+    std::vector<float *> m_outputPtrs;
+    std::vector<const float *> m_inputPtrs;
+    std::vector<float *> m_sourceBuffers;
+    std::vector<const float *> m_targetBuffers;
+    std::vector<const float *> m_loopbackBuffers;
+    std::vector<float> m_gains;
+    std::vector<float> m_peaks;
+    std::atomic<int64_t> m_frame;
+    std::atomic<int64_t> m_renderedFrames;
+    std::atomic<int64_t> m_renderTime;
+    CallbackMonitor *m_monitor;
+    std::mutex m_mutex;
+
+    OfflineRenderer(const OfflineRenderer &)=delete;
+    OfflineRenderer &operator=(const OfflineRenderer &)=delete;
+};
+
+}
+
+#endif
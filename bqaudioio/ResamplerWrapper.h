@@ -105,7 +105,9 @@ public:
     void setSystemPlaybackLatency(int) override;
 
     void setOutputLevels(float peakLeft, float peakRight) override;
+    void setSystemFreewheeling(bool) override;
     void audioProcessingOverload() override;
+    void audioProcessingDeadlineWarning(double duration, double deadline) override;
 
     /** 
      * Request some samples from the wrapped
@@ -114,6 +116,17 @@ public:
      */
     int getSourceSamples(float *const *samples, int nchannels, int nframes) override;
 
+    /**
+     * As getSourceSamples, also passing timing information through
+     * to the wrapped source. The frame position is converted to the
+     * source rate, and the output time adjusted to account for
+     * samples already buffered in the resampler, so when resampling
+     * the timing passed on is approximate.
+     */
+    int getSourceSamplesWithTiming(float *const *samples,
+                                   int nchannels, int nframes,
+                                   const CallbackTiming &timing) override;
+
 private:
     ApplicationPlaybackSource *m_source;
     
@@ -132,6 +145,9 @@ private:
 
     std::mutex m_mutex;
 
+    int getSamples(float *const *samples, int nchannels, int nframes,
+                   const CallbackTiming *timing);
+    
     // These three should be called with m_mutex held already
     void deconstructResampler();
     void reconstructResampler();
@@ -0,0 +1,174 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_SHARED_STATISTICS_H
+#define BQAUDIOIO_SHARED_STATISTICS_H
+
+#include <atomic>
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Layout of the POSIX shared-memory segment into which an IO
+ * publishes its health when given a statistics name (see
+ * AudioFactory::Preference::statisticsName and
+ * SystemPlaybackTarget::publishStatistics). A monitoring process
+ * maps the segment read-only with shm_open and mmap and reads it at
+ * whatever rate it likes, without any involvement of the audio
+ * process's threads. The bqaudioio-top program is such a reader.
+ *
+ * The layout is fixed: every field has an explicit size, and every
+ * 8-byte field is 8-byte aligned, so that a reader built separately
+ * (even for a 32-bit ABI) sees the same offsets. Readers must check
+ * magic and version before trusting anything else. Any change of
+ * layout increments the version.
+ *
+ * The snapshot is written by the audio thread at the end of every
+ * callback, under a sequence lock: the writer makes sequence odd,
+ * updates the snapshot, then makes it even again. Use
+ * readSnapshot, which retries until it gets a consistent copy. The
+ * state is written separately, whenever the stream is suspended or
+ * resumed, since there are no callbacks to publish it while
+ * suspended.
+ */
+struct SharedStatistics
+{
+    enum : uint32_t {
+        Magic = 0x62716173, // "bqas"
+        Version = 1
+    };
+
+    enum {
+        MaxChannels = 32,
+        DropoutKinds = 6 // the number of DropoutEvent::Kind values
+    };
+
+    enum State : int32_t {
+        Running = 1,
+        Suspended = 2,
+        Closed = 3 // the IO has been deleted
+    };
+
+    struct Snapshot
+    {
+        /**
+         * Time of the update, in nanoseconds on the monotonic clock
+         * (CLOCK_MONOTONIC on Linux). A reader can compare this
+         * with its own reading of the clock to spot a stalled
+         * stream.
+         */
+        int64_t updateTime;
+
+        /**
+         * Number of callbacks since the stream was opened.
+         */
+        int64_t callbacks;
+
+        int32_t sampleRate;
+
+        /**
+         * Frames processed in the most recent callback.
+         */
+        int32_t blockSize;
+
+        /**
+         * Time spent in the most recent callback as a fraction of
+         * the duration of the audio it processed (see
+         * CallbackStatistics::dspLoad); the same smoothed over about
+         * a second; and the highest since the stream was opened.
+         */
+        double load;
+        double averageLoad;
+        double maxLoad;
+
+        /**
+         * Number of dropouts of each DropoutEvent::Kind since the
+         * stream was opened, indexed by kind.
+         */
+        int64_t dropouts[DropoutKinds];
+
+        /**
+         * Most recent latencies reported to the application, in
+         * frames.
+         */
+        int32_t inputLatency;
+        int32_t outputLatency;
+
+        /**
+         * Number of channels metered, at most MaxChannels.
+         */
+        int32_t inputChannels;
+        int32_t outputChannels;
+
+        /**
+         * Sample peak of each channel, falling back at 20dB per
+         * second, as a linear magnitude (1.0 is full scale).
+         */
+        float inputPeak[MaxChannels];
+        float outputPeak[MaxChannels];
+    };
+
+    // Written once when the segment is created
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;       // of this struct, as written
+    int32_t processId;
+    char implementation[16];
+
+    std::atomic<int32_t> state;
+    std::atomic<uint32_t> sequence;
+
+    Snapshot snapshot;
+
+    /**
+     * Copy a consistent snapshot into s, retrying while the audio
+     * thread is writing. Return false if no consistent copy could be
+     * made after a number of attempts (which happens only if the
+     * reader is being starved of CPU).
+     */
+    bool readSnapshot(Snapshot &s) const {
+        for (int attempt = 0; attempt < 1000; ++attempt) {
+            uint32_t before = sequence.load(std::memory_order_acquire);
+            if (before & 1) continue;
+            s = snapshot;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+}
+
+#endif
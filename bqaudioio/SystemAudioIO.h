@@ -81,6 +81,43 @@ public:
      * implementations will implement it.
      */
     virtual void suppressRecordSide(bool suppress) = 0;
+
+    /**
+     * Retrieve a snapshot of the load and timing of the audio
+     * callbacks. For duplex IO a callback covers both recording and
+     * playback, so there is one set of statistics for the two
+     * sides. See SystemPlaybackTarget::getStatistics.
+     */
+    virtual CallbackStatistics getStatistics() const override {
+        return CallbackStatistics();
+    }
+
+    /**
+     * Discard the statistics gathered so far.
+     */
+    virtual void resetStatistics() override { }
+
+    /**
+     * Retrieve the recorded dropouts, on either side, with sequence
+     * numbers greater than after. See
+     * SystemPlaybackTarget::getDropoutEvents.
+     */
+    virtual std::vector<DropoutEvent> getDropoutEvents(int64_t = 0) const override {
+        return {};
+    }
+
+    /**
+     * Set the threshold for deadline warnings to both source and
+     * target. See SystemPlaybackTarget::setDeadlineWarningThreshold.
+     */
+    virtual bool setDeadlineWarningThreshold(double) override { return false; }
+
+    /**
+     * Publish the health of the stream, covering both sides, to the
+     * POSIX shared-memory segment of the given name. See
+     * SystemPlaybackTarget::publishStatistics.
+     */
+    virtual bool publishStatistics(std::string) override { return false; }
     
 protected:
     SystemAudioIO(ApplicationRecordTarget *target,
@@ -33,10 +33,20 @@
 #define BQAUDIOIO_SYSTEM_PLAYBACK_TARGET_H
 
 #include "Suspendable.h"
+#include "MixingMatrix.h"
+#include "ChannelLevels.h"
+#include "CallbackStatistics.h"
+#include "DropoutEvent.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
 
 namespace breakfastquay {
 
 class ApplicationPlaybackSource;
+class Meter;
 
 /**
  * Target for audio samples for playback, encapsulating the system
@@ -80,6 +90,53 @@ public:
      */
     virtual double getCurrentTime() const = 0;
 
+    /**
+     * Get the current position on the frame clock used by resumeAt
+     * and by the frame values passed to the source in
+     * CallbackTiming. For JACK this is the current JACK frame time;
+     * for other implementations it is the frame at which the next
+     * block to be processed will start. To start playback half a
+     * second from now, for example, call resumeAt with this plus
+     * half the sample rate.
+     */
+    virtual int64_t getCurrentFrame() const = 0;
+
+    /**
+     * Resume the target, if it is suspended, but leave it playing
+     * silence without requesting any samples from the source until
+     * the given frame position is reached. The first sample obtained
+     * from the source will then be played at exactly that frame.
+     *
+     * The frame position is on the same clock as the frame values
+     * passed to the source in CallbackTiming, whose current value
+     * is returned by getCurrentFrame. If the frame has
+     * already passed by the time the next block is processed,
+     * playback starts immediately. A call to resumeAt on a target
+     * that is already playing will silence it until the frame is
+     * reached.
+     *
+     * To start several targets in sync, call resumeAt on each with
+     * the same frame. This is sample-accurate only for targets that
+     * share a clock, such as JACK targets connected to the same
+     * server.
+     */
+    virtual void resumeAt(int64_t frame);
+
+    /**
+     * Request that the audio system run faster than realtime
+     * ("freewheel"), processing blocks as fast as the source can
+     * supply them rather than at the rate of the audio device, or
+     * return to normal realtime operation. Useful for rendering or
+     * bouncing through an audio graph.
+     *
+     * Return true if the request was accepted. The source (and any
+     * record target) will be told when freewheeling actually starts
+     * and stops through setSystemFreewheeling. Not all
+     * implementations support this (currently only JACK does); the
+     * default implementation returns false.
+     */
+    virtual bool setFreewheeling(bool) { return false; }
+
     /**
      * Set the playback gain (0.0 = silence, 1.0 = levels unmodified
      * from the data provided by the source). The default is 1.0.
@@ -102,12 +159,129 @@ public:
      */
     virtual float getOutputBalance() const;
 
+    /**
+     * Set the matrix used to map the source's channels onto the
+     * device's, with one row per device channel and one column per
+     * source channel (see MixingMatrix). An empty matrix restores
+     * the default mapping.
+     *
+     * Where the implementation can, a matrix with a different number
+     * of rows from the current device channel count changes the
+     * device channel count to match: JACK registers or removes
+     * ports, and PortAudio reopens its stream. PulseAudio, whose
+     * server does its own channel mapping, accepts only matrices
+     * with as many rows as columns. If the matrix can't be used, the
+     * default mapping applies.
+     *
+     * Matrices that only reorder channels cost nothing in the audio
+     * callback.
+     */
+    virtual void setOutputMixingMatrix(const MixingMatrix &matrix);
+
+    /**
+     * Retrieve the matrix last set with setOutputMixingMatrix.
+     */
+    virtual MixingMatrix getOutputMixingMatrix() const;
+
+    /**
+     * Retrieve the levels of the output measured since the previous
+     * call, one entry per device channel, after gain and mixing (see
+     * ChannelLevels). This may be called from any thread at any
+     * rate, and never blocks the audio thread. Return false, leaving
+     * levels unchanged, if nothing has been played since the
+     * previous call.
+     */
+    virtual bool getOutputLevels(std::vector<ChannelLevels> &levels);
+
+    /**
+     * Enable or disable calls to the source's setOutputLevels from
+     * the audio thread. They are enabled by default. Applications
+     * that read levels with getOutputLevels instead can disable them
+     * to save a virtual call per block.
+     */
+    virtual void setOutputLevelCallbacksEnabled(bool enabled);
+
+    /**
+     * Retrieve a snapshot of the load and timing of the audio
+     * callbacks (see CallbackStatistics). This may be called from
+     * any thread and never blocks the audio thread. Implementations
+     * that do not measure their callbacks return empty statistics.
+     */
+    virtual CallbackStatistics getStatistics() const {
+        return CallbackStatistics();
+    }
+
+    /**
+     * Discard the statistics gathered so far, so that subsequent
+     * calls to getStatistics cover only callbacks from now on.
+     */
+    virtual void resetStatistics() { }
+
+    /**
+     * Retrieve the dropouts (underflows, overflows, xruns and short
+     * deliveries from the source) recorded since the stream was
+     * opened, oldest first, omitting any with sequence numbers up to
+     * and including after. Pass the sequence number of the last
+     * event seen to get only new ones. Only the most recent few
+     * hundred events are kept. This may be called from any thread
+     * and never blocks the audio thread.
+     */
+    virtual std::vector<DropoutEvent> getDropoutEvents(int64_t = 0) const {
+        return {};
+    }
+
+    /**
+     * Ask to be warned, through
+     * ApplicationPlaybackSource::audioProcessingDeadlineWarning,
+     * whenever a single call to the source for samples takes longer
+     * than the given fraction of the duration of the audio requested
+     * (0.7, for example, to hear of calls using more than 70% of the
+     * time available). The warnings come from a separate thread, so
+     * the audio thread does no more than compare against the
+     * threshold. A fraction of 0 turns the warnings off, which is
+     * the default.
+     *
+     * Return true if the implementation supports this. The default
+     * implementation returns false.
+     */
+    virtual bool setDeadlineWarningThreshold(double) { return false; }
+
+    /**
+     * Publish the health of the stream - callback load, dropout
+     * counts, latency, levels and state - to the POSIX shared-memory
+     * segment of the given name, for monitoring from another process
+     * (see SharedStatistics, and the bqaudioio-top program). The
+     * segment is updated at the end of every callback, and removed
+     * when the IO is deleted. An empty name stops publishing. This
+     * is normally requested through
+     * AudioFactory::Preference::statisticsName rather than called
+     * directly.
+     *
+     * Return true if the segment was created. The default
+     * implementation returns false.
+     */
+    virtual bool publishStatistics(std::string) { return false; }
+
 protected:
     SystemPlaybackTarget(ApplicationPlaybackSource *source);
 
+    /**
+     * For use by implementations when about to process an output
+     * block of nframes starting at the given frame position. Return
+     * the number of frames at the start of the block that must be
+     * left silent because of a pending resumeAt, from 0 (start
+     * playing at once) to nframes (play nothing). The pending start
+     * is cleared once it falls within a block.
+     */
+    int getScheduledSilence(int64_t blockFrame, int nframes);
+
     ApplicationPlaybackSource *m_source;
     float m_outputGain;
     float m_outputBalance;
+    MixingMatrix m_outputMatrix;
+    std::atomic<int64_t> m_scheduledStart;
+    Meter *m_outputMeter;
+    std::atomic<bool> m_outputLevelCallbacks;
 
     SystemPlaybackTarget(const SystemPlaybackTarget &)=delete;
     SystemPlaybackTarget &operator=(const SystemPlaybackTarget &)=delete;
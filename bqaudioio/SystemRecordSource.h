@@ -33,10 +33,19 @@
 #define BQAUDIOIO_SYSTEM_RECORD_SOURCE_H
 
 #include "Suspendable.h"
+#include "MixingMatrix.h"
+#include "ChannelLevels.h"
+#include "CallbackStatistics.h"
+#include "DropoutEvent.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
 
 namespace breakfastquay {
 
 class ApplicationRecordTarget;
+class Meter;
 
 /**
  * Source of audio samples for recording, encapsulating the system
@@ -71,10 +80,86 @@ public:
      */
     virtual bool isSourceReady() const { return isSourceOK(); }
 
+    /**
+     * Set the matrix used to map the device's channels onto the
+     * target's, with one row per target channel and one column per
+     * device channel (see MixingMatrix). An empty matrix restores
+     * the default mapping.
+     *
+     * As with SystemPlaybackTarget::setOutputMixingMatrix, a matrix
+     * with a different number of columns from the current device
+     * channel count changes the device channel count where the
+     * implementation can, and PulseAudio accepts only square
+     * matrices. Matrices that only pick or reorder channels cost
+     * nothing in the audio callback.
+     */
+    virtual void setInputMixingMatrix(const MixingMatrix &matrix);
+
+    /**
+     * Retrieve the matrix last set with setInputMixingMatrix.
+     */
+    virtual MixingMatrix getInputMixingMatrix() const;
+
+    /**
+     * Retrieve the levels of the input measured since the previous
+     * call, one entry per channel delivered to the target (see
+     * ChannelLevels). This may be called from any thread at any
+     * rate, and never blocks the audio thread. Return false, leaving
+     * levels unchanged, if nothing has been recorded since the
+     * previous call.
+     */
+    virtual bool getInputLevels(std::vector<ChannelLevels> &levels);
+
+    /**
+     * Enable or disable calls to the target's setInputLevels from
+     * the audio thread. They are enabled by default.
+     */
+    virtual void setInputLevelCallbacksEnabled(bool enabled);
+
+    /**
+     * Retrieve a snapshot of the load and timing of the audio
+     * callbacks. See SystemPlaybackTarget::getStatistics.
+     */
+    virtual CallbackStatistics getStatistics() const {
+        return CallbackStatistics();
+    }
+
+    /**
+     * Discard the statistics gathered so far.
+     */
+    virtual void resetStatistics() { }
+
+    /**
+     * Retrieve the recorded dropouts with sequence numbers greater
+     * than after. See SystemPlaybackTarget::getDropoutEvents.
+     */
+    virtual std::vector<DropoutEvent> getDropoutEvents(int64_t = 0) const {
+        return {};
+    }
+
+    /**
+     * Ask to be warned, through
+     * ApplicationRecordTarget::audioProcessingDeadlineWarning,
+     * whenever a single call to the target with samples takes longer
+     * than the given fraction of the duration of the audio. See
+     * SystemPlaybackTarget::setDeadlineWarningThreshold.
+     */
+    virtual bool setDeadlineWarningThreshold(double) { return false; }
+
+    /**
+     * Publish the health of the stream to the POSIX shared-memory
+     * segment of the given name. See
+     * SystemPlaybackTarget::publishStatistics.
+     */
+    virtual bool publishStatistics(std::string) { return false; }
+
 protected:
     SystemRecordSource(ApplicationRecordTarget *target);
 
     ApplicationRecordTarget *m_target;
+    MixingMatrix m_inputMatrix;
+    Meter *m_inputMeter;
+    std::atomic<bool> m_inputLevelCallbacks;
 
     SystemRecordSource(const SystemRecordSource &)=delete;
     SystemRecordSource &operator=(const SystemRecordSource &)=delete;
@@ -34,6 +34,7 @@
 #include "JACKAudioIO.h"
 #include "PortAudioIO.h"
 #include "PulseAudioIO.h"
+#include "NullAudioIO.h"
 
 // These two only need to be included to avoid puzzling compile errors
 // in the case where no IO subsystem is defined at all
@@ -41,8 +42,9 @@
 #include "Mode.h"
 
 #include "Log.h"
+#include "Tracer.h"
 
-#include <iostream>
+#include <fstream>
 
 using std::string;
 using std::vector;
@@ -55,6 +57,30 @@ AudioFactory::setLogCallback(LogCallback *callback)
     Log::setLogCallback(callback);
 }
 
+void
+AudioFactory::setLogLevel(LogLevel level)
+{
+    Log::setLevel(level);
+}
+
+void
+AudioFactory::setTracing(bool enabled)
+{
+    Tracer::setEnabled(enabled);
+}
+
+bool
+AudioFactory::writeTrace(string filename)
+{
+    std::ofstream out(filename);
+    if (!out) {
+        BQAUDIOIO_LOG_ERROR("AudioFactory", "writeTrace: Failed to open file"
+                            << logField("filename", filename));
+        return false;
+    }
+    return Tracer::write(out);
+}
+
 vector<string>
 AudioFactory::getImplementationNames()
 {
@@ -72,6 +98,8 @@ AudioFactory::getImplementationNames()
     names.push_back("jack");
 #endif
 
+    names.push_back("null");
+
     return names;
 }
 
@@ -90,6 +118,9 @@ AudioFactory::getImplementationDescription(string implementationName)
     if (implementationName == "port") {
         return "PortAudio Driver";
     }
+    if (implementationName == "null") {
+        return "No Audio Device";
+    }
     return "(unknown)";
 }
 
@@ -120,6 +151,10 @@ AudioFactory::getRecordDeviceNames(string implementationName)
     }
 #endif
 
+    if (implementationName == "null") {
+        return NullAudioIO::getRecordDeviceNames();
+    }
+
     return {};
 }
 
@@ -150,9 +185,26 @@ AudioFactory::getPlaybackDeviceNames(string implementationName)
     }
 #endif
 
+    if (implementationName == "null") {
+        return NullAudioIO::getPlaybackDeviceNames();
+    }
+
     return {};
 }
 
+static SystemAudioIO *
+publishing(SystemAudioIO *io, const AudioFactory::Preference &preference)
+{
+    // Failing to publish statistics is not a reason to refuse to
+    // play, so we only report it
+    if (preference.statisticsName != "" &&
+        !io->publishStatistics(preference.statisticsName)) {
+        BQAUDIOIO_LOG_WARNING("AudioFactory", "Failed to publish statistics"
+                              << logField("name", preference.statisticsName));
+    }
+    return io;
+}
+
 static SystemAudioIO *
 createIO(Mode mode,
          ApplicationRecordTarget *target,
@@ -168,10 +220,12 @@ createIO(Mode mode,
         ++implementationsTried;
         JACKAudioIO *io = new JACKAudioIO(mode, target, source,
                                           preference.recordDevice,
-                                          preference.playbackDevice);
-        if (io->isOK()) return io;
+                                          preference.playbackDevice,
+                                          preference.shareClient,
+                                          preference.recordChannels);
+        if (io->isOK()) return publishing(io, preference);
         else {
-            std::cerr << "WARNING: AudioFactory::createCallbackIO: Failed to open JACK I/O" << std::endl;
+            BQAUDIOIO_LOG_WARNING("AudioFactory", "Failed to open JACK I/O");
             startupError = io->getStartupErrorString();
             delete io;
         }
@@ -183,10 +237,13 @@ createIO(Mode mode,
         ++implementationsTried;
         PulseAudioIO *io = new PulseAudioIO(mode, target, source,
                                             preference.recordDevice,
-                                            preference.playbackDevice);
-        if (io->isOK()) return io;
+                                            preference.playbackDevice,
+                                            preference.subBlockSize,
+                                            preference.sampleFormat,
+                                            preference.recordChannels);
+        if (io->isOK()) return publishing(io, preference);
         else {
-            std::cerr << "WARNING: AudioFactory::createCallbackIO: Failed to open PulseAudio I/O" << std::endl;
+            BQAUDIOIO_LOG_WARNING("AudioFactory", "Failed to open PulseAudio I/O");
             startupError = io->getStartupErrorString();
             delete io;
         }
@@ -198,16 +255,35 @@ createIO(Mode mode,
         ++implementationsTried;
         PortAudioIO *io = new PortAudioIO(mode, target, source,
                                           preference.recordDevice,
-                                          preference.playbackDevice);
-        if (io->isOK()) return io;
+                                          preference.playbackDevice,
+                                          preference.subBlockSize,
+                                          preference.sampleFormat,
+                                          preference.recordChannels);
+        if (io->isOK()) return publishing(io, preference);
         else {
-            std::cerr << "WARNING: AudioFactory::createCallbackIO: Failed to open PortAudio I/O" << std::endl;
+            BQAUDIOIO_LOG_WARNING("AudioFactory", "Failed to open PortAudio I/O");
             startupError = io->getStartupErrorString();
             delete io;
         }
     }
 #endif
 
+    // The null implementation plays to nothing, so it is never a
+    // suitable automatic choice: only use it if asked for by name
+    if (preference.implementation == "null") {
+        ++implementationsTried;
+        NullAudioIO *io = new NullAudioIO(mode, target, source,
+                                          preference.recordDevice,
+                                          preference.playbackDevice,
+                                          preference.blockSize);
+        if (io->isOK()) return publishing(io, preference);
+        else {
+            BQAUDIOIO_LOG_WARNING("AudioFactory", "Failed to open null I/O");
+            startupError = io->getStartupErrorString();
+            delete io;
+        }
+    }
+
     if (implementationsTried == 0) {
         if (preference.implementation == "") {
             errorString = "No audio drivers compiled in";
@@ -218,7 +294,7 @@ createIO(Mode mode,
         errorString = startupError;
     }
     
-    std::cerr << "WARNING: AudioFactory::createIO: No suitable implementation available" << std::endl;
+    BQAUDIOIO_LOG_WARNING("AudioFactory", "No suitable implementation available");
     return nullptr;
 }
 
@@ -0,0 +1,500 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "CallbackMonitor.h"
+#include "CallbackTiming.h"
+#include "StatisticsSegment.h"
+#include "ApplicationPlaybackSource.h"
+#include "ApplicationRecordTarget.h"
+#include "Tracer.h"
+
+#include <chrono>
+#include <cmath>
+
+namespace breakfastquay {
+
+static const int binsPerOctave = 16;
+
+static_assert(DropoutEvent::SourceUnderDelivery + 1 ==
+              SharedStatistics::DropoutKinds,
+              "SharedStatistics must have a dropout count for every kind");
+
+CallbackMonitor::Histogram::Histogram(double lowest, double highest) :
+    m_lowest(lowest),
+    m_bins(2 + int(ceil(log2(highest / lowest) * binsPerOctave))),
+    m_counts(new std::atomic<uint32_t>[m_bins])
+{
+    clear();
+}
+
+CallbackMonitor::Histogram::~Histogram()
+{
+    delete[] m_counts;
+}
+
+int
+CallbackMonitor::Histogram::binFor(double value) const
+{
+    // Bin 0 holds everything up to m_lowest, and the last bin
+    // everything beyond the highest value
+    if (!(value > m_lowest)) return 0;
+    int bin = 1 + int(log2(value / m_lowest) * binsPerOctave);
+    if (bin >= m_bins) bin = m_bins - 1;
+    return bin;
+}
+
+double
+CallbackMonitor::Histogram::valueFor(int bin) const
+{
+    // Geometric centre of the bin
+    if (bin == 0) return m_lowest;
+    return m_lowest * exp2((bin - 0.5) / binsPerOctave);
+}
+
+void
+CallbackMonitor::Histogram::add(double value)
+{
+    // There is only one writer, so plain load-and-store suffices
+    std::atomic<uint32_t> &count = m_counts[binFor(value)];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    
+    int64_t n = m_count.load(std::memory_order_relaxed);
+    if (n == 0 || value < m_min.load(std::memory_order_relaxed)) {
+        m_min.store(value, std::memory_order_relaxed);
+    }
+    if (n == 0 || value > m_max.load(std::memory_order_relaxed)) {
+        m_max.store(value, std::memory_order_relaxed);
+    }
+    m_sum.store(m_sum.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+    m_count.store(n + 1, std::memory_order_release);
+}
+
+void
+CallbackMonitor::Histogram::clear()
+{
+    for (int i = 0; i < m_bins; ++i) {
+        m_counts[i].store(0, std::memory_order_relaxed);
+    }
+    m_sum.store(0.0, std::memory_order_relaxed);
+    m_min.store(0.0, std::memory_order_relaxed);
+    m_max.store(0.0, std::memory_order_relaxed);
+    m_count.store(0, std::memory_order_release);
+}
+
+CallbackStatistics::Summary
+CallbackMonitor::Histogram::summarise() const
+{
+    CallbackStatistics::Summary s;
+    
+    int64_t n = m_count.load(std::memory_order_acquire);
+    if (n == 0) return s;
+
+    // The fields may be updated while we read them, so the summary
+    // can be up to one value out of step with itself, but no more
+    s.min = m_min.load(std::memory_order_relaxed);
+    s.max = m_max.load(std::memory_order_relaxed);
+    s.mean = m_sum.load(std::memory_order_relaxed) / double(n);
+
+    int64_t threshold = (n * 99 + 99) / 100;
+    int64_t cumulative = 0;
+    int bin = 0;
+    for (; bin < m_bins; ++bin) {
+        cumulative += m_counts[bin].load(std::memory_order_relaxed);
+        if (cumulative >= threshold) break;
+    }
+    s.p99 = valueFor(bin);
+    if (s.p99 < s.min) s.p99 = s.min;
+    if (s.p99 > s.max) s.p99 = s.max;
+
+    return s;
+}
+
+CallbackMonitor::CallbackMonitor() :
+    m_load(1e-4, 100.0),
+    m_application(1e-7, 100.0),
+    m_library(1e-7, 100.0),
+    m_blockSize(1.0, 1048576.0),
+    m_interval(1e-7, 100.0),
+    m_callbacks(0),
+    m_resetPending(false),
+    m_lastDuration(0),
+    m_lastBlockSize(0),
+    m_limitPerFrame(0.0),
+    m_periodPerFrame(0.0),
+    m_warnSource(nullptr),
+    m_warnTarget(nullptr),
+    m_watchdogStop(false),
+    m_segment(nullptr),
+    m_publishing(false),
+    m_inputMeter(nullptr),
+    m_outputMeter(nullptr),
+    m_suspended(false),
+    m_name(""),
+    m_start(0),
+    m_lastStart(0),
+    m_appStart(0),
+    m_appTime(0),
+    m_carriedTime(0),
+    m_carriedAppTime(0),
+    m_sourceShort(true)
+{
+    for (int d = 0; d < 2; ++d) {
+        m_overrun[d] = 0;
+        m_overrunDeadline[d] = 0;
+        m_latency[d] = 0;
+    }
+    for (int i = 0; i < SharedStatistics::DropoutKinds; ++i) {
+        m_dropoutCounts[i] = 0;
+    }
+}
+
+CallbackMonitor::~CallbackMonitor()
+{
+    stopWatchdog();
+    delete m_segment.load();
+}
+
+int64_t
+CallbackMonitor::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void
+CallbackMonitor::beginCallback(const char *name)
+{
+    m_name = name;
+    m_start = now();
+    m_appTime = 0;
+    Tracer::nameThread(name);
+}
+
+void
+CallbackMonitor::beginApplication()
+{
+    m_appStart = now();
+}
+
+void
+CallbackMonitor::endApplication(Direction direction, int nframes)
+{
+    int64_t end = now();
+    int64_t duration = end - m_appStart;
+    m_appTime += duration;
+
+    if (Tracer::isEnabled()) {
+        Tracer::record(direction == Playback ?
+                       "getSourceSamples" : "putSamples",
+                       m_appStart, end);
+    }
+
+    double limit = m_limitPerFrame.load(std::memory_order_relaxed);
+    if (limit > 0.0 && double(duration) > limit * nframes) {
+        // The watchdog swaps the duration out, so store the deadline
+        // first
+        std::atomic<int64_t> &overrun = m_overrun[direction];
+        if (duration > overrun.load(std::memory_order_relaxed)) {
+            double period = m_periodPerFrame.load(std::memory_order_relaxed);
+            m_overrunDeadline[direction].store(int64_t(period * nframes),
+                                               std::memory_order_relaxed);
+            overrun.store(duration, std::memory_order_release);
+        }
+    }
+}
+
+void
+CallbackMonitor::endPartialCallback()
+{
+    int64_t end = now();
+    Tracer::record(m_name, m_start, end);
+    m_carriedTime += end - m_start;
+    m_carriedAppTime += m_appTime;
+}
+
+void
+CallbackMonitor::endCallback(int nframes, int sampleRate)
+{
+    int64_t end = now();
+    Tracer::record(m_name, m_start, end);
+
+    if (m_resetPending.exchange(false)) {
+        m_load.clear();
+        m_application.clear();
+        m_library.clear();
+        m_blockSize.clear();
+        m_interval.clear();
+        m_callbacks.store(0, std::memory_order_relaxed);
+        m_lastStart = 0;
+    }
+    
+    int64_t total = end - m_start + m_carriedTime;
+    int64_t app = m_appTime + m_carriedAppTime;
+    m_carriedTime = 0;
+    m_carriedAppTime = 0;
+
+    const double ns = 1e-9;
+
+    double load = 0.0;
+    if (nframes > 0 && sampleRate > 0) {
+        double period = double(nframes) / double(sampleRate);
+        load = double(total) * ns / period;
+        m_load.add(load);
+    }
+    m_application.add(double(app) * ns);
+    m_library.add(double(total - app) * ns);
+    m_blockSize.add(double(nframes));
+    if (m_lastStart != 0) {
+        m_interval.add(double(m_start - m_lastStart) * ns);
+    }
+    m_lastStart = m_start;
+
+    m_lastDuration.store(total, std::memory_order_relaxed);
+    m_lastBlockSize.store(nframes, std::memory_order_relaxed);
+
+    m_callbacks.store(m_callbacks.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+
+    m_publishing = true;
+    StatisticsSegment *segment = m_segment;
+    if (segment) {
+        int64_t dropouts[SharedStatistics::DropoutKinds];
+        for (int i = 0; i < SharedStatistics::DropoutKinds; ++i) {
+            dropouts[i] = m_dropoutCounts[i].load(std::memory_order_relaxed);
+        }
+        segment->update(end, sampleRate, nframes, load, dropouts,
+                        m_latency[Record].load(std::memory_order_relaxed),
+                        m_latency[Playback].load(std::memory_order_relaxed),
+                        m_inputMeter, m_outputMeter);
+    }
+    m_publishing.store(false, std::memory_order_release);
+}
+
+CallbackStatistics
+CallbackMonitor::getStatistics() const
+{
+    CallbackStatistics stats;
+    stats.callbacks = m_callbacks.load(std::memory_order_relaxed);
+    stats.dspLoad = m_load.summarise();
+    stats.applicationTime = m_application.summarise();
+    stats.libraryTime = m_library.summarise();
+    stats.blockSize = m_blockSize.summarise();
+    stats.interval = m_interval.summarise();
+    return stats;
+}
+
+void
+CallbackMonitor::reset()
+{
+    m_resetPending = true;
+}
+
+void
+CallbackMonitor::reportDropout(DropoutEvent::Kind kind, int64_t frame)
+{
+    DropoutEvent e;
+    e.kind = kind;
+    e.frame = frame;
+    e.time = double(now()) * 1e-9;
+    e.previousCallbackDuration =
+        double(m_lastDuration.load(std::memory_order_relaxed)) * 1e-9;
+    e.blockSize = m_lastBlockSize.load(std::memory_order_relaxed);
+    m_journal.add(e);
+
+    m_dropoutCounts[kind].fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+CallbackMonitor::reportSourceDelivery(int64_t frame, int requested,
+                                      int received)
+{
+    // Starts out as if short, so that a source with nothing to play
+    // when the stream opens is not reported
+    if (received < requested) {
+        if (!m_sourceShort) {
+            reportDropout(DropoutEvent::SourceUnderDelivery,
+                          frame + received);
+        }
+        m_sourceShort = true;
+    } else {
+        m_sourceShort = false;
+    }
+}
+
+void
+CallbackMonitor::reportDropouts(int flags, int64_t frame)
+{
+    if (flags & CallbackTiming::OutputUnderflow) {
+        reportDropout(DropoutEvent::OutputUnderflow, frame);
+    }
+    if (flags & CallbackTiming::OutputOverflow) {
+        reportDropout(DropoutEvent::OutputOverflow, frame);
+    }
+    if (flags & CallbackTiming::InputUnderflow) {
+        reportDropout(DropoutEvent::InputUnderflow, frame);
+    }
+    if (flags & CallbackTiming::InputOverflow) {
+        reportDropout(DropoutEvent::InputOverflow, frame);
+    }
+}
+
+std::vector<DropoutEvent>
+CallbackMonitor::getDropoutEvents(int64_t after) const
+{
+    return m_journal.getEvents(after);
+}
+
+void
+CallbackMonitor::setDeadlineWarning(double fraction, int sampleRate,
+                                    ApplicationPlaybackSource *source,
+                                    ApplicationRecordTarget *target)
+{
+    std::lock_guard<std::mutex> guard(m_controlMutex);
+    
+    stopWatchdog();
+
+    m_limitPerFrame = 0.0;
+    for (int d = 0; d < 2; ++d) {
+        m_overrun[d] = 0;
+    }
+    
+    if (fraction <= 0.0 || sampleRate <= 0 || (!source && !target)) {
+        return;
+    }
+
+    m_warnSource = source;
+    m_warnTarget = target;
+    
+    double period = 1e9 / double(sampleRate);
+    m_periodPerFrame = period;
+    m_limitPerFrame = period * fraction;
+
+    m_watchdogStop = false;
+    m_watchdog = std::thread([this]() { watch(); });
+}
+
+bool
+CallbackMonitor::publishStatistics(std::string name,
+                                   std::string implementation,
+                                   const Meter *inputMeter,
+                                   const Meter *outputMeter)
+{
+    std::lock_guard<std::mutex> guard(m_controlMutex);
+
+    StatisticsSegment *segment = nullptr;
+    
+    if (name != "") {
+        segment = StatisticsSegment::create(name, implementation, m_suspended);
+        if (!segment) return false;
+        m_inputMeter = inputMeter;
+        m_outputMeter = outputMeter;
+    }
+
+    StatisticsSegment *old = m_segment.exchange(segment);
+    if (old) {
+        while (m_publishing) {
+            std::this_thread::yield();
+        }
+        delete old;
+    }
+    
+    return true;
+}
+
+void
+CallbackMonitor::setLatency(Direction direction, int frames)
+{
+    m_latency[direction].store(frames, std::memory_order_relaxed);
+}
+
+void
+CallbackMonitor::setSuspended(bool suspended)
+{
+    std::lock_guard<std::mutex> guard(m_controlMutex);
+
+    m_suspended = suspended;
+    
+    StatisticsSegment *segment = m_segment;
+    if (segment) {
+        segment->setState(suspended ?
+                          SharedStatistics::Suspended :
+                          SharedStatistics::Running);
+    }
+}
+
+void
+CallbackMonitor::stopWatchdog()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_watchdogMutex);
+        m_watchdogStop = true;
+    }
+    m_watchdogCondition.notify_all();
+    if (m_watchdog.joinable()) {
+        m_watchdog.join();
+    }
+}
+
+void
+CallbackMonitor::watch()
+{
+    std::unique_lock<std::mutex> lock(m_watchdogMutex);
+
+    while (!m_watchdogStop) {
+
+        m_watchdogCondition.wait_for(lock, std::chrono::milliseconds(20));
+        if (m_watchdogStop) break;
+
+        for (int d = 0; d < 2; ++d) {
+
+            int64_t duration = m_overrun[d].exchange
+                (0, std::memory_order_acquire);
+            if (duration == 0) continue;
+            
+            double deadline = double(m_overrunDeadline[d].load
+                                     (std::memory_order_relaxed)) * 1e-9;
+
+            lock.unlock();
+            if (d == Playback && m_warnSource) {
+                m_warnSource->audioProcessingDeadlineWarning
+                    (double(duration) * 1e-9, deadline);
+            } else if (d == Record && m_warnTarget) {
+                m_warnTarget->audioProcessingDeadlineWarning
+                    (double(duration) * 1e-9, deadline);
+            }
+            lock.lock();
+        }
+    }
+}
+
+}
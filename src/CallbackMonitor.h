@@ -0,0 +1,277 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_CALLBACK_MONITOR_H
+#define BQAUDIOIO_CALLBACK_MONITOR_H
+
+#include "CallbackStatistics.h"
+#include "DropoutJournal.h"
+#include "SharedStatistics.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace breakfastquay {
+
+class ApplicationPlaybackSource;
+class ApplicationRecordTarget;
+class Meter;
+class StatisticsSegment;
+
+/**
+ * Times the audio callbacks of an implementation and aggregates the
+ * results for CallbackStatistics, and keeps a journal of dropouts
+ * reported by the implementation, and optionally warns the
+ * application of calls approaching their deadline, and optionally
+ * publishes a summary to shared memory for other processes. The
+ * audio thread
+ * brackets each
+ * callback with beginCallback and endCallback, and each call into
+ * the application with beginApplication and endApplication; any
+ * other thread may call getStatistics at any time. Nothing is locked
+ * and nothing allocated after construction.
+ *
+ * The beginning and end methods must be called from a single thread
+ * at a time; the others may be called from any thread.
+ */
+class CallbackMonitor
+{
+public:
+    enum Direction { Playback = 0, Record = 1 };
+    
+    CallbackMonitor();
+    ~CallbackMonitor();
+
+    /**
+     * Return the current time on the monotonic clock used for all
+     * measurements, in nanoseconds.
+     */
+    static int64_t now();
+
+    /**
+     * Begin a callback. The name, which must be a string literal,
+     * labels the callback and its thread in traces (see Tracer).
+     */
+    void beginCallback(const char *name);
+    void beginApplication();
+
+    /**
+     * End a call into the application, which was for nframes in the
+     * given direction. If deadline warnings are enabled, this also
+     * compares the call's duration against its deadline, using the
+     * clock reading it has already made.
+     */
+    void endApplication(Direction direction, int nframes);
+
+    /**
+     * End the current callback, which processed nframes at the given
+     * sample rate, and record it.
+     */
+    void endCallback(int nframes, int sampleRate);
+
+    /**
+     * End the current callback without recording it, carrying its
+     * times over into the next one that is recorded. For an
+     * implementation whose input and output callbacks are separate
+     * but share a thread, so that together they make up one period.
+     */
+    void endPartialCallback();
+
+    CallbackStatistics getStatistics() const;
+
+    /**
+     * Discard everything recorded so far. The audio thread acts on
+     * this when it next ends a callback.
+     */
+    void reset();
+
+    /**
+     * Record a dropout of the given kind detected at the given frame
+     * position, together with the time now and the duration and
+     * size of the most recent complete callback. Realtime-safe, and
+     * may be called from any thread.
+     */
+    void reportDropout(DropoutEvent::Kind kind, int64_t frame);
+
+    /**
+     * Record a dropout for each underflow or overflow flag set in
+     * the given CallbackTiming flags.
+     */
+    void reportDropouts(int flags, int64_t frame);
+
+    /**
+     * Note that the source, asked for requested frames starting at
+     * the given frame position, returned received of them. A source
+     * that is stopped or has finished legitimately returns short, so
+     * a SourceUnderDelivery dropout is recorded only when a short
+     * delivery follows a full one, not for every short block. Audio
+     * thread only.
+     */
+    void reportSourceDelivery(int64_t frame, int requested, int received);
+
+    /**
+     * Return the journalled dropouts with sequence numbers greater
+     * than after, oldest first.
+     */
+    std::vector<DropoutEvent> getDropoutEvents(int64_t after) const;
+
+    /**
+     * Start warning the source (for Playback calls) or target (for
+     * Record calls) through audioProcessingDeadlineWarning whenever
+     * a call into it takes longer than fraction of the duration of
+     * the frames it was called for, at the given sample rate. The
+     * warnings are made from a watchdog thread that polls for them,
+     * which is started here, or stopped if fraction is zero. Not
+     * realtime-safe. The source and target must outlive the monitor
+     * or a subsequent call to this.
+     */
+    void setDeadlineWarning(double fraction, int sampleRate,
+                            ApplicationPlaybackSource *source,
+                            ApplicationRecordTarget *target);
+
+    /**
+     * Start publishing a SharedStatistics snapshot, including the
+     * channel peaks of the given meters (either of which may be
+     * null), at the end of every callback, to the POSIX
+     * shared-memory segment of the given name, labelled with the
+     * given implementation name. An empty name stops publishing and
+     * removes any segment. Return false if the segment could not be
+     * created. Not realtime-safe. The meters must outlive the
+     * monitor.
+     */
+    bool publishStatistics(std::string name, std::string implementation,
+                           const Meter *inputMeter, const Meter *outputMeter);
+
+    /**
+     * Note the latency most recently reported to the application in
+     * the given direction, for publication. Realtime-safe.
+     */
+    void setLatency(Direction direction, int frames);
+
+    /**
+     * Note whether the stream is suspended, for publication. Not
+     * realtime-safe.
+     */
+    void setSuspended(bool suspended);
+
+private:
+    /**
+     * Log-spaced histogram with 16 bins per octave, updated by one
+     * thread and readable by any.
+     */
+    class Histogram
+    {
+    public:
+        Histogram(double lowest, double highest);
+        ~Histogram();
+
+        void add(double value);
+        void clear();
+        CallbackStatistics::Summary summarise() const;
+
+    private:
+        int binFor(double value) const;
+        double valueFor(int bin) const;
+
+        const double m_lowest;
+        const int m_bins;
+        std::atomic<uint32_t> *m_counts;
+        std::atomic<int64_t> m_count;
+        std::atomic<double> m_sum;
+        std::atomic<double> m_min;
+        std::atomic<double> m_max;
+
+        Histogram(const Histogram &)=delete;
+        Histogram &operator=(const Histogram &)=delete;
+    };
+
+    Histogram m_load;
+    Histogram m_application;
+    Histogram m_library;
+    Histogram m_blockSize;
+    Histogram m_interval;
+    std::atomic<int64_t> m_callbacks;
+    std::atomic<bool> m_resetPending;
+    DropoutJournal m_journal;
+    std::atomic<int64_t> m_lastDuration;
+    std::atomic<int> m_lastBlockSize;
+
+    void stopWatchdog();
+    void watch();
+
+    // Deadline limits in nanoseconds per frame, the first zero when
+    // warnings are off; and for each direction, the longest call to
+    // exceed it since the watchdog last looked, with its deadline
+    std::atomic<double> m_limitPerFrame;
+    std::atomic<double> m_periodPerFrame;
+    std::atomic<int64_t> m_overrun[2];
+    std::atomic<int64_t> m_overrunDeadline[2];
+    ApplicationPlaybackSource *m_warnSource;
+    ApplicationRecordTarget *m_warnTarget;
+    std::thread m_watchdog;
+    std::mutex m_watchdogMutex;
+    std::condition_variable m_watchdogCondition;
+    bool m_watchdogStop;
+    std::mutex m_controlMutex;
+
+    // The audio thread raises m_publishing before looking at the
+    // segment, so that publishStatistics can wait for it to finish
+    // with an old one before deleting it
+    std::atomic<StatisticsSegment *> m_segment;
+    std::atomic<bool> m_publishing;
+    const Meter *m_inputMeter;
+    const Meter *m_outputMeter;
+    std::atomic<int64_t> m_dropoutCounts[SharedStatistics::DropoutKinds];
+    std::atomic<int> m_latency[2];
+    std::atomic<bool> m_suspended;
+
+    // Audio thread only
+    const char *m_name;
+    int64_t m_start;
+    int64_t m_lastStart;
+    int64_t m_appStart;
+    int64_t m_appTime;
+    int64_t m_carriedTime;
+    int64_t m_carriedAppTime;
+    bool m_sourceShort;
+
+    CallbackMonitor(const CallbackMonitor &)=delete;
+    CallbackMonitor &operator=(const CallbackMonitor &)=delete;
+};
+
+}
+
+#endif
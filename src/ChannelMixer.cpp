@@ -0,0 +1,125 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "ChannelMixer.h"
+#include "Kernels.h"
+
+#include "bqvec/VectorOps.h"
+
+namespace breakfastquay {
+
+ChannelMixer::ChannelMixer() :
+    m_outputs(0),
+    m_inputs(0),
+    m_identity(true),
+    m_routing(true),
+    m_permutation(true),
+    m_rowStart(1, 0)
+{
+}
+
+bool
+ChannelMixer::configure(const MixingMatrix &matrix, int outputs, int inputs)
+{
+    bool ok = true;
+    MixingMatrix m(matrix);
+    if (m.getOutputCount() != outputs || m.getInputCount() != inputs) {
+        ok = m.isEmpty();
+        m = MixingMatrix::standard(outputs, inputs);
+    }
+
+    m_outputs = m.getOutputCount();
+    m_inputs = m.getInputCount();
+    m_rowStart.clear();
+    m_termInputs.clear();
+    m_termGains.clear();
+    m_routes.assign(m_outputs, -1);
+
+    m_routing = true;
+    std::vector<int> uses(m_inputs, 0);
+    
+    for (int r = 0; r < m_outputs; ++r) {
+        m_rowStart.push_back(int(m_termInputs.size()));
+        for (int c = 0; c < m_inputs; ++c) {
+            float gain = m.get(r, c);
+            if (gain == 0.f) continue;
+            m_termInputs.push_back(c);
+            m_termGains.push_back(gain);
+            if (gain == 1.f && m_routes[r] < 0) {
+                m_routes[r] = c;
+                ++uses[c];
+            } else {
+                m_routing = false;
+            }
+        }
+    }
+    m_rowStart.push_back(int(m_termInputs.size()));
+
+    m_permutation = m_routing && (m_outputs == m_inputs);
+    m_identity = m_permutation;
+    for (int r = 0; r < m_outputs; ++r) {
+        if (m_routes[r] != r) {
+            m_identity = false;
+        }
+    }
+    for (int c = 0; c < m_inputs; ++c) {
+        if (uses[c] != 1) {
+            m_permutation = false;
+        }
+    }
+    if (!m_permutation) {
+        m_identity = false;
+    }
+    if (!m_routing) {
+        m_routes.assign(m_outputs, -1);
+    }
+
+    return ok;
+}
+
+void
+ChannelMixer::mix(float *const *dst, const float *const *src, int count) const
+{
+    for (int r = 0; r < m_outputs; ++r) {
+        int start = m_rowStart[r];
+        int terms = m_rowStart[r + 1] - start;
+        if (terms == 0) {
+            v_zero(dst[r], count);
+        } else if (m_routing) {
+            v_copy(dst[r], src[m_termInputs[start]], count);
+        } else {
+            v_mix_row(dst[r], src, m_termInputs.data() + start,
+                      m_termGains.data() + start, terms, count);
+        }
+    }
+}
+
+}
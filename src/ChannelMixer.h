@@ -0,0 +1,111 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_CHANNEL_MIXER_H
+#define BQAUDIOIO_CHANNEL_MIXER_H
+
+#include "MixingMatrix.h"
+
+#include <vector>
+
+namespace breakfastquay {
+
+/**
+ * A MixingMatrix compiled for use in the audio callback: only the
+ * non-zero gains are kept, row by row, and matrices that merely pick
+ * or reorder channels are recognised so that the drivers can remap
+ * channel pointers instead of mixing at all.
+ *
+ * configure() allocates and must not be called from the audio
+ * callback; everything else may be.
+ */
+class ChannelMixer
+{
+public:
+    ChannelMixer();
+
+    /**
+     * Compile the given matrix for mixing from the given number of
+     * input channels to the given number of outputs. If the matrix
+     * is empty, or its dimensions differ from those given, the
+     * standard mapping (see MixingMatrix::standard) is used instead
+     * and false is returned.
+     */
+    bool configure(const MixingMatrix &matrix, int outputs, int inputs);
+
+    int getOutputCount() const { return m_outputs; }
+    int getInputCount() const { return m_inputs; }
+
+    /**
+     * True if each output is the corresponding input, unchanged.
+     */
+    bool isIdentity() const { return m_identity; }
+
+    /**
+     * True if each output takes at most one input at unity gain, so
+     * that mixing amounts to picking channels (see getRoute).
+     */
+    bool isRouting() const { return m_routing; }
+
+    /**
+     * True if the matrix is square and each input goes, at unity
+     * gain, to exactly one output: a reordering of the channels.
+     */
+    bool isPermutation() const { return m_permutation; }
+
+    /**
+     * For a routing matrix, return the input channel that feeds the
+     * given output, or -1 if the output is silent.
+     */
+    int getRoute(int output) const { return m_routes[output]; }
+
+    /**
+     * Mix count frames from the input channels in src into the output
+     * channels in dst. The dst channels must not overlap the src
+     * ones.
+     */
+    void mix(float *const *dst, const float *const *src, int count) const;
+
+private:
+    int m_outputs;
+    int m_inputs;
+    bool m_identity;
+    bool m_routing;
+    bool m_permutation;
+    std::vector<int> m_rowStart;
+    std::vector<int> m_termInputs;
+    std::vector<float> m_termGains;
+    std::vector<int> m_routes;
+};
+
+}
+
+#endif
@@ -0,0 +1,110 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "DropoutJournal.h"
+
+namespace breakfastquay {
+
+DropoutJournal::DropoutJournal() :
+    m_next(1)
+{
+    for (int i = 0; i < capacity; ++i) {
+        Slot &s = m_slots[i];
+        s.sequence.store(0, std::memory_order_relaxed);
+        s.kind.store(0, std::memory_order_relaxed);
+        s.frame.store(0, std::memory_order_relaxed);
+        s.time.store(0.0, std::memory_order_relaxed);
+        s.previousCallbackDuration.store(0.0, std::memory_order_relaxed);
+        s.blockSize.store(0, std::memory_order_relaxed);
+    }
+}
+
+DropoutJournal::~DropoutJournal()
+{
+}
+
+void
+DropoutJournal::add(const DropoutEvent &event)
+{
+    int64_t seq = m_next.fetch_add(1);
+    Slot &s = m_slots[seq % capacity];
+
+    s.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    s.kind.store(int(event.kind), std::memory_order_relaxed);
+    s.frame.store(event.frame, std::memory_order_relaxed);
+    s.time.store(event.time, std::memory_order_relaxed);
+    s.previousCallbackDuration.store(event.previousCallbackDuration,
+                                     std::memory_order_relaxed);
+    s.blockSize.store(event.blockSize, std::memory_order_relaxed);
+
+    s.sequence.store(seq, std::memory_order_release);
+}
+
+std::vector<DropoutEvent>
+DropoutJournal::getEvents(int64_t after) const
+{
+    std::vector<DropoutEvent> events;
+
+    int64_t next = m_next.load(std::memory_order_acquire);
+    int64_t first = after + 1;
+    if (first < next - capacity) first = next - capacity;
+    if (first < 1) first = 1;
+
+    for (int64_t seq = first; seq < next; ++seq) {
+
+        const Slot &s = m_slots[seq % capacity];
+        if (s.sequence.load(std::memory_order_acquire) != seq) {
+            continue; // overwritten, or not yet complete
+        }
+
+        DropoutEvent e;
+        e.sequence = seq;
+        e.kind = DropoutEvent::Kind(s.kind.load(std::memory_order_relaxed));
+        e.frame = s.frame.load(std::memory_order_relaxed);
+        e.time = s.time.load(std::memory_order_relaxed);
+        e.previousCallbackDuration =
+            s.previousCallbackDuration.load(std::memory_order_relaxed);
+        e.blockSize = s.blockSize.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.sequence.load(std::memory_order_relaxed) != seq) {
+            continue; // overwritten while we were reading it
+        }
+
+        events.push_back(e);
+    }
+
+    return events;
+}
+
+}
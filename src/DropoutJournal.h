@@ -0,0 +1,93 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_DROPOUT_JOURNAL_H
+#define BQAUDIOIO_DROPOUT_JOURNAL_H
+
+#include "DropoutEvent.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace breakfastquay {
+
+/**
+ * Bounded journal of DropoutEvents. Events may be added from any
+ * thread, including realtime ones, without locking or allocation;
+ * once the journal is full, each new event replaces the oldest.
+ * Readers never block writers, and skip any event that is
+ * overwritten while they are reading it.
+ */
+class DropoutJournal
+{
+public:
+    DropoutJournal();
+    ~DropoutJournal();
+
+    /**
+     * Add an event, assigning it the next sequence number (any
+     * sequence number in the event passed is ignored).
+     */
+    void add(const DropoutEvent &event);
+
+    /**
+     * Return the events still in the journal whose sequence numbers
+     * are greater than after, oldest first.
+     */
+    std::vector<DropoutEvent> getEvents(int64_t after) const;
+
+private:
+    static const int capacity = 256;
+
+    // Each field is atomic so that a reader racing with a writer
+    // reads a stale value rather than undefined behaviour; the
+    // sequence number, zero while a write is in progress, tells
+    // the reader whether what it read was consistent
+    struct Slot {
+        std::atomic<int64_t> sequence;
+        std::atomic<int> kind;
+        std::atomic<int64_t> frame;
+        std::atomic<double> time;
+        std::atomic<double> previousCallbackDuration;
+        std::atomic<int> blockSize;
+    };
+
+    Slot m_slots[capacity];
+    std::atomic<int64_t> m_next;
+
+    DropoutJournal(const DropoutJournal &)=delete;
+    DropoutJournal &operator=(const DropoutJournal &)=delete;
+};
+
+}
+
+#endif
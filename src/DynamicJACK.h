@@ -44,217 +44,220 @@
 // at all during the build, instead using dlopen and runtime symbol
 // lookup to switch on JACK support at runtime.  The following big
 // mess (down to the #endifs) is the code that implements this.
+//
+// All of the entry points we use are looked up together, into a
+// table of function pointers, the first time a client is opened. If
+// any of the essential ones is missing, the library is treated as
+// unusable and jack_client_open fails. Those that only exist in
+// newer versions of JACK are replaced by fallbacks if missing. Either
+// way the decision is made once, so that every call after a client
+// has been opened (including those made from the process callback)
+// is a plain call through the table with no further lookup.
 
 #ifdef HAVE_JACK
 
 #include <jack/jack.h>
 #include <dlfcn.h>
 
-#include <map>
-#include <iostream>
-
-namespace breakfastquay {
+#include "Log.h"
 
-//#define DEBUG_AUDIO_JACK_TARGET 1
+#include <mutex>
 
-#ifdef __GNUC__
-#pragma GCC diagnostic ignored "-Wunused-function"
-#endif
+namespace breakfastquay {
 
-static void *symbol(const char *name)
+struct DynamicJACK
 {
-    static bool attempted = false;
-    static void *library = 0;
-    static std::map<const char *, void *> symbols;
-    if (symbols.find(name) != symbols.end()) return symbols[name];
-    if (!library) {
-        if (!attempted) {
-            library = ::dlopen("libjack.so.1", RTLD_NOW);
-            if (!library) library = ::dlopen("libjack.so.0", RTLD_NOW);
-            if (!library) library = ::dlopen("libjack.so", RTLD_NOW);
-            if (!library) {
-                std::cerr << "WARNING: Failed to load JACK library: "
-                          << ::dlerror() << " (tried .so, .so.0, .so.1)"
-                          << std::endl;
-            }
-            attempted = true;
-        }
-        if (!library) return 0;
-    }
-    void *symbol = ::dlsym(library, name);
-    if (!symbol) {
-        std::cerr << "WARNING: JACKPlaybackTarget: Failed to locate symbol "
-                  << name << ": " << ::dlerror() << std::endl;
-    }
-    symbols[name] = symbol;
-    return symbol;
-}
-
-static jack_client_t *dynamic_jack_client_open(const char *client_name,
-                                               jack_options_t options,
-                                               jack_status_t *status, ...)
+    // Essential
+    jack_client_t *(*client_open)(const char *, jack_options_t,
+                                  jack_status_t *, ...);
+    int (*client_close)(jack_client_t *);
+    int (*activate)(jack_client_t *);
+    int (*deactivate)(jack_client_t *);
+    jack_nframes_t (*get_buffer_size)(jack_client_t *);
+    jack_nframes_t (*get_sample_rate)(jack_client_t *);
+    int (*set_process_callback)(jack_client_t *, JackProcessCallback, void *);
+    int (*set_xrun_callback)(jack_client_t *, JackXRunCallback, void *);
+    int (*set_buffer_size_callback)(jack_client_t *,
+                                    JackBufferSizeCallback, void *);
+    int (*set_sample_rate_callback)(jack_client_t *,
+                                    JackSampleRateCallback, void *);
+    int (*set_freewheel_callback)(jack_client_t *,
+                                  JackFreewheelCallback, void *);
+    int (*set_freewheel)(jack_client_t *, int);
+    const char **(*get_ports)(jack_client_t *, const char *,
+                              const char *, unsigned long);
+    jack_port_t *(*port_register)(jack_client_t *, const char *,
+                                  const char *, unsigned long,
+                                  unsigned long);
+    int (*port_unregister)(jack_client_t *, jack_port_t *);
+    const char *(*port_name)(const jack_port_t *);
+    int (*connect)(jack_client_t *, const char *, const char *);
+    void *(*port_get_buffer)(jack_port_t *, jack_nframes_t);
+    jack_nframes_t (*frame_time)(const jack_client_t *);
+    jack_nframes_t (*last_frame_time)(const jack_client_t *);
+    void (*free)(void *);
+
+    // Optional (replaced with fallbacks if missing)
+    int (*get_cycle_times)(const jack_client_t *, jack_nframes_t *,
+                           jack_time_t *, jack_time_t *, float *);
+    void (*port_get_latency_range)(jack_port_t *,
+                                   jack_latency_callback_mode_t,
+                                   jack_latency_range_t *);
+    int (*set_latency_callback)(jack_client_t *, JackLatencyCallback, void *);
+};
+
+// Everything here is inline rather than static, so that every
+// translation unit that includes this header shares one copy of the
+// table and its loader, and the loader refers to the same fallbacks
+// and helpers wherever it is compiled
+inline DynamicJACK &dynamic_jack_table()
 {
-    typedef jack_client_t *(*func)(const char *client_name,
-                                   jack_options_t options,
-                                   jack_status_t *status, ...);
-    void *s = symbol("jack_client_open");
-    if (!s) return 0;
-    func f = (func)s;
-    return f(client_name, options, status); // varargs not supported here
+    static DynamicJACK table;
+    return table;
 }
 
-static int dynamic_jack_set_process_callback(jack_client_t *client,
-                                             JackProcessCallback process_callback,
-                                             void *arg)
+inline int fallback_jack_get_cycle_times(const jack_client_t *,
+                                         jack_nframes_t *,
+                                         jack_time_t *,
+                                         jack_time_t *,
+                                         float *)
 {
-    typedef int (*func)(jack_client_t *client,
-                        JackProcessCallback process_callback,
-                        void *arg);
-    void *s = symbol("jack_set_process_callback");
-    if (!s) return 1;
-    func f = (func)s;
-    return f(client, process_callback, arg);
+    return 1;
 }
 
-static int dynamic_jack_set_xrun_callback(jack_client_t *client,
-                                          JackXRunCallback xrun_callback,
-                                          void *arg)
+inline void fallback_jack_port_get_latency_range(jack_port_t *,
+                                                 jack_latency_callback_mode_t,
+                                                 jack_latency_range_t *range)
 {
-    typedef int (*func)(jack_client_t *client,
-                        JackXRunCallback xrun_callback,
-                        void *arg);
-    void *s = symbol("jack_set_xrun_callback");
-    if (!s) return 1;
-    func f = (func)s;
-    return f(client, xrun_callback, arg);
+    range->min = range->max = 0;
 }
 
-static const char **dynamic_jack_get_ports(jack_client_t *client, 
-                                           const char *port_name_pattern, 
-                                           const char *type_name_pattern, 
-                                           unsigned long flags)
+inline int fallback_jack_set_latency_callback(jack_client_t *,
+                                              JackLatencyCallback,
+                                              void *)
 {
-    typedef const char **(*func)(jack_client_t *client, 
-                                 const char *port_name_pattern, 
-                                 const char *type_name_pattern, 
-                                 unsigned long flags);
-    void *s = symbol("jack_get_ports");
-    if (!s) return 0;
-    func f = (func)s;
-    return f(client, port_name_pattern, type_name_pattern, flags);
+    return 1;
 }
 
-static jack_port_t *dynamic_jack_port_register(jack_client_t *client,
-                                               const char *port_name,
-                                               const char *port_type,
-                                               unsigned long flags,
-                                               unsigned long buffer_size)
+template <typename F>
+inline bool dynamic_jack_resolve(void *library, const char *name, F &f,
+                                 bool essential)
 {
-    typedef jack_port_t *(*func)(jack_client_t *client,
-                                 const char *port_name,
-                                 const char *port_type,
-                                 unsigned long flags,
-                                 unsigned long buffer_size);
-    void *s = symbol("jack_port_register");
-    if (!s) return 0;
-    func f = (func)s;
-    return f(client, port_name, port_type, flags, buffer_size);
+    f = (F)::dlsym(library, name);
+    if (!f && essential) {
+        const char *err = ::dlerror();
+        BQAUDIOIO_LOG_WARNING("DynamicJACK", "Failed to locate symbol"
+                              << logField("name", name)
+                              << logField("error", err ? err : ""));
+    }
+    return (f != 0);
 }
 
-static int dynamic_jack_connect(jack_client_t *client,
-                                const char *source,
-                                const char *dest)
+inline bool dynamic_jack_load()
 {
-    typedef int (*func)(jack_client_t *client,
-                        const char *source,
-                        const char *dest);
-    void *s = symbol("jack_connect");
-    if (!s) return 1;
-    func f = (func)s;
-    return f(client, source, dest);
-}
+    static std::once_flag once;
+    static bool loaded = false;
+
+    std::call_once(once, []() {
+
+        void *library = ::dlopen("libjack.so.1", RTLD_NOW);
+        if (!library) library = ::dlopen("libjack.so.0", RTLD_NOW);
+        if (!library) library = ::dlopen("libjack.so", RTLD_NOW);
+        if (!library) {
+            const char *err = ::dlerror();
+            BQAUDIOIO_LOG_WARNING("DynamicJACK", "Failed to load JACK "
+                                  << "library (tried .so, .so.0, .so.1)"
+                                  << logField("error", err ? err : ""));
+            return;
+        }
 
-static void *dynamic_jack_port_get_buffer(jack_port_t *port,
-                                          jack_nframes_t sz)
-{
-    typedef void *(*func)(jack_port_t *, jack_nframes_t);
-    void *s = symbol("jack_port_get_buffer");
-    if (!s) return 0;
-    func f = (func)s;
-    return f(port, sz);
-}
+        DynamicJACK &j(dynamic_jack_table());
+        bool ok = true;
+
+#define BQ_JACK_ESSENTIAL(name) \
+        ok = dynamic_jack_resolve(library, "jack_" #name, j.name, true) && ok
+
+        BQ_JACK_ESSENTIAL(client_open);
+        BQ_JACK_ESSENTIAL(client_close);
+        BQ_JACK_ESSENTIAL(activate);
+        BQ_JACK_ESSENTIAL(deactivate);
+        BQ_JACK_ESSENTIAL(get_buffer_size);
+        BQ_JACK_ESSENTIAL(get_sample_rate);
+        BQ_JACK_ESSENTIAL(set_process_callback);
+        BQ_JACK_ESSENTIAL(set_xrun_callback);
+        BQ_JACK_ESSENTIAL(set_buffer_size_callback);
+        BQ_JACK_ESSENTIAL(set_sample_rate_callback);
+        BQ_JACK_ESSENTIAL(set_freewheel_callback);
+        BQ_JACK_ESSENTIAL(set_freewheel);
+        BQ_JACK_ESSENTIAL(get_ports);
+        BQ_JACK_ESSENTIAL(port_register);
+        BQ_JACK_ESSENTIAL(port_unregister);
+        BQ_JACK_ESSENTIAL(port_name);
+        BQ_JACK_ESSENTIAL(connect);
+        BQ_JACK_ESSENTIAL(port_get_buffer);
+        BQ_JACK_ESSENTIAL(frame_time);
+        BQ_JACK_ESSENTIAL(last_frame_time);
+        BQ_JACK_ESSENTIAL(free);
+
+#undef BQ_JACK_ESSENTIAL
+
+#define BQ_JACK_OPTIONAL(name) \
+        if (!dynamic_jack_resolve(library, "jack_" #name, j.name, false)) { \
+            j.name = fallback_jack_##name; \
+        }
 
-static void dynamic_jack_port_get_latency_range(jack_port_t *port,
-                                                jack_latency_callback_mode_t mode,
-                                                jack_latency_range_t *range)
-{
-    typedef void (*func)(jack_port_t *, jack_latency_callback_mode_t, jack_latency_range_t *);
-    void *s = symbol("jack_port_get_latency_range");
-    if (!s) {
-        range->min = range->max = 0;
-        return;
-    }
-    func f = (func)s;
-    f(port, mode, range);
-}
+        BQ_JACK_OPTIONAL(get_cycle_times);
+        BQ_JACK_OPTIONAL(port_get_latency_range);
+        BQ_JACK_OPTIONAL(set_latency_callback);
 
-static int dynamic_jack_port_unregister(jack_client_t *client,
-                                        jack_port_t *port)
-{
-    typedef int(*func)(jack_client_t *, jack_port_t *);
-    void *s = symbol("jack_port_unregister");
-    if (!s) return 0;
-    func f = (func)s;
-    return f(client, port);
+#undef BQ_JACK_OPTIONAL
+
+        if (!ok) {
+            BQAUDIOIO_LOG_WARNING("DynamicJACK", "JACK library lacks "
+                                  << "essential functions, not using it");
+            j = DynamicJACK();
+            return;
+        }
+
+        loaded = true;
+    });
+
+    return loaded;
 }
 
-static void dynamic_jack_free(void *ptr)
+inline jack_client_t *dynamic_jack_client_open(const char *client_name,
+                                               jack_options_t options,
+                                               jack_status_t *status, ...)
 {
-    typedef void(*func)(void *);
-    void *s = symbol("jack_free");
-    if (!s) return;
-    func f = (func)s;
-    f(ptr);
-}    
-
-#define dynamic1(rv, name, argtype, failval) \
-    static rv dynamic_##name(argtype arg) { \
-        typedef rv (*func) (argtype); \
-        void *s = symbol(#name); \
-        if (!s) return failval; \
-        func f = (func) s; \
-        return f(arg); \
-    }
+    if (!dynamic_jack_load()) return 0;
+    return dynamic_jack_table().client_open
+        (client_name, options, status); // varargs not supported here
+}
 
-dynamic1(jack_client_t *, jack_client_new, const char *, 0)
-dynamic1(jack_nframes_t, jack_get_buffer_size, jack_client_t *, 0)
-dynamic1(jack_nframes_t, jack_get_sample_rate, jack_client_t *, 0)
-dynamic1(int, jack_activate, jack_client_t *, 1)
-dynamic1(int, jack_deactivate, jack_client_t *, 1)
-dynamic1(int, jack_client_close, jack_client_t *, 1)
-dynamic1(jack_nframes_t, jack_port_get_latency, jack_port_t *, 0)
-dynamic1(const char *, jack_port_name, const jack_port_t *, 0)
-dynamic1(jack_nframes_t, jack_frame_time, jack_client_t *, 0)
-
-#define jack_client_new dynamic_jack_client_new
 #define jack_client_open dynamic_jack_client_open
-#define jack_get_buffer_size dynamic_jack_get_buffer_size
-#define jack_get_sample_rate dynamic_jack_get_sample_rate
-#define jack_set_process_callback dynamic_jack_set_process_callback
-#define jack_set_xrun_callback dynamic_jack_set_xrun_callback
-#define jack_activate dynamic_jack_activate
-#define jack_deactivate dynamic_jack_deactivate
-#define jack_client_close dynamic_jack_client_close
-#define jack_get_ports dynamic_jack_get_ports
-#define jack_port_register dynamic_jack_port_register
-#define jack_port_unregister dynamic_jack_port_unregister
-#define jack_port_get_latency dynamic_jack_port_get_latency
-#define jack_port_name dynamic_jack_port_name
-#define jack_connect dynamic_jack_connect
-#define jack_port_get_buffer dynamic_jack_port_get_buffer
-#define jack_port_get_latency_range dynamic_jack_port_get_latency_range
-#define jack_frame_time dynamic_jack_frame_time
-#define jack_free dynamic_jack_free
+#define jack_client_close dynamic_jack_table().client_close
+#define jack_activate dynamic_jack_table().activate
+#define jack_deactivate dynamic_jack_table().deactivate
+#define jack_get_buffer_size dynamic_jack_table().get_buffer_size
+#define jack_get_sample_rate dynamic_jack_table().get_sample_rate
+#define jack_set_process_callback dynamic_jack_table().set_process_callback
+#define jack_set_xrun_callback dynamic_jack_table().set_xrun_callback
+#define jack_set_buffer_size_callback dynamic_jack_table().set_buffer_size_callback
+#define jack_set_sample_rate_callback dynamic_jack_table().set_sample_rate_callback
+#define jack_set_freewheel_callback dynamic_jack_table().set_freewheel_callback
+#define jack_set_freewheel dynamic_jack_table().set_freewheel
+#define jack_get_ports dynamic_jack_table().get_ports
+#define jack_port_register dynamic_jack_table().port_register
+#define jack_port_unregister dynamic_jack_table().port_unregister
+#define jack_port_name dynamic_jack_table().port_name
+#define jack_connect dynamic_jack_table().connect
+#define jack_port_get_buffer dynamic_jack_table().port_get_buffer
+#define jack_frame_time dynamic_jack_table().frame_time
+#define jack_last_frame_time dynamic_jack_table().last_frame_time
+#define jack_free dynamic_jack_table().free
+#define jack_get_cycle_times dynamic_jack_table().get_cycle_times
+#define jack_port_get_latency_range dynamic_jack_table().port_get_latency_range
+#define jack_set_latency_callback dynamic_jack_table().set_latency_callback
 
 }
 
@@ -0,0 +1,306 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "FixedBlockSourceWrapper.h"
+
+#include "bqvec/Allocators.h"
+#include "bqvec/VectorOps.h"
+
+#include "Log.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace breakfastquay {
+
+FixedBlockSourceWrapper::FixedBlockSourceWrapper(ApplicationPlaybackSource *source,
+                                                 int blockSize) :
+    m_source(source),
+    m_blockSize(blockSize),
+    m_channels(0),
+    m_sampleRate(0),
+    m_systemLatency(0),
+    m_reportedLatency(-1),
+    m_buffer(nullptr),
+    m_bufferSize(0),
+    m_fill(0),
+    m_ptrs(nullptr)
+{
+    if (m_blockSize < 1) {
+        throw std::logic_error("FixedBlockSourceWrapper block size must be positive");
+    }
+    
+    lock_guard<mutex> guard(m_mutex);
+    reallocate(m_source->getApplicationChannelCount(), m_blockSize * 2);
+}
+
+FixedBlockSourceWrapper::~FixedBlockSourceWrapper()
+{
+    lock_guard<mutex> guard(m_mutex);
+    reallocate(0, 0);
+}
+
+std::string
+FixedBlockSourceWrapper::getClientName() const
+{
+    return m_source->getClientName();
+}
+
+int
+FixedBlockSourceWrapper::getApplicationSampleRate() const
+{
+    return m_source->getApplicationSampleRate();
+}
+
+int
+FixedBlockSourceWrapper::getApplicationChannelCount() const
+{
+    return m_source->getApplicationChannelCount();
+}
+
+void
+FixedBlockSourceWrapper::setSystemPlaybackBlockSize(int sz)
+{
+    BQAUDIOIO_LOG_INFO("FixedBlockSourceWrapper",
+                       "setSystemPlaybackBlockSize called; passing fixed "
+                       << "block size to wrapped source instead"
+                       << logField("size", sz)
+                       << logField("fixedSize", m_blockSize));
+
+    {
+        lock_guard<mutex> guard(m_mutex);
+        checkBufferFor(sz);
+    }
+
+    m_source->setSystemPlaybackBlockSize(m_blockSize);
+}
+
+void
+FixedBlockSourceWrapper::setSystemPlaybackSampleRate(int rate)
+{
+    {
+        lock_guard<mutex> guard(m_mutex);
+        m_sampleRate = rate;
+    }
+    m_source->setSystemPlaybackSampleRate(rate);
+}
+
+void
+FixedBlockSourceWrapper::setSystemPlaybackChannelCount(int c)
+{
+    {
+        lock_guard<mutex> guard(m_mutex);
+        if (c != m_channels) {
+            reallocate(c, m_bufferSize);
+        }
+    }
+    m_source->setSystemPlaybackChannelCount(c);
+}
+
+void
+FixedBlockSourceWrapper::setSystemPlaybackLatency(int latency)
+{
+    lock_guard<mutex> guard(m_mutex);
+    m_systemLatency = latency;
+    reportLatency();
+}
+
+void
+FixedBlockSourceWrapper::setOutputLevels(float left, float right)
+{
+    m_source->setOutputLevels(left, right);
+}
+
+void
+FixedBlockSourceWrapper::setSystemFreewheeling(bool freewheeling)
+{
+    m_source->setSystemFreewheeling(freewheeling);
+}
+
+void
+FixedBlockSourceWrapper::audioProcessingOverload()
+{
+    m_source->audioProcessingOverload();
+}
+
+void
+FixedBlockSourceWrapper::audioProcessingDeadlineWarning(double duration, double deadline)
+{
+    m_source->audioProcessingDeadlineWarning(duration, deadline);
+}
+
+void
+FixedBlockSourceWrapper::reset()
+{
+    lock_guard<mutex> guard(m_mutex);
+    m_fill = 0;
+}
+
+void
+FixedBlockSourceWrapper::reallocate(int channels, int nframes)
+{
+    if (m_buffer) {
+        deallocate_channels(m_buffer, m_channels);
+        m_buffer = nullptr;
+    }
+    delete[] m_ptrs;
+    m_ptrs = nullptr;
+
+    m_channels = channels;
+    m_bufferSize = nframes;
+    m_fill = 0;
+    
+    if (m_channels > 0 && m_bufferSize > 0) {
+        m_buffer = allocate_and_zero_channels<float>(m_channels, m_bufferSize);
+        m_ptrs = new float *[m_channels];
+    }
+}
+
+void
+FixedBlockSourceWrapper::checkBufferFor(int nframes)
+{
+    // At the start of a request we hold fewer than one block's worth
+    // of frames, and we render whole blocks until we have at least
+    // nframes, so we need room for nframes plus one block
+    int required = nframes + m_blockSize;
+    if (required <= m_bufferSize) return;
+
+    BQAUDIOIO_LOG_INFO("FixedBlockSourceWrapper", "Extending buffer"
+                       << logField("from", m_bufferSize)
+                       << logField("to", required));
+    
+    m_buffer = reallocate_and_zero_extend_channels
+        (m_buffer,
+         m_channels, m_bufferSize,
+         m_channels, required);
+    m_bufferSize = required;
+}
+
+void
+FixedBlockSourceWrapper::reportLatency()
+{
+    // Every frame already buffered is played before the first frame
+    // of the next block the source renders
+    int latency = m_systemLatency + m_fill;
+    if (latency != m_reportedLatency) {
+        m_source->setSystemPlaybackLatency(latency);
+        m_reportedLatency = latency;
+    }
+}
+
+int
+FixedBlockSourceWrapper::getSourceSamples(float *const *samples,
+                                          int nchannels, int nframes)
+{
+    return getSamples(samples, nchannels, nframes, nullptr);
+}
+
+int
+FixedBlockSourceWrapper::getSourceSamplesWithTiming(float *const *samples,
+                                                    int nchannels, int nframes,
+                                                    const CallbackTiming &timing)
+{
+    return getSamples(samples, nchannels, nframes, &timing);
+}
+
+int
+FixedBlockSourceWrapper::getSamples(float *const *samples,
+                                    int nchannels, int nframes,
+                                    const CallbackTiming *timing)
+{
+    lock_guard<mutex> guard(m_mutex);
+
+    if (nchannels != m_channels) {
+        BQAUDIOIO_LOG_ERROR("FixedBlockSourceWrapper",
+                            "getSourceSamples: Wrong number of channels"
+                            << logField("nchannels", nchannels)
+                            << logField("expected", m_channels));
+        throw std::logic_error("Different number of channels requested than FixedBlockSourceWrapper declared");
+    }
+
+    if (nframes <= 0 || m_channels == 0) {
+        return 0;
+    }
+    
+    checkBufferFor(nframes);
+
+    bool first = true;
+    
+    while (m_fill < nframes) {
+
+        reportLatency();
+        
+        for (int c = 0; c < m_channels; ++c) {
+            m_ptrs[c] = m_buffer[c] + m_fill;
+        }
+
+        int received = 0;
+        
+        if (timing) {
+            CallbackTiming sourceTiming(*timing);
+            sourceTiming.frame += m_fill;
+            if (sourceTiming.outputTime != 0.0 && m_sampleRate != 0) {
+                sourceTiming.outputTime += double(m_fill) / m_sampleRate;
+            }
+            if (!first) {
+                // Status flags are passed on with the first block only
+                sourceTiming.flags = 0;
+            }
+            received = m_source->getSourceSamplesWithTiming
+                (m_ptrs, m_channels, m_blockSize, sourceTiming);
+        } else {
+            received = m_source->getSourceSamples
+                (m_ptrs, m_channels, m_blockSize);
+        }
+
+        if (received < 0) received = 0;
+        if (received < m_blockSize) {
+            for (int c = 0; c < m_channels; ++c) {
+                v_zero(m_ptrs[c] + received, m_blockSize - received);
+            }
+        }
+        
+        m_fill += m_blockSize;
+        first = false;
+    }
+
+    v_copy_channels(samples, m_buffer, m_channels, nframes);
+
+    m_fill -= nframes;
+    for (int c = 0; c < m_channels; ++c) {
+        v_move(m_buffer[c], m_buffer[c] + nframes, m_fill);
+    }
+    
+    return nframes;
+}
+
+}
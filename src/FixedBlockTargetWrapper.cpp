@@ -0,0 +1,316 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "FixedBlockTargetWrapper.h"
+
+#include "bqvec/Allocators.h"
+#include "bqvec/VectorOps.h"
+
+#include "Log.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace breakfastquay {
+
+FixedBlockTargetWrapper::FixedBlockTargetWrapper(ApplicationRecordTarget *target,
+                                                 int blockSize) :
+    m_target(target),
+    m_blockSize(blockSize),
+    m_channels(0),
+    m_sampleRate(0),
+    m_systemLatency(0),
+    m_reportedLatency(-1),
+    m_addedLatency(0),
+    m_buffer(nullptr),
+    m_bufferSize(0),
+    m_fill(0),
+    m_ptrs(nullptr),
+    m_startFrame(0),
+    m_startTime(0.0)
+{
+    if (m_blockSize < 1) {
+        throw std::logic_error("FixedBlockTargetWrapper block size must be positive");
+    }
+    
+    lock_guard<mutex> guard(m_mutex);
+    reallocate(m_target->getApplicationChannelCount(), m_blockSize * 2);
+}
+
+FixedBlockTargetWrapper::~FixedBlockTargetWrapper()
+{
+    lock_guard<mutex> guard(m_mutex);
+    reallocate(0, 0);
+}
+
+std::string
+FixedBlockTargetWrapper::getClientName() const
+{
+    return m_target->getClientName();
+}
+
+int
+FixedBlockTargetWrapper::getApplicationSampleRate() const
+{
+    return m_target->getApplicationSampleRate();
+}
+
+int
+FixedBlockTargetWrapper::getApplicationChannelCount() const
+{
+    return m_target->getApplicationChannelCount();
+}
+
+void
+FixedBlockTargetWrapper::setSystemRecordBlockSize(int sz)
+{
+    BQAUDIOIO_LOG_INFO("FixedBlockTargetWrapper",
+                       "setSystemRecordBlockSize called; passing fixed "
+                       << "block size to wrapped target instead"
+                       << logField("size", sz)
+                       << logField("fixedSize", m_blockSize));
+
+    {
+        lock_guard<mutex> guard(m_mutex);
+        checkBufferFor(sz);
+    }
+
+    m_target->setSystemRecordBlockSize(m_blockSize);
+}
+
+void
+FixedBlockTargetWrapper::setSystemRecordSampleRate(int rate)
+{
+    {
+        lock_guard<mutex> guard(m_mutex);
+        m_sampleRate = rate;
+    }
+    m_target->setSystemRecordSampleRate(rate);
+}
+
+void
+FixedBlockTargetWrapper::setSystemRecordChannelCount(int c)
+{
+    {
+        lock_guard<mutex> guard(m_mutex);
+        if (c != m_channels) {
+            reallocate(c, m_bufferSize);
+        }
+    }
+    m_target->setSystemRecordChannelCount(c);
+}
+
+void
+FixedBlockTargetWrapper::setSystemRecordLatency(int latency)
+{
+    lock_guard<mutex> guard(m_mutex);
+    m_systemLatency = latency;
+    reportLatency();
+}
+
+void
+FixedBlockTargetWrapper::setInputLevels(float left, float right)
+{
+    m_target->setInputLevels(left, right);
+}
+
+void
+FixedBlockTargetWrapper::setSystemFreewheeling(bool freewheeling)
+{
+    m_target->setSystemFreewheeling(freewheeling);
+}
+
+void
+FixedBlockTargetWrapper::audioProcessingOverload()
+{
+    m_target->audioProcessingOverload();
+}
+
+void
+FixedBlockTargetWrapper::audioProcessingDeadlineWarning(double duration, double deadline)
+{
+    m_target->audioProcessingDeadlineWarning(duration, deadline);
+}
+
+void
+FixedBlockTargetWrapper::reset()
+{
+    lock_guard<mutex> guard(m_mutex);
+    m_fill = 0;
+}
+
+void
+FixedBlockTargetWrapper::reallocate(int channels, int nframes)
+{
+    if (m_buffer) {
+        deallocate_channels(m_buffer, m_channels);
+        m_buffer = nullptr;
+    }
+    delete[] m_ptrs;
+    m_ptrs = nullptr;
+
+    m_channels = channels;
+    m_bufferSize = nframes;
+    m_fill = 0;
+    
+    if (m_channels > 0 && m_bufferSize > 0) {
+        m_buffer = allocate_and_zero_channels<float>(m_channels, m_bufferSize);
+        m_ptrs = new const float *[m_channels];
+    }
+}
+
+void
+FixedBlockTargetWrapper::checkBufferFor(int nframes)
+{
+    // Between calls we hold fewer than one block's worth of frames,
+    // so we need room for that plus the incoming frames
+    int required = nframes + m_blockSize;
+    if (required <= m_bufferSize) return;
+
+    BQAUDIOIO_LOG_INFO("FixedBlockTargetWrapper", "Extending buffer"
+                       << logField("from", m_bufferSize)
+                       << logField("to", required));
+    
+    m_buffer = reallocate_and_zero_extend_channels
+        (m_buffer,
+         m_channels, m_bufferSize,
+         m_channels, required);
+    m_bufferSize = required;
+}
+
+void
+FixedBlockTargetWrapper::reportLatency()
+{
+    int latency = m_systemLatency + m_addedLatency;
+    if (latency != m_reportedLatency) {
+        m_target->setSystemRecordLatency(latency);
+        m_reportedLatency = latency;
+    }
+}
+
+void
+FixedBlockTargetWrapper::putSamples(const float *const *samples,
+                                    int nchannels, int nframes)
+{
+    put(samples, nchannels, nframes, nullptr);
+}
+
+void
+FixedBlockTargetWrapper::putSamplesWithTiming(const float *const *samples,
+                                              int nchannels, int nframes,
+                                              const CallbackTiming &timing)
+{
+    put(samples, nchannels, nframes, &timing);
+}
+
+void
+FixedBlockTargetWrapper::put(const float *const *samples,
+                             int nchannels, int nframes,
+                             const CallbackTiming *timing)
+{
+    lock_guard<mutex> guard(m_mutex);
+
+    if (nchannels != m_channels) {
+        BQAUDIOIO_LOG_ERROR("FixedBlockTargetWrapper",
+                            "putSamples: Wrong number of channels"
+                            << logField("nchannels", nchannels)
+                            << logField("expected", m_channels));
+        throw std::logic_error("Different number of channels provided than FixedBlockTargetWrapper declared");
+    }
+
+    if (nframes <= 0 || m_channels == 0) {
+        return;
+    }
+    
+    checkBufferFor(nframes);
+
+    if (timing) {
+        // Work back from the first incoming frame to the first
+        // frame already buffered
+        m_startFrame = timing->frame - m_fill;
+        m_startTime = 0.0;
+        if (timing->inputTime != 0.0 && m_sampleRate != 0) {
+            m_startTime = timing->inputTime - double(m_fill) / m_sampleRate;
+        }
+    }
+    
+    for (int c = 0; c < m_channels; ++c) {
+        v_copy(m_buffer[c] + m_fill, samples[c], nframes);
+    }
+    m_fill += nframes;
+
+    int offset = 0;
+    
+    while (m_fill - offset >= m_blockSize) {
+
+        // Frames received after the end of this block have been
+        // waiting for it
+        m_addedLatency = m_fill - offset - m_blockSize;
+        reportLatency();
+
+        for (int c = 0; c < m_channels; ++c) {
+            m_ptrs[c] = m_buffer[c] + offset;
+        }
+        
+        if (timing) {
+            CallbackTiming targetTiming(*timing);
+            targetTiming.frame = m_startFrame + offset;
+            if (m_startTime != 0.0) {
+                targetTiming.inputTime =
+                    m_startTime + double(offset) / m_sampleRate;
+            }
+            if (offset > 0) {
+                // Status flags are passed on with the first block only
+                targetTiming.flags = 0;
+            }
+            m_target->putSamplesWithTiming
+                (m_ptrs, m_channels, m_blockSize, targetTiming);
+        } else {
+            m_target->putSamples(m_ptrs, m_channels, m_blockSize);
+        }
+
+        offset += m_blockSize;
+    }
+
+    if (offset > 0) {
+        m_fill -= offset;
+        for (int c = 0; c < m_channels; ++c) {
+            v_move(m_buffer[c], m_buffer[c] + offset, m_fill);
+        }
+        m_startFrame += offset;
+        if (m_startTime != 0.0) {
+            m_startTime += double(offset) / m_sampleRate;
+        }
+    }
+}
+
+}
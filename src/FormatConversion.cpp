@@ -0,0 +1,306 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "FormatConversion.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BQAUDIOIO_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace breakfastquay {
+
+static const float int16Max = 32767.f;
+static const float int24Max = 8388607.f;
+
+// The largest float below 2^31, so that full-scale positive input
+// does not wrap when converted
+static const float int32Max = 2147483520.f;
+
+int
+bytes_per_sample(SampleFormat format)
+{
+    switch (format) {
+    case SampleFormat::Int16: return 2;
+    case SampleFormat::Int24: return 3;
+    case SampleFormat::Int32: return 4;
+    case SampleFormat::Float32: return 4;
+    }
+    return 4;
+}
+
+DitherState::DitherState()
+{
+    // Any non-zero seeds will do for xorshift, but the four lanes
+    // must differ from one another
+    state[0] = 0x9e3779b9u;
+    state[1] = 0x7f4a7c15u;
+    state[2] = 0x94d049bbu;
+    state[3] = 0xbf58476du;
+}
+
+static inline uint32_t
+xorshift(uint32_t &x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+// Uniform in [0, 1) from the top 23 bits of a random word
+static inline float
+unit(uint32_t r)
+{
+    uint32_t bits = (r >> 9) | 0x3f800000u;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f - 1.f;
+}
+
+static inline float
+clip(float x, float lo, float hi)
+{
+    return x < lo ? lo : (x > hi ? hi : x);
+}
+
+#ifdef BQAUDIOIO_USE_SSE2
+
+static inline __m128i
+xorshift_epi32(__m128i &x)
+{
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+    return x;
+}
+
+static inline __m128
+unit_ps(const __m128i r)
+{
+    __m128i bits = _mm_or_si128(_mm_srli_epi32(r, 9),
+                                _mm_set1_epi32(0x3f800000));
+    return _mm_sub_ps(_mm_castsi128_ps(bits), _mm_set1_ps(1.f));
+}
+
+// Four samples scaled to 16-bit range with TPDF dither, clipped and
+// rounded to int32
+static inline __m128i
+dither16_epi32(const __m128 x, __m128i &state)
+{
+    __m128 r1 = unit_ps(xorshift_epi32(state));
+    __m128 r2 = unit_ps(xorshift_epi32(state));
+    __m128 y = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(int16Max)),
+                          _mm_sub_ps(r1, r2));
+    y = _mm_max_ps(_mm_min_ps(y, _mm_set1_ps(int16Max)),
+                   _mm_set1_ps(-int16Max - 1.f));
+    return _mm_cvtps_epi32(y);
+}
+
+#endif
+
+static void
+float_to_int16(int16_t *const dst, const float *const src, const int count,
+               DitherState &dither)
+{
+    int i = 0;
+
+#ifdef BQAUDIOIO_USE_SSE2
+    __m128i state = _mm_loadu_si128((const __m128i *)dither.state);
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = dither16_epi32(_mm_loadu_ps(src + i), state);
+        __m128i b = dither16_epi32(_mm_loadu_ps(src + i + 4), state);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+    }
+    _mm_storeu_si128((__m128i *)dither.state, state);
+#endif
+
+    for (; i < count; ++i) {
+        float r1 = unit(xorshift(dither.state[0]));
+        float r2 = unit(xorshift(dither.state[0]));
+        float y = clip(src[i] * int16Max + r1 - r2, -int16Max - 1.f, int16Max);
+        dst[i] = int16_t(lrintf(y));
+    }
+}
+
+static void
+float_to_int24(unsigned char *const dst, const float *const src,
+               const int count)
+{
+    for (int i = 0; i < count; ++i) {
+        int32_t v = int32_t(lrintf(clip(src[i] * int24Max,
+                                        -int24Max - 1.f, int24Max)));
+        unsigned char *p = dst + i * 3;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        p[0] = (unsigned char)(v >> 16);
+        p[1] = (unsigned char)(v >> 8);
+        p[2] = (unsigned char)v;
+#else
+        p[0] = (unsigned char)v;
+        p[1] = (unsigned char)(v >> 8);
+        p[2] = (unsigned char)(v >> 16);
+#endif
+    }
+}
+
+static void
+float_to_int32(int32_t *const dst, const float *const src, const int count)
+{
+    int i = 0;
+
+#ifdef BQAUDIOIO_USE_SSE2
+    const __m128 scale = _mm_set1_ps(2147483648.f);
+    const __m128 hi = _mm_set1_ps(int32Max);
+    const __m128 lo = _mm_set1_ps(-2147483648.f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 y = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+        y = _mm_max_ps(_mm_min_ps(y, hi), lo);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_cvtps_epi32(y));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        float y = clip(src[i] * 2147483648.f, -2147483648.f, int32Max);
+        dst[i] = int32_t(lrintf(y));
+    }
+}
+
+static void
+int16_to_float(float *const dst, const int16_t *const src, const int count)
+{
+    const float scale = 1.f / 32768.f;
+    int i = 0;
+
+#ifdef BQAUDIOIO_USE_SSE2
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        // Sign-extend by placing each sample in the top half of a
+        // 32-bit lane and shifting it back down
+        __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(a), s));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(b), s));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        dst[i] = float(src[i]) * scale;
+    }
+}
+
+static void
+int24_to_float(float *const dst, const unsigned char *const src,
+               const int count)
+{
+    const float scale = 1.f / 8388608.f;
+    for (int i = 0; i < count; ++i) {
+        const unsigned char *p = src + i * 3;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        uint32_t u = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+            (uint32_t(p[2]) << 8);
+#else
+        uint32_t u = (uint32_t(p[2]) << 24) | (uint32_t(p[1]) << 16) |
+            (uint32_t(p[0]) << 8);
+#endif
+        dst[i] = float(int32_t(u) >> 8) * scale;
+    }
+}
+
+static void
+int32_to_float(float *const dst, const int32_t *const src, const int count)
+{
+    const float scale = 1.f / 2147483648.f;
+    int i = 0;
+
+#ifdef BQAUDIOIO_USE_SSE2
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 4 <= count; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), s));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        dst[i] = float(src[i]) * scale;
+    }
+}
+
+void
+v_convert_from_float(void *const dst,
+                     const float *const src,
+                     const int count,
+                     const SampleFormat format,
+                     DitherState &dither)
+{
+    switch (format) {
+    case SampleFormat::Int16:
+        float_to_int16((int16_t *)dst, src, count, dither);
+        break;
+    case SampleFormat::Int24:
+        float_to_int24((unsigned char *)dst, src, count);
+        break;
+    case SampleFormat::Int32:
+        float_to_int32((int32_t *)dst, src, count);
+        break;
+    case SampleFormat::Float32:
+        memcpy(dst, src, count * sizeof(float));
+        break;
+    }
+}
+
+void
+v_convert_to_float(float *const dst,
+                   const void *const src,
+                   const int count,
+                   const SampleFormat format)
+{
+    switch (format) {
+    case SampleFormat::Int16:
+        int16_to_float(dst, (const int16_t *)src, count);
+        break;
+    case SampleFormat::Int24:
+        int24_to_float(dst, (const unsigned char *)src, count);
+        break;
+    case SampleFormat::Int32:
+        int32_to_float(dst, (const int32_t *)src, count);
+        break;
+    case SampleFormat::Float32:
+        memcpy(dst, src, count * sizeof(float));
+        break;
+    }
+}
+
+}
@@ -0,0 +1,86 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_FORMAT_CONVERSION_H
+#define BQAUDIOIO_FORMAT_CONVERSION_H
+
+#include "SampleFormat.h"
+
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Conversion between the library's float samples and the integer
+ * formats a device or sound server may take natively. Like the
+ * kernels in Kernels.h, these use SSE2 when the compiler is
+ * targeting it, and plain C++ otherwise.
+ */
+
+/**
+ * Return the number of bytes occupied by one sample in the given
+ * format.
+ */
+int bytes_per_sample(SampleFormat format);
+
+/**
+ * State for the TPDF dither applied when converting to 16-bit. Each
+ * stream being converted should have its own, so that successive
+ * blocks continue the same noise sequence.
+ */
+struct DitherState {
+    uint32_t state[4];
+    DitherState();
+};
+
+/**
+ * Convert count float samples from src into dst in the given
+ * format, clipping to the format's range. Conversion to 16-bit adds
+ * triangular (TPDF) dither of one LSB peak using the given state.
+ */
+void v_convert_from_float(void *const dst,
+                          const float *const src,
+                          const int count,
+                          const SampleFormat format,
+                          DitherState &dither);
+
+/**
+ * Convert count samples in the given format from src into float
+ * samples in dst.
+ */
+void v_convert_to_float(float *const dst,
+                        const void *const src,
+                        const int count,
+                        const SampleFormat format);
+
+}
+
+#endif
@@ -40,15 +40,26 @@ public:
     static
     std::vector<float> gainsFor(float gain, float balance, size_t channelCount) {
         std::vector<float> gains(channelCount, gain);
-        for (int c = 0; c < int(channelCount); ++c) {
-            if (c == 0) {
-                if (balance > 0.f) gains[c] *= (1.0f - balance);
-            } else if (c == 1) {
-                if (balance < 0.f) gains[c] *= (balance + 1.0f);
-            }
-        }
+        gainsFor(gain, balance, gains.data(), int(channelCount));
         return gains;
     }
+
+    /**
+     * Fill the given array of channelCount gains in place, without
+     * allocating. Suitable for use in an audio callback.
+     */
+    static
+    void gainsFor(float gain, float balance, float *gains, int channelCount) {
+        for (int c = 0; c < channelCount; ++c) {
+            gains[c] = gain;
+        }
+        if (channelCount > 0 && balance > 0.f) {
+            gains[0] *= (1.0f - balance);
+        }
+        if (channelCount > 1 && balance < 0.f) {
+            gains[1] *= (balance + 1.0f);
+        }
+    }
 };
 
 #endif
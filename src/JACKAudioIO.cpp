@@ -36,21 +36,22 @@
 #include "ApplicationPlaybackSource.h"
 #include "ApplicationRecordTarget.h"
 #include "Gains.h"
+#include "Kernels.h"
 #include "Log.h"
+#include "Meter.h"
+#include "RealtimeCheck.h"
 
-#include <bqvec/Range.h>
+#include "bqvec/Allocators.h"
+#include "bqvec/VectorOps.h"
 
-#include <iostream>
-#include <sstream>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <climits>
+#include <thread>
 
 #include <unistd.h> // getpid
 
-//#define DEBUG_AUDIO_JACK_IO 1
-
 using namespace std;
 
 namespace breakfastquay {
@@ -58,9 +59,7 @@ namespace breakfastquay {
 static string defaultConnectionName = "Default Connection";
 static string noConnectionName = "No Connection";
 
-static void log(string message) {
-    Log::log("JACKAudioIO: " + message);
-}    
+static const char *const logComponent = "JACKAudioIO";
 
 vector<string>
 JACKAudioIO::getRecordDeviceNames()
@@ -78,14 +77,34 @@ JACKAudioIO::JACKAudioIO(Mode mode,
                          ApplicationRecordTarget *target,
 			 ApplicationPlaybackSource *source,
                          string recordDevice,
-                         string playbackDevice) :
+                         string playbackDevice,
+                         bool shareClient,
+                         vector<int> recordChannels) :
     SystemAudioIO(target, source),
     m_mode(mode),
     m_client(0),
+    m_sourceChannels(0),
+    m_targetChannels(0),
+    m_scratch(nullptr),
+    m_scratchChannels(0),
+    m_scratchSize(0),
+    m_connectRecord(recordDevice != noConnectionName),
+    m_connectPlayback(playbackDevice != noConnectionName),
+    m_recordChannels(recordChannels),
     m_bufferSize(0),
-    m_sampleRate(0)
+    m_sampleRate(0),
+    m_inputLatency(0),
+    m_outputLatency(0),
+    m_lastFrameTime(0),
+    m_frameTimeBase(0),
+    m_xrunPending(false),
+    m_freewheeling(false),
+    m_connecting(false),
+    m_heldInputPeaks { 0.f, 0.f },
+    m_heldOutputPeaks { 0.f, 0.f },
+    m_deadlineFraction(0.0)
 {
-    log("starting");
+    BQAUDIOIO_LOG_INFO(logComponent, "Starting");
     
     if (m_mode == Mode::Playback) {
         m_target = 0;
@@ -98,47 +117,33 @@ JACKAudioIO::JACKAudioIO(Mode mode,
         (source ? source->getClientName() :
          target ? target->getClientName() : "bqaudioio");
 
-    JackOptions options = JackNullOption;
-    
-#if defined(HAVE_PORTAUDIO) || defined(HAVE_LIBPULSE)
-    options = JackNoStartServer;
-#endif
-
-    JackStatus status = JackStatus(0);
-    m_client = jack_client_open(clientName.c_str(), options, &status);
-    if (!m_client) {
-        m_startupError = "Failed to connect to JACK server";
-        log("ERROR: " + m_startupError);
+    m_jackClient = JACKClient::acquire(clientName, shareClient,
+                                       m_startupError);
+    if (!m_jackClient) {
         return;
     }
 
+    m_client = m_jackClient->getClient();
     m_bufferSize = jack_get_buffer_size(m_client);
     m_sampleRate = jack_get_sample_rate(m_client);
 
-    jack_set_xrun_callback(m_client, xrunStatic, this);
-    jack_set_process_callback(m_client, processStatic, this);
+    m_jackClient->addHandler(this);
 
-    if (jack_activate(m_client)) {
-        m_startupError = "Failed to activate JACK client";
-        log("ERROR: " + m_startupError);
-        return;
-    }
+    setup();
 
-    bool connectRecord = (recordDevice != noConnectionName);
-    bool connectPlayback = (playbackDevice != noConnectionName);
-    
-    setup(connectRecord, connectPlayback);
-
-    log("started successfully");
+    BQAUDIOIO_LOG_INFO(logComponent, "Started successfully");
 }
 
 JACKAudioIO::~JACKAudioIO()
 {
-    if (m_client) {
-	jack_deactivate(m_client);
-	jack_client_close(m_client);
-        log("closed");
+    if (m_jackClient) {
+        m_jackClient->removeHandler(this);
+        for (auto port: m_outputs) m_jackClient->unregisterPort(port);
+        for (auto port: m_inputs) m_jackClient->unregisterPort(port);
+        m_jackClient.reset();
+        BQAUDIOIO_LOG_INFO(logComponent, "Closed");
     }
+    deallocate_channels(m_scratch, m_scratchChannels);
 }
 
 bool
@@ -167,54 +172,259 @@ double
 JACKAudioIO::getCurrentTime() const
 {
     if (m_client && m_sampleRate) {
-        return double(jack_frame_time(m_client)) / double(m_sampleRate);
+        return double(getCurrentFrame()) / double(m_sampleRate);
     } else {
         return 0.0;
     }
 }
 
-int
-JACKAudioIO::processStatic(jack_nframes_t nframes, void *arg)
+int64_t
+JACKAudioIO::getCurrentFrame() const
+{
+    if (!m_client) return 0;
+    
+    jack_nframes_t frames = jack_frame_time(m_client);
+    int64_t base = m_frameTimeBase;
+    if (frames < m_lastFrameTime) {
+        // wrapped since the start of the last process cycle
+        base += int64_t(1) << 32;
+    }
+    return base + frames;
+}
+
+bool
+JACKAudioIO::setFreewheeling(bool freewheeling)
+{
+    if (!m_client) return false;
+    
+    if (jack_set_freewheel(m_client, freewheeling ? 1 : 0)) {
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to "
+                            << (freewheeling ? "start" : "stop")
+                            << " freewheeling");
+        return false;
+    }
+    
+    return true;
+}
+
+void
+JACKAudioIO::freewheelChanged(bool freewheeling)
+{
+    BQAUDIOIO_LOG_INFO(logComponent, (freewheeling ?
+                                      "Freewheeling started" :
+                                      "Freewheeling stopped"));
+    
+    m_freewheeling = freewheeling;
+
+    if (m_source) m_source->setSystemFreewheeling(freewheeling);
+    if (m_target) m_target->setSystemFreewheeling(freewheeling);
+}
+
+void
+JACKAudioIO::bufferSizeChanged(jack_nframes_t nframes)
+{
+    // JACK calls this outside the process callback, and guarantees
+    // not to run the process callback with the new size until it
+    // has returned - so the application may reallocate here
+    
+    if (nframes == m_bufferSize) return;
+
+    BQAUDIOIO_LOG_INFO(logComponent, "Buffer size changed"
+                       << logField("from", m_bufferSize)
+                       << logField("to", nframes));
+
+    m_bufferSize = nframes;
+
+    // Not under m_mutex, which setup() holds while calling into the
+    // server - allocateScratch has a lock of its own
+    allocateScratch();
+    
+    if (m_source) m_source->setSystemPlaybackBlockSize(m_bufferSize);
+    if (m_target) m_target->setSystemRecordBlockSize(m_bufferSize);
+}
+
+void
+JACKAudioIO::sampleRateChanged(jack_nframes_t rate)
+{
+    if (rate == m_sampleRate) return;
+
+    BQAUDIOIO_LOG_INFO(logComponent, "Sample rate changed"
+                       << logField("from", m_sampleRate)
+                       << logField("to", rate));
+
+    m_sampleRate = rate;
+    
+    if (m_source) m_source->setSystemPlaybackSampleRate(m_sampleRate);
+    if (m_target) m_target->setSystemRecordSampleRate(m_sampleRate);
+
+    double fraction = m_deadlineFraction;
+    if (fraction > 0.0) {
+        m_monitor.setDeadlineWarning(fraction, int(rate), m_source, m_target);
+    }
+}
+
+bool
+JACKAudioIO::setDeadlineWarningThreshold(double fraction)
 {
-    return ((JACKAudioIO *)arg)->process(nframes);
+    m_deadlineFraction = fraction;
+    m_monitor.setDeadlineWarning(fraction, int(m_sampleRate),
+                                 m_source, m_target);
+    return true;
 }
 
-int
-JACKAudioIO::xrunStatic(void *arg)
+void
+JACKAudioIO::latencyChanged(jack_latency_callback_mode_t mode)
 {
-    return ((JACKAudioIO *)arg)->xrun();
+    // JACK does not repeat a latency callback, so we must not drop
+    // one. The mutex is held either by process(), for no more than a
+    // cycle, or by setup(). While setup() is connecting ports, which
+    // is what usually provokes this call, it may be waiting on the
+    // server and so on us; but it queries the latencies itself once
+    // it has finished connecting, so then we can just return
+    while (!m_mutex.try_lock()) {
+        if (m_connecting) {
+            return;
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    lock_guard<mutex> guard(m_mutex, adopt_lock);
+    updateLatencies(mode);
 }
 
 void
-JACKAudioIO::setup(bool connectRecord, bool connectPlayback)
+JACKAudioIO::updateLatencies(jack_latency_callback_mode_t mode)
+{
+    // Call with m_mutex held. We report the worst-case latency
+    // across all of our ports in the given direction
+
+    jack_nframes_t latency = 0;
+    
+    if (mode == JackPlaybackLatency) {
+
+        if (!m_source || m_outputs.empty()) return;
+        
+        for (auto port: m_outputs) {
+            jack_latency_range_t range;
+            jack_port_get_latency_range(port, JackPlaybackLatency, &range);
+            if (range.max > latency) latency = range.max;
+        }
+
+        m_outputLatency = latency;
+        m_monitor.setLatency(CallbackMonitor::Playback, int(latency));
+        m_source->setSystemPlaybackLatency(int(latency));
+
+    } else {
+
+        if (!m_target || m_inputs.empty()) return;
+        
+        for (auto port: m_inputs) {
+            jack_latency_range_t range;
+            jack_port_get_latency_range(port, JackCaptureLatency, &range);
+            if (range.max > latency) latency = range.max;
+        }
+
+        m_inputLatency = latency;
+        m_monitor.setLatency(CallbackMonitor::Record, int(latency));
+        m_target->setSystemRecordLatency(int(latency));
+    }
+}
+
+void
+JACKAudioIO::pruneRecordChannels()
+{
+    // Drop any selected channels for which there is no physical
+    // capture port, rather than registering a port that can never
+    // be connected
+    
+    if (!m_client || m_recordChannels.empty()) return;
+
+    const char **capPorts =
+	jack_get_ports(m_client, NULL, NULL,
+		       JackPortIsPhysical | JackPortIsOutput);
+
+    int capPortCount = 0;
+    while (capPorts && capPorts[capPortCount]) ++capPortCount;
+
+    if (capPorts) {
+        jack_free(capPorts);
+    }
+    
+    vector<int> valid;
+    for (int c: m_recordChannels) {
+        if (c >= 0 && c < capPortCount) {
+            valid.push_back(c);
+        } else {
+            BQAUDIOIO_LOG_WARNING(logComponent, "Selected record channel is "
+                                  << "not available from the server, "
+                                  << "ignoring it"
+                                  << logField("channel", c)
+                                  << logField("capturePorts", capPortCount));
+        }
+    }
+    if (valid.empty()) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "None of the selected record "
+                              << "channels is available, recording all "
+                              << "channels instead");
+    }
+    m_recordChannels = valid;
+}
+
+void
+JACKAudioIO::setup()
 {
     lock_guard<mutex> guard(m_mutex);
 
-    int channelsPlay = 2;
-    int channelsRec = 2;
+    pruneRecordChannels();
+    
+    m_sourceChannels = 2;
+    m_targetChannels = 2;
     
     if (m_source) {
         m_source->setSystemPlaybackBlockSize(m_bufferSize);
         m_source->setSystemPlaybackSampleRate(m_sampleRate);
         if (m_source->getApplicationChannelCount() > 0) {
-            channelsPlay = m_source->getApplicationChannelCount();
+            m_sourceChannels = m_source->getApplicationChannelCount();
         }
     }
     if (m_target) {
         m_target->setSystemRecordBlockSize(m_bufferSize);
         m_target->setSystemRecordSampleRate(m_sampleRate);
         if (m_target->getApplicationChannelCount() > 0) {
-            channelsRec = m_target->getApplicationChannelCount();
+            m_targetChannels = m_target->getApplicationChannelCount();
+        } else if (!m_recordChannels.empty()) {
+            m_targetChannels = int(m_recordChannels.size());
         }
     }
 
+    // We have one port per application channel, unless a mixing
+    // matrix for the application's channel count asks for some other
+    // number
+    
+    int channelsPlay = m_sourceChannels;
+    int channelsRec = m_targetChannels;
+
+    if (!m_outputMatrix.isEmpty() &&
+        m_outputMatrix.getInputCount() == m_sourceChannels) {
+        channelsPlay = m_outputMatrix.getOutputCount();
+    }
+    if (!m_recordChannels.empty()) {
+        channelsRec = int(m_recordChannels.size());
+    } else if (!m_inputMatrix.isEmpty() &&
+               m_inputMatrix.getOutputCount() == m_targetChannels) {
+        channelsRec = m_inputMatrix.getInputCount();
+    }
+    
     if (!m_client) return;
     
     if (channelsPlay == int(m_outputs.size()) &&
         channelsRec == int(m_inputs.size())) {
+        configureMixers();
 	return;
     }
 
+    m_connecting = true;
+
     const char **playPorts =
 	jack_get_ports(m_client, NULL, NULL,
 		       JackPortIsPhysical | JackPortIsInput);
@@ -228,43 +438,29 @@ JACKAudioIO::setup(bool connectRecord, bool connectPlayback)
     int capPortCount = 0;
     while (capPorts && capPorts[capPortCount]) ++capPortCount;
 
-    {
-        ostringstream os;
-        os << "Setup: have "
-           << channelsPlay << " playback channels, "
-           << channelsRec << " capture channels, "
-           << playPortCount << " playback ports, "
-           << capPortCount << " capture ports";
-        log(os.str());
-    }
+    BQAUDIOIO_LOG_INFO(logComponent, "Setting up"
+                       << logField("playbackChannels", channelsPlay)
+                       << logField("captureChannels", channelsRec)
+                       << logField("playbackPorts", playPortCount)
+                       << logField("capturePorts", capPortCount));
 
     if (m_source) {
 
+        m_outputs.reserve(channelsPlay);
+        
         while (int(m_outputs.size()) < channelsPlay) {
 	
-            char name[50];
-            jack_port_t *port;
-
-            sprintf(name, "out %ld", long(m_outputs.size() + 1));
-
-            port = jack_port_register(m_client,
-                                      name,
-                                      JACK_DEFAULT_AUDIO_TYPE,
-                                      JackPortIsOutput,
-                                      0);
+            jack_port_t *port =
+                m_jackClient->registerPort("out", JackPortIsOutput);
 
             if (!port) {
-                ostringstream os;
-                os << "ERROR: Failed to create JACK output port " << m_outputs.size();
-                log(os.str());
-                return;
-            } else {
-                jack_latency_range_t range;
-                jack_port_get_latency_range(port, JackPlaybackLatency, &range);
-                m_source->setSystemPlaybackLatency(range.max);
+                BQAUDIOIO_LOG_ERROR(logComponent,
+                                    "Failed to create JACK output port"
+                                    << logField("index", m_outputs.size()));
+                break;
             }
 
-            if (connectPlayback) {
+            if (m_connectPlayback) {
                 if (int(m_outputs.size()) < playPortCount) {
                     jack_connect(m_client,
                                  jack_port_name(port),
@@ -278,34 +474,28 @@ JACKAudioIO::setup(bool connectRecord, bool connectPlayback)
 
     if (m_target) {
 
+        m_inputs.reserve(channelsRec);
+        
         while (int(m_inputs.size()) < channelsRec) {
 	
-            char name[50];
-            jack_port_t *port;
-
-            sprintf(name, "in %ld", long(m_inputs.size() + 1));
-
-            port = jack_port_register(m_client,
-                                      name,
-                                      JACK_DEFAULT_AUDIO_TYPE,
-                                      JackPortIsInput,
-                                      0);
+            jack_port_t *port =
+                m_jackClient->registerPort("in", JackPortIsInput);
 
             if (!port) {
-                ostringstream os;
-                os << "ERROR: Failed to create JACK input port " << m_inputs.size();
-                log(os.str());
-                return;
-            } else {
-                jack_latency_range_t range;
-                jack_port_get_latency_range(port, JackCaptureLatency, &range);
-                m_target->setSystemRecordLatency(range.max);
+                BQAUDIOIO_LOG_ERROR(logComponent,
+                                    "Failed to create JACK input port"
+                                    << logField("index", m_inputs.size()));
+                break;
             }
 
-            if (connectRecord) {
-                if (int(m_inputs.size()) < capPortCount) {
+            if (m_connectRecord) {
+                int capIndex = int(m_inputs.size());
+                if (!m_recordChannels.empty()) {
+                    capIndex = m_recordChannels[m_inputs.size()];
+                }
+                if (capIndex >= 0 && capIndex < capPortCount) {
                     jack_connect(m_client,
-                                 capPorts[m_inputs.size()],
+                                 capPorts[capIndex],
                                  jack_port_name(port));
                 }
             }
@@ -318,7 +508,7 @@ JACKAudioIO::setup(bool connectRecord, bool connectPlayback)
 	vector<jack_port_t *>::iterator itr = m_outputs.end();
 	--itr;
 	jack_port_t *port = *itr;
-	if (port) jack_port_unregister(m_client, port);
+	if (port) m_jackClient->unregisterPort(port);
 	m_outputs.erase(itr);
     }
 
@@ -326,10 +516,19 @@ JACKAudioIO::setup(bool connectRecord, bool connectPlayback)
 	vector<jack_port_t *>::iterator itr = m_inputs.end();
 	--itr;
 	jack_port_t *port = *itr;
-	if (port) jack_port_unregister(m_client, port);
+	if (port) m_jackClient->unregisterPort(port);
 	m_inputs.erase(itr);
     }
 
+    // Pointer tables for the process callback, which only ever
+    // fills them in
+    m_outputBuffers.resize(m_outputs.size(), nullptr);
+    m_inputBuffers.resize(m_inputs.size(), nullptr);
+    m_gains.resize(m_outputs.size(), 1.f);
+    m_peaks.resize(m_outputs.size(), 0.f);
+
+    configureMixers();
+
     if (m_source) {
         m_source->setSystemPlaybackChannelCount(channelsPlay);
     }
@@ -337,6 +536,13 @@ JACKAudioIO::setup(bool connectRecord, bool connectPlayback)
         m_target->setSystemRecordChannelCount(channelsRec);
     }
 
+    // Query latencies only once the ports are all connected. Any
+    // latency callback that returned early because we were
+    // connecting came before this point, so we pick up its change
+    m_connecting = false;
+    updateLatencies(JackPlaybackLatency);
+    updateLatencies(JackCaptureLatency);
+
     if (playPorts) {
         jack_free(playPorts);
     }
@@ -345,114 +551,364 @@ JACKAudioIO::setup(bool connectRecord, bool connectPlayback)
     }
 }
 
-int
-JACKAudioIO::process(jack_nframes_t j_nframes)
+void
+JACKAudioIO::setOutputMixingMatrix(const MixingMatrix &matrix)
 {
-    if (!m_mutex.try_lock()) {
-	return 0;
+    SystemPlaybackTarget::setOutputMixingMatrix(matrix);
+    setup();
+}
+
+void
+JACKAudioIO::setInputMixingMatrix(const MixingMatrix &matrix)
+{
+    SystemRecordSource::setInputMixingMatrix(matrix);
+    setup();
+}
+
+void
+JACKAudioIO::configureMixers()
+{
+    // Called with m_mutex held
+    
+    int nout = int(m_outputs.size());
+    int nin = int(m_inputs.size());
+    bool outputOK = true, inputOK = true;
+
+    {
+        // allocateScratch may be looking at the mixers from
+        // bufferSizeChanged
+        lock_guard<mutex> guard(m_scratchMutex);
+        if (m_source) {
+            outputOK = m_outputMixer.configure
+                (m_outputMatrix, nout, m_sourceChannels);
+        }
+        if (m_target) {
+            inputOK = m_inputMixer.configure
+                (m_inputMatrix, m_targetChannels, nin);
+        }
     }
 
-    lock_guard<mutex> guard(m_mutex, adopt_lock);
+    if (!outputOK) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "Output mixing matrix does not "
+                              << "map source channels to ports, using "
+                              << "default mapping"
+                              << logField("sourceChannels", m_sourceChannels)
+                              << logField("ports", nout));
+    }
+    if (!inputOK) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "Input mixing matrix does not "
+                              << "map ports to target channels, using "
+                              << "default mapping"
+                              << logField("ports", nin)
+                              << logField("targetChannels", m_targetChannels));
+    }
+
+    m_sourceBuffers.resize(m_sourceChannels, nullptr);
+    m_targetBuffers.resize(m_targetChannels, nullptr);
+    
+    allocateScratch();
+
+    // Output is metered at the ports, input as the target receives it
+    m_outputMeter->configure(nout);
+    m_inputMeter->configure(m_targetChannels);
+}
+
+void
+JACKAudioIO::allocateScratch()
+{
+    // Called either with m_mutex held (from setup) or while the
+    // process callback is known not to be running (from
+    // bufferSizeChanged). Scratch channels are needed only for real
+    // mixing; identity and pure routing use the port buffers
+
+    lock_guard<mutex> guard(m_scratchMutex);
+    
+    int channels = 0;
+    if (m_source && !m_outputMixer.isPermutation()) {
+        channels = std::max(channels, m_sourceChannels);
+    }
+    if (m_target && !m_inputMixer.isRouting()) {
+        channels = std::max(channels, m_targetChannels);
+    }
+    if (m_target && m_inputMixer.isRouting()) {
+        // a silent route still needs a zeroed buffer to point at
+        for (int r = 0; r < m_targetChannels; ++r) {
+            if (m_inputMixer.getRoute(r) < 0) {
+                channels = std::max(channels, m_targetChannels);
+                break;
+            }
+        }
+    }
+    int size = int(m_bufferSize);
+
+    if (channels == m_scratchChannels && size == m_scratchSize) {
+        return;
+    }
+
+    deallocate_channels(m_scratch, m_scratchChannels);
+    m_scratch = nullptr;
+    if (channels > 0 && size > 0) {
+        m_scratch = allocate_and_zero_channels<float>(channels, size);
+    }
+    m_scratchChannels = channels;
+    m_scratchSize = size;
+}
+
+int64_t
+JACKAudioIO::getCycleFrameTime()
+{
+    // The JACK frame time is a 32-bit counter that wraps after a day
+    // or so at typical rates; extend it to 64 bits by counting wraps
+    
+    jack_nframes_t currentFrames = 0;
+    jack_time_t currentUsecs = 0, nextUsecs = 0;
+    float periodUsecs = 0.f;
 
+    if (jack_get_cycle_times(m_client, &currentFrames,
+                             &currentUsecs, &nextUsecs, &periodUsecs)) {
+        currentFrames = jack_last_frame_time(m_client);
+    }
+
+    if (currentFrames < m_lastFrameTime) {
+        m_frameTimeBase += int64_t(1) << 32;
+    }
+    m_lastFrameTime = currentFrames;
+    
+    return m_frameTimeBase + currentFrames;
+}
+
+static void
+holdPeaks(float &peakLeft, float &peakRight, float *held, bool report)
+{
+    if (held[0] > peakLeft) peakLeft = held[0];
+    if (held[1] > peakRight) peakRight = held[1];
+    if (report) {
+        held[0] = held[1] = 0.f;
+    } else {
+        held[0] = peakLeft;
+        held[1] = peakRight;
+    }
+}
+
+void
+JACKAudioIO::process(jack_nframes_t j_nframes)
+{
+    RealtimeCheck::Scope rtcheck;
+    m_monitor.beginCallback("JACK process");
+    
     if (j_nframes > INT_MAX) j_nframes = 0;
     int nframes = int(j_nframes);
     
-    if (m_outputs.empty() && m_inputs.empty()) {
-	return 0;
+    if (!m_mutex.try_lock()) {
+        m_monitor.endCallback(nframes, int(m_sampleRate));
+	return;
     }
 
-#ifdef DEBUG_AUDIO_JACK_IO    
-    cout << "JACKAudioIO::process(" << nframes << "): have a purpose in life" << endl;
-#endif
+    lock_guard<mutex> guard(m_mutex, adopt_lock);
 
-#ifdef DEBUG_AUDIO_JACK_IO    
-    if (m_bufferSize != nframes) {
-	cerr << "WARNING: m_bufferSize != nframes (" << m_bufferSize << " != " << nframes << ")" << endl;
+    if (m_outputs.empty() && m_inputs.empty()) {
+        m_monitor.endCallback(nframes, int(m_sampleRate));
+	return;
     }
-#endif
 
-    float **inbufs = (float **)alloca(m_inputs.size() * sizeof(float *));
-    float **outbufs = (float **)alloca(m_outputs.size() * sizeof(float *));
+    BQAUDIOIO_LOG_DEBUG(logComponent, "process" << logField("nframes", nframes));
 
-    float peakLeft, peakRight;
+    if (int(m_bufferSize) != nframes) {
+        BQAUDIOIO_LOG_DEBUG(logComponent, "Block size differs from buffer size"
+                            << logField("nframes", nframes)
+                            << logField("bufferSize", m_bufferSize));
+    }
 
-    if (m_target) {
+    CallbackTiming timing = CallbackTiming();
+    timing.frame = getCycleFrameTime();
+    if (m_sampleRate) {
+        double rate = double(m_sampleRate);
+        timing.currentTime = double(timing.frame) / rate;
+        timing.outputTime = double(timing.frame + m_outputLatency) / rate;
+        timing.inputTime = double(timing.frame - m_inputLatency) / rate;
+    }
+    if (m_xrunPending.exchange(false)) {
+        timing.flags = (CallbackTiming::InputOverflow |
+                        CallbackTiming::OutputUnderflow);
+        m_monitor.reportDropout(DropoutEvent::ServerXrun, timing.frame);
+    }
 
-        for (int ch = 0; in_range_for(m_inputs, ch); ++ch) {
-            inbufs[ch] = (float *)jack_port_get_buffer(m_inputs[ch], nframes);
+    // When freewheeling we may be called many times faster than
+    // realtime, so instead of reporting levels for every block we
+    // hold the peaks and report them at a modest wall-clock rate
+    bool freewheeling = m_freewheeling;
+    bool reportLevels = true;
+    if (freewheeling) {
+        timing.flags |= CallbackTiming::Freewheeling;
+        auto now = chrono::steady_clock::now();
+        if (now - m_lastLevelReport < chrono::milliseconds(50)) {
+            reportLevels = false;
+        } else {
+            m_lastLevelReport = now;
         }
+    }
+    
+    int nin = int(m_inputs.size());
+    int nout = int(m_outputs.size());
+    float **inbufs = m_inputBuffers.data();
+    float **outbufs = m_outputBuffers.data();
 
-        peakLeft = 0.0; peakRight = 0.0;
+    for (int ch = 0; ch < nin; ++ch) {
+        inbufs[ch] = (float *)jack_port_get_buffer(m_inputs[ch], nframes);
+    }
+    for (int ch = 0; ch < nout; ++ch) {
+        outbufs[ch] = (float *)jack_port_get_buffer(m_outputs[ch], nframes);
+    }
 
-        for (int ch = 0; in_range_for(m_inputs, ch); ++ch) {
+    float peakLeft, peakRight;
 
-            float peak = 0.0;
+    if (m_target) {
 
-            for (int i = 0; i < nframes; ++i) {
-                float sample = fabsf(inbufs[ch][i]);
-                if (sample > peak) peak = sample;
+        // Map the ports onto the target's channels, by picking port
+        // buffers where the matrix allows and mixing where not
+        
+        const ChannelMixer &mixer = m_inputMixer;
+        float **tgtbufs = inbufs;
+        int ntgt = m_targetChannels;
+        
+        if (!mixer.isIdentity()) {
+            tgtbufs = m_targetBuffers.data();
+            if (mixer.isRouting()) {
+                for (int ch = 0; ch < ntgt; ++ch) {
+                    int route = mixer.getRoute(ch);
+                    if (route >= 0) {
+                        tgtbufs[ch] = inbufs[route];
+                    } else {
+                        tgtbufs[ch] = m_scratch[ch];
+                        v_zero(tgtbufs[ch], nframes);
+                    }
+                }
+            } else {
+                for (int ch = 0; ch < ntgt; ++ch) {
+                    tgtbufs[ch] = m_scratch[ch];
+                }
+                mixer.mix(tgtbufs, inbufs, nframes);
             }
+        }
 
-            if (ch == 0) peakLeft = peak;
-            if (ch > 0 || m_inputs.size() == 1) peakRight = peak;
+        m_inputMeter->process(tgtbufs, ntgt, nframes);
+        m_inputMeter->getBlockPeaks(peakLeft, peakRight);
+        
+        if (freewheeling) {
+            holdPeaks(peakLeft, peakRight, m_heldInputPeaks, reportLevels);
+        }
+        if (reportLevels && m_inputLevelCallbacks) {
+            m_target->setInputLevels(peakLeft, peakRight);
         }
         
-	m_target->setInputLevels(peakLeft, peakRight);
-        m_target->putSamples(inbufs, int(m_inputs.size()), nframes);
+        m_monitor.beginApplication();
+        m_target->putSamplesWithTiming(tgtbufs, ntgt, nframes, timing);
+        m_monitor.endApplication(CallbackMonitor::Record, nframes);
     }
 
-    auto gain = Gains::gainsFor(m_outputGain, m_outputBalance, m_outputs.size()); 
-    
     if (m_source) {
 
-        for (int ch = 0; in_range_for(m_outputs, ch); ++ch) {
-            outbufs[ch] = (float *)jack_port_get_buffer(m_outputs[ch], nframes);
-        }
+        // The source renders straight into the port buffers if the
+        // matrix maps its channels one-to-one onto the ports (in any
+        // order), and into scratch buffers for mixing if not
         
-	int received = m_source->getSourceSamples
-            (outbufs, int(m_outputs.size()), nframes);
-
-        peakLeft = 0.0; peakRight = 0.0;
+        const ChannelMixer &mixer = m_outputMixer;
+        int nsrc = m_sourceChannels;
+        float **srcbufs = outbufs;
+        
+        if (!mixer.isIdentity()) {
+            srcbufs = m_sourceBuffers.data();
+            if (mixer.isPermutation()) {
+                for (int ch = 0; ch < nout; ++ch) {
+                    srcbufs[mixer.getRoute(ch)] = outbufs[ch];
+                }
+            } else {
+                for (int ch = 0; ch < nsrc; ++ch) {
+                    srcbufs[ch] = m_scratch[ch];
+                }
+            }
+        }
 
-        for (int ch = 0; in_range_for(m_outputs, ch); ++ch) {
+        int silent = getScheduledSilence(timing.frame, nframes);
+        int received = 0;
 
-            float peak = 0.0;
+        if (silent < nframes) {
+            CallbackTiming sourceTiming(timing);
+            if (silent > 0) {
+                sourceTiming.frame += silent;
+                sourceTiming.outputTime += double(silent) / double(m_sampleRate);
+            }
+            m_monitor.beginApplication();
+            received = m_source->getSourceSamplesWithTiming
+                (srcbufs, nsrc, nframes - silent, sourceTiming);
+            m_monitor.endApplication(CallbackMonitor::Playback,
+                                     nframes - silent);
+            m_monitor.reportSourceDelivery(sourceTiming.frame,
+                                           nframes - silent, received);
+            if (silent > 0) {
+                // Shift the source's samples up to the scheduled start
+                for (int ch = 0; ch < nsrc; ++ch) {
+                    memmove(srcbufs[ch] + silent, srcbufs[ch],
+                            received * sizeof(float));
+                    for (int i = 0; i < silent; ++i) {
+                        srcbufs[ch][i] = 0.0;
+                    }
+                }
+                received += silent;
+            }
+        }
 
+        for (int ch = 0; ch < nsrc; ++ch) {
             for (int i = received; i < nframes; ++i) {
-                outbufs[ch][i] = 0.0;
+                srcbufs[ch][i] = 0.0;
             }
-        
-            for (int i = 0; i < nframes; ++i) {
-                outbufs[ch][i] *= gain[ch];
-                float sample = fabsf(outbufs[ch][i]);
-                if (sample > peak) peak = sample;
+        }
+
+        if (!mixer.isPermutation()) {
+            mixer.mix(outbufs, srcbufs, received);
+            for (int ch = 0; ch < nout; ++ch) {
+                v_zero(outbufs[ch] + received, nframes - received);
             }
+        }
+        
+        float *gain = m_gains.data();
+        Gains::gainsFor(m_outputGain, m_outputBalance, gain, nout);
 
-            if (ch == 0) peakLeft = peak;
-            if (ch > 0 || m_outputs.size() == 1) peakRight = peak;
+        v_gain_peak_channels(outbufs, nout, received, gain, m_peaks.data());
+        m_outputMeter->process(outbufs, nout, nframes);
+
+        peakLeft = 0.0; peakRight = 0.0;
+        if (nout > 0) {
+            peakLeft = m_peaks[0];
+            peakRight = (nout > 1 ? m_peaks[1] : m_peaks[0]);
         }
 	    
-        m_source->setOutputLevels(peakLeft, peakRight);
+        if (freewheeling) {
+            holdPeaks(peakLeft, peakRight, m_heldOutputPeaks, reportLevels);
+        }
+        if (reportLevels && m_outputLevelCallbacks) {
+            m_source->setOutputLevels(peakLeft, peakRight);
+        }
 
-    } else if (!m_outputs.empty()) {
+    } else {
         
-	for (int ch = 0; in_range_for(m_outputs, ch); ++ch) {
+	for (int ch = 0; ch < nout; ++ch) {
 	    for (int i = 0; i < nframes; ++i) {
 		outbufs[ch][i] = 0.0;
 	    }
 	}
     }
 
-    return 0;
+    m_monitor.endCallback(nframes, int(m_sampleRate));
 }
 
-int
+void
 JACKAudioIO::xrun()
 {
-    log("xrun!");
+    // Journalled by the next process call, which knows the frame
+    m_xrunPending = true;
     if (m_target) m_target->audioProcessingOverload();
     if (m_source) m_source->audioProcessingOverload();
-    return 0;
 }
 
 }
@@ -37,7 +37,14 @@
 #include <jack/jack.h>
 #include <vector>
 #include <mutex>
-
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+
+#include "JACKClient.h"
+#include "ChannelMixer.h"
+#include "CallbackMonitor.h"
 #include "SystemAudioIO.h"
 #include "AudioFactory.h"
 #include "Mode.h"
@@ -47,14 +54,27 @@ namespace breakfastquay {
 class ApplicationRecordTarget;
 class ApplicationPlaybackSource;
 
-class JACKAudioIO : public SystemAudioIO
+class JACKAudioIO : public SystemAudioIO,
+                    private JACKClient::Handler
 {
 public:
+    /**
+     * If shareClient is true, the IO registers its ports with a
+     * JACK client shared with any other JACKAudioIO objects in this
+     * process that were also created with shareClient and the same
+     * client name, rather than opening a client of its own.
+     *
+     * If recordChannels is non-empty, one input port is registered
+     * for each capture port it lists (numbered from zero), connected
+     * to that capture port.
+     */
     JACKAudioIO(Mode mode,
                 ApplicationRecordTarget *recordTarget,
 		ApplicationPlaybackSource *playSource,
                 std::string recordDevice,
-                std::string playbackDevice);
+                std::string playbackDevice,
+                bool shareClient = false,
+                std::vector<int> recordChannels = {});
     virtual ~JACKAudioIO();
 
     static std::vector<std::string> getRecordDeviceNames();
@@ -69,24 +89,81 @@ public:
     void suppressRecordSide(bool) override {}
     
     double getCurrentTime() const override;
+    int64_t getCurrentFrame() const override;
+
+    bool setFreewheeling(bool freewheeling) override;
+
+    void setOutputMixingMatrix(const MixingMatrix &) override;
+    void setInputMixingMatrix(const MixingMatrix &) override;
+
+    CallbackStatistics getStatistics() const override {
+        return m_monitor.getStatistics();
+    }
+    void resetStatistics() override { m_monitor.reset(); }
+    std::vector<DropoutEvent> getDropoutEvents(int64_t after = 0) const override {
+        return m_monitor.getDropoutEvents(after);
+    }
+    bool setDeadlineWarningThreshold(double fraction) override;
+    bool publishStatistics(std::string name) override {
+        return m_monitor.publishStatistics(name, "jack",
+                                           m_inputMeter, m_outputMeter);
+    }
 
     std::string getStartupErrorString() const { return m_startupError; }
     
 protected:
-    void setup(bool connectRecord, bool connectPlayback);
-    int process(jack_nframes_t nframes);
-    int xrun();
-
-    static int processStatic(jack_nframes_t, void *);
-    static int xrunStatic(void *);
+    void setup();
+    void pruneRecordChannels();
+    void configureMixers();
+    void allocateScratch();
+    void updateLatencies(jack_latency_callback_mode_t mode);
+    int64_t getCycleFrameTime();
+
+    // JACKClient::Handler
+    void process(jack_nframes_t nframes) override;
+    void xrun() override;
+    void bufferSizeChanged(jack_nframes_t nframes) override;
+    void sampleRateChanged(jack_nframes_t rate) override;
+    void latencyChanged(jack_latency_callback_mode_t mode) override;
+    void freewheelChanged(bool freewheeling) override;
 
     Mode                        m_mode;
+    std::shared_ptr<JACKClient> m_jackClient;
     jack_client_t              *m_client;
     std::vector<jack_port_t *>  m_outputs;
     std::vector<jack_port_t *>  m_inputs;
-    jack_nframes_t              m_bufferSize;
-    jack_nframes_t              m_sampleRate;
+    std::vector<float *>        m_outputBuffers;
+    std::vector<float *>        m_inputBuffers;
+    std::vector<float *>        m_sourceBuffers;
+    std::vector<float *>        m_targetBuffers;
+    int                         m_sourceChannels;
+    int                         m_targetChannels;
+    ChannelMixer                m_outputMixer;
+    ChannelMixer                m_inputMixer;
+    float                     **m_scratch;
+    int                         m_scratchChannels;
+    int                         m_scratchSize;
+    bool                        m_connectRecord;
+    bool                        m_connectPlayback;
+    std::vector<int>            m_recordChannels;
+    std::vector<float>          m_gains;
+    std::vector<float>          m_peaks;
+    std::atomic<jack_nframes_t> m_bufferSize;
+    std::atomic<jack_nframes_t> m_sampleRate;
+    jack_nframes_t              m_inputLatency;
+    jack_nframes_t              m_outputLatency;
+    std::atomic<jack_nframes_t> m_lastFrameTime;
+    std::atomic<int64_t>        m_frameTimeBase;
+    std::atomic<bool>           m_xrunPending;
+    std::atomic<bool>           m_freewheeling;
+    std::atomic<bool>           m_connecting;
+    std::chrono::steady_clock::time_point m_lastLevelReport;
+    float                       m_heldInputPeaks[2];
+    float                       m_heldOutputPeaks[2];
+    CallbackMonitor             m_monitor;
+    std::atomic<double>         m_deadlineFraction;
     std::mutex                  m_mutex;
+    std::mutex                  m_scratchMutex;
     std::string                 m_startupError;
 
     JACKAudioIO(const JACKAudioIO &)=delete;
@@ -0,0 +1,281 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifdef HAVE_JACK
+
+#include "JACKClient.h"
+#include "DynamicJACK.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <thread>
+#include <chrono>
+
+using namespace std;
+
+namespace breakfastquay {
+
+static const char *const logComponent = "JACKClient";
+
+map<string, weak_ptr<JACKClient>> JACKClient::m_sharedClients;
+mutex JACKClient::m_sharedMutex;
+
+shared_ptr<JACKClient>
+JACKClient::acquire(string name, bool shared, string &errorString)
+{
+    unique_lock<mutex> sharedLock(m_sharedMutex, defer_lock);
+    
+    if (shared) {
+        sharedLock.lock();
+        auto itr = m_sharedClients.find(name);
+        if (itr != m_sharedClients.end()) {
+            if (auto existing = itr->second.lock()) {
+                BQAUDIOIO_LOG_INFO(logComponent, "Using existing shared client"
+                                   << logField("name", name));
+                return existing;
+            }
+        }
+    }
+    
+    JackOptions options = JackNullOption;
+    
+#if defined(HAVE_PORTAUDIO) || defined(HAVE_LIBPULSE)
+    options = JackNoStartServer;
+#endif
+
+    JackStatus status = JackStatus(0);
+    jack_client_t *client = jack_client_open(name.c_str(), options, &status);
+    if (!client) {
+        errorString = "Failed to connect to JACK server";
+        BQAUDIOIO_LOG_ERROR(logComponent, errorString
+                            << logField("status", int(status)));
+        return {};
+    }
+
+    shared_ptr<JACKClient> c(new JACKClient(name, client));
+    
+    jack_set_xrun_callback(client, xrunStatic, c.get());
+    jack_set_process_callback(client, processStatic, c.get());
+    jack_set_buffer_size_callback(client, bufferSizeChangedStatic, c.get());
+    jack_set_sample_rate_callback(client, sampleRateChangedStatic, c.get());
+    jack_set_latency_callback(client, latencyChangedStatic, c.get());
+    jack_set_freewheel_callback(client, freewheelChangedStatic, c.get());
+
+    if (jack_activate(client)) {
+        errorString = "Failed to activate JACK client";
+        BQAUDIOIO_LOG_ERROR(logComponent, errorString);
+        return {};
+    }
+
+    if (shared) {
+        c->m_shared = true;
+        m_sharedClients[name] = c;
+        BQAUDIOIO_LOG_INFO(logComponent, "Opened shared client"
+                           << logField("name", name));
+    }
+    
+    return c;
+}
+
+JACKClient::JACKClient(string name, jack_client_t *client) :
+    m_name(name),
+    m_shared(false),
+    m_client(client),
+    m_processHandlers(new HandlerList),
+    m_processCycle(0)
+{
+}
+
+JACKClient::~JACKClient()
+{
+    if (m_shared) {
+        lock_guard<mutex> guard(m_sharedMutex);
+        auto itr = m_sharedClients.find(m_name);
+        if (itr != m_sharedClients.end() && itr->second.expired()) {
+            m_sharedClients.erase(itr);
+        }
+    }
+    
+    jack_deactivate(m_client);
+    jack_client_close(m_client);
+    delete m_processHandlers.load();
+    BQAUDIOIO_LOG_INFO(logComponent, "Closed");
+}
+
+void
+JACKClient::addHandler(Handler *handler)
+{
+    lock_guard<mutex> guard(m_handlerMutex);
+    m_handlers.push_back(handler);
+    publishHandlers(new HandlerList(m_handlers));
+}
+
+void
+JACKClient::removeHandler(Handler *handler)
+{
+    // The other callbacks hold m_handlerMutex throughout, so once we
+    // have it, the handler can only be running in the process
+    // callback, and publishHandlers waits for that
+    lock_guard<mutex> guard(m_handlerMutex);
+    m_handlers.erase(remove(m_handlers.begin(), m_handlers.end(), handler),
+                     m_handlers.end());
+    publishHandlers(new HandlerList(m_handlers));
+}
+
+void
+JACKClient::publishHandlers(HandlerList *list)
+{
+    // Called with m_handlerMutex held. Once the new list is in place,
+    // a cycle that starts later can't see the old one; a cycle that
+    // is running when we swap might, so wait for the cycle count to
+    // move on before deleting the old list
+    HandlerList *old = m_processHandlers.exchange(list);
+    uint64_t cycle = m_processCycle;
+    if (cycle % 2 == 1) {
+        while (m_processCycle == cycle) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+    delete old;
+}
+
+jack_port_t *
+JACKClient::registerPort(string prefix, unsigned long flags)
+{
+    lock_guard<mutex> guard(m_portMutex);
+
+    // The used numbers are held in order, so the lowest unused one
+    // is found at the first gap
+    set<int> &used = m_usedPortNumbers[prefix];
+    int n = 1;
+    for (int u: used) {
+        if (u != n) break;
+        ++n;
+    }
+
+    string name = prefix + " " + to_string(n);
+    
+    jack_port_t *port = jack_port_register(m_client,
+                                           name.c_str(),
+                                           JACK_DEFAULT_AUDIO_TYPE,
+                                           flags,
+                                           0);
+    if (port) {
+        used.insert(n);
+        m_portNumbers[port] = { prefix, n };
+    }
+
+    return port;
+}
+
+void
+JACKClient::unregisterPort(jack_port_t *port)
+{
+    lock_guard<mutex> guard(m_portMutex);
+
+    auto itr = m_portNumbers.find(port);
+    if (itr != m_portNumbers.end()) {
+        m_usedPortNumbers[itr->second.first].erase(itr->second.second);
+        m_portNumbers.erase(itr);
+    }
+    
+    jack_port_unregister(m_client, port);
+}
+
+int
+JACKClient::process(jack_nframes_t nframes)
+{
+    // No lock here: the other callbacks hold m_handlerMutex while
+    // calling into the application, and we must not lose a cycle
+    // waiting for them. Marking the cycle before reading the list
+    // lets publishHandlers know when the list it replaced is free
+    ++m_processCycle;
+
+    for (auto h: *m_processHandlers.load()) {
+        h->process(nframes);
+    }
+
+    ++m_processCycle;
+    return 0;
+}
+
+int
+JACKClient::processStatic(jack_nframes_t nframes, void *arg)
+{
+    return ((JACKClient *)arg)->process(nframes);
+}
+
+int
+JACKClient::xrunStatic(void *arg)
+{
+    JACKClient *c = (JACKClient *)arg;
+    lock_guard<mutex> guard(c->m_handlerMutex);
+    for (auto h: c->m_handlers) h->xrun();
+    return 0;
+}
+
+int
+JACKClient::bufferSizeChangedStatic(jack_nframes_t nframes, void *arg)
+{
+    JACKClient *c = (JACKClient *)arg;
+    lock_guard<mutex> guard(c->m_handlerMutex);
+    for (auto h: c->m_handlers) h->bufferSizeChanged(nframes);
+    return 0;
+}
+
+int
+JACKClient::sampleRateChangedStatic(jack_nframes_t rate, void *arg)
+{
+    JACKClient *c = (JACKClient *)arg;
+    lock_guard<mutex> guard(c->m_handlerMutex);
+    for (auto h: c->m_handlers) h->sampleRateChanged(rate);
+    return 0;
+}
+
+void
+JACKClient::latencyChangedStatic(jack_latency_callback_mode_t mode, void *arg)
+{
+    JACKClient *c = (JACKClient *)arg;
+    lock_guard<mutex> guard(c->m_handlerMutex);
+    for (auto h: c->m_handlers) h->latencyChanged(mode);
+}
+
+void
+JACKClient::freewheelChangedStatic(int starting, void *arg)
+{
+    JACKClient *c = (JACKClient *)arg;
+    lock_guard<mutex> guard(c->m_handlerMutex);
+    for (auto h: c->m_handlers) h->freewheelChanged(starting != 0);
+}
+
+}
+
+#endif /* HAVE_JACK */
@@ -0,0 +1,147 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_JACK_CLIENT_H_
+#define BQAUDIOIO_JACK_CLIENT_H_
+
+#ifdef HAVE_JACK
+
+#include <jack/jack.h>
+
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Owner of a single JACK client connection and all of its
+ * callbacks. Any number of port groups (in practice, JACKAudioIO
+ * objects) may be attached to one client as handlers, and a single
+ * process callback dispatches to each of them in turn.
+ *
+ * A client may be private to one handler, or shared between all
+ * handlers that ask for a shared client with the same client name.
+ * Sharing means the JACK server has only one client to schedule per
+ * cycle, however many streams the application has open.
+ */
+class JACKClient
+{
+public:
+    class Handler
+    {
+    public:
+        virtual ~Handler() { }
+        virtual void process(jack_nframes_t nframes) = 0;
+        virtual void xrun() = 0;
+        virtual void bufferSizeChanged(jack_nframes_t nframes) = 0;
+        virtual void sampleRateChanged(jack_nframes_t rate) = 0;
+        virtual void latencyChanged(jack_latency_callback_mode_t mode) = 0;
+        virtual void freewheelChanged(bool freewheeling) = 0;
+    };
+
+    /**
+     * Open and activate a client with the given name, or, if shared
+     * is true and a shared client of that name is already open,
+     * return that one. Return null and set errorString on failure.
+     * The client is closed when the last reference is released.
+     */
+    static std::shared_ptr<JACKClient> acquire(std::string name,
+                                               bool shared,
+                                               std::string &errorString);
+
+    ~JACKClient();
+
+    jack_client_t *getClient() const { return m_client; }
+
+    void addHandler(Handler *);
+
+    /**
+     * Remove a handler. On return the handler is guaranteed not to
+     * be called again. If a process cycle is under way, this waits
+     * for it to finish.
+     */
+    void removeHandler(Handler *);
+
+    /**
+     * Register a port named with the given prefix and the lowest
+     * number not already in use on this client, e.g. "out 3".
+     */
+    jack_port_t *registerPort(std::string prefix, unsigned long flags);
+    void unregisterPort(jack_port_t *);
+    
+private:
+    JACKClient(std::string name, jack_client_t *client);
+
+    int process(jack_nframes_t nframes);
+    
+    static int processStatic(jack_nframes_t, void *);
+    static int xrunStatic(void *);
+    static int bufferSizeChangedStatic(jack_nframes_t, void *);
+    static int sampleRateChangedStatic(jack_nframes_t, void *);
+    static void latencyChangedStatic(jack_latency_callback_mode_t, void *);
+    static void freewheelChangedStatic(int, void *);
+
+    typedef std::vector<Handler *> HandlerList;
+
+    void publishHandlers(HandlerList *);
+
+    std::string m_name;
+    bool m_shared;
+    jack_client_t *m_client;
+    HandlerList m_handlers; // guarded by m_handlerMutex
+
+    // Immutable copy of m_handlers for the process callback, which
+    // takes no lock. m_processCycle is odd while a cycle is running
+    std::atomic<HandlerList *> m_processHandlers;
+    std::atomic<uint64_t> m_processCycle;
+    std::map<jack_port_t *, std::pair<std::string, int>> m_portNumbers;
+    std::map<std::string, std::set<int>> m_usedPortNumbers;
+    std::mutex m_handlerMutex;
+    std::mutex m_portMutex;
+
+    static std::map<std::string, std::weak_ptr<JACKClient>> m_sharedClients;
+    static std::mutex m_sharedMutex;
+    
+    JACKClient(const JACKClient &)=delete;
+    JACKClient &operator=(const JACKClient &)=delete;
+};
+
+}
+
+#endif /* HAVE_JACK */
+
+#endif
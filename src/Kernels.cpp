@@ -0,0 +1,570 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "Kernels.h"
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BQAUDIOIO_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define BQAUDIOIO_USE_AVX 1
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define BQAUDIOIO_USE_AVX2 1
+#endif
+
+namespace breakfastquay {
+
+#ifdef BQAUDIOIO_USE_SSE2
+
+static inline __m128
+abs_ps(const __m128 x)
+{
+    return _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+}
+
+static inline float
+hmax_ps(const __m128 x)
+{
+    __m128 m = _mm_max_ps(x, _mm_movehl_ps(x, x));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+#endif
+
+#ifdef BQAUDIOIO_USE_AVX
+
+static inline __m256
+abs_ps(const __m256 x)
+{
+    return _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+}
+
+static inline float
+hmax_ps(const __m256 x)
+{
+    return hmax_ps(_mm_max_ps(_mm256_castps256_ps128(x),
+                              _mm256_extractf128_ps(x, 1)));
+}
+
+#endif
+
+// Scale one channel from src into dst (which may be the same
+// pointer) and return its absolute peak
+static float
+gain_peak(float *const dst, const float *const src, const int count,
+          const float gain)
+{
+    float peak = 0.f;
+    int i = 0;
+
+#ifdef BQAUDIOIO_USE_AVX
+    {
+        const __m256 g = _mm256_set1_ps(gain);
+        __m256 p = _mm256_setzero_ps();
+        for (; i + 8 <= count; i += 8) {
+            __m256 x = _mm256_mul_ps(_mm256_loadu_ps(src + i), g);
+            _mm256_storeu_ps(dst + i, x);
+            p = _mm256_max_ps(p, abs_ps(x));
+        }
+        peak = hmax_ps(p);
+    }
+#endif
+
+#ifdef BQAUDIOIO_USE_SSE2
+    {
+        const __m128 g = _mm_set1_ps(gain);
+        __m128 p = _mm_setzero_ps();
+        for (; i + 4 <= count; i += 4) {
+            __m128 x = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+            _mm_storeu_ps(dst + i, x);
+            p = _mm_max_ps(p, abs_ps(x));
+        }
+        float p4 = hmax_ps(p);
+        if (p4 > peak) peak = p4;
+    }
+#endif
+
+    for (; i < count; ++i) {
+        float x = src[i] * gain;
+        dst[i] = x;
+        float a = fabsf(x);
+        if (a > peak) peak = a;
+    }
+
+    return peak;
+}
+
+static void
+interleave_gain_peak_stereo(float *const dst,
+                            const float *const l,
+                            const float *const r,
+                            const int count,
+                            const float *const gains,
+                            float *const peaks)
+{
+    float pl = 0.f, pr = 0.f;
+    int i = 0;
+
+#ifdef BQAUDIOIO_USE_AVX
+    {
+        const __m256 gl = _mm256_set1_ps(gains[0]);
+        const __m256 gr = _mm256_set1_ps(gains[1]);
+        __m256 vpl = _mm256_setzero_ps(), vpr = _mm256_setzero_ps();
+        for (; i + 8 <= count; i += 8) {
+            __m256 a = _mm256_mul_ps(_mm256_loadu_ps(l + i), gl);
+            __m256 b = _mm256_mul_ps(_mm256_loadu_ps(r + i), gr);
+            vpl = _mm256_max_ps(vpl, abs_ps(a));
+            vpr = _mm256_max_ps(vpr, abs_ps(b));
+            // unpack works within 128-bit lanes, so the halves need
+            // to be recombined afterwards
+            __m256 lo = _mm256_unpacklo_ps(a, b);
+            __m256 hi = _mm256_unpackhi_ps(a, b);
+            _mm256_storeu_ps(dst + i*2, _mm256_permute2f128_ps(lo, hi, 0x20));
+            _mm256_storeu_ps(dst + i*2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+        }
+        pl = hmax_ps(vpl);
+        pr = hmax_ps(vpr);
+    }
+#endif
+
+#ifdef BQAUDIOIO_USE_SSE2
+    {
+        const __m128 gl = _mm_set1_ps(gains[0]);
+        const __m128 gr = _mm_set1_ps(gains[1]);
+        __m128 vpl = _mm_setzero_ps(), vpr = _mm_setzero_ps();
+        for (; i + 4 <= count; i += 4) {
+            __m128 a = _mm_mul_ps(_mm_loadu_ps(l + i), gl);
+            __m128 b = _mm_mul_ps(_mm_loadu_ps(r + i), gr);
+            vpl = _mm_max_ps(vpl, abs_ps(a));
+            vpr = _mm_max_ps(vpr, abs_ps(b));
+            _mm_storeu_ps(dst + i*2, _mm_unpacklo_ps(a, b));
+            _mm_storeu_ps(dst + i*2 + 4, _mm_unpackhi_ps(a, b));
+        }
+        float p = hmax_ps(vpl);
+        if (p > pl) pl = p;
+        p = hmax_ps(vpr);
+        if (p > pr) pr = p;
+    }
+#endif
+    
+    for (; i < count; ++i) {
+        float a = l[i] * gains[0];
+        float b = r[i] * gains[1];
+        dst[i*2] = a;
+        dst[i*2 + 1] = b;
+        if (fabsf(a) > pl) pl = fabsf(a);
+        if (fabsf(b) > pr) pr = fabsf(b);
+    }
+
+    peaks[0] = pl;
+    peaks[1] = pr;
+}
+
+void
+v_interleave_gain_peak(float *const dst,
+                       const float *const *const src,
+                       const int channels,
+                       const int count,
+                       const float *const gains,
+                       float *const peaks)
+{
+    if (channels == 1) {
+        peaks[0] = gain_peak(dst, src[0], count, gains[0]);
+        return;
+    }
+
+    if (channels == 2) {
+        interleave_gain_peak_stereo(dst, src[0], src[1], count, gains, peaks);
+        return;
+    }
+
+    int c = 0;
+
+#ifdef BQAUDIOIO_USE_SSE2
+    // Four channels at a time, transposing each 4x4 block of samples
+    // from channel-major to frame-major order in registers
+    for (; c + 4 <= channels; c += 4) {
+        const float *const s0 = src[c], *const s1 = src[c+1];
+        const float *const s2 = src[c+2], *const s3 = src[c+3];
+        const __m128 g0 = _mm_set1_ps(gains[c]), g1 = _mm_set1_ps(gains[c+1]);
+        const __m128 g2 = _mm_set1_ps(gains[c+2]), g3 = _mm_set1_ps(gains[c+3]);
+        __m128 p0 = _mm_setzero_ps(), p1 = _mm_setzero_ps();
+        __m128 p2 = _mm_setzero_ps(), p3 = _mm_setzero_ps();
+        int i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128 a = _mm_mul_ps(_mm_loadu_ps(s0 + i), g0);
+            __m128 b = _mm_mul_ps(_mm_loadu_ps(s1 + i), g1);
+            __m128 x = _mm_mul_ps(_mm_loadu_ps(s2 + i), g2);
+            __m128 y = _mm_mul_ps(_mm_loadu_ps(s3 + i), g3);
+            p0 = _mm_max_ps(p0, abs_ps(a));
+            p1 = _mm_max_ps(p1, abs_ps(b));
+            p2 = _mm_max_ps(p2, abs_ps(x));
+            p3 = _mm_max_ps(p3, abs_ps(y));
+            _MM_TRANSPOSE4_PS(a, b, x, y);
+            float *const d = dst + i * channels + c;
+            _mm_storeu_ps(d, a);
+            _mm_storeu_ps(d + channels, b);
+            _mm_storeu_ps(d + channels * 2, x);
+            _mm_storeu_ps(d + channels * 3, y);
+        }
+        float pk[4] = { hmax_ps(p0), hmax_ps(p1), hmax_ps(p2), hmax_ps(p3) };
+        for (; i < count; ++i) {
+            for (int k = 0; k < 4; ++k) {
+                float v = src[c+k][i] * gains[c+k];
+                dst[i * channels + c + k] = v;
+                if (fabsf(v) > pk[k]) pk[k] = fabsf(v);
+            }
+        }
+        for (int k = 0; k < 4; ++k) {
+            peaks[c+k] = pk[k];
+        }
+    }
+#endif
+
+    for (; c < channels; ++c) {
+        const float *const s = src[c];
+        const float g = gains[c];
+        float peak = 0.f;
+        for (int i = 0; i < count; ++i) {
+            float v = s[i] * g;
+            dst[i * channels + c] = v;
+            if (fabsf(v) > peak) peak = fabsf(v);
+        }
+        peaks[c] = peak;
+    }
+}
+
+void
+v_gain_peak_interleaved(float *const buf,
+                        const int channels,
+                        const int count,
+                        const float *const gains,
+                        float *const peaks)
+{
+    for (int c = 0; c < channels; ++c) {
+        peaks[c] = 0.f;
+    }
+    
+    int i = 0;
+    
+#ifdef BQAUDIOIO_USE_SSE2
+    // When the channel count divides the vector width, each vector
+    // holds whole frames and the gains and peaks repeat in a fixed
+    // pattern across its lanes
+    if (channels == 1 || channels == 2 || channels == 4) {
+        float g[4], pk[4];
+        for (int k = 0; k < 4; ++k) g[k] = gains[k % channels];
+        const __m128 gv = _mm_loadu_ps(g);
+        __m128 pv = _mm_setzero_ps();
+        const int total = count * channels;
+        for (; i + 4 <= total; i += 4) {
+            __m128 x = _mm_mul_ps(_mm_loadu_ps(buf + i), gv);
+            _mm_storeu_ps(buf + i, x);
+            pv = _mm_max_ps(pv, abs_ps(x));
+        }
+        _mm_storeu_ps(pk, pv);
+        for (int k = 0; k < 4; ++k) {
+            if (pk[k] > peaks[k % channels]) peaks[k % channels] = pk[k];
+        }
+        i /= channels;
+    }
+#endif
+
+    for (; i < count; ++i) {
+        float *const frame = buf + i * channels;
+        for (int c = 0; c < channels; ++c) {
+            float v = frame[c] * gains[c];
+            frame[c] = v;
+            if (fabsf(v) > peaks[c]) peaks[c] = fabsf(v);
+        }
+    }
+}
+
+void
+v_gain_peak_channels(float *const *const buf,
+                     const int channels,
+                     const int count,
+                     const float *const gains,
+                     float *const peaks)
+{
+    for (int c = 0; c < channels; ++c) {
+        peaks[c] = gain_peak(buf[c], buf[c], count, gains[c]);
+    }
+}
+
+void
+v_mix_row(float *const dst,
+          const float *const *const src,
+          const int *const inputs,
+          const float *const gains,
+          const int terms,
+          const int count)
+{
+    int i = 0;
+
+    // Accumulate every term for a run of samples in registers, so
+    // that dst is written once and read not at all
+
+#ifdef BQAUDIOIO_USE_AVX
+    for (; i + 8 <= count; i += 8) {
+        __m256 acc = _mm256_mul_ps(_mm256_loadu_ps(src[inputs[0]] + i),
+                                   _mm256_set1_ps(gains[0]));
+        for (int t = 1; t < terms; ++t) {
+            acc = _mm256_add_ps
+                (acc, _mm256_mul_ps(_mm256_loadu_ps(src[inputs[t]] + i),
+                                    _mm256_set1_ps(gains[t])));
+        }
+        _mm256_storeu_ps(dst + i, acc);
+    }
+#endif
+
+#ifdef BQAUDIOIO_USE_SSE2
+    for (; i + 4 <= count; i += 4) {
+        __m128 acc = _mm_mul_ps(_mm_loadu_ps(src[inputs[0]] + i),
+                                _mm_set1_ps(gains[0]));
+        for (int t = 1; t < terms; ++t) {
+            acc = _mm_add_ps
+                (acc, _mm_mul_ps(_mm_loadu_ps(src[inputs[t]] + i),
+                                 _mm_set1_ps(gains[t])));
+        }
+        _mm_storeu_ps(dst + i, acc);
+    }
+#endif
+
+    for (; i < count; ++i) {
+        float acc = src[inputs[0]][i] * gains[0];
+        for (int t = 1; t < terms; ++t) {
+            acc += src[inputs[t]][i] * gains[t];
+        }
+        dst[i] = acc;
+    }
+}
+
+void
+v_gather_channels(float *const *const dst,
+                  const float *const src,
+                  const int stride,
+                  const int *const channels,
+                  const int selected,
+                  const int count)
+{
+    int i = 0;
+
+#ifdef BQAUDIOIO_USE_AVX2
+    // Gather eight frames of one channel at a time
+    const __m256i step = _mm256_mullo_epi32
+        (_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    for (; i + 8 <= count; i += 8) {
+        const float *const base = src + i * stride;
+        for (int k = 0; k < selected; ++k) {
+            __m256i idx = _mm256_add_epi32(step, _mm256_set1_epi32(channels[k]));
+            _mm256_storeu_ps(dst[k] + i, _mm256_i32gather_ps(base, idx, 4));
+        }
+    }
+#endif
+
+    // Frame by frame, so that each frame's cache lines are visited
+    // only once however many channels are selected from it
+    for (; i < count; ++i) {
+        const float *const frame = src + i * stride;
+        for (int k = 0; k < selected; ++k) {
+            dst[k][i] = frame[channels[k]];
+        }
+    }
+}
+
+void
+v_level_stats(const float *const src,
+              const int count,
+              float &peak,
+              double &sumsq,
+              int64_t &clips)
+{
+    float p = peak;
+    float ss = 0.f;
+    int64_t cl = 0;
+    int i = 0;
+
+    // Clips are counted by adding 1.0 per lane under the comparison
+    // mask, which is exact for any block shorter than 2^24 samples
+
+#ifdef BQAUDIOIO_USE_AVX
+    {
+        const __m256 one = _mm256_set1_ps(1.f);
+        __m256 vp = _mm256_setzero_ps();
+        __m256 vss = _mm256_setzero_ps();
+        __m256 vcl = _mm256_setzero_ps();
+        for (; i + 8 <= count; i += 8) {
+            __m256 x = _mm256_loadu_ps(src + i);
+            __m256 a = abs_ps(x);
+            vp = _mm256_max_ps(vp, a);
+            vss = _mm256_add_ps(vss, _mm256_mul_ps(x, x));
+            vcl = _mm256_add_ps(vcl, _mm256_and_ps
+                                (_mm256_cmp_ps(a, one, _CMP_GE_OQ), one));
+        }
+        float v[8];
+        float q = hmax_ps(vp);
+        if (q > p) p = q;
+        _mm256_storeu_ps(v, vss);
+        for (int k = 0; k < 8; ++k) ss += v[k];
+        _mm256_storeu_ps(v, vcl);
+        for (int k = 0; k < 8; ++k) cl += int64_t(v[k]);
+    }
+#endif
+
+#ifdef BQAUDIOIO_USE_SSE2
+    {
+        const __m128 one = _mm_set1_ps(1.f);
+        __m128 vp = _mm_setzero_ps();
+        __m128 vss = _mm_setzero_ps();
+        __m128 vcl = _mm_setzero_ps();
+        for (; i + 4 <= count; i += 4) {
+            __m128 x = _mm_loadu_ps(src + i);
+            __m128 a = abs_ps(x);
+            vp = _mm_max_ps(vp, a);
+            vss = _mm_add_ps(vss, _mm_mul_ps(x, x));
+            vcl = _mm_add_ps(vcl, _mm_and_ps(_mm_cmpge_ps(a, one), one));
+        }
+        float v[4];
+        float q = hmax_ps(vp);
+        if (q > p) p = q;
+        _mm_storeu_ps(v, vss);
+        for (int k = 0; k < 4; ++k) ss += v[k];
+        _mm_storeu_ps(v, vcl);
+        for (int k = 0; k < 4; ++k) cl += int64_t(v[k]);
+    }
+#endif
+
+    for (; i < count; ++i) {
+        float a = fabsf(src[i]);
+        if (a > p) p = a;
+        ss += src[i] * src[i];
+        if (a >= 1.f) ++cl;
+    }
+
+    peak = p;
+    sumsq += ss;
+    clips += cl;
+}
+
+// BS.1770-4 Annex 2 interpolation filter, as four phases of twelve
+// taps. Tap j of each phase applies to the sample j before the
+// current one.
+static const float truePeakTaps[4][12] = {
+    {  0.0017089843750f,  0.0109863281250f, -0.0196533203125f,
+       0.0332031250000f, -0.0594482421875f,  0.1373291015625f,
+       0.9721679687500f, -0.1022949218750f,  0.0476074218750f,
+      -0.0266113281250f,  0.0148925781250f, -0.0083007812500f },
+    { -0.0291748046875f,  0.0292968750000f, -0.0517578125000f,
+       0.0891113281250f, -0.1665039062500f,  0.4650878906250f,
+       0.7797851562500f, -0.2003173828125f,  0.1015625000000f,
+      -0.0582275390625f,  0.0330810546875f, -0.0189208984375f },
+    { -0.0189208984375f,  0.0330810546875f, -0.0582275390625f,
+       0.1015625000000f, -0.2003173828125f,  0.7797851562500f,
+       0.4650878906250f, -0.1665039062500f,  0.0891113281250f,
+      -0.0517578125000f,  0.0292968750000f, -0.0291748046875f },
+    { -0.0083007812500f,  0.0148925781250f, -0.0266113281250f,
+       0.0476074218750f, -0.1022949218750f,  0.9721679687500f,
+       0.1373291015625f, -0.0594482421875f,  0.0332031250000f,
+      -0.0196533203125f,  0.0109863281250f,  0.0017089843750f }
+};
+
+float
+v_true_peak_4x(const float *const src,
+               const int count)
+{
+    float peak = 0.f;
+    int i = 0;
+
+    // Each phase is filtered across a run of consecutive outputs,
+    // so every load is of contiguous input and no shuffling is
+    // needed to interleave the phases
+
+#ifdef BQAUDIOIO_USE_AVX
+    {
+        __m256 vp = _mm256_setzero_ps();
+        for (; i + 8 <= count; i += 8) {
+            for (int k = 0; k < 4; ++k) {
+                __m256 acc = _mm256_setzero_ps();
+                for (int j = 0; j < 12; ++j) {
+                    acc = _mm256_add_ps
+                        (acc, _mm256_mul_ps(_mm256_loadu_ps(src + i - j),
+                                            _mm256_set1_ps(truePeakTaps[k][j])));
+                }
+                vp = _mm256_max_ps(vp, abs_ps(acc));
+            }
+        }
+        peak = hmax_ps(vp);
+    }
+#endif
+
+#ifdef BQAUDIOIO_USE_SSE2
+    {
+        __m128 vp = _mm_setzero_ps();
+        for (; i + 4 <= count; i += 4) {
+            for (int k = 0; k < 4; ++k) {
+                __m128 acc = _mm_setzero_ps();
+                for (int j = 0; j < 12; ++j) {
+                    acc = _mm_add_ps
+                        (acc, _mm_mul_ps(_mm_loadu_ps(src + i - j),
+                                         _mm_set1_ps(truePeakTaps[k][j])));
+                }
+                vp = _mm_max_ps(vp, abs_ps(acc));
+            }
+        }
+        float q = hmax_ps(vp);
+        if (q > peak) peak = q;
+    }
+#endif
+
+    for (; i < count; ++i) {
+        for (int k = 0; k < 4; ++k) {
+            float acc = 0.f;
+            for (int j = 0; j < 12; ++j) {
+                acc += src[i - j] * truePeakTaps[k][j];
+            }
+            if (fabsf(acc) > peak) peak = fabsf(acc);
+        }
+    }
+
+    return peak;
+}
+
+}
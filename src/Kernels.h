@@ -0,0 +1,140 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_KERNELS_H
+#define BQAUDIOIO_KERNELS_H
+
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Sample-processing kernels shared by the audio drivers, each doing
+ * in a single pass over the data what would otherwise take several
+ * (scale, meter, interleave). They use AVX or SSE2 when the compiler
+ * is targeting those instruction sets, and plain C++ otherwise.
+ */
+
+/**
+ * Scale each of the given non-interleaved source channels by its
+ * entry in gains, writing the results interleaved into dst, which
+ * must have room for channels * count samples. Also write into
+ * peaks, which must have room for channels values, the absolute
+ * peak of each scaled channel.
+ */
+void v_interleave_gain_peak(float *const dst,
+                            const float *const *const src,
+                            const int channels,
+                            const int count,
+                            const float *const gains,
+                            float *const peaks);
+
+/**
+ * Scale each channel of the given interleaved buffer in place by its
+ * entry in gains, and write into peaks, which must have room for
+ * channels values, the absolute peak of each scaled channel.
+ */
+void v_gain_peak_interleaved(float *const buf,
+                             const int channels,
+                             const int count,
+                             const float *const gains,
+                             float *const peaks);
+
+/**
+ * Scale each of the given non-interleaved channels in place by its
+ * entry in gains, and write into peaks, which must have room for
+ * channels values, the absolute peak of each scaled channel.
+ */
+void v_gain_peak_channels(float *const *const buf,
+                          const int channels,
+                          const int count,
+                          const float *const gains,
+                          float *const peaks);
+
+/**
+ * Write into dst the sum of terms scaled source channels: channel
+ * src[inputs[t]] scaled by gains[t], for each t. This is one row of
+ * a sparse mixing matrix. terms must be at least 1, and dst must not
+ * be one of the source channels.
+ */
+void v_mix_row(float *const dst,
+               const float *const *const src,
+               const int *const inputs,
+               const float *const gains,
+               const int terms,
+               const int count);
+
+/**
+ * Extract the given selection of channels from the interleaved
+ * buffer src, which has stride channels per frame, writing channel
+ * channels[k] into dst[k] for each k below selected. Only the
+ * selected channels are read and written, so the cost is in
+ * proportion to the selection rather than to the stride. Uses AVX2
+ * gathers where available.
+ */
+void v_gather_channels(float *const *const dst,
+                       const float *const src,
+                       const int stride,
+                       const int *const channels,
+                       const int selected,
+                       const int count);
+
+/**
+ * Accumulate level statistics for one channel of count samples:
+ * raise peak to the absolute peak of src if that is higher, add the
+ * sum of the squares of src to sumsq, and add to clips the number of
+ * samples whose absolute value is 1.0 or more.
+ */
+void v_level_stats(const float *const src,
+                   const int count,
+                   float &peak,
+                   double &sumsq,
+                   int64_t &clips);
+
+/**
+ * Number of samples of history that v_true_peak_4x reads before the
+ * start of its input.
+ */
+const int v_true_peak_history = 11;
+
+/**
+ * Return the absolute peak of src upsampled 4x with the 48-tap
+ * polyphase interpolator of ITU-R BS.1770-4, Annex 2. The filter
+ * reads the v_true_peak_history samples preceding src, so src must
+ * point that far into a buffer whose start holds the end of the
+ * previous block (or zeros).
+ */
+float v_true_peak_4x(const float *const src,
+                     const int count);
+
+}
+
+#endif
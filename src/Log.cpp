@@ -41,6 +41,8 @@ namespace breakfastquay {
 static mutex cbMutex;
 static AudioFactory::LogCallback *cb = nullptr;
 
+std::atomic<int> Log::m_level(int(Log::Level::Info));
+
 void
 Log::setLogCallback(AudioFactory::LogCallback *callback)
 {
@@ -49,12 +51,69 @@ Log::setLogCallback(AudioFactory::LogCallback *callback)
 }
 
 void
-Log::log(string message)
+Log::setLevel(Level level)
+{
+    m_level = int(level);
+}
+
+void
+Log::log(const AudioFactory::LogRecord &record)
 {
     lock_guard<mutex> guard(cbMutex);
-    if (cb) cb->log(message);
-    else cerr << message << endl;
+    if (cb) cb->logRecord(record);
+    else cerr << record.toString() << endl;
+}
+
+LogMessage::LogMessage(Log::Level level, const char *component)
+{
+    m_record.level = level;
+    m_record.component = component;
 }
 
+LogMessage::~LogMessage()
+{
+    m_record.message = m_stream.str();
+    Log::log(m_record);
+}
+
+static bool
+needsQuoting(const string &value)
+{
+    if (value == "") return true;
+    for (char c : value) {
+        if (c == ' ' || c == '"' || c == '\t' || c == '\n') return true;
+    }
+    return false;
 }
 
+string
+AudioFactory::LogRecord::toString() const
+{
+    ostringstream os;
+    if (component != "") {
+        os << component << ": ";
+    }
+    switch (level) {
+    case LogLevel::Debug: os << "DEBUG: "; break;
+    case LogLevel::Info: break;
+    case LogLevel::Warning: os << "WARNING: "; break;
+    case LogLevel::Error: os << "ERROR: "; break;
+    }
+    os << message;
+    if (!fields.empty()) {
+        os << " [";
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (i > 0) os << " ";
+            os << fields[i].first << "=";
+            if (needsQuoting(fields[i].second)) {
+                os << "\"" << fields[i].second << "\"";
+            } else {
+                os << fields[i].second;
+            }
+        }
+        os << "]";
+    }
+    return os.str();
+}
+
+}
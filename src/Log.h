@@ -34,14 +34,118 @@
 
 #include "AudioFactory.h"
 
+#include <atomic>
+#include <sstream>
+
 namespace breakfastquay {
 
 class Log {
 public:
+    typedef AudioFactory::LogLevel Level;
+    
     static void setLogCallback(AudioFactory::LogCallback *callback);
-    static void log(std::string message);
+    static void setLevel(Level level);
+
+    /**
+     * Return true if messages at the given level are being logged.
+     * Cheap enough to call anywhere, including on the audio thread.
+     */
+    static bool isEnabled(Level level) {
+        return int(level) >= m_level.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Send a record to the log callback, or to cerr if there is
+     * none, regardless of level.
+     */
+    static void log(const AudioFactory::LogRecord &record);
+
+private:
+    static std::atomic<int> m_level;
+};
+
+/**
+ * A named value to accompany a log message, added to a LogMessage
+ * with <<. Use logField to make one.
+ */
+template <typename T>
+struct LogField {
+    const char *key;
+    const T &value;
+};
+
+template <typename T>
+LogField<T> logField(const char *key, const T &value) {
+    return { key, value };
+}
+
+/**
+ * Builder for a single log record: text and fields are added with
+ * <<, and the record is sent when the builder is destroyed. Use
+ * through the BQAUDIOIO_LOG macros, which only construct a builder,
+ * and so only evaluate the expressions to be logged, if the level is
+ * enabled.
+ */
+class LogMessage {
+public:
+    LogMessage(Log::Level level, const char *component);
+    ~LogMessage();
+
+    template <typename T>
+    LogMessage &operator<<(const T &t) {
+        m_stream << t;
+        return *this;
+    }
+
+    template <typename T>
+    LogMessage &operator<<(const LogField<T> &field) {
+        std::ostringstream os;
+        os << field.value;
+        m_record.fields.push_back({ field.key, os.str() });
+        return *this;
+    }
+    
+private:
+    AudioFactory::LogRecord m_record;
+    std::ostringstream m_stream;
+
+    LogMessage(const LogMessage &)=delete;
+    LogMessage &operator=(const LogMessage &)=delete;
 };
 
 }
 
+/**
+ * Log a message at the given level from the named component, where
+ * expr is a sequence of values and logFields joined with <<, for
+ * example
+ *
+ *   BQAUDIOIO_LOG_INFO("PortAudioIO", "opened stream"
+ *                      << logField("rate", m_sampleRate));
+ */
+#define BQAUDIOIO_LOG(level, component, expr)                           \
+    do {                                                                \
+        if (::breakfastquay::Log::isEnabled(level)) {                   \
+            ::breakfastquay::LogMessage(level, component) << expr;      \
+        }                                                               \
+    } while (0)
+
+#define BQAUDIOIO_LOG_ERROR(component, expr)                            \
+    BQAUDIOIO_LOG(::breakfastquay::AudioFactory::LogLevel::Error,       \
+                  component, expr)
+#define BQAUDIOIO_LOG_WARNING(component, expr)                          \
+    BQAUDIOIO_LOG(::breakfastquay::AudioFactory::LogLevel::Warning,     \
+                  component, expr)
+#define BQAUDIOIO_LOG_INFO(component, expr)                             \
+    BQAUDIOIO_LOG(::breakfastquay::AudioFactory::LogLevel::Info,        \
+                  component, expr)
+
+#ifdef BQAUDIOIO_NO_DEBUG_LOG
+#define BQAUDIOIO_LOG_DEBUG(component, expr) do { } while (0)
+#else
+#define BQAUDIOIO_LOG_DEBUG(component, expr)                            \
+    BQAUDIOIO_LOG(::breakfastquay::AudioFactory::LogLevel::Debug,       \
+                  component, expr)
+#endif
+
 #endif
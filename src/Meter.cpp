@@ -0,0 +1,222 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "Meter.h"
+#include "Kernels.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace breakfastquay {
+
+// Samples are copied into each channel's buffer behind the filter
+// history in chunks of this many, so the buffer size is independent
+// of the block size
+static const int chunkSize = 256;
+
+// Set on the middle slot index when it holds results not yet read
+static const int freshBit = 4;
+
+Meter::Meter() :
+    m_channels(0),
+    m_middle(1),
+    m_back(0),
+    m_front(2),
+    m_consumed(false)
+{
+}
+
+Meter::~Meter()
+{
+}
+
+void
+Meter::configure(int channels)
+{
+    std::lock_guard<std::mutex> guard(m_readMutex);
+
+    if (channels < 0) channels = 0;
+    m_channels = channels;
+
+    m_state.resize(channels);
+    for (Channel &ch : m_state) {
+        ch.buffer.assign(v_true_peak_history + chunkSize, 0.f);
+        ch.peak = 0.f;
+        ch.sumsq = 0.0;
+        ch.frames = 0;
+        ch.truePeak = 0.f;
+        ch.clips = 0;
+        ch.blockPeak = 0.f;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        m_slots[i].assign(channels, ChannelLevels());
+    }
+    m_back = 0;
+    m_middle = 1;
+    m_front = 2;
+    m_consumed = false;
+}
+
+void
+Meter::begin()
+{
+    // Start a new accumulation if the reader has taken the previous
+    // one. A snapshot published while the reader was taking the one
+    // before may overlap it, which can only extend a peak hold by a
+    // block.
+    if (!m_consumed.exchange(false)) return;
+    for (Channel &ch : m_state) {
+        ch.peak = 0.f;
+        ch.sumsq = 0.0;
+        ch.frames = 0;
+        ch.truePeak = 0.f;
+    }
+}
+
+void
+Meter::processChannel(Channel &ch, const float *src, int stride, int count)
+{
+    float *const buf = ch.buffer.data();
+    float *const chunk = buf + v_true_peak_history;
+
+    float blockPeak = 0.f;
+    
+    for (int done = 0; done < count; ) {
+
+        int n = count - done;
+        if (n > chunkSize) n = chunkSize;
+
+        if (stride == 1) {
+            memcpy(chunk, src + done, n * sizeof(float));
+        } else {
+            const float *const from = src + done * stride;
+            for (int i = 0; i < n; ++i) {
+                chunk[i] = from[i * stride];
+            }
+        }
+
+        v_level_stats(chunk, n, blockPeak, ch.sumsq, ch.clips);
+
+        float tp = v_true_peak_4x(chunk, n);
+        if (tp > ch.truePeak) ch.truePeak = tp;
+
+        // The last samples of this chunk are the history for the next
+        memmove(buf, buf + n, v_true_peak_history * sizeof(float));
+
+        done += n;
+    }
+
+    ch.frames += count;
+    ch.blockPeak = blockPeak;
+    if (blockPeak > ch.peak) ch.peak = blockPeak;
+}
+
+void
+Meter::process(const float *const *buffers, int channels, int count)
+{
+    if (channels > m_channels) channels = m_channels;
+    if (channels == 0 || count <= 0) return;
+
+    begin();
+    for (int c = 0; c < channels; ++c) {
+        processChannel(m_state[c], buffers[c], 1, count);
+    }
+    publish();
+}
+
+void
+Meter::processInterleaved(const float *buffer, int channels, int count)
+{
+    int metered = channels;
+    if (metered > m_channels) metered = m_channels;
+    if (metered == 0 || count <= 0) return;
+
+    begin();
+    for (int c = 0; c < metered; ++c) {
+        processChannel(m_state[c], buffer + c, channels, count);
+    }
+    publish();
+}
+
+void
+Meter::publish()
+{
+    std::vector<ChannelLevels> &slot = m_slots[m_back];
+    for (int c = 0; c < m_channels; ++c) {
+        const Channel &ch = m_state[c];
+        slot[c].peak = ch.peak;
+        slot[c].rms = ch.frames > 0 ? float(sqrt(ch.sumsq / double(ch.frames))) : 0.f;
+        slot[c].truePeak = ch.truePeak;
+        slot[c].clipCount = ch.clips;
+    }
+    m_back = m_middle.exchange(m_back | freshBit) & ~freshBit;
+}
+
+void
+Meter::getBlockPeaks(float &left, float &right) const
+{
+    if (m_channels == 0) {
+        left = right = 0.f;
+        return;
+    }
+    left = m_state[0].blockPeak;
+    right = (m_channels > 1 ? m_state[1].blockPeak : left);
+}
+
+float
+Meter::getBlockPeak(int channel) const
+{
+    if (channel < 0 || channel >= m_channels) return 0.f;
+    return m_state[channel].blockPeak;
+}
+
+int
+Meter::getChannelCount() const
+{
+    return m_channels;
+}
+
+bool
+Meter::read(std::vector<ChannelLevels> &levels)
+{
+    std::lock_guard<std::mutex> guard(m_readMutex);
+
+    if (!(m_middle.load() & freshBit)) {
+        return false;
+    }
+    m_front = m_middle.exchange(m_front) & ~freshBit;
+    levels = m_slots[m_front];
+    m_consumed = true;
+    return true;
+}
+
+}
@@ -0,0 +1,131 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_METER_H
+#define BQAUDIOIO_METER_H
+
+#include "ChannelLevels.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace breakfastquay {
+
+/**
+ * Level meter for a multichannel stream, measuring peak, RMS,
+ * true-peak and clip count for each channel. The audio thread feeds
+ * it with process or processInterleaved, and any other thread may
+ * collect the levels accumulated since its previous reading with
+ * read, at whatever rate it likes. The two sides exchange results
+ * through a triple buffer, so neither ever waits for the other.
+ */
+class Meter
+{
+public:
+    Meter();
+    ~Meter();
+
+    /**
+     * Set the number of channels and clear all measurements. Not
+     * realtime-safe, and must not be called while process or
+     * processInterleaved may be running.
+     */
+    void configure(int channels);
+
+    /**
+     * Measure count frames of the given non-interleaved channels.
+     * Realtime-safe. Channels beyond the configured count are
+     * ignored.
+     */
+    void process(const float *const *buffers, int channels, int count);
+
+    /**
+     * Measure count frames of an interleaved buffer with the given
+     * number of channels. Realtime-safe.
+     */
+    void processInterleaved(const float *buffer, int channels, int count);
+
+    /**
+     * Retrieve the sample peaks of the first two channels (or the
+     * first channel twice, for mono) from the most recent call to
+     * process or processInterleaved. For use on the audio thread.
+     */
+    void getBlockPeaks(float &left, float &right) const;
+
+    /**
+     * Retrieve the sample peak of the given channel from the most
+     * recent call to process or processInterleaved. For use on the
+     * audio thread.
+     */
+    float getBlockPeak(int channel) const;
+
+    int getChannelCount() const;
+
+    /**
+     * Retrieve the levels accumulated since the previous call, one
+     * entry per channel. Return false, leaving levels unchanged, if
+     * nothing has been measured since then.
+     */
+    bool read(std::vector<ChannelLevels> &levels);
+
+private:
+    struct Channel {
+        std::vector<float> buffer; // history followed by one chunk
+        float peak;
+        double sumsq;
+        int64_t frames;
+        float truePeak;
+        int64_t clips;
+        float blockPeak;
+    };
+
+    void begin();
+    void processChannel(Channel &ch, const float *src, int stride, int count);
+    void publish();
+
+    int m_channels;
+    std::vector<Channel> m_state;
+
+    std::vector<ChannelLevels> m_slots[3];
+    std::atomic<int> m_middle;
+    int m_back;
+    int m_front;
+    std::atomic<bool> m_consumed;
+    std::mutex m_readMutex;
+
+    Meter(const Meter &)=delete;
+    Meter &operator=(const Meter &)=delete;
+};
+
+}
+
+#endif
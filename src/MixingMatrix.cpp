@@ -0,0 +1,152 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "MixingMatrix.h"
+
+#include <stdexcept>
+
+namespace breakfastquay {
+
+MixingMatrix::MixingMatrix() :
+    m_outputs(0),
+    m_inputs(0)
+{
+}
+
+MixingMatrix::MixingMatrix(int outputs, int inputs) :
+    m_outputs(outputs < 0 ? 0 : outputs),
+    m_inputs(inputs < 0 ? 0 : inputs),
+    m_gains(size_t(m_outputs) * m_inputs, 0.f)
+{
+}
+
+float
+MixingMatrix::get(int output, int input) const
+{
+    if (output < 0 || output >= m_outputs ||
+        input < 0 || input >= m_inputs) {
+        throw std::out_of_range("MixingMatrix::get: channel out of range");
+    }
+    return m_gains[size_t(output) * m_inputs + input];
+}
+
+void
+MixingMatrix::set(int output, int input, float gain)
+{
+    if (output < 0 || output >= m_outputs ||
+        input < 0 || input >= m_inputs) {
+        throw std::out_of_range("MixingMatrix::set: channel out of range");
+    }
+    m_gains[size_t(output) * m_inputs + input] = gain;
+}
+
+MixingMatrix
+MixingMatrix::identity(int channels)
+{
+    MixingMatrix m(channels, channels);
+    for (int c = 0; c < channels; ++c) {
+        m.set(c, c, 1.f);
+    }
+    return m;
+}
+
+MixingMatrix
+MixingMatrix::routing(const std::vector<int> &order, int inputs)
+{
+    MixingMatrix m(int(order.size()), inputs);
+    for (int r = 0; r < int(order.size()); ++r) {
+        if (order[r] >= 0 && order[r] < inputs) {
+            m.set(r, order[r], 1.f);
+        }
+    }
+    return m;
+}
+
+MixingMatrix
+MixingMatrix::monoToStereo()
+{
+    return standard(2, 1);
+}
+
+MixingMatrix
+MixingMatrix::stereoToMono()
+{
+    return standard(1, 2);
+}
+
+MixingMatrix
+MixingMatrix::stereoToQuad()
+{
+    return standard(4, 2);
+}
+
+MixingMatrix
+MixingMatrix::fiveOneToStereo()
+{
+    const float minus3dB = 0.70710678f;
+    MixingMatrix m(2, 6);
+    m.set(0, 0, 1.f);
+    m.set(1, 1, 1.f);
+    m.set(0, 2, minus3dB);
+    m.set(1, 2, minus3dB);
+    m.set(0, 4, minus3dB);
+    m.set(1, 5, minus3dB);
+    return m;
+}
+
+MixingMatrix
+MixingMatrix::standard(int outputs, int inputs)
+{
+    MixingMatrix m(outputs, inputs);
+    if (m.isEmpty()) {
+        return m;
+    }
+    if (inputs == 1) {
+        for (int r = 0; r < outputs; ++r) {
+            m.set(r, 0, 1.f);
+        }
+    } else if (outputs == 1) {
+        for (int c = 0; c < inputs; ++c) {
+            m.set(0, c, 1.f / float(inputs));
+        }
+    } else if (outputs >= inputs) {
+        for (int r = 0; r < outputs; ++r) {
+            m.set(r, r % inputs, 1.f);
+        }
+    } else {
+        for (int c = 0; c < inputs; ++c) {
+            m.set(c % outputs, c, 1.f);
+        }
+    }
+    return m;
+}
+
+}
@@ -0,0 +1,277 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "NullAudioIO.h"
+#include "ApplicationPlaybackSource.h"
+#include "ApplicationRecordTarget.h"
+#include "CallbackMonitor.h"
+#include "Log.h"
+#include "RealtimeCheck.h"
+
+#include <chrono>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+namespace breakfastquay {
+
+static const char *const logComponent = "NullAudioIO";
+
+static string silenceName = "Silence";
+static string loopbackName = "Loopback";
+static string discardName = "Discard";
+
+static const int defaultBlockSize = 1024;
+
+static void
+enableRT() // on current thread
+{
+#ifndef _WIN32
+    sched_param param;
+    param.sched_priority = std::min(70, sched_get_priority_max(SCHED_FIFO));
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+        BQAUDIOIO_LOG_INFO(logComponent, "Couldn't set RT scheduling class");
+    } else {
+        BQAUDIOIO_LOG_INFO(logComponent, "Successfully set RT scheduling class");
+    }
+#endif
+}
+
+vector<string>
+NullAudioIO::getRecordDeviceNames()
+{
+    return { silenceName, loopbackName };
+}
+
+vector<string>
+NullAudioIO::getPlaybackDeviceNames()
+{
+    return { discardName };
+}
+
+NullAudioIO::NullAudioIO(Mode mode,
+                         ApplicationRecordTarget *target,
+                         ApplicationPlaybackSource *source,
+                         string recordDevice,
+                         string playbackDevice,
+                         int blockSize) :
+    OfflineRenderer(mode == Mode::Playback ? nullptr : target,
+                    mode == Mode::Record ? nullptr : source,
+                    0,
+                    blockSize > 0 ? blockSize : defaultBlockSize,
+                    false),
+    m_mode(mode),
+    m_xrunPending(false),
+    m_suspended(false),
+    m_done(false)
+{
+    BQAUDIOIO_LOG_INFO(logComponent, "Starting");
+
+    m_callbackName = "Null process";
+    m_loopback = (recordDevice == loopbackName);
+
+    if (recordDevice != "" && recordDevice != silenceName && !m_loopback) {
+        m_startupError = "Unknown record device \"" + recordDevice + "\"";
+        BQAUDIOIO_LOG_ERROR(logComponent, m_startupError);
+        return;
+    }
+    if (playbackDevice != "" && playbackDevice != discardName) {
+        m_startupError = "Unknown playback device \"" + playbackDevice + "\"";
+        BQAUDIOIO_LOG_ERROR(logComponent, m_startupError);
+        return;
+    }
+
+    m_thread = thread([this]() { threadRun(); });
+
+    BQAUDIOIO_LOG_INFO(logComponent, "Started successfully"
+                       << logField("rate", m_sampleRate)
+                       << logField("blockSize", m_blockSize)
+                       << logField("outputChannels", m_outputChannels)
+                       << logField("inputChannels", m_inputChannels)
+                       << logField("loopback", m_loopback));
+}
+
+NullAudioIO::~NullAudioIO()
+{
+    {
+        lock_guard<mutex> guard(m_threadMutex);
+        m_done = true;
+    }
+    m_condition.notify_all();
+
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+
+    BQAUDIOIO_LOG_INFO(logComponent, "Closed");
+}
+
+bool
+NullAudioIO::isSourceOK() const
+{
+    if (m_mode == Mode::Playback) {
+        // record source is irrelevant in playback mode
+        return true;
+    } else {
+        return m_startupError == "";
+    }
+}
+
+bool
+NullAudioIO::isTargetOK() const
+{
+    if (m_mode == Mode::Record) {
+        // playback target is irrelevant in record mode
+        return true;
+    } else {
+        return m_startupError == "";
+    }
+}
+
+void
+NullAudioIO::suspend()
+{
+    {
+        lock_guard<mutex> guard(m_threadMutex);
+        if (m_suspended) return;
+        m_suspended = true;
+    }
+    m_condition.notify_all();
+
+    // Wait for any block in progress, so that the application is not
+    // called again once we return
+    {
+        lock_guard<mutex> guard(m_mutex);
+    }
+    OfflineRenderer::suspend();
+}
+
+void
+NullAudioIO::resume()
+{
+    {
+        lock_guard<mutex> guard(m_threadMutex);
+        if (!m_suspended) return;
+        m_suspended = false;
+    }
+    m_condition.notify_all();
+    OfflineRenderer::resume();
+}
+
+bool
+NullAudioIO::publishStatistics(string name)
+{
+    return m_monitor->publishStatistics(name, "null",
+                                        m_inputMeter, m_outputMeter);
+}
+
+void
+NullAudioIO::threadRun()
+{
+    enableRT();
+
+    // Blocks are due at exact multiples of the period from a start
+    // time, so that rounding of the period does not accumulate. The
+    // start is moved on a second at a time to keep the arithmetic in
+    // range, and reset on resume and after a late block
+    
+    typedef chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    int64_t elapsed = 0;
+
+    unique_lock<mutex> lock(m_threadMutex);
+
+    while (!m_done) {
+
+        if (m_suspended) {
+            m_condition.wait(lock);
+            start = clock::now();
+            elapsed = 0;
+            continue;
+        }
+
+        lock.unlock();
+        process();
+        lock.lock();
+
+        elapsed += m_blockSize;
+        while (elapsed >= m_sampleRate) {
+            elapsed -= m_sampleRate;
+            start += chrono::seconds(1);
+        }
+        
+        clock::time_point due =
+            start + chrono::nanoseconds(elapsed * 1000000000 / m_sampleRate);
+
+        if (clock::now() > due) {
+            // The block took longer than its own duration: a device
+            // would have run dry, so report it as the server would
+            m_xrunPending = true;
+            if (m_target) m_target->audioProcessingOverload();
+            if (m_source) m_source->audioProcessingOverload();
+            start = clock::now();
+            elapsed = 0;
+            continue;
+        }
+
+        m_condition.wait_until(lock, due, [this]() {
+                return m_done || m_suspended;
+            });
+    }
+}
+
+void
+NullAudioIO::process()
+{
+    RealtimeCheck::Scope rtcheck;
+
+    if (!m_mutex.try_lock()) {
+        return;
+    }
+
+    lock_guard<mutex> guard(m_mutex, adopt_lock);
+
+    int flags = 0;
+    if (m_xrunPending.exchange(false)) {
+        flags = (CallbackTiming::InputOverflow |
+                 CallbackTiming::OutputUnderflow);
+        m_monitor->reportDropout(DropoutEvent::ServerXrun, m_frame);
+    }
+
+    renderBlock(m_outputBuffers, nullptr, m_blockSize, flags);
+}
+
+}
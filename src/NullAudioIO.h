@@ -0,0 +1,105 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_NULL_AUDIO_IO_H
+#define BQAUDIOIO_NULL_AUDIO_IO_H
+
+#include "OfflineRenderer.h"
+#include "Mode.h"
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace breakfastquay {
+
+class ApplicationRecordTarget;
+class ApplicationPlaybackSource;
+
+/**
+ * An implementation with no audio hardware behind it, for headless
+ * machines and tests. A timer thread, running with realtime priority
+ * where the system allows, renders one block through the
+ * OfflineRenderer at exactly the period of a block at the
+ * application's sample rate, and the played samples are discarded.
+ *
+ * The record device may be "Silence", in which case the target
+ * receives silence, or "Loopback", in which case each block played
+ * is also recorded, at the same frame position, with device input
+ * channel n taken from device output channel n.
+ */
+class NullAudioIO : public OfflineRenderer
+{
+public:
+    NullAudioIO(Mode mode,
+                ApplicationRecordTarget *recordTarget,
+                ApplicationPlaybackSource *playSource,
+                std::string recordDevice,
+                std::string playbackDevice,
+                int blockSize = 0);
+    virtual ~NullAudioIO();
+
+    static std::vector<std::string> getRecordDeviceNames();
+    static std::vector<std::string> getPlaybackDeviceNames();
+
+    virtual bool isSourceOK() const override;
+    virtual bool isTargetOK() const override;
+
+    virtual void suspend() override;
+    virtual void resume() override;
+
+    virtual bool publishStatistics(std::string name) override;
+
+    std::string getStartupErrorString() const { return m_startupError; }
+
+protected:
+    void process();
+    void threadRun();
+
+    Mode m_mode;
+    std::atomic<bool> m_xrunPending;
+    std::thread m_thread;
+    std::mutex m_threadMutex;
+    std::condition_variable m_condition;
+    bool m_suspended;
+    bool m_done;
+    std::string m_startupError;
+
+    NullAudioIO(const NullAudioIO &)=delete;
+    NullAudioIO &operator=(const NullAudioIO &)=delete;
+};
+
+}
+
+#endif
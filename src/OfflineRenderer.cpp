@@ -0,0 +1,581 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "OfflineRenderer.h"
+#include "ApplicationPlaybackSource.h"
+#include "ApplicationRecordTarget.h"
+#include "CallbackMonitor.h"
+#include "ChannelMixer.h"
+#include "Gains.h"
+#include "Kernels.h"
+#include "Log.h"
+#include "Meter.h"
+
+#include "bqvec/Allocators.h"
+#include "bqvec/VectorOps.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace breakfastquay {
+
+static const char *const logComponent = "OfflineRenderer";
+
+static const int defaultSampleRate = 44100;
+
+OfflineRenderer::OfflineRenderer(ApplicationRecordTarget *target,
+                                 ApplicationPlaybackSource *source,
+                                 int sampleRate,
+                                 int blockSize) :
+    OfflineRenderer(target, source, sampleRate, blockSize, true)
+{
+}
+
+OfflineRenderer::OfflineRenderer(ApplicationRecordTarget *target,
+                                 ApplicationPlaybackSource *source,
+                                 int sampleRate,
+                                 int blockSize,
+                                 bool offline) :
+    SystemAudioIO(target, source),
+    m_offline(offline),
+    m_loopback(true),
+    m_callbackName("Offline render"),
+    m_sampleRate(sampleRate),
+    m_blockSize(blockSize),
+    m_sourceChannels(0),
+    m_targetChannels(0),
+    m_outputChannels(0),
+    m_inputChannels(0),
+    m_outputMixer(new ChannelMixer),
+    m_inputMixer(new ChannelMixer),
+    m_outputBuffers(nullptr),
+    m_sourceScratch(nullptr),
+    m_targetScratch(nullptr),
+    m_silence(nullptr),
+    m_allocatedOutputs(0),
+    m_allocatedSources(0),
+    m_allocatedTargets(0),
+    m_frame(0),
+    m_renderedFrames(0),
+    m_renderTime(0),
+    m_monitor(new CallbackMonitor)
+{
+    if (!source && !target) {
+        throw std::logic_error("ApplicationPlaybackSource or ApplicationRecordTarget must be provided");
+    }
+    if (blockSize <= 0) {
+        throw std::logic_error("Block size must be positive");
+    }
+
+    if (m_sampleRate == 0) {
+
+        int sourceRate = 0;
+        int targetRate = 0;
+
+        if (m_source) {
+            sourceRate = m_source->getApplicationSampleRate();
+            m_sampleRate = sourceRate;
+        }
+        if (m_target) {
+            targetRate = m_target->getApplicationSampleRate();
+            if (sourceRate != 0 && targetRate != 0 &&
+                sourceRate != targetRate) {
+                BQAUDIOIO_LOG_WARNING(logComponent, "Source and target both "
+                                      << "provide sample rates, but different "
+                                      << "ones - using source rate"
+                                      << logField("source", sourceRate)
+                                      << logField("target", targetRate));
+            } else if (targetRate != 0) {
+                m_sampleRate = targetRate;
+            }
+        }
+        if (m_sampleRate == 0) {
+            m_sampleRate = defaultSampleRate;
+        }
+    }
+
+    if (m_source) {
+        m_sourceChannels = 2;
+        if (m_source->getApplicationChannelCount() > 0) {
+            m_sourceChannels = m_source->getApplicationChannelCount();
+        }
+    }
+    if (m_target) {
+        m_targetChannels = 2;
+        if (m_target->getApplicationChannelCount() > 0) {
+            m_targetChannels = m_target->getApplicationChannelCount();
+        }
+    }
+
+    setup();
+
+    if (m_source) {
+        m_source->setSystemPlaybackBlockSize(m_blockSize);
+        m_source->setSystemPlaybackSampleRate(m_sampleRate);
+        m_source->setSystemPlaybackLatency(0);
+        if (m_offline) m_source->setSystemFreewheeling(true);
+    }
+    if (m_target) {
+        m_target->setSystemRecordBlockSize(m_blockSize);
+        m_target->setSystemRecordSampleRate(m_sampleRate);
+        m_target->setSystemRecordLatency(0);
+        if (m_offline) m_target->setSystemFreewheeling(true);
+    }
+}
+
+OfflineRenderer::~OfflineRenderer()
+{
+    deallocateBuffers();
+    delete m_monitor;
+    delete m_inputMixer;
+    delete m_outputMixer;
+}
+
+double
+OfflineRenderer::getCurrentTime() const
+{
+    return double(m_frame) / double(m_sampleRate);
+}
+
+void
+OfflineRenderer::suspend()
+{
+    m_monitor->setSuspended(true);
+}
+
+void
+OfflineRenderer::resume()
+{
+    m_monitor->setSuspended(false);
+}
+
+void
+OfflineRenderer::setOutputMixingMatrix(const MixingMatrix &matrix)
+{
+    SystemPlaybackTarget::setOutputMixingMatrix(matrix);
+    lock_guard<mutex> guard(m_mutex);
+    setup();
+}
+
+void
+OfflineRenderer::setInputMixingMatrix(const MixingMatrix &matrix)
+{
+    SystemRecordSource::setInputMixingMatrix(matrix);
+    lock_guard<mutex> guard(m_mutex);
+    setup();
+}
+
+CallbackStatistics
+OfflineRenderer::getStatistics() const
+{
+    return m_monitor->getStatistics();
+}
+
+void
+OfflineRenderer::resetStatistics()
+{
+    m_monitor->reset();
+    m_renderedFrames = 0;
+    m_renderTime = 0;
+}
+
+vector<DropoutEvent>
+OfflineRenderer::getDropoutEvents(int64_t after) const
+{
+    return m_monitor->getDropoutEvents(after);
+}
+
+bool
+OfflineRenderer::setDeadlineWarningThreshold(double fraction)
+{
+    m_monitor->setDeadlineWarning(fraction, m_sampleRate, m_source, m_target);
+    return true;
+}
+
+bool
+OfflineRenderer::publishStatistics(string name)
+{
+    return m_monitor->publishStatistics(name, "offline",
+                                        m_inputMeter, m_outputMeter);
+}
+
+double
+OfflineRenderer::getRealtimeMultiple() const
+{
+    int64_t frames = m_renderedFrames;
+    int64_t nsec = m_renderTime;
+    if (frames == 0 || nsec <= 0) {
+        return 0.0;
+    }
+    return (double(frames) / double(m_sampleRate)) / (double(nsec) / 1.0e9);
+}
+
+void
+OfflineRenderer::setup()
+{
+    // Called from the constructor or with m_mutex held. There is no
+    // device to constrain us, so the device gets one channel per
+    // application channel, or per row (for output) or column (for
+    // input) of a mixing matrix that fits the application's channels
+
+    m_outputChannels = m_sourceChannels;
+    if (!m_outputMatrix.isEmpty() &&
+        m_outputMatrix.getInputCount() == m_sourceChannels) {
+        m_outputChannels = m_outputMatrix.getOutputCount();
+    }
+
+    m_inputChannels = m_targetChannels;
+    if (!m_inputMatrix.isEmpty() &&
+        m_inputMatrix.getOutputCount() == m_targetChannels) {
+        m_inputChannels = m_inputMatrix.getInputCount();
+    }
+
+    if (m_source &&
+        !m_outputMixer->configure(m_outputMatrix,
+                                  m_outputChannels, m_sourceChannels)) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "Output mixing matrix does not "
+                              << "fit the channels, using default mapping"
+                              << logField("sourceChannels", m_sourceChannels)
+                              << logField("deviceChannels", m_outputChannels));
+    }
+    if (m_target &&
+        !m_inputMixer->configure(m_inputMatrix,
+                                 m_targetChannels, m_inputChannels)) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "Input mixing matrix does not "
+                              << "fit the channels, using default mapping"
+                              << logField("deviceChannels", m_inputChannels)
+                              << logField("targetChannels", m_targetChannels));
+    }
+
+    allocateBuffers();
+
+    // Output is metered as rendered, input as the target receives it
+    m_outputMeter->configure(m_outputChannels);
+    m_inputMeter->configure(m_targetChannels);
+
+    if (m_source) {
+        m_source->setSystemPlaybackChannelCount(m_outputChannels);
+    }
+    if (m_target) {
+        m_target->setSystemRecordChannelCount(m_inputChannels);
+    }
+}
+
+void
+OfflineRenderer::allocateBuffers()
+{
+    deallocateBuffers();
+
+    m_outputBuffers = allocate_and_zero_channels<float>
+        (m_outputChannels, m_blockSize);
+    m_sourceScratch = allocate_and_zero_channels<float>
+        (m_sourceChannels, m_blockSize);
+    m_targetScratch = allocate_and_zero_channels<float>
+        (m_targetChannels, m_blockSize);
+    m_silence = allocate_and_zero<float>(m_blockSize);
+
+    m_allocatedOutputs = m_outputChannels;
+    m_allocatedSources = m_sourceChannels;
+    m_allocatedTargets = m_targetChannels;
+
+    // Pointer tables for renderBlock, which only ever fills them in
+    m_outputPtrs.resize(m_outputChannels, nullptr);
+    m_inputPtrs.resize(m_inputChannels, nullptr);
+    m_sourceBuffers.resize(m_sourceChannels, nullptr);
+    m_targetBuffers.resize(m_targetChannels, nullptr);
+    m_loopbackBuffers.resize(m_inputChannels, nullptr);
+    m_gains.resize(m_outputChannels, 1.f);
+    m_peaks.resize(m_outputChannels, 0.f);
+}
+
+void
+OfflineRenderer::deallocateBuffers()
+{
+    deallocate_channels(m_outputBuffers, m_allocatedOutputs);
+    deallocate_channels(m_sourceScratch, m_allocatedSources);
+    deallocate_channels(m_targetScratch, m_allocatedTargets);
+    deallocate(m_silence);
+
+    m_outputBuffers = nullptr;
+    m_sourceScratch = nullptr;
+    m_targetScratch = nullptr;
+    m_silence = nullptr;
+}
+
+int
+OfflineRenderer::render(float *const *output, int nframes,
+                        const float *const *input)
+{
+    int64_t start = CallbackMonitor::now();
+
+    // Held throughout, as the caller's buffers have the channel
+    // counts of the time of the call
+    lock_guard<mutex> guard(m_mutex);
+
+    for (int done = 0; done < nframes; ) {
+
+        int n = std::min(m_blockSize, nframes - done);
+
+        float *const *out = m_outputBuffers;
+        if (output) {
+            for (int ch = 0; ch < m_outputChannels; ++ch) {
+                m_outputPtrs[ch] = output[ch] + done;
+            }
+            out = m_outputPtrs.data();
+        }
+
+        const float *const *in = nullptr;
+        if (input) {
+            for (int ch = 0; ch < m_inputChannels; ++ch) {
+                m_inputPtrs[ch] = input[ch] + done;
+            }
+            in = m_inputPtrs.data();
+        }
+
+        renderBlock(out, in, n, 0);
+        done += n;
+    }
+
+    m_renderedFrames += nframes;
+    m_renderTime += CallbackMonitor::now() - start;
+
+    return nframes;
+}
+
+int64_t
+OfflineRenderer::render(Sink &sink, int64_t frames)
+{
+    int64_t start = CallbackMonitor::now();
+    int64_t done = 0;
+    bool more = true;
+
+    while (more && done < frames) {
+
+        int n = int(std::min(int64_t(m_blockSize), frames - done));
+
+        // Taken per block, so that the mixing matrices may be
+        // changed during a long render
+        lock_guard<mutex> guard(m_mutex);
+
+        renderBlock(m_outputBuffers, nullptr, n, 0);
+        more = sink.putRenderedSamples(m_outputBuffers, m_outputChannels, n);
+        done += n;
+    }
+
+    m_renderedFrames += done;
+    m_renderTime += CallbackMonitor::now() - start;
+
+    return done;
+}
+
+void
+OfflineRenderer::renderParallel(const vector<Job> &jobs, int threads)
+{
+    if (threads <= 0) {
+        threads = int(thread::hardware_concurrency());
+    }
+    threads = std::max(1, std::min(threads, int(jobs.size())));
+
+    // Jobs are handed out one at a time, so that a thread that
+    // finishes a short one moves on to the next
+    
+    atomic<size_t> next(0);
+
+    auto work = [&]() {
+        size_t i;
+        while ((i = next++) < jobs.size()) {
+            const Job &job = jobs[i];
+            job.renderer->render(*job.sink, job.frames);
+        }
+    };
+
+    vector<thread> helpers;
+    for (int i = 1; i < threads; ++i) {
+        helpers.push_back(thread(work));
+    }
+    work();
+    for (auto &helper: helpers) {
+        helper.join();
+    }
+}
+
+void
+OfflineRenderer::renderBlock(float *const *outbufs,
+                             const float *const *input,
+                             int nframes, int flags)
+{
+    m_monitor->beginCallback(m_callbackName);
+
+    CallbackTiming timing = CallbackTiming();
+    timing.frame = m_frame;
+    timing.currentTime = double(timing.frame) / double(m_sampleRate);
+    timing.outputTime = timing.currentTime;
+    timing.inputTime = timing.currentTime;
+    timing.flags = flags;
+    if (m_offline) {
+        timing.flags |= CallbackTiming::Freewheeling;
+    }
+
+    int nout = m_outputChannels;
+    int nin = m_inputChannels;
+
+    float peakLeft = 0.f, peakRight = 0.f;
+
+    if (m_source) {
+
+        // The source renders straight into the output buffers if the
+        // matrix maps its channels one-to-one onto them (in any
+        // order), and into scratch buffers for mixing if not
+
+        const ChannelMixer &mixer = *m_outputMixer;
+        int nsrc = m_sourceChannels;
+        float *const *srcbufs = outbufs;
+
+        if (!mixer.isIdentity()) {
+            if (mixer.isPermutation()) {
+                for (int ch = 0; ch < nout; ++ch) {
+                    m_sourceBuffers[mixer.getRoute(ch)] = outbufs[ch];
+                }
+            } else {
+                for (int ch = 0; ch < nsrc; ++ch) {
+                    m_sourceBuffers[ch] = m_sourceScratch[ch];
+                }
+            }
+            srcbufs = m_sourceBuffers.data();
+        }
+
+        int silent = getScheduledSilence(timing.frame, nframes);
+        int received = 0;
+
+        if (silent < nframes) {
+            CallbackTiming sourceTiming(timing);
+            if (silent > 0) {
+                sourceTiming.frame += silent;
+                sourceTiming.outputTime += double(silent) / double(m_sampleRate);
+            }
+            m_monitor->beginApplication();
+            received = m_source->getSourceSamplesWithTiming
+                (srcbufs, nsrc, nframes - silent, sourceTiming);
+            m_monitor->endApplication(CallbackMonitor::Playback,
+                                      nframes - silent);
+            m_monitor->reportSourceDelivery(sourceTiming.frame,
+                                            nframes - silent, received);
+            if (silent > 0) {
+                // Shift the source's samples up to the scheduled start
+                for (int ch = 0; ch < nsrc; ++ch) {
+                    memmove(srcbufs[ch] + silent, srcbufs[ch],
+                            received * sizeof(float));
+                    v_zero(srcbufs[ch], silent);
+                }
+                received += silent;
+            }
+        }
+
+        for (int ch = 0; ch < nsrc; ++ch) {
+            v_zero(srcbufs[ch] + received, nframes - received);
+        }
+
+        if (!mixer.isPermutation()) {
+            mixer.mix(outbufs, srcbufs, received);
+            for (int ch = 0; ch < nout; ++ch) {
+                v_zero(outbufs[ch] + received, nframes - received);
+            }
+        }
+
+        float *gain = m_gains.data();
+        Gains::gainsFor(m_outputGain, m_outputBalance, gain, nout);
+
+        v_gain_peak_channels(outbufs, nout, received, gain, m_peaks.data());
+        m_outputMeter->process(outbufs, nout, nframes);
+
+        if (nout > 0) {
+            peakLeft = m_peaks[0];
+            peakRight = (nout > 1 ? m_peaks[1] : m_peaks[0]);
+        }
+        if (m_outputLevelCallbacks) {
+            m_source->setOutputLevels(peakLeft, peakRight);
+        }
+    }
+
+    if (m_target) {
+
+        // Without input from the caller, the inputs are the outputs
+        // just rendered, or silence
+        
+        const float *const *inbufs = input;
+        if (!inbufs) {
+            for (int ch = 0; ch < nin; ++ch) {
+                m_loopbackBuffers[ch] =
+                    ((m_loopback && ch < nout) ? outbufs[ch] : m_silence);
+            }
+            inbufs = m_loopbackBuffers.data();
+        }
+
+        const ChannelMixer &mixer = *m_inputMixer;
+        const float *const *tgtbufs = inbufs;
+        int ntgt = m_targetChannels;
+
+        if (!mixer.isIdentity()) {
+            if (mixer.isRouting()) {
+                for (int ch = 0; ch < ntgt; ++ch) {
+                    int route = mixer.getRoute(ch);
+                    m_targetBuffers[ch] =
+                        (route >= 0 ? inbufs[route] : m_silence);
+                }
+                tgtbufs = m_targetBuffers.data();
+            } else {
+                mixer.mix(m_targetScratch, inbufs, nframes);
+                tgtbufs = m_targetScratch;
+            }
+        }
+
+        m_inputMeter->process(tgtbufs, ntgt, nframes);
+        m_inputMeter->getBlockPeaks(peakLeft, peakRight);
+
+        if (m_inputLevelCallbacks) {
+            m_target->setInputLevels(peakLeft, peakRight);
+        }
+
+        m_monitor->beginApplication();
+        m_target->putSamplesWithTiming(tgtbufs, ntgt, nframes, timing);
+        m_monitor->endApplication(CallbackMonitor::Record, nframes);
+    }
+
+    m_frame += nframes;
+
+    m_monitor->endCallback(nframes, m_sampleRate);
+}
+
+}
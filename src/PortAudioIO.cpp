@@ -35,17 +35,20 @@
 #include "ApplicationPlaybackSource.h"
 #include "ApplicationRecordTarget.h"
 #include "Gains.h"
+#include "Kernels.h"
+#include "FormatConversion.h"
 #include "Log.h"
+#include "Meter.h"
+#include "RealtimeCheck.h"
 
 #include "bqvec/VectorOps.h"
 #include "bqvec/Allocators.h"
 
-#include <iostream>
-#include <sstream>
 #include <cassert>
 #include <cmath>
 #include <climits>
 #include <algorithm>
+#include <cstring>
 
 #include <mutex>
 
@@ -55,15 +58,11 @@
 #endif
 #endif
 
-//#define DEBUG_AUDIO_PORT_AUDIO_IO 1
-
 using namespace std;
 
 namespace breakfastquay {
 
-static void log(string message) {
-    Log::log("PortAudioIO: " + message);
-}    
+static const char *const logComponent = "PortAudioIO";
 
 #ifdef __LINUX__
 extern "C" {
@@ -94,9 +93,9 @@ enableRT() { // on current thread
     sched_param param;
     param.sched_priority = 20;
     if (pthread_setschedparam(pthread_self(), SCHED_RR, &param)) {
-        log("NOTE: couldn't set RT scheduling class");
+        BQAUDIOIO_LOG_INFO(logComponent, "Couldn't set RT scheduling class");
     } else {
-        log("NOTE: successfully set RT scheduling class");
+        BQAUDIOIO_LOG_INFO(logComponent, "Successfully set RT scheduling class");
     }
     return true;
 #endif
@@ -116,7 +115,8 @@ static bool initialise() {
         PaError err = Pa_Initialize();
         paio_initialised = true;
         if (err != paNoError) {
-            log("ERROR: Failed to initialize PortAudio");
+            BQAUDIOIO_LOG_ERROR(logComponent, "Failed to initialize PortAudio"
+                                << logField("error", Pa_GetErrorText(err)));
             paio_working = false;
         } else {
             paio_working = true;
@@ -149,25 +149,24 @@ getDeviceNames(bool record)
 
     if (count < 0) {
         // error
-        log(string("error in retrieving device list: ") + Pa_GetErrorText(count));
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to retrieve device list"
+                            << logField("error", Pa_GetErrorText(count)));
         return names;
     } else {
-        ostringstream os;
-        os << "have " << count << " device(s)";
-        log(os.str());
+        BQAUDIOIO_LOG_DEBUG(logComponent, "Listing devices"
+                            << logField("count", count));
     }
     
     for (int i = 0; i < count; ++i) {
 
         const PaDeviceInfo *info = Pa_GetDeviceInfo(i);
 
-        ostringstream os;
-        os << i+1 << "/" << count << ": "
-           << "\"" << info->name << "\","
-           << " channels in " << info->maxInputChannels
-           << ", out " << info->maxOutputChannels
-           << ", default rate " << info->defaultSampleRate;
-        log(os.str());
+        BQAUDIOIO_LOG_DEBUG(logComponent, "Device"
+                            << logField("index", i)
+                            << logField("name", info->name)
+                            << logField("inputChannels", info->maxInputChannels)
+                            << logField("outputChannels", info->maxOutputChannels)
+                            << logField("defaultRate", info->defaultSampleRate));
 
         if (record) {
             if (info->maxInputChannels > 0) {
@@ -186,16 +185,15 @@ static
 PaDeviceIndex
 getDeviceIndex(string name, bool record)
 {
-    {
-        ostringstream os;
-        os << "getDeviceIndex: name = \"" << name << "\", record = " << record;
-        log(os.str());
-    }
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Looking up device"
+                        << logField("name", name)
+                        << logField("record", record));
     
     if (name != "") {
         PaDeviceIndex count = Pa_GetDeviceCount();
         if (count < 0) {
-            log(string("error in retrieving device index: ") + Pa_GetErrorText(count));
+            BQAUDIOIO_LOG_ERROR(logComponent, "Failed to retrieve device index"
+                                << logField("error", Pa_GetErrorText(count)));
         }
         for (int i = 0; i < count; ++i) {
             const PaDeviceInfo *info = Pa_GetDeviceInfo(i);
@@ -239,7 +237,10 @@ PortAudioIO::PortAudioIO(Mode mode,
                          ApplicationRecordTarget *target,
                          ApplicationPlaybackSource *source,
                          string recordDevice,
-                         string playbackDevice) :
+                         string playbackDevice,
+                         int subBlockSize,
+                         SampleFormat sampleFormat,
+                         vector<int> recordChannels) :
     SystemAudioIO(target, source),
     m_stream(nullptr),
     m_recordDevice(0),
@@ -247,15 +248,25 @@ PortAudioIO::PortAudioIO(Mode mode,
     m_mode(mode),
     m_bufferSize(0),
     m_sampleRate(0),
+    m_recordChannels(recordChannels),
     m_inputLatency(0),
     m_outputLatency(0),
     m_prioritySet(false),
     m_suspended(false),
     m_recordEnabled(true),
     m_buffers(nullptr),
-    m_bufferChannels(0)
+    m_bufferChannels(0),
+    m_nonInterleaved(false),
+    m_sourceInterleaved(false),
+    m_targetInterleaved(false),
+    m_subBlockSize(subBlockSize),
+    m_requestedFormat(sampleFormat),
+    m_deviceFormat(SampleFormat::Float32),
+    m_converted(nullptr),
+    m_mixed(nullptr),
+    m_frameCount(0)
 {
-    log("starting");
+    BQAUDIOIO_LOG_INFO(logComponent, "Starting");
 
     if (!initialise()) return;
 
@@ -273,12 +284,9 @@ PortAudioIO::PortAudioIO(Mode mode,
     m_recordDevice = getDeviceIndex(recordDevice, true);
     m_playbackDevice = getDeviceIndex(playbackDevice, false);
 
-    {
-        ostringstream os;
-        os << "Obtained playback device index " << m_playbackDevice
-           << " and record device index " << m_recordDevice;
-        log(os.str());
-    }
+    BQAUDIOIO_LOG_INFO(logComponent, "Obtained device indices"
+                       << logField("playback", m_playbackDevice)
+                       << logField("record", m_recordDevice));
 
     const PaDeviceInfo *inInfo = Pa_GetDeviceInfo(m_recordDevice);
     const PaDeviceInfo *outInfo = Pa_GetDeviceInfo(m_playbackDevice);
@@ -305,8 +313,11 @@ PortAudioIO::PortAudioIO(Mode mode,
         targetRate = m_target->getApplicationSampleRate();
         if (targetRate != 0) {
             if (sourceRate != 0 && sourceRate != targetRate) {
-                ostringstream os;
-                os << "WARNING: Source and target both provide sample rates, but different ones (source " << sourceRate << ", target " << targetRate << ") - using source rate";
+                BQAUDIOIO_LOG_WARNING(logComponent, "Source and target both "
+                                      << "provide sample rates, but different "
+                                      << "ones - using source rate"
+                                      << logField("source", sourceRate)
+                                      << logField("target", targetRate));
             } else {
                 m_sampleRate = targetRate;
             }
@@ -322,12 +333,28 @@ PortAudioIO::PortAudioIO(Mode mode,
     m_inputChannels = m_targetChannels;
     m_outputChannels = m_sourceChannels;
 
+    if (!m_recordChannels.empty()) {
+        // Open as many channels as it takes to reach the highest
+        // one selected
+        m_inputChannels = 0;
+        for (int c: m_recordChannels) {
+            m_inputChannels = std::max(m_inputChannels, c + 1);
+        }
+    }
+
     if (inInfo &&
         m_inputChannels > inInfo->maxInputChannels &&
         inInfo->maxInputChannels > 0) {
         m_inputChannels = inInfo->maxInputChannels;
     }
 
+    pruneRecordChannels();
+
+    if (m_target && m_target->getApplicationChannelCount() == 0 &&
+        !m_recordChannels.empty()) {
+        m_targetChannels = getSelectedInputCount();
+    }
+
     if (outInfo &&
         m_outputChannels > outInfo->maxOutputChannels &&
         outInfo->maxOutputChannels > 0) {
@@ -339,27 +366,21 @@ PortAudioIO::PortAudioIO(Mode mode,
     if (err != paNoError) {
         m_startupError = "Failed to open PortAudio stream: ";
         m_startupError += Pa_GetErrorText(err);
-	log("ERROR: " + m_startupError);
+	BQAUDIOIO_LOG_ERROR(logComponent, m_startupError);
 	m_stream = nullptr;
         deinitialise();
 	return;
     }
 
-    const PaStreamInfo *info = Pa_GetStreamInfo(m_stream);
-    m_outputLatency = int(info->outputLatency * m_sampleRate + 0.001);
-    m_inputLatency = int(info->inputLatency * m_sampleRate + 0.001);
-    if (m_bufferSize == 0) m_bufferSize = m_outputLatency;
-    if (m_bufferSize == 0) m_bufferSize = m_inputLatency;
+    queryStreamInfo();
+    pruneRecordChannels();
 
     if (enableRT(m_stream)) {
         m_prioritySet = true;
     }
 
-    {
-        ostringstream os;
-        os << "block size " << m_bufferSize;
-        log(os.str());
-    }
+    BQAUDIOIO_LOG_INFO(logComponent, "Opened stream"
+                       << logField("blockSize", m_bufferSize));
     
     if (m_source) {
 	m_source->setSystemPlaybackBlockSize(m_bufferSize);
@@ -370,53 +391,355 @@ PortAudioIO::PortAudioIO(Mode mode,
 
     if (m_target) {
         if (m_target->getApplicationChannelCount() == 0) {
-            m_targetChannels = m_inputChannels;
+            m_targetChannels = getSelectedInputCount();
         }
 	m_target->setSystemRecordBlockSize(m_bufferSize);
 	m_target->setSystemRecordSampleRate(int(round(m_sampleRate)));
 	m_target->setSystemRecordLatency(m_inputLatency);
-        m_target->setSystemRecordChannelCount(m_inputChannels);
+        m_target->setSystemRecordChannelCount(getSelectedInputCount());
     }
 
-    m_bufferChannels = std::max(std::max(m_sourceChannels, m_targetChannels),
-                                std::max(m_inputChannels, m_outputChannels));
-    m_buffers = allocate_and_zero_channels<float>(m_bufferChannels, m_bufferSize);
+    configureMixers();
+    allocateBuffers();
 
     err = Pa_StartStream(m_stream);
 
     if (err != paNoError) {
 	m_startupError = "Failed to start PortAudio stream: ";
         m_startupError += Pa_GetErrorText(err);
-        log("ERROR: " + m_startupError);
+        BQAUDIOIO_LOG_ERROR(logComponent, m_startupError);
 	Pa_CloseStream(m_stream);
 	m_stream = nullptr;
         deinitialise();
 	return;
     }
 
-    ostringstream os;
-    os << "started successfully: rate " << m_sampleRate
-       << ", device input channels " << m_inputChannels
-       << " to record target channels " << m_targetChannels
-       << ", play source channels " << m_sourceChannels
-       << " to device output channels " << m_outputChannels
-       << ", buffer channels " << m_bufferChannels
-       << ", buffer size " << m_bufferSize
-       << ", input latency " << m_inputLatency
-       << ", output latency " << m_outputLatency;
-    log(os.str());
+    BQAUDIOIO_LOG_INFO(logComponent, "Started successfully"
+                       << logField("rate", m_sampleRate)
+                       << logField("deviceInputChannels", m_inputChannels)
+                       << logField("targetChannels", m_targetChannels)
+                       << logField("sourceChannels", m_sourceChannels)
+                       << logField("deviceOutputChannels", m_outputChannels)
+                       << logField("bufferChannels", m_bufferChannels)
+                       << logField("bufferSize", m_bufferSize)
+                       << logField("inputLatency", m_inputLatency)
+                       << logField("outputLatency", m_outputLatency));
 }
 
 PortAudioIO::~PortAudioIO()
 {
     auto err = closeStream();
     if (err != paNoError) {
-        log("ERROR: Failed to close PortAudio stream");
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to close PortAudio stream");
     }
     
     deallocate_channels(m_buffers, m_bufferChannels);
+    deallocate_channels(m_mixed, m_bufferChannels);
+    deallocate(m_converted);
     deinitialise();
-    log("closed");
+    BQAUDIOIO_LOG_INFO(logComponent, "Closed");
+}
+
+void
+PortAudioIO::queryStreamInfo()
+{
+    const PaStreamInfo *info = Pa_GetStreamInfo(m_stream);
+    m_outputLatency = int(info->outputLatency * m_sampleRate + 0.001);
+    m_inputLatency = int(info->inputLatency * m_sampleRate + 0.001);
+    m_monitor.setLatency(CallbackMonitor::Playback, m_outputLatency);
+    m_monitor.setLatency(CallbackMonitor::Record, m_inputLatency);
+    if (m_bufferSize == 0) m_bufferSize = m_outputLatency;
+    if (m_bufferSize == 0) m_bufferSize = m_inputLatency;
+    if (m_bufferSize == 0) m_bufferSize = 1024;
+}
+
+void
+PortAudioIO::allocateBuffers()
+{
+    // Called only while the stream is stopped
+    
+    deallocate_channels(m_buffers, m_bufferChannels);
+    deallocate_channels(m_mixed, m_bufferChannels);
+    deallocate(m_converted);
+    m_converted = nullptr;
+    
+    m_bufferChannels = std::max(std::max(m_sourceChannels, m_targetChannels),
+                                std::max(m_inputChannels, m_outputChannels));
+    m_buffers = allocate_and_zero_channels<float>(m_bufferChannels, m_bufferSize);
+    m_mixed = allocate_and_zero_channels<float>(m_bufferChannels, m_bufferSize);
+    m_gains.resize(m_bufferChannels, 1.f);
+    m_peaks.resize(m_bufferChannels, 0.f);
+    m_inputPtrs.resize(m_bufferChannels, nullptr);
+    m_outputPtrs.resize(m_bufferChannels, nullptr);
+    m_sourcePtrs.resize(m_bufferChannels, nullptr);
+    m_targetPtrs.resize(m_bufferChannels, nullptr);
+    if (m_requestedFormat != SampleFormat::Float32) {
+        // (allocated even if we fell back to float, in case a
+        // later reopen gets the integer format after all)
+        m_converted = allocate_and_zero<float>(m_bufferChannels * m_bufferSize);
+    }
+
+    // Output is metered as sent to the device, input as the target
+    // receives it
+    m_outputMeter->configure(m_outputChannels);
+    m_inputMeter->configure(m_targetChannels);
+}
+
+void
+PortAudioIO::configureMixers()
+{
+    // Compile outside the lock, so that the audio callback is held
+    // up only for the swap
+    
+    ChannelMixer outputMixer, inputMixer;
+
+    if (m_source &&
+        !outputMixer.configure(m_outputMatrix,
+                               m_outputChannels, m_sourceChannels)) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "Output mixing matrix does not "
+                              << "fit the channels, using default mapping"
+                              << logField("sourceChannels", m_sourceChannels)
+                              << logField("deviceChannels", m_outputChannels));
+    }
+    if (m_target &&
+        !inputMixer.configure(m_inputMatrix, m_targetChannels,
+                              getSelectedInputCount())) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "Input mixing matrix does not "
+                              << "fit the channels, using default mapping"
+                              << logField("deviceChannels",
+                                          getSelectedInputCount())
+                              << logField("targetChannels", m_targetChannels));
+    }
+
+    lock_guard<mutex> guard(m_mixerMutex);
+    std::swap(m_outputMixer, outputMixer);
+    std::swap(m_inputMixer, inputMixer);
+    negotiateInterleaving();
+}
+
+void
+PortAudioIO::reopenStream()
+{
+    bool wasSuspended = m_suspended;
+
+    PaError err = closeStream();
+    if (err != paNoError) {
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to close PortAudio stream "
+                            << "in order to reopen it");
+    }
+
+    err = openStream();
+    if (err != paNoError) {
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to reopen PortAudio stream"
+                            << logField("error", Pa_GetErrorText(err)));
+        m_stream = nullptr;
+        return;
+    }
+
+    queryStreamInfo();
+    pruneRecordChannels();
+    configureMixers();
+    allocateBuffers();
+
+    if (m_source) {
+	m_source->setSystemPlaybackLatency(m_outputLatency);
+        m_source->setSystemPlaybackChannelCount(m_outputChannels);
+    }
+    if (m_target) {
+	m_target->setSystemRecordLatency(m_inputLatency);
+        m_target->setSystemRecordChannelCount(getSelectedInputCount());
+    }
+
+    if (!wasSuspended) {
+        err = Pa_StartStream(m_stream);
+        if (err != paNoError) {
+            BQAUDIOIO_LOG_ERROR(logComponent, "Failed to restart PortAudio "
+                                << "stream"
+                                << logField("error", Pa_GetErrorText(err)));
+        }
+    }
+}
+
+void
+PortAudioIO::setOutputMixingMatrix(const MixingMatrix &matrix)
+{
+    SystemPlaybackTarget::setOutputMixingMatrix(matrix);
+    if (!m_stream || !m_source) return;
+
+    // The device gets one channel per matrix row, as far as it can
+    
+    int channels = m_sourceChannels;
+    if (!matrix.isEmpty() && matrix.getInputCount() == m_sourceChannels) {
+        channels = matrix.getOutputCount();
+    }
+    const PaDeviceInfo *info = Pa_GetDeviceInfo(m_playbackDevice);
+    if (info && info->maxOutputChannels > 0 &&
+        channels > info->maxOutputChannels) {
+        channels = info->maxOutputChannels;
+    }
+
+    if (channels != m_outputChannels) {
+        BQAUDIOIO_LOG_INFO(logComponent, "Reopening stream to change device "
+                           << "output channels"
+                           << logField("from", m_outputChannels)
+                           << logField("to", channels));
+        m_outputChannels = channels;
+        reopenStream();
+    } else {
+        configureMixers();
+    }
+}
+
+void
+PortAudioIO::setInputMixingMatrix(const MixingMatrix &matrix)
+{
+    SystemRecordSource::setInputMixingMatrix(matrix);
+    if (!m_stream || !m_target) return;
+
+    if (!m_recordChannels.empty()) {
+        // The device channels are fixed by the selection
+        configureMixers();
+        return;
+    }
+
+    // The device gets one channel per matrix column, as far as it can
+    
+    int channels = m_targetChannels;
+    if (!matrix.isEmpty() && matrix.getOutputCount() == m_targetChannels) {
+        channels = matrix.getInputCount();
+    }
+    const PaDeviceInfo *info = Pa_GetDeviceInfo(m_recordDevice);
+    if (info && info->maxInputChannels > 0 &&
+        channels > info->maxInputChannels) {
+        channels = info->maxInputChannels;
+    }
+
+    if (channels != m_inputChannels) {
+        BQAUDIOIO_LOG_INFO(logComponent, "Reopening stream to change device "
+                           << "input channels"
+                           << logField("from", m_inputChannels)
+                           << logField("to", channels));
+        m_inputChannels = channels;
+        reopenStream();
+    } else {
+        configureMixers();
+    }
+}
+
+bool
+PortAudioIO::setDeadlineWarningThreshold(double fraction)
+{
+    m_monitor.setDeadlineWarning(fraction, int(m_sampleRate),
+                                 m_source, m_target);
+    return true;
+}
+
+int
+PortAudioIO::getSelectedInputCount() const
+{
+    if (m_recordChannels.empty()) {
+        return m_inputChannels;
+    } else {
+        return int(m_recordChannels.size());
+    }
+}
+
+void
+PortAudioIO::pruneRecordChannels()
+{
+    // Drop any selected channels the device doesn't have (or has not
+    // agreed to open)
+    
+    vector<int> valid;
+    for (int c: m_recordChannels) {
+        if (c >= 0 && c < m_inputChannels) {
+            valid.push_back(c);
+        } else {
+            BQAUDIOIO_LOG_WARNING(logComponent, "Selected record channel is "
+                                  << "not available from the device, "
+                                  << "ignoring it"
+                                  << logField("channel", c)
+                                  << logField("deviceChannels", m_inputChannels));
+        }
+    }
+    if (!m_recordChannels.empty() && valid.empty()) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "None of the selected record "
+                              << "channels is available, recording all "
+                              << "channels instead");
+    }
+    m_recordChannels = valid;
+}
+
+void
+PortAudioIO::negotiateInterleaving()
+{
+    // The application's interleaved callbacks can be given the
+    // device buffer directly only if no channel reconfiguration is
+    // needed between the two
+    
+    m_sourceInterleaved =
+        (!m_nonInterleaved &&
+         m_source && m_source->supportsInterleavedSamples() &&
+         m_outputMixer.isIdentity());
+
+    m_targetInterleaved =
+        (!m_nonInterleaved &&
+         m_target && m_target->supportsInterleavedSamples() &&
+         m_recordChannels.empty() &&
+         m_inputMixer.isIdentity());
+
+    if (m_sourceInterleaved) {
+        BQAUDIOIO_LOG_INFO(logComponent, "Application source takes "
+                           << "interleaved samples, passing device buffer "
+                           << "through");
+    }
+    if (m_targetInterleaved) {
+        BQAUDIOIO_LOG_INFO(logComponent, "Application target takes "
+                           << "interleaved samples, passing device buffer "
+                           << "through");
+    }
+}
+
+static int
+findSupportedChannelCount(PaStreamParameters params, bool input,
+                          double sampleRate)
+{
+    // Return the largest count no greater than the one requested
+    // that the device accepts, or 0 if it accepts none of them
+    while (params.channelCount > 0) {
+        PaError err = input ?
+            Pa_IsFormatSupported(&params, 0, sampleRate) :
+            Pa_IsFormatSupported(0, &params, sampleRate);
+        if (err == paFormatIsSupported) {
+            break;
+        }
+        --params.channelCount;
+    }
+    return params.channelCount;
+}
+
+static PaSampleFormat
+paSampleFormat(SampleFormat format)
+{
+    switch (format) {
+    case SampleFormat::Int16: return paInt16;
+    case SampleFormat::Int24: return paInt24;
+    case SampleFormat::Int32: return paInt32;
+    case SampleFormat::Float32: return paFloat32;
+    }
+    return paFloat32;
+}
+
+static bool
+hostTakesFloat(PaDeviceIndex device)
+{
+    // True if the host API for this device works in floating point
+    // throughout, so that PortAudio has no need to clip or dither
+    const PaDeviceInfo *info = Pa_GetDeviceInfo(device);
+    if (!info) return false;
+    const PaHostApiInfo *hostInfo = Pa_GetHostApiInfo(info->hostApi);
+    if (!hostInfo) return false;
+    return (hostInfo->type == paJACK || hostInfo->type == paCoreAudio);
 }
 
 PaError
@@ -440,45 +763,130 @@ PortAudioIO::openStream()
     if (m_mode == Mode::Duplex && !m_recordEnabled) {
         activeMode = Mode::Playback;
     }
-    
-    m_bufferSize = 0;
-    err = openStreamStatic
-        (activeMode, &m_stream, &ip, &op, m_sampleRate,
-         paFramesPerBufferUnspecified, this);
 
-    if (err != paNoError) {
-	m_bufferSize = 1024;
-        err = openStreamStatic
-            (activeMode, &m_stream, &ip, &op, m_sampleRate, 1024, this);
+    PaStreamFlags flags = paNoFlag;
+    if ((activeMode == Mode::Playback || hostTakesFloat(m_recordDevice)) &&
+        (activeMode == Mode::Record || hostTakesFloat(m_playbackDevice))) {
+        flags = paClipOff | paDitherOff;
+    }
+
+    // Non-interleaved streams let us pass the device's channel
+    // buffers straight to the application, unless the application
+    // has asked for interleaved samples, in which case an
+    // interleaved stream is the one that can be passed straight
+    // through
+    bool preferInterleaved =
+        ((m_source && m_source->supportsInterleavedSamples()) ||
+         (m_target && m_target->supportsInterleavedSamples()));
+
+    m_nonInterleaved = false;
+    m_deviceFormat = SampleFormat::Float32;
+
+    if (m_requestedFormat != SampleFormat::Float32) {
+
+        // We convert, clip and dither ourselves, into an interleaved
+        // buffer of the device's format
+        
+        ip.sampleFormat = paSampleFormat(m_requestedFormat);
+        op.sampleFormat = paSampleFormat(m_requestedFormat);
+        err = tryOpenStream(activeMode, &ip, &op, paClipOff | paDitherOff);
+        if (err == paNoError) {
+            BQAUDIOIO_LOG_INFO(logComponent, "Opened stream with integer samples"
+                               << logField("bytesPerSample",
+                                           bytes_per_sample(m_requestedFormat)));
+            m_deviceFormat = m_requestedFormat;
+            return err;
+        }
+        BQAUDIOIO_LOG_INFO(logComponent, "Failed to open stream in requested "
+                           << "integer format, trying float"
+                           << logField("error", Pa_GetErrorText(err)));
+        ip.sampleFormat = paFloat32;
+        op.sampleFormat = paFloat32;
+    }
+    
+    if (!preferInterleaved) {
+        ip.sampleFormat = paFloat32 | paNonInterleaved;
+        op.sampleFormat = paFloat32 | paNonInterleaved;
+        err = tryOpenStream(activeMode, &ip, &op, flags);
+        if (err == paNoError) {
+            BQAUDIOIO_LOG_INFO(logComponent, "Opened non-interleaved stream");
+            m_nonInterleaved = true;
+            return err;
+        }
+        BQAUDIOIO_LOG_INFO(logComponent, "Failed to open non-interleaved "
+                           << "stream, trying interleaved"
+                           << logField("error", Pa_GetErrorText(err)));
+        ip.sampleFormat = paFloat32;
+        op.sampleFormat = paFloat32;
     }
 
+    err = tryOpenStream(activeMode, &ip, &op, flags);
+
     if (err != paNoError) {
-        if (m_inputChannels != 2 || m_outputChannels != 2) {
 
-            log(string("WARNING: Failed to open PortAudio stream: ") + 
-                Pa_GetErrorText(err) + ": trying again with 2x2 configuration");
+        // Rather than dropping straight to stereo, find the largest
+        // channel count that each side can open on its own, so that
+        // a many-channel device that rejects one configuration keeps
+        // as many of its channels as it can
+        
+        int inputChannels = m_inputChannels;
+        int outputChannels = m_outputChannels;
+        if (activeMode != Mode::Playback) {
+            inputChannels = findSupportedChannelCount(ip, true, m_sampleRate);
+        }
+        if (activeMode != Mode::Record) {
+            outputChannels = findSupportedChannelCount(op, false, m_sampleRate);
+        }
+        
+        if (inputChannels == 0 || outputChannels == 0) {
+            BQAUDIOIO_LOG_ERROR(logComponent, "Failed to open PortAudio "
+                                << "stream, and device supports no channel "
+                                << "count in this format"
+                                << logField("error", Pa_GetErrorText(err))
+                                << logField("inputChannels", inputChannels)
+                                << logField("outputChannels", outputChannels));
+            
+        } else if (inputChannels != m_inputChannels ||
+                   outputChannels != m_outputChannels) {
+
+            BQAUDIOIO_LOG_WARNING(logComponent, "Failed to open PortAudio "
+                                  << "stream, trying again with fewer channels"
+                                  << logField("error", Pa_GetErrorText(err))
+                                  << logField("inputChannels", inputChannels)
+                                  << logField("outputChannels", outputChannels));
             
-            m_inputChannels = 2;
-            m_outputChannels = 2;
+            m_inputChannels = inputChannels;
+            m_outputChannels = outputChannels;
             ip.channelCount = m_inputChannels;
             op.channelCount = m_outputChannels;
 
-            m_bufferSize = 0;
-            err = openStreamStatic
-                (activeMode, &m_stream, &ip, &op, m_sampleRate,
-                 paFramesPerBufferUnspecified, this);
-
-            m_bufferSize = 1024;
-            if (err != paNoError) {
-                err = openStreamStatic
-                    (activeMode, &m_stream, &ip, &op, m_sampleRate, 1024, this);
-            }
+            err = tryOpenStream(activeMode, &ip, &op, flags);
         }
     }
 
     return err;
 }
 
+PaError
+PortAudioIO::tryOpenStream(Mode activeMode,
+                           const PaStreamParameters *ip,
+                           const PaStreamParameters *op,
+                           PaStreamFlags flags)
+{
+    m_bufferSize = 0;
+    PaError err = openStreamStatic
+        (activeMode, &m_stream, ip, op, m_sampleRate,
+         paFramesPerBufferUnspecified, flags, this);
+
+    if (err != paNoError) {
+	m_bufferSize = 1024;
+        err = openStreamStatic
+            (activeMode, &m_stream, ip, op, m_sampleRate, 1024, flags, this);
+    }
+
+    return err;
+}
+
 PaError
 PortAudioIO::closeStream()
 {
@@ -487,16 +895,18 @@ PortAudioIO::closeStream()
         if (!m_suspended) {
             err = Pa_StopStream(m_stream);
             if (err != paNoError) {
-                log("ERROR: Failed to stop PortAudio stream");
+                BQAUDIOIO_LOG_ERROR(logComponent, "Failed to stop PortAudio "
+                                    << "stream");
                 err = Pa_AbortStream(m_stream);
                 if (err != paNoError) {
-                    log("ERROR: Failed to abort PortAudio stream");
+                    BQAUDIOIO_LOG_ERROR(logComponent, "Failed to abort "
+                                        << "PortAudio stream");
                 }
             }
 	}
 	err = Pa_CloseStream(m_stream);
 	if (err != paNoError) {
-	    log("ERROR: Failed to close PortAudio stream");
+	    BQAUDIOIO_LOG_ERROR(logComponent, "Failed to close PortAudio stream");
 	}
         m_stream = nullptr;
     }
@@ -510,21 +920,9 @@ PortAudioIO::suppressRecordSide(bool suppress)
     if (enabled == m_recordEnabled) {
         return;
     }
-    bool wasSuspended = m_suspended;
-    PaError err = paNoError;
     if (m_stream) {
-        err = closeStream();
-        if (err != paNoError) {
-            log("ERROR: Failed to close PortAudio stream in order to change record mode");
-        }
         m_recordEnabled = enabled;
-        err = openStream();
-        if (err != paNoError) {
-            log("ERROR: Failed to reopen PortAudio stream in order to change record mode");
-        }
-        if (!wasSuspended) {
-            resume();
-        }
+        reopenStream();
     }        
 }
 
@@ -535,19 +933,20 @@ PortAudioIO::openStreamStatic(Mode mode,
                               const PaStreamParameters *outputParameters,
                               double sampleRate,
                               unsigned long framesPerBuffer,
+                              PaStreamFlags flags,
                               void *data)
 {
     switch (mode) {
     case Mode::Playback:
         return Pa_OpenStream(stream, 0, outputParameters, sampleRate,
-                             framesPerBuffer, paNoFlag, processStatic, data);
+                             framesPerBuffer, flags, processStatic, data);
     case Mode::Record:
         return Pa_OpenStream(stream, inputParameters, 0, sampleRate,
-                             framesPerBuffer, paNoFlag, processStatic, data);
+                             framesPerBuffer, flags, processStatic, data);
     case Mode::Duplex:
         return Pa_OpenStream(stream, inputParameters, outputParameters,
                              sampleRate,
-                             framesPerBuffer, paNoFlag, processStatic, data);
+                             framesPerBuffer, flags, processStatic, data);
     };
     return paNoError;
 }
@@ -584,31 +983,35 @@ PortAudioIO::getCurrentTime() const
 void
 PortAudioIO::suspend()
 {
-    log("suspend called");
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Suspend called");
 
     if (m_suspended || !m_stream) return;
     PaError err = Pa_StopStream(m_stream);
     if (err != paNoError) {
-        log("ERROR: Failed to stop PortAudio stream");
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to stop PortAudio stream"
+                            << logField("error", Pa_GetErrorText(err)));
     }
     
     m_suspended = true;
-    log("suspended");
+    m_monitor.setSuspended(true);
+    BQAUDIOIO_LOG_INFO(logComponent, "Suspended");
 }
 
 void
 PortAudioIO::resume()
 {
-    log("resume called");
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Resume called");
 
     if (!m_suspended || !m_stream) return;
     PaError err = Pa_StartStream(m_stream);
     if (err != paNoError) {
-        cerr << "ERROR: Failed to restart PortAudio stream";
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to restart PortAudio stream"
+                            << logField("error", Pa_GetErrorText(err)));
     }
 
     m_suspended = false;
-    log("resumed");
+    m_monitor.setSuspended(false);
+    BQAUDIOIO_LOG_INFO(logComponent, "Resumed");
 }
 
 int
@@ -625,137 +1028,503 @@ PortAudioIO::processStatic(const void *input, void *output,
 int
 PortAudioIO::process(const void *inputBuffer, void *outputBuffer,
                      unsigned long pa_nframes,
-                     const PaStreamCallbackTimeInfo *,
-                     PaStreamCallbackFlags)
+                     const PaStreamCallbackTimeInfo *timeInfo,
+                     PaStreamCallbackFlags statusFlags)
 {
-#ifdef DEBUG_AUDIO_PORT_AUDIO_IO
-    {
-        ostringstream os;
-        os << "process: " << pa_nframes << " frames";
-        log(os.str());
-    }
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Process"
+                        << logField("frames", pa_nframes));
 
     if (!m_prioritySet) {
         enableRT();
         m_prioritySet = true;
     }
 
-    if (!m_source && !m_target) return 0;
-    if (!m_stream) return 0;
+    RealtimeCheck::Scope rtcheck;
+    m_monitor.beginCallback("PortAudio callback");
 
     if (pa_nframes > INT_MAX) pa_nframes = 0;
 
     int nframes = int(pa_nframes);
 
-    if (nframes > m_bufferSize) {
-#ifdef DEBUG_AUDIO_PORT_AUDIO_IO
-        {
-            ostringstream os;
-            os << "extending channel buffers from "
-               << m_bufferSize << " to " << nframes << " frames (across "
-               << m_bufferChannels << " channel(s))";
-            log(os.str());
+    if ((!m_source && !m_target) || !m_stream) {
+        m_monitor.endCallback(nframes, int(m_sampleRate));
+        return 0;
+    }
+
+    // The mixers are swapped under this lock when a new matrix is
+    // set. That takes only a moment, so if we happen to coincide
+    // with it, just play silence for this one block
+    unique_lock<mutex> mixerLock(m_mixerMutex, try_to_lock);
+    if (!mixerLock.owns_lock()) {
+        if (m_outputChannels > 0 && outputBuffer) {
+            silenceOutput(outputBuffer, nframes);
         }
-#endif
-        m_buffers = reallocate_and_zero_extend_channels
-            (m_buffers,
-             m_bufferChannels, m_bufferSize,
-             m_bufferChannels, nframes);
-        m_bufferSize = nframes;
+        m_monitor.endCallback(nframes, int(m_sampleRate));
+        return 0;
+    }
+
+    CallbackTiming timing = CallbackTiming();
+    if (timeInfo) {
+        timing.currentTime = timeInfo->currentTime;
+        timing.outputTime = timeInfo->outputBufferDacTime;
+        timing.inputTime = timeInfo->inputBufferAdcTime;
+    }
+    timing.frame = m_frameCount;
+    if (statusFlags & paInputUnderflow) {
+        timing.flags |= CallbackTiming::InputUnderflow;
+    }
+    if (statusFlags & paInputOverflow) {
+        timing.flags |= CallbackTiming::InputOverflow;
+    }
+    if (statusFlags & paOutputUnderflow) {
+        timing.flags |= CallbackTiming::OutputUnderflow;
+    }
+    if (statusFlags & paOutputOverflow) {
+        timing.flags |= CallbackTiming::OutputOverflow;
     }
+    if (statusFlags & paPrimingOutput) {
+        timing.flags |= CallbackTiming::PrimingOutput;
+    }
+    m_monitor.reportDropouts(timing.flags, timing.frame);
+    m_frameCount += nframes;
     
     const float *input = (const float *)inputBuffer;
     float *output = (float *)outputBuffer;
 
-    float peakLeft, peakRight;
+    // With an integer device format, the application side works on
+    // an interleaved float buffer converted on the way in and out,
+    // one sub-block at a time. Input is done with this buffer before
+    // output starts on it
+    bool converting = (m_deviceFormat != SampleFormat::Float32);
+    int bytes = bytes_per_sample(m_deviceFormat);
+
+    // In a non-interleaved stream, the buffer arguments are arrays
+    // of per-channel pointers
+    const float *const *inputChannels = (const float *const *)inputBuffer;
+    float *const *outputChannels = (float *const *)outputBuffer;
+
+    // With a sub-block size set, each stage runs over one short
+    // sub-block at a time, so that the data stays in cache from the
+    // application's callback through to the device buffer. A block
+    // larger than our buffers, which PortAudio may deliver when the
+    // stream was opened with an unspecified block size, is also
+    // split, rather than reallocating here
+    int block = nframes;
+    if (m_subBlockSize > 0 && m_subBlockSize < block) {
+        block = m_subBlockSize;
+    }
+    if (block > m_bufferSize) {
+        block = m_bufferSize;
+    }
+    
+    float peakLeft = 0.f, peakRight = 0.f;
 
     if (m_target && input) {
 
-#ifdef DEBUG_AUDIO_PORT_AUDIO_IO
-        log("have input and a record target, recording");
-#endif
+        BQAUDIOIO_LOG_DEBUG(logComponent, "Have input and a record target, "
+                            << "recording");
+
+        for (int off = 0; off < nframes; off += block) {
+            int n = std::min(block, nframes - off);
+            if (m_nonInterleaved) {
+                processInputChannels(inputChannels, off, n,
+                                     subBlockTiming(timing, off),
+                                     peakLeft, peakRight);
+            } else if (converting) {
+                v_convert_to_float(m_converted,
+                                   (const char *)inputBuffer +
+                                   size_t(off) * m_inputChannels * bytes,
+                                   n * m_inputChannels, m_deviceFormat);
+                processInput(m_converted, n,
+                             subBlockTiming(timing, off),
+                             peakLeft, peakRight);
+            } else {
+                processInput(input + off * m_inputChannels, n,
+                             subBlockTiming(timing, off),
+                             peakLeft, peakRight);
+            }
+        }
+        
+        if (m_inputLevelCallbacks) {
+            m_target->setInputLevels(peakLeft, peakRight);
+        }
+    }
+
+    if (m_source && output) {
+
+        BQAUDIOIO_LOG_DEBUG(logComponent, "Have output and a playback "
+                            << "source, playing");
+
+        int silent = getScheduledSilence(timing.frame, nframes);
+
+        peakLeft = 0.f, peakRight = 0.f;
+        
+        for (int off = 0; off < nframes; off += block) {
+            int n = std::min(block, nframes - off);
+            int s = std::max(0, std::min(n, silent - off));
+            if (m_nonInterleaved) {
+                processOutputChannels(outputChannels, off, n, s,
+                                      subBlockTiming(timing, off),
+                                      peakLeft, peakRight);
+            } else if (converting) {
+                processOutput(m_converted, n, s,
+                              subBlockTiming(timing, off),
+                              peakLeft, peakRight);
+                v_convert_from_float((char *)outputBuffer +
+                                     size_t(off) * m_outputChannels * bytes,
+                                     m_converted, n * m_outputChannels,
+                                     m_deviceFormat, m_dither);
+            } else {
+                processOutput(output + off * m_outputChannels, n, s,
+                              subBlockTiming(timing, off),
+                              peakLeft, peakRight);
+            }
+        }
+        
+        if (m_outputLevelCallbacks) {
+            m_source->setOutputLevels(peakLeft, peakRight);
+        }
+
+    } else if (m_outputChannels > 0 && output) {
+
+        silenceOutput(outputBuffer, nframes);
+    }
+
+    m_monitor.endCallback(nframes, int(m_sampleRate));
+    
+    return 0;
+}
+
+void
+PortAudioIO::silenceOutput(void *outputBuffer, int nframes)
+{
+    if (m_deviceFormat != SampleFormat::Float32) {
+        memset(outputBuffer, 0, size_t(nframes) * m_outputChannels *
+               bytes_per_sample(m_deviceFormat));
+    } else if (m_nonInterleaved) {
+        float *const *outputChannels = (float *const *)outputBuffer;
+        for (int c = 0; c < m_outputChannels; ++c) {
+            v_zero(outputChannels[c], nframes);
+        }
+    } else {
+        v_zero((float *)outputBuffer, m_outputChannels * nframes);
+    }
+}
+
+CallbackTiming
+PortAudioIO::subBlockTiming(const CallbackTiming &timing, int offset) const
+{
+    if (offset == 0) return timing;
+    
+    CallbackTiming t(timing);
+    double sec = double(offset) / m_sampleRate;
+    t.frame += offset;
+    if (t.outputTime != 0.0) t.outputTime += sec;
+    if (t.inputTime != 0.0) t.inputTime += sec;
+
+    // Status flags relate to the callback as a whole, so are
+    // reported with its first sub-block only
+    t.flags = 0;
+    return t;
+}
+
+static void
+accumulateBlockPeaks(const Meter &meter, float &peakLeft, float &peakRight)
+{
+    float left, right;
+    meter.getBlockPeaks(left, right);
+    if (left > peakLeft) peakLeft = left;
+    if (right > peakRight) peakRight = right;
+}
+
+void
+PortAudioIO::processInput(const float *input, int nframes,
+                          const CallbackTiming &timing,
+                          float &peakLeft, float &peakRight)
+{
+    if (m_targetInterleaved) {
+
+        // Hand the device buffer straight to the application
+        
+        m_inputMeter->processInterleaved(input, m_inputChannels, nframes);
+        accumulateBlockPeaks(*m_inputMeter, peakLeft, peakRight);
 
+        m_monitor.beginApplication();
+        m_target->putSamplesInterleaved
+            (input, m_inputChannels, nframes, timing);
+        m_monitor.endApplication(CallbackMonitor::Record, nframes);
+        return;
+    }
+    
+    if (m_recordChannels.empty()) {
         v_deinterleave
             (m_buffers, input, m_inputChannels, nframes);
-        
-        v_reconfigure_channels_inplace
-            (m_buffers, m_targetChannels, m_inputChannels, nframes);
+    } else {
+        v_gather_channels
+            (m_buffers, input, m_inputChannels, m_recordChannels.data(),
+             int(m_recordChannels.size()), nframes);
+    }
+
+    const float *const *mapped = mapInput(m_buffers, nframes);
+    
+    m_inputMeter->process(mapped, m_targetChannels, nframes);
+    accumulateBlockPeaks(*m_inputMeter, peakLeft, peakRight);
+
+    m_monitor.beginApplication();
+    m_target->putSamplesWithTiming
+        (mapped, m_targetChannels, nframes, timing);
+    m_monitor.endApplication(CallbackMonitor::Record, nframes);
+}
 
-        peakLeft = 0.0, peakRight = 0.0;
+const float *const *
+PortAudioIO::mapInput(const float *const *device, int nframes)
+{
+    // Map the device's input channels onto the target's, by picking
+    // channels where the matrix allows and mixing where not
+    
+    const ChannelMixer &mixer = m_inputMixer;
 
-        for (int c = 0; c < m_targetChannels && c < 2; ++c) {
-            float peak = 0.f;
-            for (int i = 0; i < nframes; ++i) {
-                float sample = fabsf(m_buffers[c][i]);
-                if (sample > peak) peak = sample;
+    if (mixer.isIdentity()) {
+        return device;
+    }
+
+    if (mixer.isRouting()) {
+        for (int c = 0; c < m_targetChannels; ++c) {
+            int route = mixer.getRoute(c);
+            if (route >= 0) {
+                m_targetPtrs[c] = device[route];
+            } else {
+                v_zero(m_mixed[c], nframes);
+                m_targetPtrs[c] = m_mixed[c];
             }
-            if (c == 0) peakLeft = peak;
-            if (c > 0 || m_targetChannels == 1) peakRight = peak;
         }
+        return m_targetPtrs.data();
+    }
+
+    mixer.mix(m_mixed, device, nframes);
+    return m_mixed;
+}
 
-        m_target->putSamples(m_buffers, m_targetChannels, nframes);
-        m_target->setInputLevels(peakLeft, peakRight);
+void
+PortAudioIO::processInputChannels(const float *const *input,
+                                  int offset, int nframes,
+                                  const CallbackTiming &timing,
+                                  float &peakLeft, float &peakRight)
+{
+    // The device's channel buffers go straight to the application,
+    // or are picked from or mixed, without any intermediate copy
+        
+    if (m_recordChannels.empty()) {
+        for (int c = 0; c < m_inputChannels; ++c) {
+            m_inputPtrs[c] = input[c] + offset;
+        }
+    } else {
+        for (int c = 0; c < int(m_recordChannels.size()); ++c) {
+            m_inputPtrs[c] = input[m_recordChannels[c]] + offset;
+        }
     }
 
-    if (m_source && output) {
+    const float *const *mapped = mapInput(m_inputPtrs.data(), nframes);
+    
+    m_inputMeter->process(mapped, m_targetChannels, nframes);
+    accumulateBlockPeaks(*m_inputMeter, peakLeft, peakRight);
 
-#ifdef DEBUG_AUDIO_PORT_AUDIO_IO
-        log("have output and a playback source, playing");
-#endif
+    m_monitor.beginApplication();
+    m_target->putSamplesWithTiming
+        (mapped, m_targetChannels, nframes, timing);
+    m_monitor.endApplication(CallbackMonitor::Record, nframes);
+}
+
+void
+PortAudioIO::processOutput(float *output, int nframes, int silent,
+                           const CallbackTiming &timing,
+                           float &peakLeft, float &peakRight)
+{
+    int received = 0;
 
-        int received = m_source->getSourceSamples
-            (m_buffers, m_sourceChannels, nframes);
+    CallbackTiming sourceTiming(timing);
+    if (silent > 0) {
+        sourceTiming.frame += silent;
+        if (sourceTiming.outputTime != 0.0) {
+            sourceTiming.outputTime += double(silent) / m_sampleRate;
+        }
+    }
 
-#ifdef DEBUG_AUDIO_PORT_AUDIO_IO
-        {
-            ostringstream os;
-            os << "received " << received << " frames from application source";
-            log(os.str());
+    float *gain = m_gains.data();
+    Gains::gainsFor(m_outputGain, m_outputBalance, gain, m_outputChannels);
+    
+    if (m_sourceInterleaved) {
+
+        // The application writes straight into the device buffer,
+        // after any scheduled silence
+
+        int channels = m_outputChannels;
+        v_zero(output, silent * channels);
+
+        if (silent < nframes) {
+            m_monitor.beginApplication();
+            received = m_source->getSourceSamplesInterleaved
+                (output + silent * channels, channels,
+                 nframes - silent, sourceTiming);
+            m_monitor.endApplication(CallbackMonitor::Playback,
+                                     nframes - silent);
+            m_monitor.reportSourceDelivery(sourceTiming.frame,
+                                           nframes - silent, received);
+        }
+        
+        if (silent + received < nframes) {
+            v_zero(output + (silent + received) * channels,
+                   (nframes - silent - received) * channels);
         }
-#endif
 
-        if (received < nframes) {
-            ostringstream os;
-            os << "WARNING: requested " << nframes
-               << " from application source, received only " << received;
-            log(os.str());
-            for (int c = 0; c < m_sourceChannels; ++c) {
-                v_zero(m_buffers[c] + received, nframes - received);
+        v_gain_peak_interleaved
+            (output, channels, nframes, gain, m_peaks.data());
+        
+    } else {
+
+        float *const *rendered =
+            renderIntoBuffers(nframes, silent, sourceTiming, m_mixed);
+
+        v_interleave_gain_peak
+            (output, rendered, m_outputChannels, nframes,
+             gain, m_peaks.data());
+    }
+
+    m_outputMeter->processInterleaved(output, m_outputChannels, nframes);
+
+    float left = m_peaks[0];
+    float right = (m_outputChannels > 1 ? m_peaks[1] : m_peaks[0]);
+    if (left > peakLeft) peakLeft = left;
+    if (right > peakRight) peakRight = right;
+}
+
+void
+PortAudioIO::processOutputChannels(float *const *output,
+                                   int offset, int nframes, int silent,
+                                   const CallbackTiming &timing,
+                                   float &peakLeft, float &peakRight)
+{
+    CallbackTiming sourceTiming(timing);
+    if (silent > 0) {
+        sourceTiming.frame += silent;
+        if (sourceTiming.outputTime != 0.0) {
+            sourceTiming.outputTime += double(silent) / m_sampleRate;
+        }
+    }
+
+    float *gain = m_gains.data();
+    Gains::gainsFor(m_outputGain, m_outputBalance, gain, m_outputChannels);
+
+    const ChannelMixer &mixer = m_outputMixer;
+    
+    if (mixer.isPermutation()) {
+
+        // The application writes straight into the device's channel
+        // buffers, in whatever order the matrix puts them, after any
+        // scheduled silence
+        
+        for (int c = 0; c < m_outputChannels; ++c) {
+            v_zero(output[c] + offset, silent);
+            m_outputPtrs[mixer.getRoute(c)] = output[c] + offset + silent;
+        }
+
+        int received = 0;
+        if (silent < nframes) {
+            m_monitor.beginApplication();
+            received = m_source->getSourceSamplesWithTiming
+                (m_outputPtrs.data(), m_outputChannels,
+                 nframes - silent, sourceTiming);
+            m_monitor.endApplication(CallbackMonitor::Playback,
+                                     nframes - silent);
+            m_monitor.reportSourceDelivery(sourceTiming.frame,
+                                           nframes - silent, received);
+        }
+
+        if (silent + received < nframes) {
+            for (int c = 0; c < m_outputChannels; ++c) {
+                v_zero(m_outputPtrs[c] + received,
+                       nframes - silent - received);
             }
         }
 
-        v_reconfigure_channels_inplace
-            (m_buffers, m_outputChannels, m_sourceChannels, nframes);
+    } else {
 
-        auto gain = Gains::gainsFor
-            (m_outputGain, m_outputBalance, m_outputChannels);
+        // Mix straight from the source's buffers into the device's
+        
         for (int c = 0; c < m_outputChannels; ++c) {
-            v_scale(m_buffers[c], gain[c], nframes);
+            m_outputPtrs[c] = output[c] + offset;
         }
+        renderIntoBuffers(nframes, silent, sourceTiming, m_outputPtrs.data());
+    }
+
+    for (int c = 0; c < m_outputChannels; ++c) {
+        m_outputPtrs[c] = output[c] + offset;
+    }
+    
+    v_gain_peak_channels(m_outputPtrs.data(), m_outputChannels, nframes,
+                         gain, m_peaks.data());
+    m_outputMeter->process(m_outputPtrs.data(), m_outputChannels, nframes);
+
+    float left = m_peaks[0];
+    float right = (m_outputChannels > 1 ? m_peaks[1] : m_peaks[0]);
+    if (left > peakLeft) peakLeft = left;
+    if (right > peakRight) peakRight = right;
+}
 
-        peakLeft = 0.0, peakRight = 0.0;
-        for (int c = 0; c < m_outputChannels && c < 2; ++c) {
-            float peak = 0.f;
-            for (int i = 0; i < nframes; ++i) {
-                float sample = fabsf(m_buffers[c][i]);
-                if (sample > peak) peak = sample;
+float *const *
+PortAudioIO::renderIntoBuffers(int nframes, int silent,
+                               const CallbackTiming &sourceTiming,
+                               float *const *mixed)
+{
+    int received = 0;
+
+    if (silent < nframes) {
+        m_monitor.beginApplication();
+        received = m_source->getSourceSamplesWithTiming
+            (m_buffers, m_sourceChannels, nframes - silent, sourceTiming);
+        m_monitor.endApplication(CallbackMonitor::Playback,
+                                 nframes - silent);
+        m_monitor.reportSourceDelivery(sourceTiming.frame,
+                                       nframes - silent, received);
+        if (silent > 0) {
+            // Shift the source's samples up to the scheduled start
+            for (int c = 0; c < m_sourceChannels; ++c) {
+                v_move(m_buffers[c] + silent, m_buffers[c], received);
+                v_zero(m_buffers[c], silent);
             }
-            if (c == 0) peakLeft = peak;
-            if (c == 1 || m_outputChannels == 1) peakRight = peak;
+            received += silent;
         }
+    }
 
-        v_interleave
-            (output, m_buffers, m_outputChannels, nframes);
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Received frames from application "
+                        << "source"
+                        << logField("frames", received));
 
-        m_source->setOutputLevels(peakLeft, peakRight);
+    if (received < nframes) {
+        for (int c = 0; c < m_sourceChannels; ++c) {
+            v_zero(m_buffers[c] + received, nframes - received);
+        }
+    }
 
-    } else if (m_outputChannels > 0 && output) {
+    // Map the source's channels onto the device's: a reordering
+    // needs only a reordered pointer table, anything else is mixed
+    // into the buffers given
+    
+    const ChannelMixer &mixer = m_outputMixer;
 
-        v_zero(output, m_outputChannels * nframes);
+    if (mixer.isIdentity()) {
+        return m_buffers;
+    }
+    
+    if (mixer.isPermutation()) {
+        for (int c = 0; c < m_outputChannels; ++c) {
+            m_sourcePtrs[c] = m_buffers[mixer.getRoute(c)];
+        }
+        return m_sourcePtrs.data();
     }
 
-    return 0;
+    mixer.mix(mixed, m_buffers, nframes);
+    return mixed;
 }
 
 }
@@ -39,10 +39,18 @@
 
 #include "SystemAudioIO.h"
 #include "AudioFactory.h"
+#include "CallbackTiming.h"
+#include "SampleFormat.h"
+#include "FormatConversion.h"
+#include "ChannelMixer.h"
+#include "CallbackMonitor.h"
 #include "Mode.h"
 
 #include <vector>
 #include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
 
 namespace breakfastquay {
 
@@ -56,7 +64,10 @@ public:
                 ApplicationRecordTarget *recordTarget,
                 ApplicationPlaybackSource *playSource,
                 std::string recordDevice,
-                std::string playbackDevice);
+                std::string playbackDevice,
+                int subBlockSize = 0,
+                SampleFormat sampleFormat = SampleFormat::Float32,
+                std::vector<int> recordChannels = {});
     virtual ~PortAudioIO();
 
     static std::vector<std::string> getRecordDeviceNames();
@@ -66,11 +77,28 @@ public:
     virtual bool isTargetOK() const override;
 
     virtual double getCurrentTime() const override;
+    virtual int64_t getCurrentFrame() const override { return m_frameCount; }
 
     virtual void suspend() override;
     virtual void resume() override;
 
     virtual void suppressRecordSide(bool) override;
+
+    virtual void setOutputMixingMatrix(const MixingMatrix &) override;
+    virtual void setInputMixingMatrix(const MixingMatrix &) override;
+
+    virtual CallbackStatistics getStatistics() const override {
+        return m_monitor.getStatistics();
+    }
+    virtual void resetStatistics() override { m_monitor.reset(); }
+    virtual std::vector<DropoutEvent> getDropoutEvents(int64_t after = 0) const override {
+        return m_monitor.getDropoutEvents(after);
+    }
+    virtual bool setDeadlineWarningThreshold(double fraction) override;
+    virtual bool publishStatistics(std::string name) override {
+        return m_monitor.publishStatistics(name, "port",
+                                           m_inputMeter, m_outputMeter);
+    }
     
     std::string getStartupErrorString() const { return m_startupError; }
     
@@ -79,13 +107,44 @@ protected:
                 const PaStreamCallbackTimeInfo *timeInfo,
                 PaStreamCallbackFlags statusFlags);
 
+    void processInput(const float *input, int nframes,
+                      const CallbackTiming &timing,
+                      float &peakLeft, float &peakRight);
+    void processOutput(float *output, int nframes, int silent,
+                       const CallbackTiming &timing,
+                       float &peakLeft, float &peakRight);
+    void processInputChannels(const float *const *input,
+                              int offset, int nframes,
+                              const CallbackTiming &timing,
+                              float &peakLeft, float &peakRight);
+    void processOutputChannels(float *const *output,
+                               int offset, int nframes, int silent,
+                               const CallbackTiming &timing,
+                               float &peakLeft, float &peakRight);
+    float *const *renderIntoBuffers(int nframes, int silent,
+                                    const CallbackTiming &sourceTiming,
+                                    float *const *mixed);
+    const float *const *mapInput(const float *const *device, int nframes);
+    void silenceOutput(void *output, int nframes);
+    void negotiateInterleaving();
+    void configureMixers();
+    void allocateBuffers();
+    void queryStreamInfo();
+    void reopenStream();
+    void pruneRecordChannels();
+    int getSelectedInputCount() const;
+    CallbackTiming subBlockTiming(const CallbackTiming &, int offset) const;
+
     PaError openStream();
+    PaError tryOpenStream(Mode, const PaStreamParameters *,
+                          const PaStreamParameters *, PaStreamFlags);
     PaError closeStream();
     
     static PaError openStreamStatic(Mode, PaStream **,
                                     const PaStreamParameters *,
                                     const PaStreamParameters *,
-                                    double, unsigned long, void *);
+                                    double, unsigned long, PaStreamFlags,
+                                    void *);
     
     static int processStatic(const void *, void *, unsigned long,
                              const PaStreamCallbackTimeInfo *,
@@ -103,6 +162,7 @@ protected:
     int m_targetChannels;
     int m_inputChannels;
     int m_outputChannels;
+    std::vector<int> m_recordChannels;
     int m_inputLatency;
     int m_outputLatency;
     bool m_prioritySet;
@@ -110,6 +170,26 @@ protected:
     bool m_recordEnabled;
     float **m_buffers;
     int m_bufferChannels;
+    bool m_nonInterleaved;
+    bool m_sourceInterleaved;
+    bool m_targetInterleaved;
+    std::vector<float> m_gains;
+    std::vector<float> m_peaks;
+    std::vector<const float *> m_inputPtrs;
+    std::vector<float *> m_outputPtrs;
+    std::vector<float *> m_sourcePtrs;
+    std::vector<const float *> m_targetPtrs;
+    ChannelMixer m_outputMixer;
+    ChannelMixer m_inputMixer;
+    std::mutex m_mixerMutex;
+    int m_subBlockSize;
+    SampleFormat m_requestedFormat;
+    SampleFormat m_deviceFormat;
+    DitherState m_dither;
+    float *m_converted;
+    float **m_mixed;
+    std::atomic<int64_t> m_frameCount;
+    CallbackMonitor m_monitor;
     std::string m_startupError;
 
     PortAudioIO(const PortAudioIO &)=delete;
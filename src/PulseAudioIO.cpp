@@ -36,28 +36,39 @@
 #include "ApplicationPlaybackSource.h"
 #include "ApplicationRecordTarget.h"
 #include "Gains.h"
+#include "Kernels.h"
+#include "FormatConversion.h"
 #include "Log.h"
+#include "Meter.h"
+#include "RealtimeCheck.h"
+#include "Tracer.h"
 
 #include "bqvec/VectorOps.h"
 #include "bqvec/Allocators.h"
 
-#include <iostream>
-#include <sstream>
 #include <cmath>
 #include <climits>
 
 using namespace std;
 
-//#define DEBUG_PULSE_AUDIO_IO 1
-
 namespace breakfastquay {
 
-static void log(string message) {
-    Log::log("PulseAudioIO: " + message);
-}    
+static const char *const logComponent = "PulseAudioIO";
 
 static string defaultDeviceName = "Default Device";
 
+static pa_sample_format_t
+pulseSampleFormat(SampleFormat format)
+{
+    switch (format) {
+    case SampleFormat::Int16: return PA_SAMPLE_S16NE;
+    case SampleFormat::Int24: return PA_SAMPLE_S24NE;
+    case SampleFormat::Int32: return PA_SAMPLE_S32NE;
+    case SampleFormat::Float32: return PA_SAMPLE_FLOAT32NE;
+    }
+    return PA_SAMPLE_FLOAT32NE;
+}
+
 vector<string>
 PulseAudioIO::getRecordDeviceNames()
 {
@@ -74,7 +85,10 @@ PulseAudioIO::PulseAudioIO(Mode mode,
                            ApplicationRecordTarget *target,
                            ApplicationPlaybackSource *source,
                            string /* recordDevice */,
-                           string /* playbackDevice */) :
+                           string /* playbackDevice */,
+                           int subBlockSize,
+                           SampleFormat sampleFormat,
+                           vector<int> recordChannels) :
     SystemAudioIO(target, source),
     m_mode(mode),
     m_loop(0),
@@ -83,17 +97,29 @@ PulseAudioIO::PulseAudioIO(Mode mode,
     m_in(0), 
     m_out(0),
     m_buffers(0),
+    m_mixed(0),
     m_interleaved(0),
+    m_sourceInterleaved(false),
+    m_targetInterleaved(false),
+    m_targetChannels(0),
     m_bufferChannels(0),
     m_bufferSize(0),
     m_sampleRate(0),
+    m_subBlockSize(subBlockSize),
+    m_inFormat(sampleFormat),
+    m_outFormat(sampleFormat),
+    m_converted(0),
     m_done(false),
     m_captureReady(false),
     m_playbackReady(false),
+    m_inFrameCount(0),
+    m_outFrameCount(0),
+    m_inFlags(0),
+    m_outFlags(0),
     m_aboutToAct(false),
     m_suspended(false)
 {
-    log("PulseAudioIO: starting");
+    BQAUDIOIO_LOG_INFO(logComponent, "Starting");
 
     if (m_mode == Mode::Playback) {
         m_target = 0;
@@ -108,7 +134,7 @@ PulseAudioIO::PulseAudioIO(Mode mode,
     m_loop = pa_mainloop_new();
     if (!m_loop) {
         m_startupError = "Failed to create PulseAudio main loop";
-        log("ERROR: " + m_startupError);
+        BQAUDIOIO_LOG_ERROR(logComponent, m_startupError);
         return;
     }
 
@@ -117,14 +143,12 @@ PulseAudioIO::PulseAudioIO(Mode mode,
     int sourceRate = 0;
     int targetRate = 0;
 
-    ostringstream os;
-
     if (m_source) {
         sourceRate = m_source->getApplicationSampleRate();
         if (sourceRate != 0) {
-            os << "application source requests sample rate "
-               << sourceRate << ", will try to comply";
-            log(os.str());
+            BQAUDIOIO_LOG_INFO(logComponent, "Application source requests "
+                               << "sample rate, will try to comply"
+                               << logField("rate", sourceRate));
             m_sampleRate = sourceRate;
         }
         m_outSpec.channels = 2;
@@ -139,12 +163,15 @@ PulseAudioIO::PulseAudioIO(Mode mode,
         targetRate = m_target->getApplicationSampleRate();
         if (targetRate != 0) {
             if (sourceRate != 0 && sourceRate != targetRate) {
-                os << "WARNING: Source and target both provide sample rates, but different ones (source " << sourceRate << ", target " << targetRate << ") - using source rate";
-                log(os.str());
+                BQAUDIOIO_LOG_WARNING(logComponent, "Source and target both "
+                                      << "provide sample rates, but different "
+                                      << "ones - using source rate"
+                                      << logField("source", sourceRate)
+                                      << logField("target", targetRate));
             } else {
-                os << "application target requests sample rate "
-                   << targetRate << ", will try to comply";
-                log(os.str());
+                BQAUDIOIO_LOG_INFO(logComponent, "Application target requests "
+                                   << "sample rate, will try to comply"
+                                   << logField("rate", targetRate));
                 m_sampleRate = targetRate;
             }
         }
@@ -152,12 +179,35 @@ PulseAudioIO::PulseAudioIO(Mode mode,
         if (m_target->getApplicationChannelCount() != 0) {
             m_inSpec.channels = (uint8_t)m_target->getApplicationChannelCount();
         }
+        m_targetChannels = m_inSpec.channels;
+        
+        // With a channel selection, open enough channels to reach the
+        // highest one selected, and extract the selection from them
+        int highest = -1;
+        for (int c: recordChannels) {
+            if (c >= 0 && c < int(PA_CHANNELS_MAX)) {
+                m_recordChannels.push_back(c);
+                highest = std::max(highest, c);
+            } else {
+                BQAUDIOIO_LOG_WARNING(logComponent, "Selected record channel "
+                                      << "is out of range, ignoring it"
+                                      << logField("channel", c));
+            }
+        }
+        if (!m_recordChannels.empty()) {
+            m_inSpec.channels = (uint8_t)(highest + 1);
+            if (m_target->getApplicationChannelCount() == 0) {
+                m_targetChannels = getSelectedInputCount();
+            }
+        }
     } else {
         m_inSpec.channels = 0;
     }
 
     if (m_sampleRate == 0) {
-        log("neither source nor target requested a sample rate, requesting default rate of 44100");
+        BQAUDIOIO_LOG_INFO(logComponent, "Neither source nor target "
+                           << "requested a sample rate, requesting default"
+                           << logField("rate", 44100));
         m_sampleRate = 44100;
     }
 
@@ -166,17 +216,38 @@ PulseAudioIO::PulseAudioIO(Mode mode,
     m_inSpec.rate = m_sampleRate;
     m_outSpec.rate = m_sampleRate;
     
-    m_inSpec.format = PA_SAMPLE_FLOAT32NE;
-    m_outSpec.format = PA_SAMPLE_FLOAT32NE;
+    m_inSpec.format = pulseSampleFormat(m_inFormat);
+    m_outSpec.format = pulseSampleFormat(m_outFormat);
     
-    m_bufferChannels = std::max(m_inSpec.channels, m_outSpec.channels);
+    m_bufferChannels = std::max(std::max(int(m_inSpec.channels),
+                                         int(m_outSpec.channels)),
+                                m_targetChannels);
     m_buffers = allocate_and_zero_channels<float>(m_bufferChannels, m_bufferSize);
+    m_mixed = allocate_and_zero_channels<float>(m_bufferChannels, m_bufferSize);
     m_interleaved = allocate_and_zero<float>(m_bufferChannels * m_bufferSize);
+    m_sourcePtrs.resize(m_bufferChannels, nullptr);
+    m_targetPtrs.resize(m_bufferChannels, nullptr);
+    if (sampleFormat != SampleFormat::Float32) {
+        // The server converts to whatever the device wants, but
+        // sending it integer samples saves bandwidth (and gives us
+        // control over the dither)
+        m_converted = allocate_and_zero<unsigned char>
+            (m_bufferChannels * m_bufferSize * sizeof(float));
+    }
+    m_gains.resize(m_bufferChannels, 1.f);
+
+    m_peaks.resize(m_bufferChannels, 0.f);
+    configureMixers();
+
+    // Output is metered as written to the stream, input as the
+    // target receives it
+    m_outputMeter->configure(m_outSpec.channels);
+    m_inputMeter->configure(m_targetChannels);
 
     m_context = pa_context_new(m_api, m_name.c_str());
     if (!m_context) {
         m_startupError = "Failed to create PulseAudio context object";
-        log("ERROR: " + m_startupError);
+        BQAUDIOIO_LOG_ERROR(logComponent, m_startupError);
         return;
     }
 
@@ -186,12 +257,12 @@ PulseAudioIO::PulseAudioIO(Mode mode,
 
     m_loopthread = thread([this]() { threadRun(); });
 
-    log("started successfully");
+    BQAUDIOIO_LOG_INFO(logComponent, "Started successfully");
 }
 
 PulseAudioIO::~PulseAudioIO()
 {
-    log("PulseAudioIO: closing");
+    BQAUDIOIO_LOG_INFO(logComponent, "Closing");
 
     if (m_context) {
 
@@ -243,9 +314,11 @@ PulseAudioIO::~PulseAudioIO()
     }
     
     deallocate_channels(m_buffers, m_bufferChannels);
+    deallocate_channels(m_mixed, m_bufferChannels);
     deallocate(m_interleaved);
+    deallocate(m_converted);
     
-    log("closed");
+    BQAUDIOIO_LOG_INFO(logComponent, "Closed");
 }
 
 void
@@ -256,21 +329,20 @@ PulseAudioIO::threadRun()
     while (1) {
 
         {
-#ifdef DEBUG_PULSE_AUDIO_IO
-//            cerr << "PulseAudioIO::threadRun: locking loop mutex for prepare" << endl;
-#endif
             lock_guard<mutex> lguard(m_loopMutex);
             if (m_done) return;
 
             rv = pa_mainloop_prepare(m_loop, 100);
             if (rv < 0) {
-                log("ERROR: threadRun: Failure in pa_mainloop_prepare");
+                BQAUDIOIO_LOG_ERROR(logComponent, "Failure in "
+                                    << "pa_mainloop_prepare");
                 return;
             }
 
             rv = pa_mainloop_poll(m_loop);
             if (rv < 0) {
-                log("ERROR: threadRun: Failure in pa_mainloop_poll");
+                BQAUDIOIO_LOG_ERROR(logComponent, "Failure in "
+                                    << "pa_mainloop_poll");
                 return;
             }
         }
@@ -285,15 +357,16 @@ PulseAudioIO::threadRun()
         }
 
         {
-#ifdef DEBUG_PULSE_AUDIO_IO
-//            cerr << "PulseAudioIO::threadRun: locking loop mutex for dispatch" << endl;
-#endif
             lock_guard<mutex> lguard(m_loopMutex);
             if (m_done) return;
 
+            Tracer::nameThread("PulseAudio mainloop");
+            TraceScope scope("pa_mainloop_dispatch");
+            
             rv = pa_mainloop_dispatch(m_loop);
             if (rv < 0) {
-                log("ERROR: threadRun: Failure in pa_mainloop_dispatch");
+                BQAUDIOIO_LOG_ERROR(logComponent, "Failure in "
+                                    << "pa_mainloop_dispatch");
                 return;
             }
         }
@@ -339,10 +412,11 @@ PulseAudioIO::isTargetReady() const
 double
 PulseAudioIO::getCurrentTime() const
 {
-    if (!m_out) return 0.0;
+    pa_stream *clock = getClockStream();
+    if (!clock) return 0.0;
 
     pa_usec_t usec = 0;
-    pa_stream_get_time(m_out, &usec);
+    pa_stream_get_time(clock, &usec);
     return double(usec) / 1000000.0;
 }
 
@@ -368,10 +442,22 @@ PulseAudioIO::checkBufferCapacity(int nframes)
              m_bufferChannels, m_bufferSize,
              m_bufferChannels, nframes);
 
+        m_mixed = reallocate_and_zero_extend_channels
+            (m_mixed,
+             m_bufferChannels, m_bufferSize,
+             m_bufferChannels, nframes);
+
         m_interleaved = reallocate
             (m_interleaved,
              m_bufferChannels * m_bufferSize,
              m_bufferChannels * nframes);
+
+        if (m_converted) {
+            m_converted = reallocate
+                (m_converted,
+                 m_bufferChannels * m_bufferSize * sizeof(float),
+                 m_bufferChannels * nframes * sizeof(float));
+        }
         
         m_bufferSize = nframes;
     }
@@ -380,13 +466,10 @@ PulseAudioIO::checkBufferCapacity(int nframes)
 void
 PulseAudioIO::streamWrite(int requested)
 {
-#ifdef DEBUG_PULSE_AUDIO_IO    
-    cerr << "PulseAudioIO::streamWrite(" << requested << ")" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamWrite"
+                        << logField("requested", requested));
 
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::streamWrite: locking stream mutex" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamWrite: locking stream mutex");
 
     // Pulse is a consumer system with long buffers, this is not a RT
     // context like the other drivers
@@ -394,63 +477,334 @@ PulseAudioIO::streamWrite(int requested)
     if (m_done) return;
     if (!m_source) return;
 
+    int channels = m_outSpec.channels;
+    if (channels == 0) return;
+
+    RealtimeCheck::Scope rtcheck;
+    m_monitor.beginCallback("PulseAudio write");
+
+    CallbackTiming timing = CallbackTiming();
+    
+    pa_usec_t usec = 0;
+    if (!pa_stream_get_time(m_out, &usec)) {
+        timing.currentTime = double(usec) / 1000000.0;
+    }
+
     pa_usec_t latency = 0;
     int negative = 0;
     if (!pa_stream_get_latency(m_out, &latency, &negative)) {
         int latframes = latencyFrames(latency);
-        if (latframes > 0) m_source->setSystemPlaybackLatency(latframes);
+        if (latframes > 0) {
+            m_monitor.setLatency(CallbackMonitor::Playback, latframes);
+            m_source->setSystemPlaybackLatency(latframes);
+        }
+        if (timing.currentTime != 0.0) {
+            double latsec = double(latency) / 1000000.0;
+            if (negative) latsec = -latsec;
+            timing.outputTime = timing.currentTime + latsec;
+        }
     }
 
+    int bytes = bytes_per_sample(m_outFormat);
+    int nframes = requested / (channels * bytes);
+
+    checkBufferCapacity(nframes);
+
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamWrite"
+                        << logField("frames", nframes));
+
+    timing.frame = m_outFrameCount;
+    timing.flags = m_outFlags.exchange(0);
+    m_monitor.reportDropouts(timing.flags, timing.frame);
+    m_outFrameCount += nframes;
+    
+    int silent = getScheduledSilence(timing.frame, nframes);
+
+    // With a sub-block size set, each stage runs over one short
+    // sub-block at a time, so that the data stays in cache from the
+    // application's callback through to the interleaved buffer
+    int block = nframes;
+    if (m_subBlockSize > 0 && m_subBlockSize < nframes) {
+        block = m_subBlockSize;
+    }
+
+    float peakLeft = 0.f, peakRight = 0.f;
+    
+    for (int off = 0; off < nframes; off += block) {
+        int n = std::min(block, nframes - off);
+        writeSubBlock(m_interleaved + off * channels, n,
+                      std::max(0, std::min(n, silent - off)),
+                      subBlockTiming(timing, off),
+                      peakLeft, peakRight);
+    }
+
+    const void *data = m_interleaved;
+    if (m_outFormat != SampleFormat::Float32) {
+        v_convert_from_float(m_converted, m_interleaved, nframes * channels,
+                             m_outFormat, m_dither);
+        data = m_converted;
+    }
+
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Calling pa_stream_write"
+                        << logField("bytes", nframes * channels * bytes));
+
+    {
+        // libpulse copies the data into a memblock of its own
+        RealtimeCheck::Allow allow;
+        pa_stream_write(m_out, data, size_t(nframes) * channels * bytes,
+                        0, 0, PA_SEEK_RELATIVE);
+    }
+
+    if (m_outputLevelCallbacks) {
+        m_source->setOutputLevels(peakLeft, peakRight);
+    }
+
+    m_monitor.endCallback(nframes, m_sampleRate);
+    
+    return;
+}
+
+CallbackTiming
+PulseAudioIO::subBlockTiming(const CallbackTiming &timing, int offset) const
+{
+    if (offset == 0) return timing;
+    
+    CallbackTiming t(timing);
+    double sec = double(offset) / double(m_sampleRate);
+    t.frame += offset;
+    if (t.outputTime != 0.0) t.outputTime += sec;
+    if (t.inputTime != 0.0) t.inputTime += sec;
+
+    // Overflow and underflow flags are reported with the first
+    // sub-block only
+    t.flags = 0;
+    return t;
+}
+
+void
+PulseAudioIO::writeSubBlock(float *out, int nframes, int silent,
+                            const CallbackTiming &timing,
+                            float &peakLeft, float &peakRight)
+{
     int channels = m_outSpec.channels;
-    if (channels == 0) return;
+    int received = 0;
 
-    int nframes = requested / int(channels * sizeof(float));
+    CallbackTiming sourceTiming(timing);
+    if (silent > 0) {
+        sourceTiming.frame += silent;
+        if (sourceTiming.outputTime != 0.0) {
+            sourceTiming.outputTime += double(silent) / double(m_sampleRate);
+        }
+    }
 
-    checkBufferCapacity(nframes);
+    float *gain = m_gains.data();
+    Gains::gainsFor(m_outputGain, m_outputBalance, gain, channels); 
 
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::streamWrite: nframes = " << nframes << endl;
-#endif
+    if (m_sourceInterleaved) {
 
-    int received = m_source->getSourceSamples(m_buffers, channels, nframes);
+        // The application writes straight into the buffer we pass to
+        // pa_stream_write, after any scheduled silence
+        
+        v_zero(out, silent * channels);
+        if (silent < nframes) {
+            m_monitor.beginApplication();
+            received = m_source->getSourceSamplesInterleaved
+                (out + silent * channels, channels,
+                 nframes - silent, sourceTiming);
+            m_monitor.endApplication(CallbackMonitor::Playback,
+                                     nframes - silent);
+            m_monitor.reportSourceDelivery(sourceTiming.frame,
+                                           nframes - silent, received);
+        }
+        if (silent + received < nframes) {
+            v_zero(out + (silent + received) * channels,
+                   (nframes - silent - received) * channels);
+        }
+
+        v_gain_peak_interleaved(out, channels, nframes,
+                                gain, m_peaks.data());
+
+    } else {
+        
+        if (silent < nframes) {
+            m_monitor.beginApplication();
+            received = m_source->getSourceSamplesWithTiming
+                (m_buffers, channels, nframes - silent, sourceTiming);
+            m_monitor.endApplication(CallbackMonitor::Playback,
+                                     nframes - silent);
+            m_monitor.reportSourceDelivery(sourceTiming.frame,
+                                           nframes - silent, received);
+            if (silent > 0) {
+                // Shift the source's samples up to the scheduled start
+                for (int c = 0; c < channels; ++c) {
+                    v_move(m_buffers[c] + silent, m_buffers[c], received);
+                    v_zero(m_buffers[c], silent);
+                }
+                received += silent;
+            }
+        }
     
-    if (received < nframes) {
-        for (int c = 0; c < channels; ++c) {
-            v_zero(m_buffers[c] + received, nframes - received);
+        if (received < nframes) {
+            for (int c = 0; c < channels; ++c) {
+                v_zero(m_buffers[c] + received, nframes - received);
+            }
+        }
+
+        // A reordering of channels needs only a reordered pointer
+        // table; anything else is mixed
+        
+        float *const *rendered = m_buffers;
+        const ChannelMixer &mixer = m_outputMixer;
+        if (mixer.isPermutation() && !mixer.isIdentity()) {
+            for (int c = 0; c < channels; ++c) {
+                m_sourcePtrs[c] = m_buffers[mixer.getRoute(c)];
+            }
+            rendered = m_sourcePtrs.data();
+        } else if (!mixer.isPermutation()) {
+            mixer.mix(m_mixed, m_buffers, nframes);
+            rendered = m_mixed;
         }
+
+        v_interleave_gain_peak(out, rendered, channels, nframes,
+                               gain, m_peaks.data());
     }
+
+    m_outputMeter->processInterleaved(out, channels, nframes);
+
+    float left = m_peaks[0];
+    float right = (channels > 1 ? m_peaks[1] : m_peaks[0]);
+    if (left > peakLeft) peakLeft = left;
+    if (right > peakRight) peakRight = right;
+}
+
+static void
+accumulateBlockPeaks(const Meter &meter, float &peakLeft, float &peakRight)
+{
+    float left, right;
+    meter.getBlockPeaks(left, right);
+    if (left > peakLeft) peakLeft = left;
+    if (right > peakRight) peakRight = right;
+}
+
+void
+PulseAudioIO::readSubBlock(const float *in, int nframes,
+                           const CallbackTiming &timing,
+                           float &peakLeft, float &peakRight)
+{
+    int channels = m_inSpec.channels;
+    int selected = getSelectedInputCount();
+    int targetChannels = m_targetChannels;
+
+    if (m_targetInterleaved) {
+
+        // Hand Pulse's buffer straight to the application
         
-    float peakLeft = 0.0, peakRight = 0.0;
-    auto gain = Gains::gainsFor(m_outputGain, m_outputBalance, channels); 
+        m_inputMeter->processInterleaved(in, channels, nframes);
+        accumulateBlockPeaks(*m_inputMeter, peakLeft, peakRight);
 
-    for (int c = 0; c < channels; ++c) {
-        v_scale(m_buffers[c], gain[c], nframes);
+        m_monitor.beginApplication();
+        m_target->putSamplesInterleaved(in, channels, nframes, timing);
+        m_monitor.endApplication(CallbackMonitor::Record, nframes);
+        return;
     }
     
-    for (int c = 0; c < channels && c < 2; ++c) {
-	float peak = 0.f;
-        for (int i = 0; i < nframes; ++i) {
-            float sample = fabsf(m_buffers[c][i]);
-            if (sample > peak) peak = sample;
+    if (m_recordChannels.empty()) {
+        v_deinterleave(m_buffers, in, channels, nframes);
+    } else {
+        v_gather_channels(m_buffers, in, channels, m_recordChannels.data(),
+                          selected, nframes);
+    }
+
+    const float *const *mapped = m_buffers;
+    const ChannelMixer &mixer = m_inputMixer;
+    if (mixer.isRouting() && !mixer.isIdentity()) {
+        for (int c = 0; c < targetChannels; ++c) {
+            int route = mixer.getRoute(c);
+            if (route >= 0) {
+                m_targetPtrs[c] = m_buffers[route];
+            } else {
+                v_zero(m_mixed[c], nframes);
+                m_targetPtrs[c] = m_mixed[c];
+            }
         }
-        if (c == 0) peakLeft = peak;
-        if (c == 1 || channels == 1) peakRight = peak;
+        mapped = m_targetPtrs.data();
+    } else if (!mixer.isRouting()) {
+        mixer.mix(m_mixed, m_buffers, nframes);
+        mapped = m_mixed;
     }
 
-    v_interleave(m_interleaved, m_buffers, channels, nframes);
+    m_inputMeter->process(mapped, targetChannels, nframes);
+    accumulateBlockPeaks(*m_inputMeter, peakLeft, peakRight);
 
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "calling pa_stream_write with "
-         << nframes * channels * sizeof(float) << " bytes" << endl;
-#endif
+    m_monitor.beginApplication();
+    m_target->putSamplesWithTiming(mapped, targetChannels, nframes, timing);
+    m_monitor.endApplication(CallbackMonitor::Record, nframes);
+}
 
-    pa_stream_write(m_out, m_interleaved,
-                    nframes * channels * sizeof(float),
-                    0, 0, PA_SEEK_RELATIVE);
+int
+PulseAudioIO::getSelectedInputCount() const
+{
+    if (m_recordChannels.empty()) {
+        return m_inSpec.channels;
+    } else {
+        return int(m_recordChannels.size());
+    }
+}
 
-    m_source->setOutputLevels(peakLeft, peakRight);
+void
+PulseAudioIO::configureMixers()
+{
+    // Called from the constructor or with m_streamMutex held. Pulse
+    // is always opened with the application's channel counts (or,
+    // for input, the selected channels), and the server does any
+    // mapping to the device, so only matrices that fit those counts
+    // apply here
+    
+    int outChannels = m_outSpec.channels;
+    
+    if (!m_outputMixer.configure(m_outputMatrix, outChannels, outChannels)) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "Output mixing matrix must be "
+                              << "square, with one row and column per "
+                              << "application channel: using default mapping");
+    }
+    if (!m_inputMixer.configure(m_inputMatrix, m_targetChannels,
+                                getSelectedInputCount())) {
+        BQAUDIOIO_LOG_WARNING(logComponent, "Input mixing matrix must have "
+                              << "one row per application channel and one "
+                              << "column per recorded channel: using default "
+                              << "mapping");
+    }
 
-    return;
+    // The interleaved callbacks can be used whenever offered, unless
+    // there is mixing to do
+    m_sourceInterleaved = (m_source && m_source->supportsInterleavedSamples() &&
+                           m_outputMixer.isIdentity());
+    m_targetInterleaved = (m_target && m_target->supportsInterleavedSamples() &&
+                           m_recordChannels.empty() &&
+                           m_inputMixer.isIdentity());
+}
+
+void
+PulseAudioIO::setOutputMixingMatrix(const MixingMatrix &matrix)
+{
+    lock_guard<mutex> guard(m_streamMutex);
+    SystemPlaybackTarget::setOutputMixingMatrix(matrix);
+    configureMixers();
+}
+
+void
+PulseAudioIO::setInputMixingMatrix(const MixingMatrix &matrix)
+{
+    lock_guard<mutex> guard(m_streamMutex);
+    SystemRecordSource::setInputMixingMatrix(matrix);
+    configureMixers();
+}
+
+bool
+PulseAudioIO::setDeadlineWarningThreshold(double fraction)
+{
+    m_monitor.setDeadlineWarning(fraction, m_sampleRate, m_source, m_target);
+    return true;
 }
 
 void
@@ -468,70 +822,113 @@ PulseAudioIO::streamReadStatic(pa_stream *,
 void
 PulseAudioIO::streamRead(int available)
 {
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::streamRead(" << available << ")" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamRead"
+                        << logField("available", available));
 
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::streamRead: locking stream mutex" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamRead: locking stream mutex");
     lock_guard<mutex> guard(m_streamMutex);
     if (m_done) return;
     if (!m_target) return;
+
+    int channels = m_inSpec.channels;
+    if (channels == 0) return;
+
+    RealtimeCheck::Scope rtcheck;
+    m_monitor.beginCallback("PulseAudio read");
+    
+    CallbackTiming timing = CallbackTiming();
     
+    // The current time comes from the same clock as getCurrentTime
+    // and the write callback, so that input and output times are
+    // comparable; only the latency is the record stream's own
+    pa_usec_t usec = 0;
+    if (!pa_stream_get_time(getClockStream(), &usec)) {
+        timing.currentTime = double(usec) / 1000000.0;
+    }
+
     pa_usec_t latency = 0;
     int negative = 0;
     if (!pa_stream_get_latency(m_in, &latency, &negative)) {
         int latframes = latencyFrames(latency);
-        if (latframes > 0) m_target->setSystemRecordLatency(latframes);
+        if (latframes > 0) {
+            m_monitor.setLatency(CallbackMonitor::Record, latframes);
+            m_target->setSystemRecordLatency(latframes);
+        }
+        if (timing.currentTime != 0.0) {
+            double latsec = double(latency) / 1000000.0;
+            if (negative) latsec = -latsec;
+            timing.inputTime = timing.currentTime - latsec;
+        }
     }
 
-    int channels = m_inSpec.channels;
-    if (channels == 0) return;
-
-    int nframes = available / int(channels * sizeof(float));
+    int bytes = bytes_per_sample(m_inFormat);
+    int nframes = available / (channels * bytes);
 
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::streamRead: nframes = " << nframes << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamRead"
+                        << logField("frames", nframes));
 
-    checkBufferCapacity(nframes);
-    
     float peakLeft = 0.0, peakRight = 0.0;
 
     size_t actual = available;
     
     const void *input = 0;
-    pa_stream_peek(m_in, &input, &actual);
+    {
+        RealtimeCheck::Allow allow;
+        pa_stream_peek(m_in, &input, &actual);
+    }
 
-    int actualFrames = int(actual) / int(channels * sizeof(float));
+    int actualFrames = int(actual) / (channels * bytes);
 
     if (actualFrames < nframes) {
-        ostringstream os;
-        os << "WARNING: streamRead: read " << actualFrames
-           << " frames, expected " << nframes;
-        log(os.str());
+        BQAUDIOIO_LOG_WARNING(logComponent, "Read fewer frames than expected"
+                              << logField("read", actualFrames)
+                              << logField("expected", nframes));
     }
+
+    // Pulse may hand us more than it said was available, and every
+    // path below needs buffers of at least the size actually read
+    checkBufferCapacity(actualFrames);
     
     const float *finput = (const float *)input;
+    if (input && m_inFormat != SampleFormat::Float32) {
+        v_convert_to_float(m_interleaved, input, actualFrames * channels,
+                           m_inFormat);
+        finput = m_interleaved;
+    }
 
-    v_deinterleave(m_buffers, finput, channels, actualFrames);
+    timing.frame = m_inFrameCount;
+    timing.flags = m_inFlags.exchange(0);
+    m_monitor.reportDropouts(timing.flags, timing.frame);
+    m_inFrameCount += actualFrames;
 
-    for (int c = 0; c < channels && c < 2; ++c) {
-	float peak = 0.f;
-        for (int i = 0; i < actualFrames; ++i) {
-            if (m_buffers[c][i] > peak) {
-                peak = m_buffers[c][i];
-            }
-        }
-	if (c == 0) peakLeft = peak;
-	if (c > 0 || channels == 1) peakRight = peak;
+    int block = actualFrames;
+    if (m_subBlockSize > 0 && m_subBlockSize < actualFrames) {
+        block = m_subBlockSize;
     }
 
-    m_target->putSamples(m_buffers, channels, actualFrames);
-    m_target->setInputLevels(peakLeft, peakRight);
+    for (int off = 0; off < actualFrames; off += block) {
+        int n = std::min(block, actualFrames - off);
+        readSubBlock(finput + off * channels, n,
+                     subBlockTiming(timing, off),
+                     peakLeft, peakRight);
+    }
+    
+    if (m_inputLevelCallbacks) {
+        m_target->setInputLevels(peakLeft, peakRight);
+    }
+
+    {
+        RealtimeCheck::Allow allow;
+        pa_stream_drop(m_in);
+    }
 
-    pa_stream_drop(m_in);
+    // Reads and writes are called on the same thread, so when both
+    // are running, a period's load is what the two take together
+    if (m_out && m_source) {
+        m_monitor.endPartialCallback();
+    } else {
+        m_monitor.endCallback(actualFrames, m_sampleRate);
+    }
 
     return;
 }
@@ -548,13 +945,9 @@ PulseAudioIO::streamStateChangedStatic(pa_stream *stream,
 void
 PulseAudioIO::streamStateChanged(pa_stream *stream)
 {
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::streamStateChanged" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamStateChanged");
 
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::streamStateChanged: locking stream mutex" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamStateChanged: locking stream mutex");
     lock_guard<mutex> guard(m_streamMutex);
     if (m_done) return;
 
@@ -570,10 +963,10 @@ PulseAudioIO::streamStateChanged(pa_stream *stream)
         case PA_STREAM_READY:
         {
             if (stream == m_in) {
-                log("streamStateChanged: Capture ready");
+                BQAUDIOIO_LOG_INFO(logComponent, "Capture ready");
                 m_captureReady = true;
             } else {
-                log("streamStateChanged: Playback ready");
+                BQAUDIOIO_LOG_INFO(logComponent, "Playback ready");
                 m_playbackReady = true;
             }                
 
@@ -584,27 +977,29 @@ PulseAudioIO::streamStateChanged(pa_stream *stream)
                 m_source->setSystemPlaybackSampleRate(m_sampleRate);
                 m_source->setSystemPlaybackChannelCount(m_outSpec.channels);
                 if (pa_stream_get_latency(m_out, &latency, &negative)) {
-                    log("streamStateChanged: Failed to query playback latency");
+                    BQAUDIOIO_LOG_WARNING(logComponent, "Failed to query "
+                                          << "playback latency");
                 } else {
-                    ostringstream os;
                     int latframes = latencyFrames(latency);
-                    os << "playback latency = " << latency << " usec, "
-                       << latframes << " frames";
-                    log(os.str());
+                    BQAUDIOIO_LOG_INFO(logComponent, "Playback latency"
+                                       << logField("usec", latency)
+                                       << logField("frames", latframes));
+                    m_monitor.setLatency(CallbackMonitor::Playback, latframes);
                     m_source->setSystemPlaybackLatency(latframes);
                 }
             }
             if (m_target && (stream == m_in)) {
                 m_target->setSystemRecordSampleRate(m_sampleRate);
-                m_target->setSystemRecordChannelCount(m_inSpec.channels);
+                m_target->setSystemRecordChannelCount(getSelectedInputCount());
                 if (pa_stream_get_latency(m_in, &latency, &negative)) {
-                    log("streamStateChanged: Failed to query record latency");
+                    BQAUDIOIO_LOG_WARNING(logComponent, "Failed to query "
+                                          << "record latency");
                 } else {
-                    ostringstream os;
                     int latframes = latencyFrames(latency);
-                    os << "record latency = " << latency << " usec, "
-                       << latframes << " frames";
-                    log(os.str());
+                    BQAUDIOIO_LOG_INFO(logComponent, "Record latency"
+                                       << logField("usec", latency)
+                                       << logField("frames", latframes));
+                    m_monitor.setLatency(CallbackMonitor::Record, latframes);
                     m_target->setSystemRecordLatency(latframes);
                 }
             }
@@ -614,15 +1009,14 @@ PulseAudioIO::streamStateChanged(pa_stream *stream)
 
         case PA_STREAM_FAILED:
         default:
-            log(string("streamStateChanged: Error: ") +
-                pa_strerror(pa_context_errno(m_context)));
+            BQAUDIOIO_LOG_ERROR(logComponent, "Stream failed"
+                                << logField("error", pa_strerror
+                                            (pa_context_errno(m_context))));
             //!!! do something...
             break;
     }
 
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::streamStateChanged complete" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "streamStateChanged complete");
 }
 
 void
@@ -633,23 +1027,17 @@ PulseAudioIO::suspend()
         pa_mainloop_wakeup(m_loop);
     }
     
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::suspend: locking all mutexes" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "suspend: locking all mutexes");
     {
         lock_guard<mutex> cguard(m_contextMutex);
         if (m_suspended) return;
     }
 
     lock_guard<mutex> lguard(m_loopMutex);
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::suspend: loop mutex ok" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "suspend: loop mutex ok");
     
     lock_guard<mutex> sguard(m_streamMutex);
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::suspend: stream mutex ok" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "suspend: stream mutex ok");
 
     m_aboutToAct = false;
     if (m_done) return;
@@ -665,10 +1053,9 @@ PulseAudioIO::suspend()
     }
 
     m_suspended = true;
+    m_monitor.setSuspended(true);
     
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::suspend: corked!" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "suspend: corked!");
 }
 
 void
@@ -679,23 +1066,17 @@ PulseAudioIO::resume()
         pa_mainloop_wakeup(m_loop);
     }
     
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::resume: locking all mutexes" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "resume: locking all mutexes");
     {
         lock_guard<mutex> cguard(m_contextMutex);
         if (!m_suspended) return;
     }
 
     lock_guard<mutex> lguard(m_loopMutex);
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::suspend: loop mutex ok" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "resume: loop mutex ok");
 
     lock_guard<mutex> sguard(m_streamMutex);
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::suspend: stream mutex ok" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "resume: stream mutex ok");
 
     m_aboutToAct = false;
     if (m_done) return;
@@ -710,10 +1091,9 @@ PulseAudioIO::resume()
     }
 
     m_suspended = false;
+    m_monitor.setSuspended(false);
     
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::resume: uncorked!" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "resume: uncorked!");
 }
 
 void
@@ -727,12 +1107,8 @@ PulseAudioIO::contextStateChangedStatic(pa_context *,
 void
 PulseAudioIO::contextStateChanged()
 {
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::contextStateChanged" << endl;
-#endif
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::contextStateChanged: locking context mutex" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "contextStateChanged");
+    BQAUDIOIO_LOG_DEBUG(logComponent, "contextStateChanged: locking context mutex");
     lock_guard<mutex> guard(m_contextMutex);
 
     switch (pa_context_get_state(m_context)) {
@@ -745,7 +1121,7 @@ PulseAudioIO::contextStateChanged()
 
         case PA_CONTEXT_READY:
         {
-            log("contextStateChanged: Ready");
+            BQAUDIOIO_LOG_INFO(logComponent, "Context ready");
 
             pa_stream_flags_t flags;
             flags = pa_stream_flags_t(PA_STREAM_INTERPOLATE_TIMING |
@@ -758,8 +1134,18 @@ PulseAudioIO::contextStateChanged()
                 
                 m_in = pa_stream_new(m_context, "Capture", &m_inSpec, 0);
 
+                if (!m_in && m_inFormat != SampleFormat::Float32) {
+                    BQAUDIOIO_LOG_INFO(logComponent, "Failed to create "
+                                       << "capture stream in requested "
+                                       << "integer format, trying float");
+                    m_inFormat = SampleFormat::Float32;
+                    m_inSpec.format = PA_SAMPLE_FLOAT32NE;
+                    m_in = pa_stream_new(m_context, "Capture", &m_inSpec, 0);
+                }
+
                 if (!m_in) {
-                    log("contextStateChanged: Failed to create capture stream");
+                    BQAUDIOIO_LOG_ERROR(logComponent, "Failed to create "
+                                        << "capture stream");
                 } else {
                     pa_stream_set_state_callback(m_in, streamStateChangedStatic, this);
                     pa_stream_set_read_callback(m_in, streamReadStatic, this);
@@ -767,7 +1153,8 @@ PulseAudioIO::contextStateChanged()
                     pa_stream_set_underflow_callback(m_in, streamUnderflowStatic, this);
             
                     if (pa_stream_connect_record (m_in, 0, 0, flags)) {
-                        log("contextStateChanged: Failed to connect record stream");
+                        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to connect "
+                                            << "record stream");
                     }
                 }
             }
@@ -776,8 +1163,18 @@ PulseAudioIO::contextStateChanged()
 
                 m_out = pa_stream_new(m_context, "Playback", &m_outSpec, 0);
 
+                if (!m_out && m_outFormat != SampleFormat::Float32) {
+                    BQAUDIOIO_LOG_INFO(logComponent, "Failed to create "
+                                       << "playback stream in requested "
+                                       << "integer format, trying float");
+                    m_outFormat = SampleFormat::Float32;
+                    m_outSpec.format = PA_SAMPLE_FLOAT32NE;
+                    m_out = pa_stream_new(m_context, "Playback", &m_outSpec, 0);
+                }
+
                 if (!m_out) {
-                    log("contextStateChanged: Failed to create playback stream");
+                    BQAUDIOIO_LOG_ERROR(logComponent, "Failed to create "
+                                        << "playback stream");
                 } else {
                     pa_stream_set_state_callback(m_out, streamStateChangedStatic, this);
                     pa_stream_set_write_callback(m_out, streamWriteStatic, this);
@@ -785,7 +1182,8 @@ PulseAudioIO::contextStateChanged()
                     pa_stream_set_underflow_callback(m_out, streamUnderflowStatic, this);
 
                     if (pa_stream_connect_playback(m_out, 0, 0, flags, 0, 0)) { 
-                        log("contextStateChanged: Failed to connect playback stream");
+                        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to connect "
+                                            << "playback stream");
                     }
                 }
             }
@@ -794,39 +1192,46 @@ PulseAudioIO::contextStateChanged()
         }
 
         case PA_CONTEXT_TERMINATED:
-            log("contextStateChanged: Terminated");
+            BQAUDIOIO_LOG_INFO(logComponent, "Context terminated");
             break;
 
         case PA_CONTEXT_FAILED:
         default:
-            log(string("contextStateChanged: Error: ") +
-                pa_strerror(pa_context_errno(m_context)));
+            BQAUDIOIO_LOG_ERROR(logComponent, "Context failed"
+                                << logField("error", pa_strerror
+                                            (pa_context_errno(m_context))));
             break;
     }
 
-#ifdef DEBUG_PULSE_AUDIO_IO
-    cerr << "PulseAudioIO::contextStateChanged complete" << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "contextStateChanged complete");
 }
 
 void
-PulseAudioIO::streamOverflowStatic(pa_stream *, void *data)
+PulseAudioIO::streamOverflowStatic(pa_stream *stream, void *data)
 {
-    log("streamOverflowStatic: Overflow!");
-
     PulseAudioIO *io = (PulseAudioIO *)data;
 
+    if (stream == io->m_in) {
+        io->m_inFlags |= CallbackTiming::InputOverflow;
+    } else {
+        io->m_outFlags |= CallbackTiming::OutputOverflow;
+    }
+
     if (io->m_target) io->m_target->audioProcessingOverload();
     if (io->m_source) io->m_source->audioProcessingOverload();
 }
 
 void
-PulseAudioIO::streamUnderflowStatic(pa_stream *, void *data)
+PulseAudioIO::streamUnderflowStatic(pa_stream *stream, void *data)
 {
-    log("streamUnderflowStatic: Underflow!");
-    
     PulseAudioIO *io = (PulseAudioIO *)data;
 
+    if (stream == io->m_in) {
+        io->m_inFlags |= CallbackTiming::InputUnderflow;
+    } else {
+        io->m_outFlags |= CallbackTiming::OutputUnderflow;
+    }
+
     if (io->m_target) io->m_target->audioProcessingOverload();
     if (io->m_source) io->m_source->audioProcessingOverload();
 }
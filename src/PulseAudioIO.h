@@ -39,6 +39,11 @@
 
 #include "SystemAudioIO.h"
 #include "AudioFactory.h"
+#include "CallbackTiming.h"
+#include "SampleFormat.h"
+#include "FormatConversion.h"
+#include "ChannelMixer.h"
+#include "CallbackMonitor.h"
 #include "Mode.h"
 
 #include <mutex>
@@ -47,6 +52,7 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
 
 namespace breakfastquay {
 
@@ -60,7 +66,10 @@ public:
                  ApplicationRecordTarget *recordTarget,
                  ApplicationPlaybackSource *playSource,
                  std::string recordDevice,
-                 std::string playbackDevice);
+                 std::string playbackDevice,
+                 int subBlockSize = 0,
+                 SampleFormat sampleFormat = SampleFormat::Float32,
+                 std::vector<int> recordChannels = {});
     virtual ~PulseAudioIO();
 
     static std::vector<std::string> getRecordDeviceNames();
@@ -72,17 +81,43 @@ public:
     bool isTargetReady() const override;
 
     double getCurrentTime() const override;
+    int64_t getCurrentFrame() const override { return m_outFrameCount; }
 
     void suspend() override;
     void resume() override;
 
     void suppressRecordSide(bool) override {}
+
+    void setOutputMixingMatrix(const MixingMatrix &) override;
+    void setInputMixingMatrix(const MixingMatrix &) override;
+
+    CallbackStatistics getStatistics() const override {
+        return m_monitor.getStatistics();
+    }
+    void resetStatistics() override { m_monitor.reset(); }
+    std::vector<DropoutEvent> getDropoutEvents(int64_t after = 0) const override {
+        return m_monitor.getDropoutEvents(after);
+    }
+    bool setDeadlineWarningThreshold(double fraction) override;
+    bool publishStatistics(std::string name) override {
+        return m_monitor.publishStatistics(name, "pulse",
+                                           m_inputMeter, m_outputMeter);
+    }
     
     std::string getStartupErrorString() const { return m_startupError; }
 
 protected:
     void streamWrite(int);
     void streamRead(int);
+    void writeSubBlock(float *out, int nframes, int silent,
+                       const CallbackTiming &timing,
+                       float &peakLeft, float &peakRight);
+    void readSubBlock(const float *in, int nframes,
+                      const CallbackTiming &timing,
+                      float &peakLeft, float &peakRight);
+    CallbackTiming subBlockTiming(const CallbackTiming &, int offset) const;
+    void configureMixers();
+    int getSelectedInputCount() const;
     void streamStateChanged(pa_stream *);
     void contextStateChanged();
 
@@ -97,6 +132,11 @@ protected:
         return int((double(latusec) / 1000000.0) * double(m_sampleRate));
     }
 
+    // The stream whose clock gives the current time for both
+    // directions: the playback stream, or the record stream if there
+    // is no playback
+    pa_stream *getClockStream() const { return m_out ? m_out : m_in; }
+
     std::mutex m_loopMutex;
     std::mutex m_contextMutex;
     mutable std::mutex m_streamMutex;
@@ -116,15 +156,37 @@ protected:
     pa_sample_spec m_outSpec;
 
     float **m_buffers;
+    float **m_mixed;
     float *m_interleaved;
+    ChannelMixer m_outputMixer;
+    ChannelMixer m_inputMixer;
+    std::vector<float *> m_sourcePtrs;
+    std::vector<const float *> m_targetPtrs;
+    bool m_sourceInterleaved;
+    bool m_targetInterleaved;
+    std::vector<float> m_gains;
+    std::vector<float> m_peaks;
+    std::vector<int> m_recordChannels;
+    int m_targetChannels;
     int m_bufferChannels;
     int m_bufferSize;
     int m_sampleRate;
+    int m_subBlockSize;
+    SampleFormat m_inFormat;
+    SampleFormat m_outFormat;
+    DitherState m_dither;
+    unsigned char *m_converted;
     bool m_done;
 
     bool m_captureReady;
     bool m_playbackReady;
 
+    int64_t m_inFrameCount;
+    std::atomic<int64_t> m_outFrameCount;
+    std::atomic<int> m_inFlags;
+    std::atomic<int> m_outFlags;
+    CallbackMonitor m_monitor;
+
     std::atomic<bool> m_aboutToAct;
     bool m_suspended;
 
@@ -0,0 +1,264 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "RealtimeCheck.h"
+
+#ifdef BQAUDIOIO_RTCHECK
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace breakfastquay {
+
+// Nothing here may allocate or lock, as everything is reachable from
+// within malloc. Thread-locals are plain values with constant
+// initialisers, which need no allocation in an executable.
+
+static thread_local int realtimeDepth = 0;
+static thread_local bool reporting = false;
+static thread_local bool resolving = false;
+
+typedef void *(*MallocFn)(size_t);
+typedef void *(*CallocFn)(size_t, size_t);
+typedef void *(*ReallocFn)(void *, size_t);
+typedef void (*FreeFn)(void *);
+typedef int (*MutexLockFn)(pthread_mutex_t *);
+
+static MallocFn realMalloc = nullptr;
+static CallocFn realCalloc = nullptr;
+static ReallocFn realRealloc = nullptr;
+static FreeFn realFree = nullptr;
+static MutexLockFn realMutexLock = nullptr;
+
+static std::atomic<int> resolution(0); // 0 = not started, 1 = under way, 2 = done
+
+// dlsym may itself allocate, before we know where the real
+// allocator is; such allocations come from here and are never freed
+static char bootstrapArena[8192];
+static std::atomic<size_t> bootstrapUsed(0);
+
+static void *
+bootstrapAllocate(size_t n)
+{
+    n = (n + 15) & ~size_t(15);
+    size_t at = bootstrapUsed.fetch_add(n);
+    if (at + n > sizeof(bootstrapArena)) {
+        static const char msg[] = "bqaudioio rtcheck: bootstrap arena exhausted\n";
+        if (write(2, msg, sizeof(msg) - 1)) { }
+        abort();
+    }
+    return bootstrapArena + at;
+}
+
+static bool
+isBootstrap(void *ptr)
+{
+    return ptr >= (void *)bootstrapArena &&
+        ptr < (void *)(bootstrapArena + sizeof(bootstrapArena));
+}
+
+static void
+resolve()
+{
+    if (resolution.load(std::memory_order_acquire) == 2) return;
+
+    int expected = 0;
+    if (!resolution.compare_exchange_strong(expected, 1)) {
+        while (resolution.load(std::memory_order_acquire) != 2) { }
+        return;
+    }
+
+    resolving = true;
+    realMalloc = (MallocFn)dlsym(RTLD_NEXT, "malloc");
+    realCalloc = (CallocFn)dlsym(RTLD_NEXT, "calloc");
+    realRealloc = (ReallocFn)dlsym(RTLD_NEXT, "realloc");
+    realFree = (FreeFn)dlsym(RTLD_NEXT, "free");
+    realMutexLock = (MutexLockFn)dlsym(RTLD_NEXT, "pthread_mutex_lock");
+    resolving = false;
+    resolution.store(2, std::memory_order_release);
+
+    // The first backtrace loads the unwinder, which allocates, so
+    // get that over with now rather than in the middle of a report
+    void *frame;
+    backtrace(&frame, 1);
+}
+
+static bool
+shouldAbort()
+{
+    const char *e = getenv("BQAUDIOIO_RTCHECK_ABORT");
+    return e && !strcmp(e, "1");
+}
+
+// Calling locations already reported, so as not to flood the output
+// with a report for every callback
+static const int maxReported = 1024;
+static std::atomic<void *> reported[maxReported];
+
+static bool
+firstReport(void *caller)
+{
+    for (int i = 0; i < maxReported; ++i) {
+        void *existing = reported[i].load(std::memory_order_relaxed);
+        if (existing == caller) return false;
+        if (!existing) {
+            if (reported[i].compare_exchange_strong(existing, caller)) {
+                return true;
+            }
+            if (existing == caller) return false;
+        }
+    }
+    return true;
+}
+
+// Not inlined, so that it is always the innermost two frames of the
+// backtrace that belong to us
+static void __attribute__((noinline))
+check(const char *what, void *caller)
+{
+    if (realtimeDepth <= 0 || reporting) return;
+    if (!firstReport(caller)) return;
+    
+    reporting = true;
+
+    char msg[200];
+    int n = snprintf(msg, sizeof(msg),
+                     "bqaudioio rtcheck: %s called from realtime audio thread, at:\n",
+                     what);
+    if (n > 0 && write(2, msg, size_t(n))) { }
+
+    void *frames[64];
+    int count = backtrace(frames, 64);
+    if (count > 2) {
+        backtrace_symbols_fd(frames + 2, count - 2, 2);
+    }
+
+    if (shouldAbort()) {
+        static const char abortMsg[] =
+            "bqaudioio rtcheck: aborting (BQAUDIOIO_RTCHECK_ABORT is set)\n";
+        if (write(2, abortMsg, sizeof(abortMsg) - 1)) { }
+        abort();
+    }
+    
+    reporting = false;
+}
+
+RealtimeCheck::Scope::Scope()
+{
+    resolve();
+    ++realtimeDepth;
+}
+
+RealtimeCheck::Scope::~Scope()
+{
+    --realtimeDepth;
+}
+
+RealtimeCheck::Allow::Allow()
+{
+    --realtimeDepth;
+}
+
+RealtimeCheck::Allow::~Allow()
+{
+    ++realtimeDepth;
+}
+
+}
+
+using namespace breakfastquay;
+
+extern "C" {
+
+void *
+malloc(size_t n)
+{
+    if (resolving) return bootstrapAllocate(n);
+    resolve();
+    check("malloc", __builtin_return_address(0));
+    return realMalloc(n);
+}
+
+void *
+calloc(size_t count, size_t n)
+{
+    // The arena is static and so already zeroed
+    if (resolving) return bootstrapAllocate(count * n);
+    resolve();
+    check("calloc", __builtin_return_address(0));
+    return realCalloc(count, n);
+}
+
+void *
+realloc(void *ptr, size_t n)
+{
+    if (resolving) return bootstrapAllocate(n);
+    resolve();
+    check("realloc", __builtin_return_address(0));
+    if (isBootstrap(ptr)) {
+        // Rare enough to be worth no more than a copy of the most we
+        // could have handed out
+        void *moved = realMalloc(n);
+        size_t available = bootstrapArena + sizeof(bootstrapArena) - (char *)ptr;
+        memcpy(moved, ptr, n < available ? n : available);
+        return moved;
+    }
+    return realRealloc(ptr, n);
+}
+
+void
+free(void *ptr)
+{
+    if (!ptr || isBootstrap(ptr)) return;
+    resolve();
+    check("free", __builtin_return_address(0));
+    realFree(ptr);
+}
+
+int
+pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    resolve();
+    check("pthread_mutex_lock", __builtin_return_address(0));
+    return realMutexLock(mutex);
+}
+
+}
+
+#endif
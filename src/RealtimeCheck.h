@@ -0,0 +1,102 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_REALTIME_CHECK_H
+#define BQAUDIOIO_REALTIME_CHECK_H
+
+namespace breakfastquay {
+
+/**
+ * Detection of realtime-safety violations, for debug builds.
+ *
+ * When the library is built with BQAUDIOIO_RTCHECK defined (as by
+ * the rtcheck make target), each audio callback marks its thread as
+ * realtime for its duration with a RealtimeCheck::Scope, and malloc,
+ * calloc, realloc, free and pthread_mutex_lock are interposed so that
+ * any call to them from a marked thread - whether made by the
+ * library or by the application's source or target - is reported on
+ * stderr with a backtrace. Each calling location is reported only
+ * once. If the environment variable BQAUDIOIO_RTCHECK_ABORT is set
+ * to 1, the report is followed by abort(), so that a test run fails
+ * at the first violation.
+ *
+ * The interposition relies on the library being linked statically
+ * into the executable, which must also be linked with -ldl (and
+ * with -rdynamic for function names in the backtraces).
+ *
+ * In other builds, the scopes compile to nothing.
+ */
+class RealtimeCheck
+{
+public:
+    /**
+     * Mark the current thread as realtime for the lifetime of the
+     * object. Scopes may nest.
+     */
+    class Scope
+    {
+    public:
+#ifdef BQAUDIOIO_RTCHECK
+        Scope();
+        ~Scope();
+#else
+        Scope() { }
+        ~Scope() { }
+#endif
+    private:
+        Scope(const Scope &)=delete;
+        Scope &operator=(const Scope &)=delete;
+    };
+
+    /**
+     * Lift the realtime mark from the current thread for the
+     * lifetime of the object, around calls into a system library
+     * whose allocation we can do nothing about and have accepted.
+     */
+    class Allow
+    {
+    public:
+#ifdef BQAUDIOIO_RTCHECK
+        Allow();
+        ~Allow();
+#else
+        Allow() { }
+        ~Allow() { }
+#endif
+    private:
+        Allow(const Allow &)=delete;
+        Allow &operator=(const Allow &)=delete;
+    };
+};
+
+}
+
+#endif
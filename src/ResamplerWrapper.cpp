@@ -38,16 +38,15 @@
 
 #include "ApplicationPlaybackSource.h"
 #include "Log.h"
+#include "Tracer.h"
 
-#include <iostream>
-#include <sstream>
-
-//#define DEBUG_RESAMPLER_WRAPPER 1
 
 using namespace std;
 
 namespace breakfastquay {
 
+static const char *const logComponent = "ResamplerWrapper";
+
 static int defaultMaxBufferSize = 10240; // bigger will require dynamic resizing
 
 ResamplerWrapper::ResamplerWrapper(ApplicationPlaybackSource *source) :
@@ -72,12 +71,9 @@ ResamplerWrapper::ResamplerWrapper(ApplicationPlaybackSource *source) :
     
     m_channels = m_source->getApplicationChannelCount();
 
-    {
-        ostringstream os;
-        os << "ResamplerWrapper: Initial source rate " << m_sourceRate
-           << " and channels " << m_channels;
-        Log::log(os.str());
-    }
+    BQAUDIOIO_LOG_INFO(logComponent, "Created"
+                       << logField("sourceRate", m_sourceRate)
+                       << logField("channels", m_channels));
     
     reconstructResampler();
 }
@@ -95,21 +91,18 @@ ResamplerWrapper::changeApplicationSampleRate(int newRate)
 {
     lock_guard<mutex> guard(m_mutex);
 
-    {
-        ostringstream os;
-        os << "ResamplerWrapper: Source rate changing from " << m_sourceRate
-           << " to " << newRate;
-        Log::log(os.str());
-    }
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Source rate changing"
+                        << logField("from", m_sourceRate)
+                        << logField("to", newRate));
 
     m_sourceRate = newRate;
 
     if (m_sourceRate == 0) {
-        Log::log("ResamplerWrapper::changeApplicationSampleRate: Note: "
-                 "Source rate is zero, won't be resampling");
+        BQAUDIOIO_LOG_DEBUG(logComponent, "Source rate is zero, "
+                            << "won't be resampling");
     } else if (m_sourceRate == m_targetRate) {
-        Log::log("ResamplerWrapper::changeApplicationSampleRate: Note: "
-                 "Source rate is equal to target rate, won't be resampling");
+        BQAUDIOIO_LOG_DEBUG(logComponent, "Source rate is equal to "
+                            << "target rate, won't be resampling");
     }
     
     checkBuffersFor(defaultMaxBufferSize);
@@ -141,11 +134,10 @@ ResamplerWrapper::getApplicationChannelCount() const
 void
 ResamplerWrapper::setSystemPlaybackBlockSize(int sz)
 {
-    ostringstream os;
-    os << "NOTE: ResamplerWrapper::setSystemPlaybackBlockSize called "
-       << "with size = " << sz << "; not passing to wrapped source, as "
-       << "actual block size will vary";
-    Log::log(os.str());
+    BQAUDIOIO_LOG_INFO(logComponent, "setSystemPlaybackBlockSize called; "
+                       << "not passing to wrapped source, as actual "
+                       << "block size will vary"
+                       << logField("size", sz));
 }
 
 void
@@ -156,11 +148,10 @@ ResamplerWrapper::setSystemPlaybackSampleRate(int rate)
         m_targetRate = rate;
     }
 
-    ostringstream os;
-    os << "NOTE: ResamplerWrapper::setSystemPlaybackSampleRate called "
-       << "with rate = " << rate << "; not passing to wrapped source, as "
-       << "we're doing the resampling";
-    Log::log(os.str());
+    BQAUDIOIO_LOG_INFO(logComponent, "setSystemPlaybackSampleRate called; "
+                       << "not passing to wrapped source, as we're doing "
+                       << "the resampling"
+                       << logField("rate", rate));
 
     // We do the resampling around here - pretend to our own source
     // that their preferred rate is always the same as the device's
@@ -203,12 +194,24 @@ ResamplerWrapper::setOutputLevels(float left, float right)
     m_source->setOutputLevels(left, right);
 }
 
+void
+ResamplerWrapper::setSystemFreewheeling(bool freewheeling)
+{
+    m_source->setSystemFreewheeling(freewheeling);
+}
+
 void
 ResamplerWrapper::audioProcessingOverload()
 {
     m_source->audioProcessingOverload();
 }
 
+void
+ResamplerWrapper::audioProcessingDeadlineWarning(double duration, double deadline)
+{
+    m_source->audioProcessingDeadlineWarning(duration, deadline);
+}
+
 void
 ResamplerWrapper::reset()
 {
@@ -243,7 +246,9 @@ ResamplerWrapper::reconstructResampler()
     }
         
     if (m_channels == 0) {
-        Log::log("ResamplerWrapper::reconstructResampler: Channel count is 0; not constructing a resampler until the system calls back with a non-zero channel count");
+        BQAUDIOIO_LOG_INFO(logComponent, "Channel count is 0; not "
+                           << "constructing a resampler until the system "
+                           << "calls back with a non-zero channel count");
         return;
     }
     
@@ -256,12 +261,10 @@ ResamplerWrapper::reconstructResampler()
         params.initialSampleRate = m_sourceRate;
     }
 
-    ostringstream os;
-    os << "ResamplerWrapper::reconstructResampler: Creating resampler with "
-       << "initial source rate " << params.initialSampleRate
-       << ", buffer size " << defaultMaxBufferSize
-       << ", channel count " << m_channels;
-    Log::log(os.str());
+    BQAUDIOIO_LOG_INFO(logComponent, "Creating resampler"
+                       << logField("initialSourceRate", params.initialSampleRate)
+                       << logField("bufferSize", defaultMaxBufferSize)
+                       << logField("channels", m_channels));
 
     m_resampler = new Resampler(params, m_channels);
     
@@ -284,14 +287,11 @@ ResamplerWrapper::checkBuffersFor(int nframes)
     int newInSize = int(newResampledSize / ratio);
     
     if (!m_resampled || newResampledSize > m_resampledSize) {
-        {
-            ostringstream os;
-            os << "ResamplerWrapper::checkBuffersFor: Source rate "
-               << m_sourceRate << " -> target rate " << m_targetRate
-               << "; newResampledSize = " << newResampledSize
-               << ", newInSize = " << newInSize;
-            Log::log(os.str());
-        }
+        BQAUDIOIO_LOG_INFO(logComponent, "Extending buffers"
+                           << logField("sourceRate", m_sourceRate)
+                           << logField("targetRate", m_targetRate)
+                           << logField("resampledSize", newResampledSize)
+                           << logField("inSize", newInSize));
         m_resampled = reallocate_and_zero_extend_channels
             (m_resampled,
              m_channels, m_resampledSize,
@@ -311,11 +311,30 @@ ResamplerWrapper::checkBuffersFor(int nframes)
 int
 ResamplerWrapper::getSourceSamples(float *const *samples, int nchannels, int nframes)
 {
+    return getSamples(samples, nchannels, nframes, nullptr);
+}
+
+int
+ResamplerWrapper::getSourceSamplesWithTiming(float *const *samples,
+                                             int nchannels, int nframes,
+                                             const CallbackTiming &timing)
+{
+    return getSamples(samples, nchannels, nframes, &timing);
+}
+
+int
+ResamplerWrapper::getSamples(float *const *samples, int nchannels, int nframes,
+                             const CallbackTiming *timing)
+{
+    TraceScope scope("ResamplerWrapper::getSourceSamples");
+    
     lock_guard<mutex> guard(m_mutex);
     
-#ifdef DEBUG_RESAMPLER_WRAPPER
-    cerr << "ResamplerWrapper::getSourceSamples(" << nframes << "): source rate = " << m_sourceRate << ", target rate = " << m_targetRate << ", channels = " << m_channels << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "getSourceSamples"
+                        << logField("nframes", nframes)
+                        << logField("sourceRate", m_sourceRate)
+                        << logField("targetRate", m_targetRate)
+                        << logField("channels", m_channels));
     
     checkBuffersFor(nframes);
 
@@ -325,15 +344,20 @@ ResamplerWrapper::getSourceSamples(float *const *samples, int nchannels, int nfr
     }
     
     if (nchannels != m_channels) {
-        ostringstream os;
-        os << "ERROR: ResamplerWrapper::getSourceSamples: nchannels = "
-           << nchannels << " but m_channels = " << m_channels;
-        Log::log(os.str());
+        BQAUDIOIO_LOG_ERROR(logComponent,
+                            "getSourceSamples: Wrong number of channels"
+                            << logField("nchannels", nchannels)
+                            << logField("expected", m_channels));
         throw std::logic_error("Different number of channels requested than ResamplerWrapper declared");
     }
     
     if (m_sourceRate == m_targetRate) {
-	return m_source->getSourceSamples(samples, nchannels, nframes);
+        if (timing) {
+            return m_source->getSourceSamplesWithTiming
+                (samples, nchannels, nframes, *timing);
+        } else {
+            return m_source->getSourceSamples(samples, nchannels, nframes);
+        }
     }
 
     double ratio = double(m_targetRate) / double(m_sourceRate);
@@ -341,19 +365,38 @@ ResamplerWrapper::getSourceSamples(float *const *samples, int nchannels, int nfr
     int reqResampled = nframes - m_resampledFill + 1;
     int req = int(round(reqResampled / ratio)) + 1;
 
-    int received = m_source->getSourceSamples(m_in, m_channels, req);
+    int received = 0;
+
+    if (timing) {
+        CallbackTiming sourceTiming(*timing);
+        // The first source frame rendered now is the one that will
+        // follow the resampled frames already buffered, so both frame
+        // and time are advanced by the buffered fill
+        sourceTiming.frame = int64_t
+            (round(double(timing->frame + m_resampledFill) / ratio));
+        if (sourceTiming.outputTime != 0.0) {
+            sourceTiming.outputTime +=
+                double(m_resampledFill) / double(m_targetRate);
+        }
+        received = m_source->getSourceSamplesWithTiming
+            (m_in, m_channels, req, sourceTiming);
+    } else {
+        received = m_source->getSourceSamples(m_in, m_channels, req);
+    }
 
     for (int i = 0; i < m_channels; ++i) {
         m_ptrs[i] = m_resampled[i] + m_resampledFill;
     }
 
-#ifdef DEBUG_RESAMPLER_WRAPPER
-    cerr << "ResamplerWrapper: nframes = " << nframes << ", ratio = " << ratio << endl;
-    cerr << "ResamplerWrapper: m_inSize = " << m_inSize << ", m_resampledSize = "
-         << m_resampledSize << ", m_resampledFill = " << m_resampledFill << endl;
-    cerr << "ResamplerWrapper: reqResampled = " << reqResampled << ", req = "
-         << req << ", received = " << received << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Received from source"
+                        << logField("nframes", nframes)
+                        << logField("ratio", ratio)
+                        << logField("inSize", m_inSize)
+                        << logField("resampledSize", m_resampledSize)
+                        << logField("resampledFill", m_resampledFill)
+                        << logField("reqResampled", reqResampled)
+                        << logField("req", req)
+                        << logField("received", received));
 
     if (received > 0) {
 
@@ -365,20 +408,18 @@ ResamplerWrapper::getSourceSamples(float *const *samples, int nchannels, int nfr
 
             m_resampledFill += resampled;
         
-#ifdef DEBUG_RESAMPLER_WRAPPER
-            cerr << "ResamplerWrapper: resampled = " << resampled << ", m_resampledFill now = " << m_resampledFill << endl;
-#endif
+            BQAUDIOIO_LOG_DEBUG(logComponent, "Resampled"
+                                << logField("resampled", resampled)
+                                << logField("resampledFill", m_resampledFill));
 
         } catch (const breakfastquay::Resampler::Exception &e) {
             static bool errorShown = false;
             if (!errorShown) {
-                ostringstream os;
-                os << "ResamplerWrapper: Failed to resample " << received
-                   << " sample(s) at a ratio of " << ratio
-                   << " (NB this error will not be printed again, even if "
-                   << "the problem persists)";
-                Log::log(os.str());
-                cerr << "ERROR: " << os.str() << endl;
+                BQAUDIOIO_LOG_ERROR(logComponent, "Failed to resample "
+                                    << "(NB this error will not be printed "
+                                    << "again, even if the problem persists)"
+                                    << logField("received", received)
+                                    << logField("ratio", ratio));
                 errorShown = true;
             }
         }
@@ -402,9 +443,9 @@ ResamplerWrapper::getSourceSamples(float *const *samples, int nchannels, int nfr
 
     m_resampledFill -= nframes;
 
-#ifdef DEBUG_RESAMPLER_WRAPPER
-    cerr << "ResamplerWrapper: m_resampledFill now = " << m_resampledFill << " and returning nframes = " << nframes << endl;
-#endif
+    BQAUDIOIO_LOG_DEBUG(logComponent, "Returning"
+                        << logField("nframes", nframes)
+                        << logField("resampledFill", m_resampledFill));
 
     return nframes;
 }
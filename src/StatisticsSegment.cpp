@@ -0,0 +1,216 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "StatisticsSegment.h"
+#include "Meter.h"
+#include "Log.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using std::string;
+
+namespace breakfastquay {
+
+static const char *const logComponent = "StatisticsSegment";
+
+// Readers depend on these, so any change must come with a new version
+static_assert(offsetof(SharedStatistics, snapshot) == 40,
+              "SharedStatistics layout changed");
+static_assert(sizeof(SharedStatistics) == 408,
+              "SharedStatistics layout changed");
+
+StatisticsSegment::StatisticsSegment(string name, SharedStatistics *stats) :
+    m_name(name),
+    m_stats(stats),
+    m_lastUpdate(0)
+{
+}
+
+#ifdef _WIN32
+
+StatisticsSegment *
+StatisticsSegment::create(string, string, bool)
+{
+    BQAUDIOIO_LOG_ERROR(logComponent, "Shared-memory statistics are not "
+                        << "supported on this platform");
+    return nullptr;
+}
+
+StatisticsSegment::~StatisticsSegment()
+{
+}
+
+#else
+
+StatisticsSegment *
+StatisticsSegment::create(string name, string implementation, bool suspended)
+{
+    if (name == "") return nullptr;
+    if (name[0] != '/') name = "/" + name;
+
+    // Replace rather than reuse any segment left behind by a process
+    // that exited without removing it, as it may have a different
+    // layout and readers may have it mapped
+    shm_unlink(name.c_str());
+    
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to create segment"
+                            << logField("name", name)
+                            << logField("error", strerror(errno)));
+        return nullptr;
+    }
+
+    void *addr = MAP_FAILED;
+    if (ftruncate(fd, sizeof(SharedStatistics)) == 0) {
+        addr = mmap(nullptr, sizeof(SharedStatistics),
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int err = errno;
+    close(fd);
+    
+    if (addr == MAP_FAILED) {
+        BQAUDIOIO_LOG_ERROR(logComponent, "Failed to map segment"
+                            << logField("name", name)
+                            << logField("error", strerror(err)));
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    // The new segment is zero-filled, which is a valid empty
+    // snapshot; the magic number goes in last, so that a reader
+    // never sees it on a half-initialised header
+    SharedStatistics *stats = static_cast<SharedStatistics *>(addr);
+    stats->version = SharedStatistics::Version;
+    stats->size = sizeof(SharedStatistics);
+    stats->processId = int32_t(getpid());
+    strncpy(stats->implementation, implementation.c_str(),
+            sizeof(stats->implementation) - 1);
+    stats->state.store(suspended ?
+                       SharedStatistics::Suspended :
+                       SharedStatistics::Running);
+    std::atomic_thread_fence(std::memory_order_release);
+    stats->magic = SharedStatistics::Magic;
+
+    BQAUDIOIO_LOG_INFO(logComponent, "Publishing statistics"
+                       << logField("name", name));
+    
+    return new StatisticsSegment(name, stats);
+}
+
+StatisticsSegment::~StatisticsSegment()
+{
+    // Readers that still have the segment mapped see that we have
+    // gone; new ones will find no segment
+    setState(SharedStatistics::Closed);
+    munmap(m_stats, sizeof(SharedStatistics));
+    shm_unlink(m_name.c_str());
+}
+
+#endif
+
+void
+StatisticsSegment::setState(SharedStatistics::State state)
+{
+    m_stats->state.store(state, std::memory_order_release);
+}
+
+static void
+updatePeaks(const Meter *meter, float fall, float *peaks, int32_t &channels)
+{
+    int n = (meter ? meter->getChannelCount() : 0);
+    if (n > SharedStatistics::MaxChannels) n = SharedStatistics::MaxChannels;
+    for (int c = 0; c < n; ++c) {
+        float peak = meter->getBlockPeak(c);
+        float held = peaks[c] * fall;
+        peaks[c] = (peak > held ? peak : held);
+    }
+    channels = n;
+}
+
+void
+StatisticsSegment::update(int64_t time, int sampleRate, int blockSize,
+                          double load, const int64_t *dropouts,
+                          int inputLatency, int outputLatency,
+                          const Meter *inputMeter, const Meter *outputMeter)
+{
+    SharedStatistics::Snapshot &s = m_stats->snapshot;
+
+    // We are the only writer, so the values in the snapshot are our
+    // own and may be read back freely
+    uint32_t sequence = m_stats->sequence.load(std::memory_order_relaxed);
+    m_stats->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    double elapsed = 0.0;
+    if (m_lastUpdate != 0) elapsed = double(time - m_lastUpdate) * 1e-9;
+    m_lastUpdate = time;
+
+    s.updateTime = time;
+    s.sampleRate = sampleRate;
+    s.blockSize = blockSize;
+
+    s.load = load;
+    if (s.callbacks == 0) {
+        s.averageLoad = load;
+    } else {
+        // Exponential smoothing with a time constant of one second
+        s.averageLoad += (load - s.averageLoad) * (elapsed / (elapsed + 1.0));
+    }
+    if (load > s.maxLoad) s.maxLoad = load;
+    ++s.callbacks;
+
+    for (int i = 0; i < SharedStatistics::DropoutKinds; ++i) {
+        s.dropouts[i] = dropouts[i];
+    }
+    
+    s.inputLatency = inputLatency;
+    s.outputLatency = outputLatency;
+
+    // 20dB per second is a factor of ten in magnitude
+    float fall = float(pow(10.0, -elapsed));
+    updatePeaks(inputMeter, fall, s.inputPeak, s.inputChannels);
+    updatePeaks(outputMeter, fall, s.outputPeak, s.outputChannels);
+
+    m_stats->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+}
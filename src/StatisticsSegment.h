@@ -0,0 +1,95 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_STATISTICS_SEGMENT_H
+#define BQAUDIOIO_STATISTICS_SEGMENT_H
+
+#include "SharedStatistics.h"
+
+#include <string>
+
+namespace breakfastquay {
+
+class Meter;
+
+/**
+ * Owner of a POSIX shared-memory segment containing a
+ * SharedStatistics, which it creates on construction and removes on
+ * destruction. The audio thread fills in the snapshot with update;
+ * the state may be set from any one non-realtime thread at a time.
+ */
+class StatisticsSegment
+{
+public:
+    /**
+     * Create the segment with the given name (a leading slash is
+     * added if missing), replacing any existing segment of that
+     * name, for an IO of the named implementation. Return nullptr,
+     * after logging the reason, if it cannot be created. Not
+     * realtime-safe.
+     */
+    static StatisticsSegment *create(std::string name,
+                                     std::string implementation,
+                                     bool suspended);
+    
+    ~StatisticsSegment();
+
+    /**
+     * Set the stream state. This is written directly, not as part of
+     * the snapshot.
+     */
+    void setState(SharedStatistics::State state);
+
+    /**
+     * Publish a new snapshot at the end of a callback, taking the
+     * channel peaks from the most recent block measured by each
+     * meter (either of which may be null). Realtime-safe; to be
+     * called from the audio thread only.
+     */
+    void update(int64_t time, int sampleRate, int blockSize,
+                double load, const int64_t *dropouts,
+                int inputLatency, int outputLatency,
+                const Meter *inputMeter, const Meter *outputMeter);
+    
+private:
+    StatisticsSegment(std::string name, SharedStatistics *stats);
+
+    std::string m_name;
+    SharedStatistics *m_stats;
+    int64_t m_lastUpdate;
+
+    StatisticsSegment(const StatisticsSegment &)=delete;
+    StatisticsSegment &operator=(const StatisticsSegment &)=delete;
+};
+
+}
+
+#endif
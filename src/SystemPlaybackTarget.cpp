@@ -31,18 +31,51 @@
 */
 
 #include "SystemPlaybackTarget.h"
+#include "Meter.h"
 
 namespace breakfastquay {
 
 SystemPlaybackTarget::SystemPlaybackTarget(ApplicationPlaybackSource *source) :
     m_source(source),
     m_outputGain(1.0),
-    m_outputBalance(0.0)
+    m_outputBalance(0.0),
+    m_scheduledStart(-1),
+    m_outputMeter(new Meter),
+    m_outputLevelCallbacks(true)
 {
 }
 
 SystemPlaybackTarget::~SystemPlaybackTarget()
 {
+    delete m_outputMeter;
+}
+
+void
+SystemPlaybackTarget::resumeAt(int64_t frame)
+{
+    if (frame < 0) frame = 0;
+    m_scheduledStart = frame;
+    resume();
+}
+
+int
+SystemPlaybackTarget::getScheduledSilence(int64_t blockFrame, int nframes)
+{
+    int64_t start = m_scheduledStart;
+    if (start < 0) {
+        return 0;
+    }
+    if (start >= blockFrame + nframes) {
+        return nframes;
+    }
+    // The start falls within (or before) this block, so this is the
+    // last block affected by it - unless resumeAt has been called
+    // again in the meantime, in which case leave the new one alone
+    m_scheduledStart.compare_exchange_strong(start, -1);
+    if (start <= blockFrame) {
+        return 0;
+    }
+    return int(start - blockFrame);
 }
 
 void
@@ -69,5 +102,29 @@ SystemPlaybackTarget::getOutputBalance() const
     return m_outputBalance;
 }
 
+void
+SystemPlaybackTarget::setOutputMixingMatrix(const MixingMatrix &matrix)
+{
+    m_outputMatrix = matrix;
+}
+
+MixingMatrix
+SystemPlaybackTarget::getOutputMixingMatrix() const
+{
+    return m_outputMatrix;
+}
+
+bool
+SystemPlaybackTarget::getOutputLevels(std::vector<ChannelLevels> &levels)
+{
+    return m_outputMeter->read(levels);
+}
+
+void
+SystemPlaybackTarget::setOutputLevelCallbacksEnabled(bool enabled)
+{
+    m_outputLevelCallbacks = enabled;
+}
+
 }
 
@@ -32,18 +32,46 @@
 
 #include "SystemRecordSource.h"
 #include "ApplicationRecordTarget.h"
+#include "Meter.h"
 
 #include <iostream>
 
 namespace breakfastquay {
 
 SystemRecordSource::SystemRecordSource(ApplicationRecordTarget *target) :
-    m_target(target)
+    m_target(target),
+    m_inputMeter(new Meter),
+    m_inputLevelCallbacks(true)
 {
 }
 
 SystemRecordSource::~SystemRecordSource()
 {
+    delete m_inputMeter;
+}
+
+void
+SystemRecordSource::setInputMixingMatrix(const MixingMatrix &matrix)
+{
+    m_inputMatrix = matrix;
+}
+
+MixingMatrix
+SystemRecordSource::getInputMixingMatrix() const
+{
+    return m_inputMatrix;
+}
+
+bool
+SystemRecordSource::getInputLevels(std::vector<ChannelLevels> &levels)
+{
+    return m_inputMeter->read(levels);
+}
+
+void
+SystemRecordSource::setInputLevelCallbacksEnabled(bool enabled)
+{
+    m_inputLevelCallbacks = enabled;
 }
 
 }
@@ -0,0 +1,306 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "Tracer.h"
+#include "CallbackMonitor.h"
+#include "RealtimeCheck.h"
+#include "Log.h"
+
+#include <mutex>
+#include <sstream>
+#include <iomanip>
+
+using namespace std;
+
+namespace breakfastquay {
+
+static const char *const logComponent = "Tracer";
+
+static const int threadBufferCount = 16;
+static const int eventsPerThread = 16384;
+
+namespace {
+
+struct TraceEvent {
+    // Atomic only so that export can race with recording safely
+    atomic<const char *> name;
+    atomic<int64_t> start;
+    atomic<int64_t> end;
+};
+
+struct ThreadBuffer {
+    TraceEvent events[eventsPerThread];
+    atomic<int64_t> written;
+    // Index of the first event written by the current owner; events
+    // before it belong to a thread that has exited
+    atomic<int64_t> first;
+    atomic<const char *> threadName;
+    atomic<bool> inUse;
+    ThreadBuffer() : written(0), first(0), threadName(nullptr), inUse(false) { }
+};
+
+}
+
+atomic<bool> Tracer::m_enabled(false);
+
+// Allocated on first enabling and never freed. A thread hands its
+// buffer back to the pool when it exits, but the buffer keeps the
+// thread's events for export until another thread claims it
+static ThreadBuffer *buffers = nullptr;
+static atomic<int> buffersClaimed(0);
+static atomic<bool> buffersReady(false);
+static atomic<int> buffersReleased(0);
+static atomic<bool> exhaustionLogged(false);
+static mutex setupMutex;
+
+namespace {
+
+// Holds the calling thread's buffer and releases it on thread exit
+struct ThreadBufferHolder {
+    ThreadBuffer *buffer;
+    // Value of buffersReleased when we last failed to get a buffer,
+    // or -1; we try again only once another thread has released one
+    int failedAt;
+    ThreadBufferHolder() : buffer(nullptr), failedAt(-1) { }
+    ~ThreadBufferHolder() {
+        if (buffer) {
+            buffer->inUse.store(false, memory_order_release);
+            ++buffersReleased;
+        }
+    }
+};
+
+}
+
+static thread_local ThreadBufferHolder threadBuffer;
+
+static ThreadBuffer *
+claimBuffer()
+{
+    // Use a buffer that has never been claimed, if there is one, so
+    // that the events of exited threads are kept as long as possible
+    int index = buffersClaimed.load();
+    while (index < threadBufferCount) {
+        if (buffersClaimed.compare_exchange_weak(index, index + 1)) {
+            buffers[index].inUse = true;
+            return &buffers[index];
+        }
+    }
+
+    for (int i = 0; i < threadBufferCount; ++i) {
+        ThreadBuffer &b = buffers[i];
+        bool inUse = false;
+        if (!b.inUse.load(memory_order_relaxed) &&
+            b.inUse.compare_exchange_strong(inUse, true,
+                                            memory_order_acquire)) {
+            b.threadName.store(nullptr, memory_order_relaxed);
+            b.first.store(b.written.load(memory_order_relaxed),
+                          memory_order_release);
+            return &b;
+        }
+    }
+
+    return nullptr;
+}
+
+static ThreadBuffer *
+getThreadBuffer()
+{
+    ThreadBufferHolder &holder = threadBuffer;
+    if (holder.buffer) return holder.buffer;
+    if (!buffersReady) return nullptr;
+
+    int released = buffersReleased;
+    if (holder.failedAt == released) return nullptr;
+    
+    holder.buffer = claimBuffer();
+    if (holder.buffer) {
+        holder.failedAt = -1;
+        return holder.buffer;
+    }
+
+    holder.failedAt = released;
+    if (!exhaustionLogged.exchange(true)) {
+        RealtimeCheck::Allow allow;
+        BQAUDIOIO_LOG_WARNING(logComponent, "All trace buffers are in use, "
+                              << "not tracing this thread until another "
+                              << "thread exits"
+                              << logField("buffers", threadBufferCount));
+    }
+    return nullptr;
+}
+
+void
+Tracer::setEnabled(bool enabled)
+{
+#ifdef BQAUDIOIO_NO_TRACING
+    (void)enabled;
+#else
+    if (enabled) {
+        lock_guard<mutex> guard(setupMutex);
+        if (!buffers) {
+            buffers = new ThreadBuffer[threadBufferCount];
+            buffersReady = true;
+        }
+    }
+    m_enabled = enabled;
+#endif
+}
+
+void
+Tracer::record(const char *name, int64_t start, int64_t end)
+{
+    if (!isEnabled()) return;
+    ThreadBuffer *b = getThreadBuffer();
+    if (!b) return;
+
+    int64_t n = b->written.load(memory_order_relaxed);
+    TraceEvent &e = b->events[n % eventsPerThread];
+    e.name.store(name, memory_order_relaxed);
+    e.start.store(start, memory_order_relaxed);
+    e.end.store(end, memory_order_relaxed);
+    b->written.store(n + 1, memory_order_release);
+}
+
+void
+Tracer::nameThread(const char *name)
+{
+    if (!isEnabled()) return;
+    ThreadBuffer *b = getThreadBuffer();
+    if (!b || b->threadName.load(memory_order_relaxed)) return;
+    b->threadName.store(name, memory_order_relaxed);
+}
+
+static void
+writeString(ostream &out, const char *s)
+{
+    out << '"';
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') out << '\\';
+        out << *s;
+    }
+    out << '"';
+}
+
+bool
+Tracer::write(ostream &out)
+{
+    int claimed = 0;
+    {
+        lock_guard<mutex> guard(setupMutex);
+        if (buffers) {
+            claimed = std::min(int(buffersClaimed), threadBufferCount);
+        }
+    }
+
+    // Timestamps are in microseconds, relative to the earliest event
+    // so as to keep the numbers short
+    int64_t origin = -1;
+    for (int t = 0; t < claimed; ++t) {
+        const ThreadBuffer &b = buffers[t];
+        int64_t n = b.written.load(memory_order_acquire);
+        int64_t first = std::max(b.first.load(memory_order_acquire),
+                                 n - eventsPerThread);
+        if (first < n) {
+            int64_t s = b.events[first % eventsPerThread].start;
+            if (origin < 0 || s < origin) origin = s;
+        }
+    }
+    if (origin < 0) origin = 0;
+    
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    out << fixed << setprecision(3);
+    
+    bool needComma = false;
+    
+    for (int t = 0; t < claimed; ++t) {
+
+        const ThreadBuffer &b = buffers[t];
+        int tid = t + 1;
+
+        const char *threadName = b.threadName;
+        if (threadName) {
+            if (needComma) out << ",";
+            out << "\n{\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+                << ",\"name\":\"thread_name\",\"args\":{\"name\":";
+            writeString(out, threadName);
+            out << "}}";
+            needComma = true;
+        }
+
+        int64_t n = b.written.load(memory_order_acquire);
+        int64_t first = std::max(b.first.load(memory_order_acquire),
+                                 n - eventsPerThread);
+
+        for (int64_t i = first; i < n; ++i) {
+
+            const TraceEvent &e = b.events[i % eventsPerThread];
+            const char *name = e.name.load(memory_order_relaxed);
+            int64_t start = e.start.load(memory_order_relaxed);
+            int64_t end = e.end.load(memory_order_relaxed);
+
+            // Omit the event if the writer may have come round and
+            // overwritten it while we were reading. It starts on this
+            // slot once written reaches i + eventsPerThread, before it
+            // publishes the count that follows
+            atomic_thread_fence(memory_order_acquire);
+            if (b.written.load(memory_order_relaxed) - i >= eventsPerThread) {
+                continue;
+            }
+            
+            if (needComma) out << ",";
+            out << "\n{\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                << ",\"name\":";
+            writeString(out, name);
+            out << ",\"ts\":" << double(start - origin) / 1000.0
+                << ",\"dur\":" << double(end - start) / 1000.0 << "}";
+            needComma = true;
+        }
+    }
+
+    out << "\n]}\n";
+    return bool(out);
+}
+
+TraceScope::TraceScope(const char *name) :
+    m_name(Tracer::isEnabled() ? name : nullptr),
+    m_start(m_name ? CallbackMonitor::now() : 0)
+{
+}
+
+TraceScope::~TraceScope()
+{
+    if (m_name) {
+        Tracer::record(m_name, m_start, CallbackMonitor::now());
+    }
+}
+
+}
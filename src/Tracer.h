@@ -0,0 +1,114 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQAUDIOIO_TRACER_H
+#define BQAUDIOIO_TRACER_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+namespace breakfastquay {
+
+/**
+ * Recorder of timed events for tuning, exported as Chrome
+ * trace-event JSON (see AudioFactory::setTracing and
+ * AudioFactory::writeTrace). Off by default.
+ *
+ * Each thread that records an event claims one of a fixed pool of
+ * buffers, allocated when tracing is first enabled, and thereafter
+ * writes to it alone, without locking or allocation. Each buffer is
+ * a ring that keeps the most recent events. A thread's buffer
+ * returns to the pool when the thread exits, keeping its events
+ * until another thread claims it. Defining BQAUDIOIO_NO_TRACING
+ * removes tracing from the build.
+ */
+class Tracer
+{
+public:
+    static void setEnabled(bool enabled);
+
+    static bool isEnabled() {
+#ifdef BQAUDIOIO_NO_TRACING
+        return false;
+#else
+        return m_enabled.load(std::memory_order_relaxed);
+#endif
+    }
+
+    /**
+     * Record a complete event with the given name, which must be a
+     * string literal or otherwise outlive the tracer, and start and
+     * end times from CallbackMonitor::now(). Realtime-safe. Does
+     * nothing if tracing is disabled or the pool of thread buffers
+     * is exhausted.
+     */
+    static void record(const char *name, int64_t start, int64_t end);
+
+    /**
+     * Label the calling thread in the exported trace. The name must
+     * outlive the tracer. Only the first name given to a thread is
+     * used. Realtime-safe.
+     */
+    static void nameThread(const char *name);
+
+    /**
+     * Write everything recorded so far as a Chrome trace-event JSON
+     * object. Events may continue to be recorded meanwhile; any
+     * overwritten while being written out are omitted.
+     */
+    static bool write(std::ostream &out);
+
+private:
+    static std::atomic<bool> m_enabled;
+};
+
+/**
+ * Records an event covering the lifetime of the object, if tracing
+ * is enabled when it is constructed.
+ */
+class TraceScope
+{
+public:
+    TraceScope(const char *name);
+    ~TraceScope();
+
+private:
+    const char *m_name;
+    int64_t m_start;
+
+    TraceScope(const TraceScope &)=delete;
+    TraceScope &operator=(const TraceScope &)=delete;
+};
+
+}
+
+#endif
@@ -0,0 +1,215 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+/*
+ * bqaudioio-bench-channels: open a duplex stream with each of a
+ * series of channel counts, run it for a while, and report how long
+ * the stream took to open and close and how much time the library
+ * spent in each callback. The per-channel figures should stay flat
+ * as the channel count rises.
+ *
+ * The default is the null implementation, which needs no audio
+ * hardware and measures the library's own mixing and metering. Use
+ * -i jack (with a server running) to include port registration and
+ * connection.
+ */
+
+#include "AudioFactory.h"
+#include "SystemAudioIO.h"
+#include "ApplicationPlaybackSource.h"
+#include "ApplicationRecordTarget.h"
+#include "ChannelLevels.h"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+
+using namespace std;
+using namespace breakfastquay;
+
+class Source : public ApplicationPlaybackSource
+{
+public:
+    Source(int channels) : m_channels(channels) { }
+
+    string getClientName() const override { return "bqaudioio-bench"; }
+    int getApplicationSampleRate() const override { return 0; }
+    int getApplicationChannelCount() const override { return m_channels; }
+    void setSystemPlaybackBlockSize(int) override { }
+    void setSystemPlaybackSampleRate(int) override { }
+    void setSystemPlaybackChannelCount(int) override { }
+    void setSystemPlaybackLatency(int) override { }
+    void setOutputLevels(float, float) override { }
+
+    int getSourceSamples(float *const *samples, int nchannels,
+                         int nframes) override {
+        // Quiet noise, so that the meters have something to measure
+        for (int c = 0; c < nchannels; ++c) {
+            for (int i = 0; i < nframes; ++i) {
+                m_seed = m_seed * 1664525 + 1013904223;
+                samples[c][i] = float(int32_t(m_seed)) * 1e-11f;
+            }
+        }
+        return nframes;
+    }
+
+private:
+    int m_channels;
+    uint32_t m_seed = 1;
+};
+
+class Target : public ApplicationRecordTarget
+{
+public:
+    Target(int channels) : m_channels(channels) { }
+
+    string getClientName() const override { return "bqaudioio-bench"; }
+    int getApplicationChannelCount() const override { return m_channels; }
+    void setSystemRecordBlockSize(int) override { }
+    void setSystemRecordSampleRate(int) override { }
+    void setSystemRecordLatency(int) override { }
+    void setSystemRecordChannelCount(int) override { }
+    void setInputLevels(float, float) override { }
+    void putSamples(const float *const *, int, int) override { }
+
+private:
+    int m_channels;
+};
+
+static void
+usage(const char *name)
+{
+    cerr << "Usage: " << name << " [-i <implementation>] [-d <seconds>] "
+         << "[-m <channels>]\n\n"
+         << "Open a duplex stream with 1, 2, 4 ... channels each way and "
+         << "report the\ncost of opening it and of each callback.\n\n"
+         << "  -i <name>  Implementation to use (default \"null\")\n"
+         << "  -d <s>     Seconds to run each stream for (default 2)\n"
+         << "  -m <n>     Largest channel count to try (default 256)\n"
+         << endl;
+    exit(2);
+}
+
+static double
+secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int
+main(int argc, char **argv)
+{
+    string implementation = "null";
+    double duration = 2.0;
+    int maxChannels = 256;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-i" && i + 1 < argc) {
+            implementation = argv[++i];
+        } else if (arg == "-d" && i + 1 < argc) {
+            duration = atof(argv[++i]);
+            if (duration <= 0.0) usage(argv[0]);
+        } else if (arg == "-m" && i + 1 < argc) {
+            maxChannels = atoi(argv[++i]);
+            if (maxChannels <= 0) usage(argv[0]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    AudioFactory::setLogLevel(AudioFactory::LogLevel::Warning);
+    
+    AudioFactory::Preference preference;
+    preference.implementation = implementation;
+    
+    cout << "Implementation: " << implementation << "\n\n"
+         << "channels   open ms  close ms  callbacks  block  "
+         << "lib us/cb  lib p99 us  lib ns/ch/frame\n";
+
+    for (int channels = 1; channels <= maxChannels; channels *= 2) {
+
+        Source source(channels);
+        Target target(channels);
+        string error;
+
+        auto start = chrono::steady_clock::now();
+        SystemAudioIO *io = AudioFactory::createCallbackIO
+            (&target, &source, preference, error);
+        double openTime = secondsSince(start);
+        
+        if (!io) {
+            cerr << "Failed to open stream with " << channels
+                 << " channels: " << error << endl;
+            return 1;
+        }
+
+        // Read the levels as a user interface would, so that their
+        // cost is part of the measurement
+        vector<ChannelLevels> levels;
+        io->resetStatistics();
+        start = chrono::steady_clock::now();
+        while (secondsSince(start) < duration) {
+            this_thread::sleep_for(chrono::milliseconds(50));
+            io->getOutputLevels(levels);
+            io->getInputLevels(levels);
+        }
+        
+        CallbackStatistics stats = io->getStatistics();
+
+        start = chrono::steady_clock::now();
+        delete io;
+        double closeTime = secondsSince(start);
+
+        double perFrame = 0.0;
+        if (stats.blockSize.mean > 0.0) {
+            perFrame = stats.libraryTime.mean * 1e9 /
+                (stats.blockSize.mean * channels);
+        }
+        
+        cout << fixed
+             << setw(8) << channels
+             << setw(10) << setprecision(2) << openTime * 1000.0
+             << setw(10) << setprecision(2) << closeTime * 1000.0
+             << setw(11) << stats.callbacks
+             << setw(7) << setprecision(0) << stats.blockSize.mean
+             << setw(11) << setprecision(1) << stats.libraryTime.mean * 1e6
+             << setw(12) << setprecision(1) << stats.libraryTime.p99 * 1e6
+             << setw(17) << setprecision(3) << perFrame
+             << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+/*
+ * bqaudioio-bench-formats: measure the cost of converting output to,
+ * and input from, each device sample format the library supports
+ * (see AudioFactory::Preference::sampleFormat), together with the
+ * number of bytes each moves to or from the device or server per
+ * second of stereo audio.
+ */
+
+#include "src/FormatConversion.h"
+
+#include "bqvec/Allocators.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+using namespace breakfastquay;
+
+static volatile float sink;
+
+// Run f repeatedly for about the given time and return the mean
+// nanoseconds per sample processed
+static double
+measure(function<void()> f, int samplesPerCall, double seconds)
+{
+    int64_t calls = 0;
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0.0;
+    while (elapsed < seconds) {
+        for (int i = 0; i < 100; ++i) {
+            f();
+            ++calls;
+        }
+        elapsed = chrono::duration<double>
+            (chrono::steady_clock::now() - start).count();
+    }
+    return elapsed * 1e9 / (double(calls) * samplesPerCall);
+}
+
+int
+main(int argc, char **argv)
+{
+    double seconds = 0.2;
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+        if (seconds <= 0.0) {
+            cerr << "Usage: " << argv[0] << " [<seconds per case>]" << endl;
+            return 2;
+        }
+    }
+
+    const struct {
+        SampleFormat format;
+        const char *name;
+    } formats[] = {
+        { SampleFormat::Float32, "float32" },
+        { SampleFormat::Int16, "int16 (dithered)" },
+        { SampleFormat::Int24, "int24" },
+        { SampleFormat::Int32, "int32" }
+    };
+
+    // An interleaved stereo block of the size PulseAudio commonly
+    // asks for
+    const int channels = 2;
+    const int nframes = 4096;
+    const int count = nframes * channels;
+    const int rate = 48000;
+
+    float *samples = allocate<float>(count);
+    float *returned = allocate<float>(count);
+    char *device = allocate<char>(count * 4);
+
+    for (int i = 0; i < count; ++i) {
+        samples[i] = float(sin(i * 0.01) * 0.9);
+    }
+
+    cout << "Interleaved stereo, " << nframes << "-frame blocks, "
+         << "times in ns per sample\n\n"
+         << "format              to device  from device  "
+         << "KB/s at " << rate << " Hz\n";
+    
+    for (const auto &f: formats) {
+
+        DitherState dither;
+
+        // Float32 needs no conversion and the drivers pass their
+        // buffers straight through, so its cost is a copy at most
+        double to = 0.0, from = 0.0;
+        if (f.format != SampleFormat::Float32) {
+            to = measure([&]() {
+                    v_convert_from_float(device, samples, count,
+                                         f.format, dither);
+                    sink = float(device[count - 1]);
+                }, count, seconds);
+            from = measure([&]() {
+                    v_convert_to_float(returned, device, count, f.format);
+                    sink = returned[count - 1];
+                }, count, seconds);
+        }
+
+        double kbps = double(bytes_per_sample(f.format)) *
+            channels * rate / 1024.0;
+        
+        cout << left << setw(18) << f.name << right
+             << fixed << setprecision(3)
+             << setw(11) << to << setw(13) << from
+             << setw(17) << setprecision(0) << kbps
+             << endl;
+    }
+
+    deallocate(samples);
+    deallocate(returned);
+    deallocate(device);
+    return 0;
+}
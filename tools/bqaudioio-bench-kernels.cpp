@@ -0,0 +1,179 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+/*
+ * bqaudioio-bench-kernels: compare the single-pass output kernels of
+ * src/Kernels.h with the sequence of separate passes they replace
+ * (scale each channel, find each channel's peak, then interleave),
+ * for a range of channel counts and block sizes.
+ */
+
+#include "src/Kernels.h"
+
+#include "bqvec/VectorOps.h"
+#include "bqvec/Allocators.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+using namespace breakfastquay;
+
+static volatile float sink;
+
+// Run f repeatedly for about the given time and return the mean
+// nanoseconds per sample (channel-frame) processed
+static double
+measure(function<void(int)> f, int samplesPerCall, double seconds)
+{
+    int64_t calls = 0;
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0.0;
+    while (elapsed < seconds) {
+        for (int i = 0; i < 100; ++i) {
+            f(int(calls++));
+        }
+        elapsed = chrono::duration<double>
+            (chrono::steady_clock::now() - start).count();
+    }
+    return elapsed * 1e9 / (double(calls) * samplesPerCall);
+}
+
+int
+main(int argc, char **argv)
+{
+    double seconds = 0.2;
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+        if (seconds <= 0.0) {
+            cerr << "Usage: " << argv[0] << " [<seconds per case>]" << endl;
+            return 2;
+        }
+    }
+    
+    const int channelCounts[] = { 1, 2, 8, 32 };
+    const int blockSizes[] = { 64, 256, 1024, 4096 };
+
+    cout << "Times in ns per sample\n\n"
+         << "channels  block  interleaved: passes   fused  speedup"
+         << "  non-interleaved: passes   fused  speedup\n";
+    
+    for (int channels: channelCounts) {
+        for (int n: blockSizes) {
+
+            float **buf = allocate_channels<float>(channels, n);
+            float *out = allocate<float>(channels * n);
+            vector<float> gains(channels), peaks(channels);
+
+            for (int c = 0; c < channels; ++c) {
+                for (int i = 0; i < n; ++i) {
+                    buf[c][i] = float(sin((c + 1) * i * 0.01) * 0.5);
+                }
+            }
+
+            // Gains alternate between 0.5 and 2 on successive calls,
+            // so that scaling in place leaves the data unchanged over
+            // time and never strays into denormals
+            auto setGains = [&](int call) {
+                for (int c = 0; c < channels; ++c) {
+                    gains[c] = (call % 2 ? 2.f : 0.5f);
+                }
+            };
+
+            auto separatePeaks = [&]() {
+                for (int c = 0; c < channels; ++c) {
+                    float peak = 0.f;
+                    for (int i = 0; i < n; ++i) {
+                        float v = fabsf(buf[c][i]);
+                        if (v > peak) peak = v;
+                    }
+                    peaks[c] = peak;
+                }
+            };
+
+            double interleavedPasses = measure([&](int call) {
+                    setGains(call);
+                    for (int c = 0; c < channels; ++c) {
+                        v_scale(buf[c], gains[c], n);
+                    }
+                    separatePeaks();
+                    v_interleave(out, buf, channels, n);
+                    sink = out[n - 1] + peaks[0];
+                }, channels * n, seconds);
+
+            double interleavedFused = measure([&](int call) {
+                    setGains(call);
+                    v_interleave_gain_peak(out, buf, channels, n,
+                                           gains.data(), peaks.data());
+                    sink = out[n - 1] + peaks[0];
+                }, channels * n, seconds);
+
+            double channelPasses = measure([&](int call) {
+                    setGains(call);
+                    for (int c = 0; c < channels; ++c) {
+                        v_scale(buf[c], gains[c], n);
+                    }
+                    separatePeaks();
+                    sink = buf[0][n - 1] + peaks[0];
+                }, channels * n, seconds);
+
+            double channelFused = measure([&](int call) {
+                    setGains(call);
+                    v_gain_peak_channels(buf, channels, n,
+                                         gains.data(), peaks.data());
+                    sink = buf[0][n - 1] + peaks[0];
+                }, channels * n, seconds);
+
+            cout << fixed << setprecision(3)
+                 << setw(8) << channels << setw(7) << n
+                 << setw(21) << interleavedPasses
+                 << setw(8) << interleavedFused
+                 << setw(8) << setprecision(2)
+                 << interleavedPasses / interleavedFused << "x"
+                 << setprecision(3)
+                 << setw(25) << channelPasses
+                 << setw(8) << channelFused
+                 << setw(8) << setprecision(2)
+                 << channelPasses / channelFused << "x"
+                 << endl;
+
+            deallocate_channels(buf, channels);
+            deallocate(out);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+/*
+ * bqaudioio-bench-subblock: compare processing each driver block
+ * whole with splitting it into sub-blocks (see
+ * AudioFactory::Preference::subBlockSize), for a range of channel
+ * counts and driver block sizes. Each block goes through the same
+ * stages as in PulseAudioIO and PortAudioIO: the application renders
+ * into non-interleaved buffers, the output mixer mixes them, and the
+ * result is scaled, peak-measured and interleaved into the device
+ * buffer, then metered.
+ */
+
+#include "src/Kernels.h"
+#include "src/ChannelMixer.h"
+#include "src/Meter.h"
+#include "MixingMatrix.h"
+
+#include "bqvec/Allocators.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+using namespace std;
+using namespace breakfastquay;
+
+static volatile float sink;
+
+// Stand-in for the application's callback: quiet noise in every
+// channel, a little arithmetic per sample as a real source would do
+static void
+render(float *const *buffers, int channels, int nframes, uint32_t &seed)
+{
+    for (int c = 0; c < channels; ++c) {
+        float *buf = buffers[c];
+        for (int i = 0; i < nframes; ++i) {
+            seed = seed * 1664525 + 1013904223;
+            buf[i] = float(int32_t(seed)) * 1e-10f;
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    double seconds = 0.2;
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+        if (seconds <= 0.0) {
+            cerr << "Usage: " << argv[0] << " [<seconds per case>]" << endl;
+            return 2;
+        }
+    }
+    
+    const int channelCounts[] = { 2, 8, 32 };
+    const int driverBlocks[] = { 1024, 4096, 24000 };
+    const int subBlocks[] = { 0, 64, 128, 256, 1024 };
+
+    cout << "Times in ns per sample; sub-block 0 processes each driver "
+         << "block whole\n\n"
+         << "channels  driver block  sub-block   ns/sample  speedup\n";
+
+    for (int channels: channelCounts) {
+
+        // Each output takes its own channel and half of the next, so
+        // that the mixer has real work to do
+        MixingMatrix matrix(channels, channels);
+        for (int c = 0; c < channels; ++c) {
+            matrix.set(c, c, 1.f);
+            if (channels > 1) matrix.set(c, (c + 1) % channels, 0.5f);
+        }
+        ChannelMixer mixer;
+        mixer.configure(matrix, channels, channels);
+
+        Meter meter;
+        meter.configure(channels);
+
+        vector<float> gains(channels, 0.5f), peaks(channels);
+        
+        for (int nframes: driverBlocks) {
+
+            float **buffers = allocate_channels<float>(channels, nframes);
+            float **mixed = allocate_channels<float>(channels, nframes);
+            float *out = allocate<float>(nframes * channels);
+            uint32_t seed = 1;
+            double whole = 0.0;
+
+            for (int subBlock: subBlocks) {
+
+                if (subBlock > nframes) continue;
+                int block = (subBlock > 0 ? subBlock : nframes);
+                
+                int64_t calls = 0;
+                double elapsed = 0.0;
+                auto start = chrono::steady_clock::now();
+                
+                while (elapsed < seconds) {
+                    for (int off = 0; off < nframes; off += block) {
+                        int n = min(block, nframes - off);
+                        render(buffers, channels, n, seed);
+                        mixer.mix(mixed, buffers, n);
+                        v_interleave_gain_peak(out + off * channels, mixed,
+                                               channels, n,
+                                               gains.data(), peaks.data());
+                        meter.processInterleaved(out + off * channels,
+                                                 channels, n);
+                    }
+                    sink = out[nframes - 1] + peaks[0];
+                    ++calls;
+                    elapsed = chrono::duration<double>
+                        (chrono::steady_clock::now() - start).count();
+                }
+
+                double ns = elapsed * 1e9 / (double(calls) * nframes * channels);
+                if (subBlock == 0) whole = ns;
+
+                cout << fixed << setprecision(3)
+                     << setw(8) << channels << setw(14) << nframes
+                     << setw(11) << subBlock << setw(12) << ns
+                     << setw(8) << setprecision(2) << whole / ns << "x"
+                     << endl;
+            }
+
+            deallocate_channels(buffers, channels);
+            deallocate_channels(mixed, channels);
+            deallocate(out);
+        }
+    }
+
+    return 0;
+}
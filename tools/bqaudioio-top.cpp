@@ -0,0 +1,259 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudioio
+
+    Copyright 2007-2021 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+/*
+ * bqaudioio-top: display the statistics published by a bqaudioio
+ * stream to shared memory (see SharedStatistics.h), refreshing
+ * periodically. Only maps the segment read-only and never
+ * communicates with the audio process in any other way.
+ */
+
+#include "SharedStatistics.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+using namespace std;
+using breakfastquay::SharedStatistics;
+
+static const char *const dropoutNames[SharedStatistics::DropoutKinds] = {
+    "output underflow",
+    "output overflow",
+    "input underflow",
+    "input overflow",
+    "server xrun",
+    "source under-delivery"
+};
+
+static void
+usage(const char *name)
+{
+    cerr << "Usage: " << name << " [-1] [-i <ms>] <statistics-name>\n\n"
+         << "Display the statistics published by a bqaudioio stream that "
+         << "was opened with\nthe given statistics name.\n\n"
+         << "  -1       Print once and exit\n"
+         << "  -i <ms>  Refresh interval in milliseconds (default 500)\n"
+         << endl;
+    exit(2);
+}
+
+static int64_t
+monotonicNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static const SharedStatistics *
+openSegment(string name)
+{
+    if (name[0] != '/') name = "/" + name;
+    
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= off_t(sizeof(SharedStatistics))) {
+        addr = mmap(nullptr, sizeof(SharedStatistics), PROT_READ,
+                    MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+
+    const SharedStatistics *stats = static_cast<const SharedStatistics *>(addr);
+    if (stats->magic != SharedStatistics::Magic ||
+        stats->version != SharedStatistics::Version ||
+        stats->size != sizeof(SharedStatistics)) {
+        munmap(addr, sizeof(SharedStatistics));
+        return nullptr;
+    }
+    
+    return stats;
+}
+
+static string
+meter(float peak)
+{
+    // 40 characters covering -60 to 0 dBFS
+    const int width = 40;
+    double db = (peak > 0.f ? 20.0 * log10(peak) : -200.0);
+    int n = int((db + 60.0) / 60.0 * width + 0.5);
+    if (n < 0) n = 0;
+    if (n > width) n = width;
+
+    ostringstream os;
+    if (db < -99.9) os << "   -inf";
+    else os << setw(7) << fixed << setprecision(1) << db;
+    os << " dBFS |" << string(n, '#') << string(width - n, '-') << "|";
+    if (peak >= 1.f) os << " CLIP";
+    return os.str();
+}
+
+static void
+showLevels(ostream &out, const char *label, int channels, const float *peaks)
+{
+    if (channels <= 0) return;
+    out << label << " levels:\n";
+    for (int c = 0; c < channels; ++c) {
+        out << "  " << setw(2) << c + 1 << " " << meter(peaks[c]) << "\n";
+    }
+}
+
+static string
+latency(int frames, int sampleRate)
+{
+    ostringstream os;
+    os << frames << " frames";
+    if (sampleRate > 0) {
+        os << " (" << fixed << setprecision(1)
+           << double(frames) * 1000.0 / sampleRate << " ms)";
+    }
+    return os.str();
+}
+
+static bool
+show(ostream &out, string name, const SharedStatistics *stats)
+{
+    SharedStatistics::Snapshot s;
+    if (!stats->readSnapshot(s)) {
+        out << "Failed to read a consistent snapshot" << endl;
+        return true;
+    }
+
+    int32_t state = stats->state.load(std::memory_order_acquire);
+    bool alive = !(kill(stats->processId, 0) != 0 && errno == ESRCH);
+
+    string stateName;
+    switch (state) {
+    case SharedStatistics::Running:
+        if (!alive) stateName = "process has exited";
+        else if (s.callbacks == 0) stateName = "starting";
+        else if (monotonicNow() - s.updateTime > 1000000000) {
+            stateName = "STALLED";
+        } else stateName = "running";
+        break;
+    case SharedStatistics::Suspended: stateName = "suspended"; break;
+    case SharedStatistics::Closed: stateName = "closed"; break;
+    default: stateName = "unknown"; break;
+    }
+
+    char implementation[sizeof(stats->implementation) + 1];
+    memcpy(implementation, stats->implementation, sizeof(stats->implementation));
+    implementation[sizeof(stats->implementation)] = '\0';
+    
+    out << name << ": " << implementation << ", pid "
+        << stats->processId << ", " << stateName << "\n\n";
+
+    out << "Sample rate " << s.sampleRate << " Hz, block "
+        << s.blockSize << " frames, " << s.callbacks << " callbacks\n";
+    
+    out << fixed << setprecision(1)
+        << "Load: now " << s.load * 100.0 << "%, average "
+        << s.averageLoad * 100.0 << "%, max " << s.maxLoad * 100.0 << "%\n";
+    
+    out << "Latency: input " << latency(s.inputLatency, s.sampleRate)
+        << ", output " << latency(s.outputLatency, s.sampleRate) << "\n";
+
+    out << "Dropouts:";
+    for (int i = 0; i < SharedStatistics::DropoutKinds; ++i) {
+        out << (i == 0 ? " " : ", ") << dropoutNames[i] << " " << s.dropouts[i];
+    }
+    out << "\n\n";
+
+    showLevels(out, "Input", s.inputChannels, s.inputPeak);
+    showLevels(out, "Output", s.outputChannels, s.outputPeak);
+
+    out << flush;
+    return alive && state != SharedStatistics::Closed;
+}
+
+int
+main(int argc, char **argv)
+{
+    bool once = false;
+    int interval = 500;
+    string name;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-1") {
+            once = true;
+        } else if (arg == "-i" && i + 1 < argc) {
+            interval = atoi(argv[++i]);
+            if (interval <= 0) usage(argv[0]);
+        } else if (arg[0] == '-' || name != "") {
+            usage(argv[0]);
+        } else {
+            name = arg;
+        }
+    }
+
+    if (name == "") usage(argv[0]);
+
+    const SharedStatistics *stats = openSegment(name);
+    if (!stats) {
+        cerr << argv[0] << ": No bqaudioio statistics segment \""
+             << name << "\" found (or it has an incompatible version)"
+             << endl;
+        return 1;
+    }
+
+    if (once) {
+        show(cout, name, stats);
+        return 0;
+    }
+    
+    while (true) {
+        ostringstream os;
+        bool more = show(os, name, stats);
+        // Clear the screen and home the cursor before each refresh
+        cout << "\033[H\033[2J" << os.str() << flush;
+        if (!more) break;
+        usleep(interval * 1000);
+    }
+
+    return 0;
+}